@@ -0,0 +1,187 @@
+/*
+ * Throughput benchmark for snarf and the HTTP package, run against the
+ * loopback test server so that results do not depend on the network.
+ *
+ * Each run retrieves the same synthetic document a number of times,
+ * both through the HTTP package in this process and by running the
+ * snarf program, and reports MB/s, requests per second and the CPU time
+ * the client used per request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "http.h"
+#include "url.h"
+#include "server.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-n requests] [-s size] [-c chunk] [-d delay] [-H headers] [-z] [-g] [-m mode]\n" \
+            "\n"                                                               \
+            "Benchmarks retrieval of synthetic documents from a loopback server\n" \
+            "\n"                                                               \
+            "-n requests Number of retrievals (default 100).\n"                \
+            "-s size     Size of each document in bytes (default 1048576).\n"  \
+            "-c chunk    Send documents chunked, in pieces of 'chunk' bytes.\n"\
+            "-d delay    Delay each response by 'delay' milliseconds.\n"       \
+            "-H headers  Add 'headers' extra response headers.\n"              \
+            "-z          Compress documents with gzip.\n"                      \
+            "-g          Read documents with http_getc() instead of\n"         \
+            "            http_read().\n"                                       \
+            "-m mode     'api' (the HTTP package), 'snarf' (the program),\n"   \
+            "            or 'both' (the default).\n",                          \
+            (prog_name));                                                      \
+  } while (0)
+
+static double now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static double rusage_seconds(struct rusage *ru) {
+    return(ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6);
+}
+
+static void report(char *mode, int requests, double bytes, double wall, double cpu) {
+    printf("%-6s %8d req %10.1f MB/s %10.1f req/s %10.1f us cpu/req\n", mode, requests,
+           bytes / wall / (1024 * 1024), requests / wall, cpu / requests * 1e6);
+}
+
+/*
+ * Retrieve the document with the HTTP package.  The CPU time is that of
+ * this thread only, leaving out the server's threads.
+ */
+
+static int bench_api(char *url, int requests, int use_getc) {
+    static char buf[65536];
+    double wall = 0, cpu = 0, bytes = 0;
+    URL *up = NULL;
+    HTTP *http = NULL;
+    ssize_t n = 0;
+    int code = 0;
+
+    if((up = url_parse(url)) == NULL || url_addresses(up) == NULL) {
+        fprintf(stderr, "Illegal URL: '%s'\n", url);
+        return(1);
+    }
+
+    wall = now(CLOCK_MONOTONIC);
+    cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    for(int i = 0; i < requests; i++) {
+        if((http = http_open(url_addresses(up), url_port(up))) == NULL || http_request(http, up) ||
+           http_response(http) || http_status(http, &code) == NULL || code != 200) {
+            fprintf(stderr, "Request %d failed\n", i);
+            http_close(http);
+            url_free(up);
+            return(1);
+        }
+
+        if(use_getc) {
+            while(http_getc(http) != EOF) {
+                bytes++;
+            }
+        } else {
+            while((n = http_read(http, buf, sizeof(buf))) > 0) {
+                bytes += n;
+            }
+        }
+        http_close(http);
+    }
+    cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = now(CLOCK_MONOTONIC) - wall;
+
+    report(use_getc ? "getc" : "read", requests, bytes, wall, cpu);
+    url_free(up);
+    return(0);
+}
+
+/*
+ * Retrieve the document by running snarf, with the output discarded.
+ * The CPU time is that of the snarf processes.
+ */
+
+static int bench_snarf(char *snarf, char *url, int requests, long long size) {
+    struct rusage ru;
+    double wall = 0, cpu = 0;
+    pid_t pid = 0;
+    int status = 0;
+
+    wall = now(CLOCK_MONOTONIC);
+    for(int i = 0; i < requests; i++) {
+        if((pid = fork()) == 0) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, 1);
+            execl(snarf, snarf, url, (char *)NULL);
+            _exit(127);
+        }
+        if(pid < 0 || wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Running '%s' failed\n", snarf);
+            return(1);
+        }
+        cpu += rusage_seconds(&ru);
+    }
+    wall = now(CLOCK_MONOTONIC) - wall;
+
+    report("snarf", requests, (double)size * requests, wall, cpu);
+    return(0);
+}
+
+int main(int argc, char *argv[]) {
+    TEST_SERVER *server = NULL;
+    char url[256], *mode = "both", *snarf = "bin/snarf";
+    long long size = 1048576;
+    int requests = 100, chunk = 0, delay = 0, headers = 0, gzip = 0, use_getc = 0;
+    int option = 0, err = 0;
+
+    while((option = getopt(argc, argv, "n:s:c:d:H:zgm:")) != -1) {
+        switch(option) {
+            case 'n': requests = atoi(optarg); break;
+            case 's': size = atoll(optarg); break;
+            case 'c': chunk = atoi(optarg); break;
+            case 'd': delay = atoi(optarg); break;
+            case 'H': headers = atoi(optarg); break;
+            case 'z': gzip = 1; break;
+            case 'g': use_getc = 1; break;
+            case 'm': mode = optarg; break;
+            default:
+                USAGE(argv[0]);
+                exit(-1);
+        }
+    }
+
+    if(requests <= 0 || size < 0 || (strcmp(mode, "api") && strcmp(mode, "snarf") && strcmp(mode, "both"))) {
+        USAGE(argv[0]);
+        exit(-1);
+    }
+
+    if((server = server_start()) == NULL) {
+        fprintf(stderr, "Unable to start the test server\n");
+        exit(-1);
+    }
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/%lld?chunk=%d&delay=%d&headers=%d%s",
+             server_port(server), size, chunk, delay, headers, gzip ? "&gzip" : "");
+    printf("%s\n", url);
+
+    if(strcmp(mode, "snarf")) {
+        err |= bench_api(url, requests, use_getc);
+    }
+    if(strcmp(mode, "api")) {
+        err |= bench_snarf(snarf, url, requests, size);
+    }
+
+    server_stop(server);
+    exit(err ? -1 : 0);
+}
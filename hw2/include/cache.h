@@ -0,0 +1,58 @@
+/*
+ * Interface to a simple on-disk cache of retrieved documents.
+ *
+ * Usage:
+ *  (1) Open a cache directory using cache_open().  The directory is
+ *	created if it does not already exist.
+ *
+ *  (2) Before issuing a request, use cache_lookup() to find a previously
+ *	saved copy of the document.  If one is found, use cache_validate()
+ *	to send conditional GET headers ("If-None-Match" and
+ *	"If-Modified-Since") to the server using the FILE pointer returned
+ *	by http_file().
+ *
+ *  (3) If the server answers 304 (Not Modified), use cache_serve() to copy
+ *	the saved document to the output without reading it into memory,
+ *	or cache_body() to read it.
+ *
+ *  (4) If the server answers 200, use cache_store() to start a new entry,
+ *	cache_write() to save the body as it arrives, then cache_commit()
+ *	to install it (or cache_abort() to throw it away).
+ *
+ *  (5) Release entries with cache_entry_free() and the cache with
+ *	cache_close().
+ *
+ * Entries are keyed by a hash of the URL.  Each entry consists of a body
+ * file and a small metadata file holding the validators.  When the total
+ * size of the saved bodies exceeds the limit given to cache_open(), the
+ * least recently used entries are evicted.
+ *
+ * Functions that return int return zero if successful, nonzero if
+ *	an error occurs.
+ * Functions that return pointers return NULL if unsuccessful.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define CACHE_DEFAULT_LIMIT (256L * 1024 * 1024)
+
+typedef struct cache CACHE;		/* An open cache directory */
+typedef struct cache_entry CACHE_ENTRY;	/* A saved (or in progress) document */
+
+CACHE *cache_open(char *dir, off_t limit);
+void cache_close(CACHE *cp);
+CACHE_ENTRY *cache_lookup(CACHE *cp, char *url);
+int cache_validate(CACHE_ENTRY *ep, FILE *f);
+int cache_serve(CACHE_ENTRY *ep, int fd);
+FILE *cache_body(CACHE_ENTRY *ep);
+CACHE_ENTRY *cache_store(CACHE *cp, char *url, char *etag, char *lastmod);
+int cache_write(CACHE_ENTRY *ep, char *buf, size_t len);
+int cache_commit(CACHE_ENTRY *ep);
+void cache_abort(CACHE_ENTRY *ep);
+void cache_entry_free(CACHE_ENTRY *ep);
+
+#endif
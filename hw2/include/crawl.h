@@ -0,0 +1,38 @@
+/*
+ * Interface to a recursive retriever that mirrors a web site into a
+ * directory tree, built on the URL and HTTP packages.
+ *
+ * Usage:
+ *  (1) Create a crawl with crawl_new(), giving the maximum link depth
+ *	to follow, the directory to write the mirror into, the number of
+ *	documents to retrieve at once, and the number of those that may
+ *	be from the same server.
+ *
+ *  (2) Add one or more starting URLs with crawl_add().  Only links to
+ *	the servers of the starting URLs are followed.
+ *
+ *  (3) Run the crawl with crawl_run(), which returns when there is
+ *	nothing left to retrieve, then release it with crawl_free().
+ *
+ * Each document is written to dir/host/path (dir/host:port/path if the
+ * port is not 80), with "index.html" added to paths ending in '/'.  Links
+ * in href and src attributes are collected from text/html documents as
+ * they arrive.  URLs waiting to be retrieved are kept in a temporary
+ * file, and the URLs already seen only as 64-bit hashes, so memory use
+ * stays small however many documents there are.
+ */
+
+#ifndef CRAWL_H
+#define CRAWL_H
+
+#define CRAWL_DEFAULT_WORKERS 4
+#define CRAWL_HOST_LIMIT 2
+
+typedef struct crawl CRAWL;		/* A recursive retrieval */
+
+CRAWL *crawl_new(int depth, char *dir, int workers, int per_host);
+int crawl_add(CRAWL *cp, char *url);
+int crawl_run(CRAWL *cp);
+void crawl_free(CRAWL *cp);
+
+#endif
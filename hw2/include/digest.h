@@ -0,0 +1,42 @@
+/*
+ * Interface for computing a digest of a document as it is retrieved.
+ *
+ * Usage:
+ *  (1) Start a digest with digest_init(), naming the algorithm
+ *	("sha256" or "crc32c").  digest_length() tells whether a name
+ *	is known, and how many hex digits its digests have.
+ *
+ *  (2) Pass each block of the document to digest_update() as it
+ *	goes by.
+ *
+ *  (3) Get the result as a string of hex digits with digest_final().
+ *
+ * Where the processor has instructions for them (the SHA extensions and
+ * SSE4.2 CRC32 on x86), they are used; otherwise the digests are
+ * computed in portable C.  The choice is made once, at run time.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_HEX_MAX 65	/* Size of a buffer for any digest in hex */
+
+typedef enum { DG_SHA256, DG_CRC32C } DIGEST_ALG;
+
+typedef struct digest {
+    DIGEST_ALG alg;
+    uint32_t state[8];		/* SHA-256 chaining value, or the CRC */
+    uint64_t length;		/* Bytes hashed so far */
+    unsigned char block[64];	/* Partial SHA-256 block */
+    size_t fill;		/* Bytes in the partial block */
+} DIGEST;
+
+size_t digest_length(char *name);
+int digest_init(DIGEST *dp, char *name);
+void digest_update(DIGEST *dp, char *buf, size_t n);
+char *digest_final(DIGEST *dp, char *hex);
+
+#endif
@@ -1,3 +1,5 @@
+#include <sys/types.h>
+
 #include "url.h"
 
 /*
@@ -19,7 +21,9 @@ typedef struct http HTTP;		/* An "HTTP connection" object */
  *
  * Usage:
  *  (1) Use http_open() to create an open HTTP connection to
- *	the specified IP address and port.
+ *	the specified port on a server, given the list of its addresses
+ *	from url_addresses().  The addresses are raced against each
+ *	other, IPv6 and IPv4 in turn, and the first to connect is used.
  *
  *  (2) Use http_request() to issue an HTTP GET request for a particular
  *	URL to the server at the other end of an HTTP connection.
@@ -34,10 +38,18 @@ typedef struct http HTTP;		/* An "HTTP connection" object */
  *	Query the response headers using http_headers_lookup().
  *
  *  (6) Collect the document making up the body of the response using
- *	http_getc()
+ *	http_getc(), or in blocks using http_read().  Chunked transfer
+ *	encoding is removed, and a gzip or deflate content encoding is
+ *	inflated, as the data arrives.  Use http_error() at the end to
+ *	find out whether the whole document was received.
  *
  *  (7) Close the HTTP connection using http_close();
  *
+ * No connection may take longer than the connect timeout to open, and
+ * reading gives up if the server sends nothing for the read timeout.
+ * Both are set for all connections with http_timeouts(), in
+ * milliseconds; zero means no limit.
+ *
  * Functions that return int return zero if successful, nonzero if
  *	an error occurs.
  * Functions that return pointers return NULL if unsuccessful.
@@ -47,12 +59,22 @@ typedef struct http HTTP;		/* An "HTTP connection" object */
  *	HTTP object itself again once http_close() has been called.
  */
 
-HTTP *http_open(IPADDR *addr, int port);
+#define HTTP_CONNECT_TIMEOUT 30000	/* Default connect timeout (ms) */
+#define HTTP_READ_TIMEOUT 60000		/* Default read timeout (ms) */
+#define HTTP_ATTEMPT_DELAY 250		/* Wait before trying the next address (ms) */
+#define HTTP_MAX_ATTEMPTS 16		/* Addresses tried for one connection */
+
+HTTP *http_open(ADDRLIST *addrs, int port);
+void http_timeouts(int connect_ms, int read_ms);
 int http_close(HTTP *http);
 FILE *http_file(HTTP *http);
 int http_request(HTTP *http, URL *up);
 int http_response(HTTP *http);
 int http_getc(HTTP *http);
+ssize_t http_read(HTTP *http, char *buf, size_t n);
+int http_error(HTTP *http);
+long http_length(HTTP *http);
+char *http_encoding(HTTP *http);
 char *http_status(HTTP *http, int *code);
 char *http_headers_lookup(HTTP *http, char *key);
 char *http_header_key(HTTP *http, char *key);
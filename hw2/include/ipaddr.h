@@ -1,5 +1,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
 typedef struct in_addr IPADDR;		/* Structure to hold IP address */
+typedef struct addrinfo ADDRLIST;	/* All the addresses of a host */
@@ -0,0 +1,31 @@
+/*
+ * Interface to a caching HTTP forward proxy, built on the URL and HTTP
+ * packages.
+ *
+ * Usage:
+ *	Call proxy_run() with the port number to listen on and the maximum
+ *	number of bytes of documents to keep in memory.  It only returns if
+ *	the server could not be started.
+ *
+ * Clients on the local host send ordinary proxy requests of the form
+ *
+ *	GET http://hostname:port/path HTTP/1.0
+ *
+ * Documents retrieved with status 200 are kept in memory and evicted in
+ * least recently used order when the limit is exceeded.  The limit counts
+ * documents still being retrieved as well; one that does not fit is passed
+ * on to its clients without being kept.  Requests for a
+ * document that is already being retrieved are collapsed onto the same
+ * upstream request, and each client is sent the body as it arrives.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+
+#define PROXY_DEFAULT_LIMIT (64L * 1024 * 1024)
+
+int proxy_run(int port, size_t limit);
+
+#endif
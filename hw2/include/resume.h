@@ -0,0 +1,59 @@
+/*
+ * Interface for resuming an interrupted retrieval into a file.
+ *
+ * Usage:
+ *  (1) Use resume_open() with the output file and URL.  If the file holds
+ *	part of the document from an earlier attempt, it is opened for
+ *	appending, and resume_offset() tells how much of it there is;
+ *	otherwise it is created empty.  Write the body to resume_file().
+ *
+ *  (2) After http_request(), use resume_request() to send "Range" and
+ *	"If-Range" headers using the FILE pointer returned by http_file().
+ *
+ *  (3) After http_response(), call resume_response().  A 206 (Partial
+ *	Content) reply is appended to the file and a 200 reply replaces
+ *	it; any other reply to a request for the rest is an error, and
+ *	the file is kept to be resumed later.  The validators of the
+ *	reply are saved, so that a later attempt can carry on where this
+ *	one stops.
+ *
+ *  (4) Report each block written with resume_progress().
+ *
+ *  (5) Finish with resume_close(), saying whether the document is
+ *	complete.
+ *
+ * The progress of a retrieval is kept in a small file next to the
+ * output, named by adding RESUME_SUFFIX.  It is only brought up to date
+ * every RESUME_SYNC_BYTES bytes, and an attempt that is resumed carries on
+ * from the last recorded length, so what is in the file past that point
+ * is fetched again.  The file is removed when the document is complete.
+ * A document with a content encoding cannot be resumed, because ranges
+ * count bytes before it is decoded.
+ *
+ * Functions that return int return zero if successful, nonzero if
+ *	an error occurs.
+ * Functions that return pointers return NULL if unsuccessful.
+ */
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+#define RESUME_SUFFIX ".snarf"
+#define RESUME_SYNC_BYTES (8L * 1024 * 1024)
+
+typedef struct resume RESUME;		/* A retrieval that may be resumed */
+
+RESUME *resume_open(char *file, char *url);
+FILE *resume_file(RESUME *rp);
+off_t resume_offset(RESUME *rp);
+int resume_request(RESUME *rp, FILE *f);
+int resume_response(RESUME *rp, HTTP *http, int code);
+int resume_progress(RESUME *rp, size_t len);
+int resume_close(RESUME *rp, int complete);
+
+#endif
@@ -1,7 +1,13 @@
+#define DIGEST_MISMATCH -2	/* snarf() result when the -c digest does not match */
+#define EXIT_MISMATCH 3		/* ... and the exit status it gives */
+
 #define USAGE(prog_name)                                                       \
   do {                                                                         \
     fprintf(stderr,                                                            \
-            "\n%s [-h] [-q keyword] [-o file] URL\n"                           \
+            "\n%s [-h] [-T] [-t secs] [-c algo[:hex]] [-q keyword] [-o file [-C]] [-d dir [-m size]] URL\n" \
+            "%s [-T] [-t secs] [-c algo] [-q keyword] [-o file] [-d dir [-m size]] -i list\n" \
+            "%s -P port [-m size]\n"                                         \
+            "%s -r depth [-j n] [-t secs] [-o dir] URL | -i list\n"                  \
             "\n"                                                               \
 	    "Retrieves document at URL using HTTP GET request\n"               \
             "\n"                                                               \
@@ -12,13 +18,47 @@
             "            May be repeated to select multiple keywords.\n"       \
             "-o file     Retrieved document should be written to 'file',\n"    \
             "            instead of the default stdout.\n"                     \
+            "-C          Continue an interrupted retrieval into 'file',\n"    \
+            "            asking only for the part still missing.\n"          \
+            "-d dir      Keep a cache of retrieved documents in 'dir', and\n"  \
+            "            revalidate saved copies with a conditional GET.\n"    \
+            "-m size     Limit the cache to 'size' bytes (K, M, G suffixes\n"  \
+            "            allowed), evicting least recently used documents.\n"  \
+            "-i list     Retrieve each URL listed, one per line, in 'list'\n"  \
+            "            ('-' for stdin), writing the documents in turn.\n"    \
+            "-c algo:hex Compute the sha256 or crc32c digest of the document\n" \
+            "            as it arrives and print it on stderr.  If 'hex' is\n"  \
+            "            given and does not match, exit with status 3.\n"       \
+            "-T          Time each retrieval (DNS, connect, time to first\n"   \
+            "            byte, transfer) and report it on stderr.  With -i,\n" \
+            "            also print percentiles of all of them as JSON.\n"     \
+            "-t secs     Give up on a server that takes more than 'secs'\n"  \
+            "            seconds to accept the connection or to send more\n" \
+            "            of the response (default 30 and 60).\n"           \
+            "-P port     Run as a caching HTTP proxy for local clients on\n"   \
+            "            'port', keeping up to 'size' bytes in memory.\n"      \
+            "-r depth    Mirror the site into directory 'dir' (default .),\n" \
+            "            following links up to 'depth' levels deep.\n"        \
+            "-j n        Retrieve up to 'n' documents at once when mirroring\n"\
+            "            (default 4, and at most 2 from one server).\n"       \
             "\nPositional arguments:\n\n"                                      \
             "URL         Location of the document to retrieve.\n",             \
-            (prog_name));                                                      \
+            (prog_name), (prog_name), (prog_name), (prog_name));                                                      \
   } while (0)
 
 extern char *url_to_snarf;
 extern char *output_file;
+extern char *cache_dir;
+extern off_t cache_limit;
+extern int proxy_port;
+extern char *url_list;
+extern int timing_option;
+extern int crawl_depth;
+extern int crawl_workers;
+extern char *digest_alg;
+extern char *digest_expect;
+extern int resume_option;
+extern int timeout_secs;
 extern char *keyPtr;
 extern char keywords[1024];
 
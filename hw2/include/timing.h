@@ -0,0 +1,45 @@
+/*
+ * Interface for timing the phases of a document retrieval.
+ *
+ * Usage:
+ *  (1) Clear a TIMING object with timing_init() before each retrieval.
+ *
+ *  (2) Bracket each phase with timing_start() and timing_stop().
+ *	The phases are the DNS lookup (url_addresses()), the connection
+ *	to the server (http_open()), the time to the first byte of the
+ *	response (from http_request() until http_response() returns),
+ *	and the transfer of the body (the http_read() loop).
+ *	Record the number of body bytes with timing_bytes().
+ *
+ *  (3) Print the result of one retrieval with timing_report().
+ *
+ *  (4) To summarize many retrievals, add each one to the running
+ *	histograms with timing_add(), and print percentiles of all of
+ *	them as JSON with timing_json().
+ *
+ * All times are measured with CLOCK_MONOTONIC.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <time.h>
+
+typedef enum { PH_DNS, PH_CONNECT, PH_TTFB, PH_TRANSFER, PH_TOTAL, NUM_PHASES } PHASE;
+
+typedef struct timing {
+    struct timespec start[NUM_PHASES];	/* When each phase started */
+    double elapsed[NUM_PHASES];		/* Duration of each phase, in seconds */
+    long bytes;				/* Bytes of body transferred */
+} TIMING;
+
+void timing_init(TIMING *tp);
+void timing_start(TIMING *tp, PHASE ph);
+void timing_stop(TIMING *tp, PHASE ph);
+void timing_bytes(TIMING *tp, long bytes);
+void timing_report(TIMING *tp, char *url, FILE *f);
+void timing_add(TIMING *tp);
+void timing_json(FILE *f);
+
+#endif
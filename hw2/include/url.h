@@ -4,9 +4,11 @@
  * Usage:
  *  (1) Parse a URL string into a URL object using url_parse();
  *
- *  (2) Extract IP address and port number for http_open()
- *	using url_address() and url_port().
- *	Note: the first time url_address() is used on a URL
+ *  (2) Extract the addresses and port number for http_open()
+ *	using url_addresses() and url_port().  The list has every
+ *	IPv4 and IPv6 address of the host; url_address() gives just
+ *	the first IPv4 one.
+ *	Note: the first time url_addresses() is used on a URL
  *	object, a DNS lookup will occur.
  *
  *  (3) If desired, extract the "access method"
@@ -16,6 +18,17 @@
  *
  *  (4) When finished with the URL, free it with url_free().
  *
+ * A link found in a document can be turned into an absolute URL string
+ * with url_resolve(), giving it the URL of the document as the base.
+ *
+ * Where many URLs have to be taken apart, url_parse_view() fills in a
+ * URL_VIEW supplied by the caller with the location and length of each
+ * part within the original string, without copying anything or using
+ * the heap.  The path of a view does not include the query string or
+ * fragment, which have their own slices (without the '?' or '#').
+ * Parts that are absent have a NULL pointer.  url_parse_batch() does
+ * the same for each line of a buffer, filling in an array of views.
+ *
  * Functions that return pointers return NULL if unsuccessful.
  *
  * Do not attempt to free() any pointers returned by url_method()
@@ -23,11 +36,29 @@
  *	URL object itself again once url_free() has been called.
  */
 
+#ifndef URL_H
+#define URL_H
+
 #include <stdio.h>
 #include "ipaddr.h"
 
 typedef struct url URL;			/* A "parsed URL" object */
 
+typedef struct url_slice {
+    char *ptr;				/* Start of the part, or NULL */
+    size_t len;				/* Its length */
+} URL_SLICE;
+
+typedef struct url_view {
+    URL_SLICE url;			/* The whole URL */
+    URL_SLICE method;			/* Access method, without the ':' */
+    URL_SLICE hostname;			/* Host name */
+    URL_SLICE path;			/* Path, up to any '?' or '#' */
+    URL_SLICE query;			/* Query string, after the '?' */
+    URL_SLICE fragment;			/* Fragment, after the '#' */
+    int port;				/* TCP port (80 by default for http) */
+} URL_VIEW;
+
 void url_init(URL *url);
 URL *url_parse(char *url);
 void url_free(URL *up);
@@ -36,3 +67,9 @@ char *url_hostname(URL *up);
 int url_port(URL *up);
 char *url_path(URL *up);
 IPADDR *url_address(URL *up);
+ADDRLIST *url_addresses(URL *up);
+char *url_resolve(char *base, char *ref);
+int url_parse_view(char *url, size_t len, URL_VIEW *vp);
+size_t url_parse_batch(char *buf, size_t len, URL_VIEW *views, size_t max, size_t *used);
+
+#endif
@@ -2,10 +2,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "debug.h"
 #include "snarf.h"
+#include "digest.h"
+
+#define OPTIONS "+q:o:d:m:P:i:Tr:j:c:Ct:"		/* Options for getopt() */
+#define OPTION_LETTERS "qodmPirjct"		/* Letters of the options taking an argument */
 
 int opterr = 0;
 int optopt = 0;
@@ -13,10 +18,60 @@ int optind = 0;
 char *optarg = NULL;
 char *url_to_snarf = NULL;
 char *output_file = NULL;
+char *cache_dir = NULL;
+off_t cache_limit = 0;
+int proxy_port = 0;
+char *url_list = NULL;
+int timing_option = 0;
+int crawl_depth = -1;
+int crawl_workers = 0;
+char *digest_alg = NULL;
+char *digest_expect = NULL;
+int resume_option = 0;
+int timeout_secs = 0;
 
 char *keyPtr = NULL;
 char keywords[1024];
 
+/*
+ * Check that an option argument is not itself one of our flags, and that
+ * it was separated from its flag by a space.  If not, exit with error.
+ */
+static void check_optarg(char *argv[]) {
+    if((optarg[0] == '-' && optarg[1] != '\0' && optarg[2] == '\0' && strchr(OPTION_LETTERS, optarg[1]) != NULL) ||
+       *(optarg - 1) != '\0') {
+        USAGE(argv[0]);
+        exit(-1);
+    }
+}
+
+/*
+ * Parse a size given as a number of bytes, with an optional
+ * K, M or G suffix.  Returns -1 if the size is invalid.
+ */
+static off_t parse_size(char *arg) {
+    char *end = NULL;
+    long long size = strtoll(arg, &end, 10);
+
+    if(end == arg || size <= 0) {
+        return(-1);
+    }
+
+    switch(*end) {
+        case 'G': case 'g': size *= 1024;
+        /* FALLTHROUGH */
+        case 'M': case 'm': size *= 1024;
+        /* FALLTHROUGH */
+        case 'K': case 'k': size *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+
+    return(*end == '\0' ? (off_t)size : -1);
+}
+
 void parse_args(int argc, char *argv[]) {
     int i = 0;
     char option = 0;
@@ -34,52 +89,136 @@ void parse_args(int argc, char *argv[]) {
         debug("%d optopt: %d", i, optopt);
         debug("%d argv[optind]: %s", i, argv[optind]);
 
-        if ((option = getopt(argc, argv, "+q:o:")) != -1) {
+        if ((option = getopt(argc, argv, OPTIONS)) != -1) {
             switch (option) {
                 case 'q':
                     info("Query header: %s", optarg);
-                    if(!strcmp(optarg, "-o") || !strcmp(optarg, "-q")) { // Check if the argument for -q is a flag, if not, exit with error.
+                    check_optarg(argv);
+
+                    if(keyPtr == NULL) {
+                        keyPtr = keywords; // Have a pointer to keywords if we don't have one already.
+                    }
+
+                    strcat(keywords, optarg); // Concatenate the keyword into the buffer.
+                    strcat(keywords, " "); // Concenate a space into the buffer.
+
+                    break;
+                case 'o':
+                    info("Output file: %s", optarg);
+                    check_optarg(argv);
+
+                    if(output_file == NULL) {
+                        output_file = optarg; // Have output_file have a pointer to the file argument.
+                    } else { // There can only be one output file.
                         USAGE(argv[0]);
                         exit(-1);
                     }
 
-                    if(*(optarg - 1) != '\0') { // Check if there is a space between the flag and argument, if not, exit with error.
+                    break;
+                case 'd':
+                    info("Cache directory: %s", optarg);
+                    check_optarg(argv);
+
+                    if(cache_dir != NULL) { // There can only be one cache directory.
                         USAGE(argv[0]);
                         exit(-1);
                     }
 
-                    if(keyPtr == NULL) {
-                        keyPtr = keywords; // Have a pointer to keywords if we don't have one already.
+                    cache_dir = optarg;
+                    break;
+                case 'm':
+                    info("Cache limit: %s", optarg);
+                    check_optarg(argv);
+
+                    if((cache_limit = parse_size(optarg)) < 0) {
+                        USAGE(argv[0]);
+                        exit(-1);
                     }
 
-                    strcat(keywords, optarg); // Concatenate the keyword into the buffer.
-                    strcat(keywords, " "); // Concenate a space into the buffer.
+                    break;
+                case 'P':
+                    info("Proxy port: %s", optarg);
+                    check_optarg(argv);
+
+                    if((proxy_port = atoi(optarg)) <= 0 || proxy_port > 65535) {
+                        USAGE(argv[0]);
+                        exit(-1);
+                    }
 
                     break;
-                case 'o':
-                    info("Output file: %s", optarg);
+                case 'i':
+                    info("URL list: %s", optarg);
+                    check_optarg(argv);
 
-                    if(!strcmp(optarg, "-o") || !strcmp(optarg, "-q")) { // Check if the argument for -o is a flag, if not, exit with error.
+                    if(url_list != NULL) { // There can only be one list of URLs.
                         USAGE(argv[0]);
                         exit(-1);
                     }
 
-                    if(*(optarg - 1) != '\0') { // Check if there is a space between the flag and argument, if not, exit with error.
+                    url_list = optarg;
+                    break;
+                case 'r':
+                    info("Crawl depth: %s", optarg);
+                    check_optarg(argv);
+
+                    if((crawl_depth = atoi(optarg)) < 0 || !isdigit((unsigned char)optarg[0])) {
                         USAGE(argv[0]);
                         exit(-1);
                     }
 
-                    if(output_file == NULL) {
-                        output_file = optarg; // Have output_file have a pointer to the file argument.
-                    } else { // There can only be one output file.
+                    break;
+                case 'j':
+                    info("Crawl workers: %s", optarg);
+                    check_optarg(argv);
+
+                    if((crawl_workers = atoi(optarg)) <= 0) {
+                        USAGE(argv[0]);
+                        exit(-1);
+                    }
+
+                    break;
+                case 'c':
+                    info("Digest: %s", optarg);
+                    check_optarg(argv);
+
+                    /*
+                     * Either "algo", to print the digest, or "algo:hex",
+                     * to check it as well.
+                     */
+                    digest_alg = optarg;
+                    if((digest_expect = strchr(optarg, ':')) != NULL) {
+                        *digest_expect++ = '\0';
+                    }
+
+                    if(digest_length(digest_alg) == 0 || (digest_expect != NULL &&
+                       (strlen(digest_expect) != digest_length(digest_alg) ||
+                        strspn(digest_expect, "0123456789abcdefABCDEF") != strlen(digest_expect)))) {
                         USAGE(argv[0]);
                         exit(-1);
                     }
 
+                    break;
+                case 't':
+                    info("Timeout: %s", optarg);
+                    check_optarg(argv);
+
+                    if((timeout_secs = atoi(optarg)) <= 0) {
+                        USAGE(argv[0]);
+                        exit(-1);
+                    }
+
+                    break;
+                case 'T':
+                    info("Timing enabled");
+                    timing_option = 1;
+                    break;
+                case 'C':
+                    info("Resume enabled");
+                    resume_option = 1;
                     break;
                 case '?':
                     if (optopt != 'h') {
-                        if(optopt != 'q' && optopt != 'o') {
+                        if(strchr(OPTION_LETTERS, optopt) == NULL) {
                             fprintf(stderr, KRED "-%c is not a supported argument\n" KNRM, optopt);
                         }
                         USAGE(argv[0]);
@@ -105,4 +244,13 @@ void parse_args(int argc, char *argv[]) {
             }
         }
     }
+
+    /*
+     * Resuming needs a file to resume into, and only makes sense for a
+     * single document.
+     */
+    if(resume_option && (output_file == NULL || url_list != NULL || crawl_depth >= 0 || proxy_port != 0)) {
+        USAGE(argv[0]);
+        exit(-1);
+    }
 }
@@ -0,0 +1,577 @@
+/*
+ * Routines to manage an on-disk cache of retrieved documents,
+ * so that repeated retrievals of the same URL can be satisfied with a
+ * conditional GET and a local copy.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+#include "debug.h"
+#include "cache.h"
+
+#define KEY_LEN 16			/* Hex digits in an entry key */
+
+struct cache {
+    char *dir;				/* Directory holding the entries */
+    off_t limit;			/* Maximum total size of saved bodies */
+};
+
+struct cache_entry {
+    CACHE *cache;			/* Cache the entry belongs to */
+    char key[KEY_LEN + 1];		/* Hash of the URL, in hex */
+    char *url;				/* URL of the document */
+    char *etag;				/* "ETag" validator, if any */
+    char *lastmod;			/* "Last-Modified" validator, if any */
+    FILE *body;				/* Body being stored, for a new entry */
+    char *tmp;				/* Temporary name of the body being stored */
+};
+
+/*
+ * Information about one entry, collected when deciding what to evict.
+ */
+
+typedef struct {
+    char key[KEY_LEN + 1];
+    struct timespec used;
+    off_t size;
+} CACHE_USE;
+
+/*
+ * Compute the key for a URL, using the 64-bit FNV-1a hash.
+ */
+
+static void cache_key(char *url, char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for(unsigned char *cp = (unsigned char *)url; *cp != '\0'; cp++) {
+        h ^= *cp;
+        h *= 0x100000001b3ULL;
+    }
+
+    snprintf(key, KEY_LEN + 1, "%016llx", (unsigned long long)h);
+}
+
+/*
+ * Build the path name of a file belonging to an entry.
+ * The result must be freed by the caller.
+ */
+
+static char *cache_path(CACHE *cp, char *key, char *suffix) {
+    char *path = NULL;
+
+    if(asprintf(&path, "%s/%s%s", cp->dir, key, suffix) < 0) {
+        return(NULL);
+    }
+
+    return(path);
+}
+
+static CACHE_ENTRY *cache_entry_new(CACHE *cp, char *url) {
+    CACHE_ENTRY *ep = NULL;
+
+    if((ep = calloc(1, sizeof(*ep))) == NULL) {
+        return(NULL);
+    }
+
+    ep->cache = cp;
+    cache_key(url, ep->key);
+    if((ep->url = strdup(url)) == NULL) {
+        free(ep);
+        return(NULL);
+    }
+
+    return(ep);
+}
+
+/*
+ * Open a cache directory, creating it if necessary.
+ */
+
+CACHE *cache_open(char *dir, off_t limit) {
+    CACHE *cp = NULL;
+
+    if(dir == NULL) {
+        return(NULL);
+    }
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return(NULL);
+    }
+
+    if((cp = malloc(sizeof(*cp))) == NULL) {
+        return(NULL);
+    }
+
+    if((cp->dir = strdup(dir)) == NULL) {
+        free(cp);
+        return(NULL);
+    }
+
+    cp->limit = limit > 0 ? limit : CACHE_DEFAULT_LIMIT;
+    return(cp);
+}
+
+/*
+ * Close a cache that was previously opened.
+ */
+
+void cache_close(CACHE *cp) {
+    if(cp != NULL) {
+        free(cp->dir);
+        free(cp);
+    }
+}
+
+/*
+ * Look up the saved copy of a URL.  Returns NULL if there is none,
+ * or if the entry on disk belongs to a different URL with the same key.
+ */
+
+CACHE_ENTRY *cache_lookup(CACHE *cp, char *url) {
+    CACHE_ENTRY *ep = NULL;
+    FILE *meta = NULL;
+    char *path = NULL, *line = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    int match = 0;
+
+    if(cp == NULL || url == NULL || (ep = cache_entry_new(cp, url)) == NULL) {
+        return(NULL);
+    }
+
+    if((path = cache_path(cp, ep->key, ".meta")) == NULL || (meta = fopen(path, "r")) == NULL) {
+        free(path);
+        cache_entry_free(ep);
+        return(NULL);
+    }
+    free(path);
+
+    /*
+     * The metadata file consists of "name value" lines.
+     */
+    while((read = getline(&line, &len, meta)) != -1) {
+        while(read > 0 && (line[read-1] == '\n' || line[read-1] == '\r')) {
+            line[--read] = '\0';
+        }
+
+        if(!strncmp(line, "url ", 4)) {
+            match = !strcmp(line + 4, url);
+        } else if(!strncmp(line, "etag ", 5)) {
+            ep->etag = strdup(line + 5);
+        } else if(!strncmp(line, "last-modified ", 14)) {
+            ep->lastmod = strdup(line + 14);
+        }
+    }
+
+    free(line);
+    fclose(meta);
+
+    if(!match || (ep->etag == NULL && ep->lastmod == NULL)) {
+        cache_entry_free(ep);
+        return(NULL);
+    }
+
+    return(ep);
+}
+
+/*
+ * Output conditional GET headers for a saved entry.
+ * This must be done after http_request() and before http_response().
+ */
+
+int cache_validate(CACHE_ENTRY *ep, FILE *f) {
+    if(ep == NULL || f == NULL) {
+        return(1);
+    }
+
+    if(ep->etag != NULL && fprintf(f, "If-None-Match: %s\r\n", ep->etag) < 0) {
+        return(1);
+    }
+
+    if(ep->lastmod != NULL && fprintf(f, "If-Modified-Since: %s\r\n", ep->lastmod) < 0) {
+        return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * Fall back to copying through a buffer when the kernel will not
+ * copy between the two descriptors for us.
+ */
+
+static int cache_copy(int in, int out, off_t off, off_t len) {
+    char buf[65536];
+    ssize_t n = 0;
+
+    if(lseek(in, off, SEEK_SET) < 0) {
+        return(1);
+    }
+
+    while(len > 0 && (n = read(in, buf, len < (off_t)sizeof(buf) ? (size_t)len : sizeof(buf))) > 0) {
+        for(ssize_t done = 0, w = 0; done < n; done += w) {
+            if((w = write(out, buf + done, n - done)) < 0) {
+                return(1);
+            }
+        }
+        len -= n;
+    }
+
+    return(n < 0);
+}
+
+/*
+ * The modification time of the metadata file records the last use,
+ * for LRU eviction.
+ */
+
+static void cache_touch(CACHE_ENTRY *ep) {
+    char *path = NULL;
+
+    if((path = cache_path(ep->cache, ep->key, ".meta")) != NULL) {
+        utimensat(AT_FDCWD, path, NULL, 0);
+        free(path);
+    }
+}
+
+/*
+ * Copy the body of a saved entry to a file descriptor.
+ * When the output is a regular file, copy_file_range() is used so the
+ * data never passes through user space; otherwise sendfile() is used.
+ * The entry is marked as recently used.
+ */
+
+int cache_serve(CACHE_ENTRY *ep, int fd) {
+    struct stat st;
+    char *path = NULL;
+    off_t off = 0;
+    ssize_t n = 0;
+    int in = -1, regular = 0;
+
+    if(ep == NULL || fd < 0) {
+        return(1);
+    }
+
+    if((path = cache_path(ep->cache, ep->key, ".body")) == NULL) {
+        return(1);
+    }
+
+    in = open(path, O_RDONLY);
+    free(path);
+    if(in < 0 || fstat(in, &st) < 0) {
+        if(in >= 0) {
+            close(in);
+        }
+        return(1);
+    }
+
+    struct stat ost;
+    regular = fstat(fd, &ost) == 0 && S_ISREG(ost.st_mode);
+
+    while(off < st.st_size) {
+        if(regular) {
+            loff_t ioff = off;
+            n = copy_file_range(in, &ioff, fd, NULL, st.st_size - off, 0);
+        } else {
+            n = sendfile(fd, in, &off, st.st_size - off);
+            if(n > 0) {
+                continue;
+            }
+        }
+
+        if(n > 0) {
+            off += n;
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            /*
+             * The kernel refuses some combinations of descriptors (for
+             * example an output opened for appending), so copy the rest
+             * the ordinary way, which also reports any real error.
+             */
+            if(cache_copy(in, fd, off, st.st_size - off)) {
+                close(in);
+                return(1);
+            }
+            off = st.st_size;
+        }
+    }
+
+    close(in);
+    cache_touch(ep);
+
+    return(0);
+}
+
+/*
+ * Open the body of a saved entry for reading, for a caller that has to
+ * see the data on its way out rather than have cache_serve() copy it.
+ * The entry is marked as recently used.  Returns NULL on failure.
+ */
+
+FILE *cache_body(CACHE_ENTRY *ep) {
+    FILE *f = NULL;
+    char *path = NULL;
+
+    if(ep == NULL || (path = cache_path(ep->cache, ep->key, ".body")) == NULL) {
+        return(NULL);
+    }
+
+    if((f = fopen(path, "r")) != NULL) {
+        cache_touch(ep);
+    }
+
+    free(path);
+    return(f);
+}
+
+/*
+ * Begin saving a new copy of a document.  The body is written to a
+ * temporary file, which replaces any previous entry when committed.
+ * A document without validators cannot be revalidated, so it is not saved.
+ */
+
+CACHE_ENTRY *cache_store(CACHE *cp, char *url, char *etag, char *lastmod) {
+    CACHE_ENTRY *ep = NULL;
+    int fd = -1;
+
+    if(cp == NULL || url == NULL || (etag == NULL && lastmod == NULL)) {
+        return(NULL);
+    }
+
+    if((ep = cache_entry_new(cp, url)) == NULL) {
+        return(NULL);
+    }
+
+    if((etag != NULL && (ep->etag = strdup(etag)) == NULL) ||
+       (lastmod != NULL && (ep->lastmod = strdup(lastmod)) == NULL) ||
+       (ep->tmp = cache_path(cp, ep->key, ".XXXXXX")) == NULL) {
+        cache_entry_free(ep);
+        return(NULL);
+    }
+
+    if((fd = mkstemp(ep->tmp)) < 0 || (ep->body = fdopen(fd, "w")) == NULL) {
+        if(fd >= 0) {
+            close(fd);
+            unlink(ep->tmp);
+        }
+        cache_entry_free(ep);
+        return(NULL);
+    }
+
+    return(ep);
+}
+
+/*
+ * Append data to the body of an entry being stored.
+ */
+
+int cache_write(CACHE_ENTRY *ep, char *buf, size_t len) {
+    if(ep == NULL || ep->body == NULL) {
+        return(1);
+    }
+
+    return(fwrite(buf, 1, len, ep->body) != len);
+}
+
+static int cache_use_cmp(const void *a, const void *b) {
+    const CACHE_USE *ua = a, *ub = b;
+
+    /*
+     * To the nanosecond, as entries are often used within the same second.
+     */
+    if(ua->used.tv_sec != ub->used.tv_sec) {
+        return((ua->used.tv_sec > ub->used.tv_sec) - (ua->used.tv_sec < ub->used.tv_sec));
+    }
+    return((ua->used.tv_nsec > ub->used.tv_nsec) - (ua->used.tv_nsec < ub->used.tv_nsec));
+}
+
+/*
+ * Remove an entry from the cache directory.
+ */
+
+static void cache_remove(CACHE *cp, char *key) {
+    char *path = NULL;
+
+    if((path = cache_path(cp, key, ".meta")) != NULL) {
+        unlink(path);
+        free(path);
+    }
+
+    if((path = cache_path(cp, key, ".body")) != NULL) {
+        unlink(path);
+        free(path);
+    }
+}
+
+/*
+ * Evict least recently used entries until the total size of the saved
+ * bodies is within the limit of the cache.  The entry just stored under
+ * keep goes last, and only if it alone is over the limit.
+ */
+
+static void cache_evict(CACHE *cp, char *keep) {
+    DIR *dir = NULL;
+    struct dirent *de = NULL;
+    struct stat st;
+    CACHE_USE *uses = NULL, *tmp = NULL;
+    size_t count = 0, max = 0;
+    off_t total = 0;
+    char *path = NULL;
+
+    if((dir = opendir(cp->dir)) == NULL) {
+        return;
+    }
+
+    while((de = readdir(dir)) != NULL) {
+        char *dot = strchr(de->d_name, '.');
+
+        if(dot == NULL || dot - de->d_name != KEY_LEN || strcmp(dot, ".body")) {
+            continue;
+        }
+
+        if(count == max) {
+            max = max ? 2 * max : 64;
+            if((tmp = realloc(uses, max * sizeof(*uses))) == NULL) {
+                break;
+            }
+            uses = tmp;
+        }
+
+        CACHE_USE *up = &uses[count];
+        memcpy(up->key, de->d_name, KEY_LEN);
+        up->key[KEY_LEN] = '\0';
+
+        if((path = cache_path(cp, up->key, ".body")) == NULL || stat(path, &st) < 0) {
+            free(path);
+            continue;
+        }
+        free(path);
+        up->size = st.st_size;
+
+        if((path = cache_path(cp, up->key, ".meta")) == NULL || stat(path, &st) < 0) {
+            free(path);
+            continue;
+        }
+        free(path);
+        up->used = st.st_mtim;
+
+        total += up->size;
+        count++;
+    }
+    closedir(dir);
+
+    if(total > cp->limit) {
+        qsort(uses, count, sizeof(*uses), cache_use_cmp);
+        for(size_t i = 0; i < count && total > cp->limit; i++) {
+            if(!strcmp(uses[i].key, keep)) {
+                continue;
+            }
+            debug("Evicting %s (%ld bytes)", uses[i].key, (long)uses[i].size);
+            cache_remove(cp, uses[i].key);
+            total -= uses[i].size;
+        }
+        if(total > cp->limit) {
+            debug("Evicting %s, which is over the limit by itself", keep);
+            cache_remove(cp, keep);
+        }
+    }
+
+    free(uses);
+}
+
+/*
+ * Finish storing an entry: install the body and the metadata under the
+ * key of the URL, then evict old entries if the cache is over its limit.
+ */
+
+int cache_commit(CACHE_ENTRY *ep) {
+    FILE *meta = NULL;
+    char *body = NULL, *path = NULL, *tmp = NULL;
+    int err = 0;
+
+    if(ep == NULL || ep->body == NULL) {
+        return(1);
+    }
+
+    err = fclose(ep->body) == EOF;
+    ep->body = NULL;
+
+    body = cache_path(ep->cache, ep->key, ".body");
+    path = cache_path(ep->cache, ep->key, ".meta");
+    tmp = cache_path(ep->cache, ep->key, ".meta.tmp");
+    if(err || body == NULL || path == NULL || tmp == NULL || (meta = fopen(tmp, "w")) == NULL) {
+        unlink(ep->tmp);
+        free(body);
+        free(path);
+        free(tmp);
+        return(1);
+    }
+
+    fprintf(meta, "url %s\n", ep->url);
+    if(ep->etag != NULL) {
+        fprintf(meta, "etag %s\n", ep->etag);
+    }
+    if(ep->lastmod != NULL) {
+        fprintf(meta, "last-modified %s\n", ep->lastmod);
+    }
+
+    /*
+     * Install the body before the metadata, so that a reader never
+     * finds validators for a body that is not there.
+     */
+    if(fclose(meta) == EOF || rename(ep->tmp, body) < 0 || rename(tmp, path) < 0) {
+        unlink(ep->tmp);
+        unlink(tmp);
+        err = 1;
+    }
+
+    free(body);
+    free(path);
+    free(tmp);
+
+    if(!err) {
+        cache_evict(ep->cache, ep->key);
+    }
+
+    return(err);
+}
+
+/*
+ * Abandon an entry that is being stored.
+ */
+
+void cache_abort(CACHE_ENTRY *ep) {
+    if(ep != NULL && ep->body != NULL) {
+        fclose(ep->body);
+        ep->body = NULL;
+        unlink(ep->tmp);
+    }
+}
+
+/*
+ * Free an entry returned by cache_lookup() or cache_store().
+ */
+
+void cache_entry_free(CACHE_ENTRY *ep) {
+    if(ep != NULL) {
+        cache_abort(ep);
+        free(ep->url);
+        free(ep->etag);
+        free(ep->lastmod);
+        free(ep->tmp);
+        free(ep);
+    }
+}
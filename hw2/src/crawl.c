@@ -0,0 +1,643 @@
+/*
+ * A recursive retriever that mirrors web sites into a directory tree.
+ *
+ * A fixed number of worker threads take URLs from the front of a queue,
+ * retrieve them, and add the links they find to the back.  The queue
+ * lives in a temporary file, and the set of URLs already queued is kept
+ * as a table of 64-bit hashes, so that a crawl of a very large site only
+ * needs a few bytes of memory per document.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "debug.h"
+#include "url.h"
+#include "http.h"
+#include "crawl.h"
+
+#define LINK_MAX 2048		/* Longest link that will be followed */
+#define SEEN_INITIAL 1024	/* Initial size of the table of hashes */
+
+/*
+ * A server that links may be followed to.
+ */
+
+typedef struct host {
+    char *name;			/* Host name, as it appears in URLs */
+    int port;			/* TCP port */
+    URL *up;			/* First URL seen, holding the addresses
+				   looked up once by crawl_add() */
+    int active;			/* Retrievals in progress from this server */
+    struct host *next;
+} HOST;
+
+struct crawl {
+    int depth;			/* Links followed from the starting URLs */
+    char *dir;			/* Root of the mirror */
+    int workers;		/* Retrievals in progress at once */
+    int per_host;		/* ... and how many may be from one server */
+    HOST *hosts;		/* Servers of the starting URLs */
+    pthread_mutex_t lock;	/* Protects everything below */
+    pthread_cond_t cond;	/* Signalled when work arrives or finishes */
+    FILE *queue;		/* URLs waiting to be retrieved */
+    off_t head, tail;		/* Offsets of the front and back of the queue */
+    size_t pending;		/* Number of URLs in the queue */
+    int busy;			/* Workers with a URL in hand */
+    uint64_t *seen;		/* Open-addressed table of URL hashes */
+    size_t seen_size;		/* Slots in the table (a power of two) */
+    size_t seen_count;		/* Slots in use */
+    int result;			/* 200, or status of the last failure */
+};
+
+/*
+ * State of the scan for links in an HTML document, which is fed the
+ * document in whatever pieces it arrives in.
+ */
+
+typedef enum { LS_TEXT, LS_TAG, LS_NAME, LS_AFTER_NAME, LS_BEFORE_VALUE, LS_VALUE } LINK_STATE;
+
+typedef struct {
+    LINK_STATE state;
+    char name[8];		/* Attribute name (only short ones matter) */
+    size_t nlen;
+    char quote;			/* Quote around the value, or 0 */
+    char value[LINK_MAX];	/* Attribute value */
+    size_t vlen;
+} LINK_SCAN;
+
+static uint64_t url_fingerprint(char *url) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for(unsigned char *cp = (unsigned char *)url; *cp != '\0'; cp++) {
+        h ^= *cp;
+        h *= 0x100000001b3ULL;
+    }
+
+    return(h != 0 ? h : 1); // Zero marks an empty slot.
+}
+
+/*
+ * Add a hash to the set of URLs seen.  Returns 1 if it was not already
+ * there, 0 if it was, or -1 if the table could not be grown.
+ * Called with the lock held.
+ */
+
+static int seen_add(CRAWL *cp, uint64_t h) {
+    size_t i = 0;
+
+    if(2 * (cp->seen_count + 1) > cp->seen_size) {
+        size_t size = cp->seen_size * 2;
+        uint64_t *seen = calloc(size, sizeof(uint64_t));
+
+        if(seen == NULL) {
+            return(-1);
+        }
+        for(size_t j = 0; j < cp->seen_size; j++) {
+            if(cp->seen[j] != 0) {
+                for(i = cp->seen[j] & (size - 1); seen[i] != 0; i = (i + 1) & (size - 1));
+                seen[i] = cp->seen[j];
+            }
+        }
+        free(cp->seen);
+        cp->seen = seen;
+        cp->seen_size = size;
+    }
+
+    for(i = h & (cp->seen_size - 1); cp->seen[i] != 0; i = (i + 1) & (cp->seen_size - 1)) {
+        if(cp->seen[i] == h) {
+            return(0);
+        }
+    }
+
+    cp->seen[i] = h;
+    cp->seen_count++;
+    return(1);
+}
+
+/*
+ * Find the server a URL refers to, if links to it are being followed.
+ * This happens for every link found, so the URL is only looked at
+ * through a view, without copying it.
+ */
+
+static HOST *host_find(CRAWL *cp, char *url) {
+    URL_VIEW view;
+
+    if(url_parse_view(url, strlen(url), &view) || view.method.len != 4 ||
+       strncasecmp(view.method.ptr, "http", 4) || view.hostname.ptr == NULL) {
+        return(NULL);
+    }
+
+    for(HOST *hp = cp->hosts; hp != NULL; hp = hp->next) {
+        if(hp->port == view.port && !strncasecmp(hp->name, view.hostname.ptr, view.hostname.len) &&
+           hp->name[view.hostname.len] == '\0') {
+            return(hp);
+        }
+    }
+
+    return(NULL);
+}
+
+/*
+ * Put a URL on the back of the queue, unless it has been seen before.
+ * Called with the lock held.
+ */
+
+static int crawl_queue(CRAWL *cp, char *url, int depth) {
+    int new = 0;
+
+    if((new = seen_add(cp, url_fingerprint(url))) <= 0) {
+        return(new);
+    }
+
+    if(fseeko(cp->queue, cp->tail, SEEK_SET) || fprintf(cp->queue, "%d %s\n", depth, url) < 0) {
+        return(-1);
+    }
+
+    cp->tail = ftello(cp->queue);
+    cp->pending++;
+    pthread_cond_broadcast(&cp->cond);
+    return(1);
+}
+
+/*
+ * Take the URL from the front of the queue.  Returns a string that must
+ * be freed, or NULL if the queue could not be read.
+ * Called with the lock held, when the queue is not empty.
+ */
+
+static char *crawl_dequeue(CRAWL *cp, int *depth) {
+    char *line = NULL, *url = NULL;
+    size_t len = 0;
+    ssize_t n = 0;
+
+    if(fseeko(cp->queue, cp->head, SEEK_SET) || (n = getline(&line, &len, cp->queue)) <= 0) {
+        free(line);
+        return(NULL);
+    }
+
+    cp->head = ftello(cp->queue);
+    if(--cp->pending == 0) {
+        cp->head = cp->tail = 0; // Start the file over.
+    }
+
+    line[n-1] = '\0';
+    *depth = atoi(line);
+    if((url = strchr(line, ' ')) == NULL || (url = strdup(url + 1)) == NULL) {
+        free(line);
+        return(NULL);
+    }
+
+    free(line);
+    return(url);
+}
+
+/*
+ * Follow a link found in a document, if it leads to one of our servers.
+ */
+
+static void crawl_link(CRAWL *cp, char *base, char *ref, int depth) {
+    char *url = NULL;
+
+    if((url = url_resolve(base, ref)) == NULL) {
+        return;
+    }
+
+    if(host_find(cp, url) != NULL) {
+        pthread_mutex_lock(&cp->lock);
+        if(crawl_queue(cp, url, depth) < 0) {
+            fprintf(stderr, "Unable to queue '%s'\n", url);
+        }
+        pthread_mutex_unlock(&cp->lock);
+    }
+
+    free(url);
+}
+
+/*
+ * Finish an attribute value, following it if it is a link.
+ */
+
+static void scan_value(CRAWL *cp, LINK_SCAN *sp, char *base, int depth) {
+    char *in = sp->value, *out = sp->value;
+
+    if(sp->vlen >= sizeof(sp->value) || (strcasecmp(sp->name, "href") && strcasecmp(sp->name, "src"))) {
+        return;
+    }
+
+    sp->value[sp->vlen] = '\0';
+    while(*in != '\0') {
+        if(!strncmp(in, "&amp;", 5)) {
+            *out++ = '&';
+            in += 5;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+
+    crawl_link(cp, base, sp->value, depth);
+}
+
+/*
+ * Scan the next piece of an HTML document for href and src attributes.
+ */
+
+static void scan_links(CRAWL *cp, LINK_SCAN *sp, char *buf, size_t n, char *base, int depth) {
+    for(size_t i = 0; i < n; i++) {
+        char c = buf[i];
+
+        switch(sp->state) {
+        case LS_TEXT:
+            if(c == '<') {
+                sp->state = LS_TAG;
+            }
+            break;
+        case LS_AFTER_NAME:
+            if(c == '=') {
+                sp->state = LS_BEFORE_VALUE;
+                break;
+            }
+            /* FALLTHROUGH */
+        case LS_TAG:
+            if(c == '>') {
+                sp->state = LS_TEXT;
+            } else if(!isspace((unsigned char)c)) {
+                sp->name[0] = c;
+                sp->nlen = 1;
+                sp->state = LS_NAME;
+            }
+            break;
+        case LS_NAME:
+            if(c == '>') {
+                sp->state = LS_TEXT;
+            } else if(c == '=') {
+                sp->state = LS_BEFORE_VALUE;
+            } else if(isspace((unsigned char)c)) {
+                sp->state = LS_AFTER_NAME;
+            } else if(sp->nlen < sizeof(sp->name) - 1) {
+                sp->name[sp->nlen++] = c;
+            } else {
+                sp->name[0] = '\0'; // Too long to be interesting.
+            }
+            sp->name[sp->nlen] = '\0';
+            break;
+        case LS_BEFORE_VALUE:
+            if(c == '>') {
+                sp->state = LS_TEXT;
+            } else if(!isspace((unsigned char)c)) {
+                sp->quote = (c == '"' || c == '\'') ? c : 0;
+                sp->vlen = 0;
+                if(sp->quote == 0) {
+                    sp->value[sp->vlen++] = c;
+                }
+                sp->state = LS_VALUE;
+            }
+            break;
+        case LS_VALUE:
+            if(sp->quote ? c == sp->quote : (isspace((unsigned char)c) || c == '>')) {
+                scan_value(cp, sp, base, depth);
+                sp->state = c == '>' ? LS_TEXT : LS_TAG;
+            } else if(sp->vlen < sizeof(sp->value)) {
+                sp->value[sp->vlen++] = c;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Create a directory of the mirror.  A document already saved where the
+ * directory goes, as /a is before /a/b, is moved into it as index.html.
+ * Returns 0 on success, -1 on error.  Called with the lock held.
+ */
+
+static int crawl_mkdir(char *dir) {
+    char *moved = NULL, *index = NULL;
+    struct stat st;
+    int err = 0;
+
+    if(mkdir(dir, 0777) == 0) {
+        return(0);
+    }
+    if(errno != EEXIST || stat(dir, &st)) {
+        return(-1);
+    }
+    if(S_ISDIR(st.st_mode)) {
+        return(0);
+    }
+
+    if(asprintf(&moved, "%s.moving", dir) < 0) {
+        return(-1);
+    }
+    if(asprintf(&index, "%s/index.html", dir) < 0) {
+        free(moved);
+        return(-1);
+    }
+    err = rename(dir, moved) || mkdir(dir, 0777) || rename(moved, index);
+    free(moved);
+    free(index);
+
+    return(err ? -1 : 0);
+}
+
+/*
+ * Work out where in the mirror a document goes, and create the
+ * directories leading to it.  A document whose path is already a
+ * directory, as /a is after /a/b, is saved in it as index.html.
+ * Returns a string that must be freed, or NULL if the document cannot
+ * be saved.  Called with the lock held, so that the mirror does not
+ * change under it before the document is opened.
+ */
+
+static char *crawl_path(CRAWL *cp, URL *up) {
+    char *path = url_path(up), *file = NULL, *index = NULL;
+    size_t len = strlen(path);
+    struct stat st;
+    int err = 0;
+
+    if(path[0] != '/' || strstr(path, "/../") != NULL || (len >= 3 && !strcmp(path + len - 3, "/.."))) {
+        return(NULL);
+    }
+
+    if(url_port(up) == 80) {
+        err = asprintf(&file, "%s/%s%s%s", cp->dir, url_hostname(up), path,
+                       path[len-1] == '/' ? "index.html" : "") < 0;
+    } else {
+        err = asprintf(&file, "%s/%s:%d%s%s", cp->dir, url_hostname(up), url_port(up), path,
+                       path[len-1] == '/' ? "index.html" : "") < 0;
+    }
+    if(err) {
+        return(NULL);
+    }
+
+    for(char *slash = strchr(file + strlen(cp->dir) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        err = crawl_mkdir(file);
+        *slash = '/';
+        if(err) {
+            free(file);
+            return(NULL);
+        }
+    }
+
+    if(stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+        err = asprintf(&index, "%s/index.html", file) < 0;
+        free(file);
+        file = err ? NULL : index;
+    }
+
+    return(file);
+}
+
+/*
+ * Retrieve one document into the mirror, following its links if it is
+ * HTML and not too deep.  Returns the HTTP status code, or -1 if any
+ * other kind of error occurs.
+ */
+
+static int crawl_fetch(CRAWL *cp, HOST *hp, char *url, int depth) {
+    URL *up = NULL;
+    HTTP *http = NULL;
+    FILE *out = NULL;
+    LINK_SCAN *sp = NULL;
+    char buf[BUFSIZ], *file = NULL, *type = NULL;
+    ssize_t n = 0;
+    int code = -1;
+
+    if((up = url_parse(url)) == NULL || (http = http_open(url_addresses(hp->up), url_port(up))) == NULL ||
+       http_request(http, up) || http_response(http) || http_status(http, &code) == NULL) {
+        fprintf(stderr, "Unable to retrieve '%s'\n", url);
+        code = -1;
+        goto done;
+    }
+
+    if(code != 200) {
+        fprintf(stderr, "Status %d retrieving '%s'\n", code, url);
+        goto done;
+    }
+
+    pthread_mutex_lock(&cp->lock);
+    if((file = crawl_path(cp, up)) != NULL) {
+        out = fopen(file, "w");
+    }
+    pthread_mutex_unlock(&cp->lock);
+    if(out == NULL) {
+        fprintf(stderr, "Unable to save '%s'\n", url);
+        code = -1;
+        goto done;
+    }
+
+    type = http_headers_lookup(http, "Content-Type");
+    if(depth < cp->depth && type != NULL && !strncasecmp(type, "text/html", 9)) {
+        sp = calloc(1, sizeof(LINK_SCAN));
+    }
+
+    while((n = http_read(http, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, out);
+        if(sp != NULL) {
+            scan_links(cp, sp, buf, n, url, depth + 1);
+        }
+    }
+
+    if(fclose(out) == EOF || http_error(http)) {
+        fprintf(stderr, "Incomplete or corrupt document from '%s'\n", url);
+        code = -1;
+    }
+
+done:
+    free(sp);
+    free(file);
+    http_close(http);
+    url_free(up);
+    return(code);
+}
+
+static void *crawl_worker(void *arg) {
+    CRAWL *cp = arg;
+    HOST *hp = NULL;
+    char *url = NULL;
+    int depth = 0, code = 0;
+
+    pthread_mutex_lock(&cp->lock);
+    for(;;) {
+        while(cp->pending == 0 && cp->busy > 0) {
+            pthread_cond_wait(&cp->cond, &cp->lock);
+        }
+        if(cp->pending == 0) {
+            break;
+        }
+
+        if((url = crawl_dequeue(cp, &depth)) == NULL) {
+            fprintf(stderr, "Unable to read the crawl queue\n");
+            cp->result = -1;
+            cp->pending = 0;
+            break;
+        }
+
+        /*
+         * Wait our turn if too many documents are already coming
+         * from the same server.
+         */
+        cp->busy++;
+        if((hp = host_find(cp, url)) != NULL) {
+            while(hp->active >= cp->per_host) {
+                pthread_cond_wait(&cp->cond, &cp->lock);
+            }
+            hp->active++;
+            pthread_mutex_unlock(&cp->lock);
+
+            code = crawl_fetch(cp, hp, url, depth);
+
+            pthread_mutex_lock(&cp->lock);
+            hp->active--;
+            if(code != 200) {
+                cp->result = code;
+            }
+        }
+        cp->busy--;
+        pthread_cond_broadcast(&cp->cond);
+
+        free(url);
+    }
+
+    pthread_cond_broadcast(&cp->cond);
+    pthread_mutex_unlock(&cp->lock);
+    return(NULL);
+}
+
+/*
+ * Create a new crawl.
+ */
+
+CRAWL *crawl_new(int depth, char *dir, int workers, int per_host) {
+    CRAWL *cp = NULL;
+
+    if(dir == NULL || (cp = calloc(1, sizeof(CRAWL))) == NULL) {
+        return(NULL);
+    }
+
+    cp->depth = depth;
+    cp->dir = dir;
+    cp->workers = workers > 0 ? workers : 1;
+    cp->per_host = per_host > 0 ? per_host : 1;
+    cp->result = 200;
+    cp->seen_size = SEEN_INITIAL;
+    pthread_mutex_init(&cp->lock, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+
+    if((cp->queue = tmpfile()) == NULL || (cp->seen = calloc(cp->seen_size, sizeof(uint64_t))) == NULL ||
+       (mkdir(dir, 0777) && errno != EEXIST)) {
+        crawl_free(cp);
+        return(NULL);
+    }
+
+    return(cp);
+}
+
+/*
+ * Add a starting URL to a crawl, and follow links to its server.
+ */
+
+int crawl_add(CRAWL *cp, char *url) {
+    URL *up = NULL;
+    HOST *hp = NULL;
+    char *abs = NULL;
+    int err = 0;
+
+    if(cp == NULL || (abs = url_resolve(url, "")) == NULL || (up = url_parse(abs)) == NULL ||
+       url_method(up) == NULL || strcasecmp(url_method(up), "http")) {
+        free(abs);
+        url_free(up);
+        return(1);
+    }
+
+    if(host_find(cp, abs) == NULL) {
+        if(url_addresses(up) == NULL || (hp = calloc(1, sizeof(HOST))) == NULL ||
+           (hp->name = strdup(url_hostname(up))) == NULL) {
+            err = 1;
+            free(hp);
+        } else {
+            hp->port = url_port(up);
+            hp->up = up;
+            up = NULL;
+            hp->next = cp->hosts;
+            cp->hosts = hp;
+        }
+    }
+
+    if(!err) {
+        pthread_mutex_lock(&cp->lock);
+        err = crawl_queue(cp, abs, 0) < 0;
+        pthread_mutex_unlock(&cp->lock);
+    }
+
+    free(abs);
+    url_free(up);
+    return(err);
+}
+
+/*
+ * Retrieve everything reachable from the starting URLs.
+ * Returns 200 if every retrieval succeeded, otherwise the status (or -1)
+ * of the last one that did not.
+ */
+
+int crawl_run(CRAWL *cp) {
+    pthread_t *tids = NULL;
+    int started = 0;
+
+    if(cp == NULL || (tids = calloc(cp->workers, sizeof(pthread_t))) == NULL) {
+        return(-1);
+    }
+
+    for(started = 0; started < cp->workers; started++) {
+        if(pthread_create(&tids[started], NULL, crawl_worker, cp)) {
+            break;
+        }
+    }
+
+    if(started == 0) {
+        crawl_worker(cp);
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(tids);
+    return(cp->result);
+}
+
+void crawl_free(CRAWL *cp) {
+    HOST *next = NULL;
+
+    if(cp == NULL) {
+        return;
+    }
+
+    for(HOST *hp = cp->hosts; hp != NULL; hp = next) {
+        next = hp->next;
+        free(hp->name);
+        url_free(hp->up);
+        free(hp);
+    }
+
+    if(cp->queue != NULL) {
+        fclose(cp->queue);
+    }
+    free(cp->seen);
+    pthread_mutex_destroy(&cp->lock);
+    pthread_cond_destroy(&cp->cond);
+    free(cp);
+}
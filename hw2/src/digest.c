@@ -0,0 +1,293 @@
+/*
+ * Routines for computing SHA-256 and CRC32C digests of a stream of data.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define DIGEST_X86
+#endif
+
+#include "digest.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * Process whole 64-byte blocks of SHA-256 input.
+ */
+
+static void sha256_blocks_c(uint32_t *state, const unsigned char *p, size_t blocks) {
+    uint32_t w[64], s[8], t1 = 0, t2 = 0;
+
+    for( ; blocks > 0; blocks--, p += 64) {
+        for(int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+        }
+        for(int i = 16; i < 64; i++) {
+            w[i] = w[i-16] + (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+                   w[i-7] + (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+        }
+
+        memcpy(s, state, sizeof(s));
+        for(int i = 0; i < 64; i++) {
+            t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+                 ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+            t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+                 ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            memmove(s + 1, s, 7 * sizeof(uint32_t));
+            s[4] += t1;
+            s[0] = t1 + t2;
+        }
+        for(int i = 0; i < 8; i++) {
+            state[i] += s[i];
+        }
+    }
+}
+
+static uint32_t crc32c_c(uint32_t crc, const unsigned char *p, size_t n) {
+    static uint32_t table[256];
+
+    if(table[1] == 0) {
+        for(uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++) {
+                c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+            }
+            table[i] = c;
+        }
+    }
+
+    while(n-- > 0) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return(crc);
+}
+
+#ifdef DIGEST_X86
+
+/*
+ * SHA-256 using the SHA extensions.  The state is kept in the ABEF/CDGH
+ * arrangement the instructions want, and each group of four rounds also
+ * extends the message schedule by four words.
+ */
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_x86(uint32_t *state, const unsigned char *p, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, msg, tmp, w[4];
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);	/* CDAB */
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);	/* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);					/* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);				/* CDGH */
+
+    for( ; blocks > 0; blocks--, p += 64) {
+        save0 = state0;
+        save1 = state1;
+
+        for(int g = 0; g < 16; g++) {
+            if(g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * g)), mask);
+            } else {
+                tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+                                    _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(tmp, w[(g + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);		/* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);		/* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);	/* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);		/* HGFE */
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_x86(uint32_t crc, const unsigned char *p, size_t n) {
+#ifdef __x86_64__
+    uint64_t c = crc, v = 0;
+
+    for( ; n >= 8; n -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    while(n-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return(crc);
+}
+
+#endif
+
+static void (*sha256_blocks)(uint32_t *, const unsigned char *, size_t) = NULL;
+static uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t) = NULL;
+
+/*
+ * Pick the fastest implementations this processor supports.
+ */
+
+static void digest_select(void) {
+    sha256_blocks = sha256_blocks_c;
+    crc32c = crc32c_c;
+
+#ifdef DIGEST_X86
+    unsigned int a = 0, b = 0, c = 0, d = 0;
+
+    if(__get_cpuid(1, &a, &b, &c, &d)) {
+        if(c & bit_SSE4_2) {
+            crc32c = crc32c_x86;
+        }
+        if((c & bit_SSE4_1) && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA)) {
+            sha256_blocks = sha256_blocks_x86;
+        }
+    }
+#endif
+}
+
+/*
+ * Return the number of hex digits in a digest made with the named
+ * algorithm, or 0 if it is not one we know.
+ */
+
+size_t digest_length(char *name) {
+    if(name == NULL) {
+        return(0);
+    }
+
+    if(!strcasecmp(name, "sha256")) {
+        return(64);
+    }
+
+    if(!strcasecmp(name, "crc32c")) {
+        return(8);
+    }
+
+    return(0);
+}
+
+int digest_init(DIGEST *dp, char *name) {
+    if(dp == NULL || digest_length(name) == 0) {
+        return(1);
+    }
+
+    if(sha256_blocks == NULL) {
+        digest_select();
+    }
+
+    memset(dp, 0, sizeof(*dp));
+    if(!strcasecmp(name, "sha256")) {
+        dp->alg = DG_SHA256;
+        memcpy(dp->state, sha256_init, sizeof(sha256_init));
+    } else {
+        dp->alg = DG_CRC32C;
+        dp->state[0] = 0xffffffff;
+    }
+
+    return(0);
+}
+
+void digest_update(DIGEST *dp, char *buf, size_t n) {
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t k = 0;
+
+    if(dp == NULL || n == 0) {
+        return;
+    }
+
+    dp->length += n;
+    if(dp->alg == DG_CRC32C) {
+        dp->state[0] = crc32c(dp->state[0], p, n);
+        return;
+    }
+
+    if(dp->fill > 0) {
+        k = 64 - dp->fill < n ? 64 - dp->fill : n;
+        memcpy(dp->block + dp->fill, p, k);
+        dp->fill += k;
+        p += k;
+        n -= k;
+        if(dp->fill < 64) {
+            return;
+        }
+        sha256_blocks(dp->state, dp->block, 1);
+        dp->fill = 0;
+    }
+
+    sha256_blocks(dp->state, p, n / 64);
+    p += n & ~(size_t)63;
+    memcpy(dp->block, p, n & 63);
+    dp->fill = n & 63;
+}
+
+/*
+ * Finish a digest and write it to hex, which must have room for
+ * DIGEST_HEX_MAX characters.  Returns hex.
+ */
+
+char *digest_final(DIGEST *dp, char *hex) {
+    uint64_t bits = 0;
+
+    if(dp == NULL || hex == NULL) {
+        return(NULL);
+    }
+
+    if(dp->alg == DG_CRC32C) {
+        snprintf(hex, DIGEST_HEX_MAX, "%08x", dp->state[0] ^ 0xffffffff);
+        return(hex);
+    }
+
+    /*
+     * Pad with a 1 bit, zeros, and the length in bits.
+     */
+    bits = dp->length * 8;
+    dp->block[dp->fill++] = 0x80;
+    if(dp->fill > 56) {
+        memset(dp->block + dp->fill, 0, 64 - dp->fill);
+        sha256_blocks(dp->state, dp->block, 1);
+        dp->fill = 0;
+    }
+    memset(dp->block + dp->fill, 0, 56 - dp->fill);
+    for(int i = 0; i < 8; i++) {
+        dp->block[63 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    sha256_blocks(dp->state, dp->block, 1);
+
+    for(int i = 0; i < 8; i++) {
+        snprintf(hex + 8 * i, DIGEST_HEX_MAX - 8 * i, "%08x", dp->state[i]);
+    }
+
+    return(hex);
+}
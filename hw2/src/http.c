@@ -6,14 +6,22 @@
  * E. Stark, 11/18/97 for CSE 230
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
-#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
+#include <zlib.h>
 
 #include "debug.h"
 #include "url.h"
@@ -22,6 +30,7 @@
 typedef struct HDRNODE *HEADERS;
 HEADERS http_parse_headers(HTTP *http);
 void http_free_headers(HEADERS env);
+static int http_body_init(HTTP *http);
 
 /*
  * Routines to manage HTTP connections
@@ -29,25 +38,271 @@ void http_free_headers(HEADERS env);
 
 typedef enum { ST_REQ, ST_HDRS, ST_BODY, ST_DONE } HTTP_STATE;
 
+/*
+ * The body of a response passes through up to two decoding stages on its
+ * way to the caller: the chunk framing of "Transfer-Encoding: chunked" is
+ * removed first, then a "Content-Encoding" of gzip or deflate is inflated.
+ * Each stage works on a fixed-size buffer, so the memory used does not
+ * depend on the size of the document.
+ */
+
+typedef enum { CH_NONE, CH_SIZE, CH_DATA, CH_CRLF, CH_TRAILER, CH_DONE } CHUNK_STATE;
+
+#define ZBUF_SIZE 16384		/* Compressed input buffer for inflate() */
+#define DBUF_SIZE 4096		/* Decoded data waiting for http_getc() */
+
 struct http {
-    FILE *file;             /* Stream to remote server */
+    int sock;               /* Socket connected to remote server */
+    FILE *file;             /* Stream to read the response from the server */
+    FILE *head;             /* Stream collecting the request headers */
+    char *hbuf;             /* Buffer behind the head stream */
+    size_t hlen;            /* Length of the request headers in hbuf */
     HTTP_STATE state;		/* State of the connection */
     int code;			    /* Response code */
     char version[4];		/* HTTP version from the response */
     char *response;		    /* Response string with message */
     HEADERS headers;		/* Reply headers */
+    CHUNK_STATE chunk;		/* Where we are in the chunk framing */
+    size_t chunk_left;		/* Bytes remaining in the current chunk */
+    z_stream *zs;		/* Inflate state, if the content is encoded */
+    unsigned char *zbuf;	/* Input buffer for inflate() */
+    int zraw;			/* Retried "deflate" as a raw deflate stream */
+    int zdone;			/* End of the compressed stream was reached */
+    long received;		/* Bytes of the body returned so far */
+    int error;			/* Body was truncated or corrupt */
+    char dbuf[DBUF_SIZE];	/* Decoded data for http_getc() */
+    size_t dpos, dlen;		/* Unread portion of dbuf */
 };
 
 /*
- * Open an HTTP connection for a specified IP address and port number
+ * Time limits, in milliseconds, shared by all connections.
+ * A limit of zero or less means to wait as long as it takes.
+ */
+
+static int connect_timeout = HTTP_CONNECT_TIMEOUT;
+static int read_timeout = HTTP_READ_TIMEOUT;
+
+void http_timeouts(int connect_ms, int read_ms) {
+    connect_timeout = connect_ms;
+    read_timeout = read_ms;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000L + ts.tv_nsec / 1000000L);
+}
+
+/*
+ * Wait for a socket to become ready, for no longer than a timeout.
+ * Returns 1 if it is ready, 0 if the time ran out, or -1 on error.
+ */
+
+static int http_wait(int sock, short events, int timeout) {
+    struct pollfd pfd = { sock, events, 0 };
+    int n = 0;
+
+    while((n = poll(&pfd, 1, timeout > 0 ? timeout : -1)) < 0 && errno == EINTR);
+    return(n);
+}
+
+/*
+ * The response is read through stdio, but every read from the socket
+ * first waits in poll(), so that a server that stops sending cannot hold
+ * up the reader for longer than the read timeout.
  */
 
-HTTP * http_open(IPADDR *addr, int port) {
+static ssize_t http_sock_read(void *cookie, char *buf, size_t n) {
+    HTTP *http = cookie;
+    ssize_t k = 0;
+    int ready = 0;
+
+    if((ready = http_wait(http->sock, POLLIN, read_timeout)) <= 0) {
+        if(ready == 0) {
+            errno = ETIMEDOUT;
+        }
+        return(-1);
+    }
+
+    while((k = read(http->sock, buf, n)) < 0 && errno == EINTR);
+    return(k);
+}
+
+static int http_sock_close(void *cookie) {
+    HTTP *http = cookie;
+
+    return(close(http->sock));
+}
+
+static cookie_io_functions_t http_sock_io = { http_sock_read, NULL, NULL, http_sock_close };
+
+/*
+ * Put the addresses of a host in the order they are to be tried in:
+ * alternately one of the family of the first address and one of the
+ * other family, so that a host whose IPv6 addresses are all unreachable
+ * does not have to wait for every one of them before IPv4 gets a turn.
+ */
+
+static int http_order(ADDRLIST *addrs, ADDRLIST **order, int max) {
+    ADDRLIST *first[HTTP_MAX_ATTEMPTS], *other[HTTP_MAX_ATTEMPTS];
+    int nfirst = 0, nother = 0, n = 0;
+
+    for(ADDRLIST *ap = addrs; ap != NULL; ap = ap->ai_next) {
+        if(ap->ai_family != AF_INET && ap->ai_family != AF_INET6) {
+            continue;
+        }
+        if(ap->ai_family == addrs->ai_family && nfirst < HTTP_MAX_ATTEMPTS) {
+            first[nfirst++] = ap;
+        } else if(ap->ai_family != addrs->ai_family && nother < HTTP_MAX_ATTEMPTS) {
+            other[nother++] = ap;
+        }
+    }
+
+    for(int i = 0; n < max && (i < nfirst || i < nother); i++) {
+        if(i < nfirst) {
+            order[n++] = first[i];
+        }
+        if(i < nother && n < max) {
+            order[n++] = other[i];
+        }
+    }
+
+    return(n);
+}
+
+/*
+ * Start a non-blocking connection to one address.  Returns the socket,
+ * or -1 if the attempt failed at once.  *done is set if the connection
+ * was made without waiting.
+ */
+
+static int http_attempt(ADDRLIST *ap, int port, int *done) {
+    struct sockaddr_storage ss;
+    int sock = -1;
+
+    if(ap->ai_addrlen > sizeof(ss) || (sock = socket(ap->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        return(-1);
+    }
+
+    memcpy(&ss, ap->ai_addr, ap->ai_addrlen);
+    if(ap->ai_family == AF_INET6) {
+        ((struct sockaddr_in6 *)&ss)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)&ss)->sin_port = htons(port);
+    }
+
+    *done = 0;
+    if(connect(sock, (struct sockaddr *)&ss, ap->ai_addrlen) == 0) {
+        *done = 1;
+    } else if(errno != EINPROGRESS) {
+        close(sock);
+        return(-1);
+    }
+
+    return(sock);
+}
+
+/*
+ * Connect to whichever address of a host answers first ("Happy
+ * Eyeballs", RFC 8305).  Addresses are tried in the order given by
+ * http_order(), starting the next one HTTP_ATTEMPT_DELAY ms after the
+ * last, or at once if an attempt fails, while those already started are
+ * left to run.  The first to connect is kept and the rest are closed.
+ * Returns the connected socket, or -1 if none connected within the
+ * connect timeout.
+ */
+
+static int http_connect(ADDRLIST *addrs, int port) {
+    ADDRLIST *order[HTTP_MAX_ATTEMPTS];
+    struct pollfd fds[HTTP_MAX_ATTEMPTS];
+    long now = 0, deadline = 0, next_start = 0;
+    int n = 0, next = 0, started = 0, pending = 0, sock = -1, done = 0, err = 0, wait = 0;
+    socklen_t len = sizeof(err);
+
+    n = http_order(addrs, order, HTTP_MAX_ATTEMPTS);
+    next_start = now = now_ms();
+    deadline = connect_timeout > 0 ? now + connect_timeout : 0;
+
+    while(sock < 0 && (next < n || pending > 0)) {
+        now = now_ms();
+        if(deadline != 0 && now >= deadline) {
+            errno = ETIMEDOUT;
+            break;
+        }
+
+        if(next < n && (now >= next_start || pending == 0)) {
+            int fd = http_attempt(order[next++], port, &done);
+
+            if(fd >= 0 && done) {
+                sock = fd;
+            } else if(fd >= 0) {
+                fds[started].fd = fd;
+                fds[started].events = POLLOUT;
+                fds[started++].revents = 0;
+                pending++;
+                next_start = now + HTTP_ATTEMPT_DELAY;
+            } else {
+                next_start = now;
+            }
+            continue;
+        }
+
+        /*
+         * Sleep until an attempt finishes, it is time to start the next
+         * one, or the time is up, whichever comes first.
+         */
+        wait = -1;
+        if(next < n) {
+            wait = next_start - now;
+        }
+        if(deadline != 0 && (wait < 0 || deadline - now < wait)) {
+            wait = deadline - now;
+        }
+        if(poll(fds, started, wait) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for(int i = 0; i < started && sock < 0; i++) {
+            if(fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            err = 0;
+            len = sizeof(err);
+            if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                sock = fds[i].fd;
+            } else {
+                close(fds[i].fd);
+                next_start = now_ms();
+            }
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for(int i = 0; i < started; i++) {
+        if(fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+
+    if(sock >= 0) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    return(sock);
+}
+
+/*
+ * Open an HTTP connection to a server, given the list of its addresses
+ * and a port number
+ */
+
+HTTP * http_open(ADDRLIST *addrs, int port) {
     HTTP *http = NULL; // Safety initialization.
-    struct sockaddr_in sa = {0}; // Safety initialization.
-    int sock = 0; // Safety initialization.
+    int sock = -1; // Safety initialization.
 
-    if(addr == NULL) {
+    if(addrs == NULL) {
         return(NULL);
     }
 
@@ -56,16 +311,20 @@ HTTP * http_open(IPADDR *addr, int port) {
     }
 
     bzero(http, sizeof(*http));
-    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if((sock = http_connect(addrs, port)) < 0) {
         free(http);
         return(NULL);
     }
 
-    bzero(&sa, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    bcopy(addr, &sa.sin_addr.s_addr, sizeof(struct in_addr));
-    if(connect(sock, (struct sockaddr *)(&sa), sizeof(sa)) < 0 || (http->file = fdopen(sock, "w+")) == NULL) {
+    /*
+     * The request is sent in a single write, so there is nothing to be
+     * gained by delaying small segments.
+     */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    http->sock = sock;
+    if((http->file = fopencookie(http, "r", http_sock_io)) == NULL) {
         free(http);
         close(sock);
         return(NULL);
@@ -89,6 +348,17 @@ int http_close(HTTP *http) {
 
     http_free_headers(http->headers);
 
+    if(http->zs != NULL) {
+        inflateEnd(http->zs);
+        free(http->zs);
+    }
+    free(http->zbuf);
+
+    if(http->head != NULL) {
+        fclose(http->head);
+    }
+    free(http->hbuf);
+
     err = fclose(http->file);
     free(http->response);
     free(http);
@@ -99,6 +369,8 @@ int http_close(HTTP *http) {
 /*
  * Obtain the underlying FILE in an HTTP connection.
  * This can be used to issue additional headers after the request.
+ * Until http_response() is called, the headers are collected in memory,
+ * so that the whole request goes to the server at once.
  */
 
 FILE * http_file(HTTP *http) {
@@ -106,6 +378,10 @@ FILE * http_file(HTTP *http) {
         return(NULL);
     }
 
+    if(http->head != NULL) {
+        return(http->head);
+    }
+
     return(http->file);
 }
 
@@ -117,8 +393,6 @@ FILE * http_file(HTTP *http) {
  */
 
 int http_request(HTTP *http, URL *up) {
-    void *prev = NULL; // Safety initialization.
-
     if(http == NULL || up == NULL) { // Added NULL check.
         return(1);
     }
@@ -127,17 +401,17 @@ int http_request(HTTP *http, URL *up) {
         return(1);
     }
 
-    /* Ignore SIGPIPE so we don't die while doing this */
-    prev = signal(SIGPIPE, SIG_IGN);
-    if(fprintf(http->file, "GET %s://%s:%d%s HTTP/1.0\r\nHost: %s\r\n",
+    if((http->head = open_memstream(&http->hbuf, &http->hlen)) == NULL) {
+        return(1);
+    }
+
+    if(fprintf(http->head, "GET %s://%s:%d%s HTTP/1.0\r\nHost: %s\r\n",
 	   url_method(up), url_hostname(up), url_port(up),
 	   url_path(up), url_hostname(up)) == -1) {
-           signal(SIGPIPE, prev);
            return(1);
     }
 
     http->state = ST_HDRS;
-    signal(SIGPIPE, prev);
     return(0);
 }
 
@@ -149,7 +423,6 @@ int http_request(HTTP *http, URL *up) {
  */
 
 int http_response(HTTP *http) {
-    void *prev = NULL; // Safety initialization.
     char *response = NULL; // Safety initialization.
     size_t len = 0; // Change type of len to size_t because getline() takes in a size_t parameter.
 
@@ -161,15 +434,28 @@ int http_response(HTTP *http) {
         return(1);
     }
 
-    /* Ignore SIGPIPE so we don't die while doing this */
-    prev = signal(SIGPIPE, SIG_IGN);
-    if(fprintf(http->file, "\r\n") == -1 || fflush(http->file) == EOF) {
-        signal(SIGPIPE, prev);
-        return(1);
+    /*
+     * Terminate the headers and send the whole request in one system call.
+     * MSG_NOSIGNAL keeps a closed connection from raising SIGPIPE.
+     */
+    int err = fputs("\r\n", http->head) == EOF;
+    err |= fclose(http->head) == EOF;
+    http->head = NULL;
+    for(size_t sent = 0; !err && sent < http->hlen; ) {
+        ssize_t n = send(http->sock, http->hbuf + sent, http->hlen - sent, MSG_NOSIGNAL);
+
+        if(n > 0) {
+            sent += n;
+        } else if(n < 0 && errno != EINTR) {
+            err = 1;
+        }
     }
 
-    rewind(http->file);
-    signal(SIGPIPE, prev);
+    free(http->hbuf);
+    http->hbuf = NULL;
+    if(err) {
+        return(1);
+    }
 
     len = getline(&response, &len, http->file); // Returns the number of lines read and stores the lines in response. |+
 
@@ -194,6 +480,9 @@ int http_response(HTTP *http) {
     }
 
     http->headers = http_parse_headers(http);
+    if(http_body_init(http)) {
+        return(1);
+    }
     http->state = ST_BODY;
 
     return(0);
@@ -220,20 +509,274 @@ char * http_status(HTTP *http, int *code) {
     return(http->response);
 }
 
+/*
+ * Set up the decoding stages called for by the response headers.
+ */
+
+static int http_body_init(HTTP *http) {
+    char *te = http_headers_lookup(http, "Transfer-Encoding");
+    char *ce = http_headers_lookup(http, "Content-Encoding");
+
+    http->chunk = (te != NULL && strcasestr(te, "chunked") != NULL) ? CH_SIZE : CH_NONE;
+
+    if(ce == NULL || (strcasecmp(ce, "gzip") && strcasecmp(ce, "x-gzip") && strcasecmp(ce, "deflate"))) {
+        return(0);
+    }
+
+    if((http->zs = calloc(1, sizeof(z_stream))) == NULL || (http->zbuf = malloc(ZBUF_SIZE)) == NULL) {
+        return(1);
+    }
+
+    /*
+     * A window size of 15+32 accepts either a gzip or a zlib header.
+     */
+    if(inflateInit2(http->zs, 15 + 32) != Z_OK) {
+        free(http->zs);
+        http->zs = NULL;
+        return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * Read one CRLF-terminated line of chunk framing into buf,
+ * discarding whatever does not fit.  Returns nonzero at end of file.
+ */
+
+static int http_chunk_line(HTTP *http, char *buf, size_t size) {
+    size_t n = 0;
+    int c = 0;
+
+    while((c = fgetc(http->file)) != EOF && c != '\n') {
+        if(n + 1 < size) {
+            buf[n++] = c;
+        }
+    }
+    while(n > 0 && buf[n-1] == '\r') {
+        n--;
+    }
+    buf[n] = '\0';
+
+    return(c == EOF);
+}
+
+/*
+ * Read up to n bytes of the body with any chunk framing removed.
+ * Returns the number of bytes read, 0 at the end of the body,
+ * or -1 if the framing is broken or the connection closes too soon.
+ */
+
+static ssize_t http_read_chunked(HTTP *http, char *buf, size_t n) {
+    char line[64], *end = NULL;
+    size_t k = 0;
+
+    if(http->chunk == CH_NONE) {
+        k = fread(buf, 1, n, http->file);
+        return(k == 0 && ferror(http->file) ? -1 : (ssize_t) k);
+    }
+
+    for(;;) {
+        switch(http->chunk) {
+        case CH_SIZE:
+            if(http_chunk_line(http, line, sizeof(line))) {
+                return(-1);
+            }
+            /*
+             * At least one hex digit, then only spaces or tabs, and any
+             * chunk extensions after ';', which are ignored.
+             */
+            errno = 0;
+            http->chunk_left = strtoul(line, &end, 16);
+            end += strspn(end, " \t");
+            if(errno || !isxdigit((unsigned char)line[0]) || (*end != '\0' && *end != ';')) {
+                return(-1);
+            }
+            http->chunk = http->chunk_left == 0 ? CH_TRAILER : CH_DATA;
+            break;
+        case CH_DATA:
+            k = fread(buf, 1, n < http->chunk_left ? n : http->chunk_left, http->file);
+            if(k == 0) {
+                return(-1);
+            }
+            if((http->chunk_left -= k) == 0) {
+                http->chunk = CH_CRLF;
+            }
+            return(k);
+        case CH_CRLF:
+            if(http_chunk_line(http, line, sizeof(line))) {
+                return(-1);
+            }
+            http->chunk = CH_SIZE;
+            break;
+        case CH_TRAILER:
+            if(http_chunk_line(http, line, sizeof(line))) {
+                return(-1);
+            }
+            if(line[0] == '\0') {
+                http->chunk = CH_DONE;
+            }
+            break;
+        default:
+            return(0);
+        }
+    }
+}
+
+/*
+ * Inflate up to n bytes of an encoded body into buf.
+ * Returns the number of bytes produced, 0 at the end of the body,
+ * or -1 if the compressed data is corrupt or truncated.
+ */
+
+static ssize_t http_inflate(HTTP *http, char *buf, size_t n) {
+    z_stream *zs = http->zs;
+    ssize_t k = 0;
+    int ret = Z_OK, eof = 0;
+
+    zs->next_out = (unsigned char *) buf;
+    zs->avail_out = n;
+
+    while(!http->zdone && zs->avail_out == n) {
+        if(zs->avail_in == 0) {
+            if((k = http_read_chunked(http, (char *) http->zbuf, ZBUF_SIZE)) < 0) {
+                return(-1);
+            }
+            eof = k == 0;
+            zs->next_in = http->zbuf;
+            zs->avail_in = k;
+        }
+
+        ret = inflate(zs, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END) {
+            /*
+             * gzip allows several members one after the other.
+             */
+            if(zs->avail_in > 0) {
+                inflateReset(zs);
+            } else {
+                http->zdone = 1;
+            }
+        } else if(ret == Z_DATA_ERROR && !http->zraw && zs->total_out == 0 &&
+                  zs->next_in - http->zbuf == (ssize_t) zs->total_in) {
+            /*
+             * Some servers send "deflate" without the zlib header
+             * that is supposed to come with it.  Start over on the
+             * input we have, treating it as a raw deflate stream.
+             */
+            http->zraw = 1;
+            zs->avail_in += zs->total_in;
+            zs->next_in = http->zbuf;
+            if(inflateReset2(zs, -15) != Z_OK) {
+                return(-1);
+            }
+        } else if(ret != Z_OK && !(ret == Z_BUF_ERROR && !eof)) {
+            return(-1);
+        } else if(eof && zs->avail_out == n) {
+            return(-1);
+        }
+    }
+
+    return(n - zs->avail_out);
+}
+
+/*
+ * Read up to n bytes of a document from an HTTP connection, with any
+ * transfer and content encoding removed.  Returns the number of bytes
+ * read, 0 at the end of the document, or -1 if the document could not
+ * be decoded.
+ */
+
+ssize_t http_read(HTTP *http, char *buf, size_t n) {
+    ssize_t k = 0;
+
+    if(http == NULL || buf == NULL) {
+        return(-1);
+    }
+
+    if(http->state != ST_BODY || n == 0) {
+        return(0);
+    }
+
+    if(http->dpos < http->dlen) {
+        k = http->dlen - http->dpos < n ? http->dlen - http->dpos : n;
+        memcpy(buf, http->dbuf + http->dpos, k);
+        http->dpos += k;
+        return(k);
+    }
+
+    k = http->zs != NULL ? http_inflate(http, buf, n) : http_read_chunked(http, buf, n);
+    if(k > 0) {
+        http->received += k;
+    } else {
+        http->error = k < 0 || (http_length(http) >= 0 && http->received != http_length(http));
+        http->state = ST_DONE;
+    }
+
+    return(k < 0 ? -1 : k);
+}
+
 /*
  * Read the next character of a document from an HTTP connection
  */
 
 int http_getc(HTTP *http) {
+    ssize_t k = 0;
+
     if(http == NULL) { // Added NULL check.
         return(EOF);
     }
 
-    if(http->state != ST_BODY) {
-        return(EOF);
+    if(http->dpos == http->dlen) {
+        if((k = http_read(http, http->dbuf, sizeof(http->dbuf))) <= 0) {
+            return(EOF);
+        }
+        http->dpos = 0;
+        http->dlen = k;
+    }
+
+    return((unsigned char) http->dbuf[http->dpos++]);
+}
+
+/*
+ * Determine whether the document was cut short or could not be decoded.
+ * Only meaningful once http_getc() or http_read() has reached the end.
+ */
+
+int http_error(HTTP *http) {
+    return(http == NULL || http->error);
+}
+
+/*
+ * Return the length of the document as it will be read, or -1 if this
+ * is not known in advance because the body is chunked or compressed.
+ */
+
+long http_length(HTTP *http) {
+    char *length = NULL;
+
+    if(http == NULL || http->chunk != CH_NONE || http->zs != NULL) {
+        return(-1);
+    }
+
+    if((length = http_headers_lookup(http, "Content-Length")) == NULL) {
+        return(-1);
+    }
+
+    return(atol(length));
+}
+
+/*
+ * Return the Content-Encoding that remains on the document as it will be
+ * read, or NULL if there is none (or it has already been removed).
+ */
+
+char * http_encoding(HTTP *http) {
+    if(http == NULL || http->zs != NULL) {
+        return(NULL);
     }
 
-    return(fgetc(http->file));
+    return(http_headers_lookup(http, "Content-Encoding"));
 }
 
 /*
@@ -0,0 +1,609 @@
+/*
+ * A caching HTTP forward proxy, built on the URL and HTTP packages.
+ *
+ * Each client connection is served by its own thread.  Documents are kept
+ * in a table of entries, keyed by URL.  The first request for a URL creates
+ * an entry and starts a fetcher thread, which retrieves the document and
+ * appends the body to the entry as it arrives.  Every client requesting the
+ * URL, including the first, is a "waiter" on the entry and is sent the body
+ * from the entry's buffer, so concurrent requests share one upstream fetch.
+ *
+ * Complete documents with status 200 stay in the table, on a list in least
+ * recently used order, until the total size of the bodies exceeds the
+ * limit.  A document that is too large to keep, or that failed, is removed
+ * from the table; its buffer only holds the part not yet sent to all of its
+ * waiters, and the fetcher waits for slow waiters rather than let the
+ * buffer grow without bound.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "url.h"
+#include "http.h"
+#include "proxy.h"
+
+#define TABLE_SIZE 1024			/* Buckets in the table of entries */
+#define CHUNK_SIZE 16384		/* Unit of transfer to and from entries */
+#define WINDOW_SIZE (1024 * 1024)	/* Buffer for a document not being kept */
+
+typedef enum { EN_FETCHING, EN_DONE, EN_FAILED } ENTRY_STATE;
+
+typedef struct waiter {
+    size_t off;				/* Offset of the next byte to send */
+    struct waiter *next;
+} WAITER;
+
+typedef struct entry {
+    char *url;				/* URL of the document */
+    ENTRY_STATE state;			/* State of the upstream fetch */
+    char *head;				/* Status line and headers, once known */
+    char *length;			/* Length of the decoded body, if known */
+    char *body;				/* Body received so far */
+    size_t base;			/* Offset in the document of body[0] */
+    size_t len;				/* Number of bytes in body */
+    size_t cap;				/* Allocated size of body */
+    int kept;				/* Is the entry in the table? */
+    int refs;				/* Waiters plus the fetcher */
+    WAITER *waiters;			/* Clients reading the entry */
+    pthread_cond_t cond;		/* Signalled when the entry changes */
+    struct entry *hnext;		/* Next entry in the same bucket */
+    struct entry *lprev, *lnext;	/* Neighbours in LRU order */
+} ENTRY;
+
+/*
+ * Headers of the upstream response that are passed on to clients.
+ */
+
+static char *passed_headers[] = {
+    "Content-Type", "Content-Encoding", "Last-Modified", "ETag",
+    "Expires", "Cache-Control", NULL
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static ENTRY *table[TABLE_SIZE];
+static ENTRY lru = { .lprev = &lru, .lnext = &lru };	/* Most recent first */
+static size_t kept_bytes;
+static size_t kept_limit;
+
+static unsigned int url_hash(char *url) {
+    uint32_t h = 2166136261u;
+
+    for(unsigned char *cp = (unsigned char *)url; *cp != '\0'; cp++) {
+        h ^= *cp;
+        h *= 16777619u;
+    }
+
+    return(h % TABLE_SIZE);
+}
+
+static void lru_unlink(ENTRY *e) {
+    e->lprev->lnext = e->lnext;
+    e->lnext->lprev = e->lprev;
+}
+
+static void lru_push(ENTRY *e) {
+    e->lnext = lru.lnext;
+    e->lprev = &lru;
+    lru.lnext->lprev = e;
+    lru.lnext = e;
+}
+
+static void entry_free(ENTRY *e) {
+    pthread_cond_destroy(&e->cond);
+    free(e->url);
+    free(e->head);
+    free(e->length);
+    free(e->body);
+    free(e);
+}
+
+/*
+ * Remove an entry from the table, so that new requests no longer find it.
+ * The entry is freed once its last reference goes away.
+ * Called with the lock held.
+ */
+
+static void entry_drop(ENTRY *e) {
+    ENTRY **ep = NULL;
+
+    if(!e->kept) {
+        return;
+    }
+
+    for(ep = &table[url_hash(e->url)]; *ep != e; ep = &(*ep)->hnext);
+    *ep = e->hnext;
+    lru_unlink(e);
+    e->kept = 0;
+    kept_bytes -= e->len;
+}
+
+/*
+ * Release a reference to an entry.  Called with the lock held.
+ */
+
+static void entry_release(ENTRY *e) {
+    if(--e->refs == 0 && !e->kept) {
+        entry_free(e);
+    }
+}
+
+/*
+ * Evict least recently used documents until the table is within its limit.
+ * Documents still being retrieved are left alone.  Called with the lock held.
+ */
+
+static void entry_evict(void) {
+    ENTRY *e = lru.lprev, *prev = NULL;
+
+    for( ; kept_bytes > kept_limit && e != &lru; e = prev) {
+        prev = e->lprev;
+        if(e->state == EN_DONE) {
+            debug("Evicting %s (%lu bytes)", e->url, (unsigned long)e->len);
+            entry_drop(e);
+            if(e->refs == 0) {
+                entry_free(e);
+            }
+        }
+    }
+}
+
+/*
+ * Discard the part of the body of an entry that has been sent to every
+ * waiter.  Only done for entries no longer in the table, since a kept
+ * entry must hold the whole document.  Called with the lock held.
+ */
+
+static void entry_trim(ENTRY *e) {
+    size_t low = e->base + e->len;
+
+    if(e->kept) {
+        return;
+    }
+
+    for(WAITER *w = e->waiters; w != NULL; w = w->next) {
+        if(w->off < low) {
+            low = w->off;
+        }
+    }
+
+    if(low > e->base) {
+        memmove(e->body, e->body + (low - e->base), e->base + e->len - low);
+        e->len -= low - e->base;
+        e->base = low;
+    }
+}
+
+/*
+ * Append body data to an entry.  Called with the lock held.
+ */
+
+static int entry_append(ENTRY *e, char *buf, size_t n) {
+    if(e->len + n > e->cap) {
+        size_t cap = e->cap ? e->cap : CHUNK_SIZE;
+        char *body = NULL;
+
+        while(cap < e->len + n) {
+            cap *= 2;
+        }
+
+        if((body = realloc(e->body, cap)) == NULL) {
+            return(1);
+        }
+
+        e->body = body;
+        e->cap = cap;
+    }
+
+    memcpy(e->body + e->len, buf, n);
+    e->len += n;
+
+    /*
+     * The body of a kept document counts against the limit as it arrives,
+     * so that several retrievals at once cannot hold more than the table.
+     * Finished documents make room for it; failing that, it is not kept.
+     */
+    if(e->kept) {
+        kept_bytes += n;
+        entry_evict();
+        if(kept_bytes > kept_limit) {
+            entry_drop(e);
+        }
+    }
+
+    return(0);
+}
+
+/*
+ * Build the status line and passed-on headers of the upstream response.
+ * The body is passed on decoded, so Content-Encoding is only included
+ * if http_read() leaves it in place.
+ */
+
+static char *entry_head(HTTP *http, char *status) {
+    char *head = NULL, *value = NULL;
+    size_t size = 0;
+    FILE *f = NULL;
+
+    if((f = open_memstream(&head, &size)) == NULL) {
+        return(NULL);
+    }
+
+    fprintf(f, "%s\r\n", status);
+    for(char **hp = passed_headers; *hp != NULL; hp++) {
+        if(!strcmp(*hp, "Content-Encoding")) {
+            value = http_encoding(http);
+        } else {
+            value = http_headers_lookup(http, *hp);
+        }
+        if(value != NULL) {
+            fprintf(f, "%s: %s\r\n", *hp, value);
+        }
+    }
+
+    if(fclose(f) == EOF) {
+        free(head);
+        return(NULL);
+    }
+
+    return(head);
+}
+
+/*
+ * Mark the end of an upstream fetch, and drop the fetcher's reference.
+ * Called with the lock held.
+ */
+
+static void entry_finish(ENTRY *e, ENTRY_STATE state) {
+    e->state = state;
+
+    if(state != EN_DONE) {
+        entry_drop(e);
+    }
+
+    pthread_cond_broadcast(&e->cond);
+    entry_release(e);
+}
+
+/*
+ * Thread that retrieves the document for an entry from the remote server.
+ */
+
+static void *proxy_fetch(void *arg) {
+    ENTRY *e = arg;
+    URL *up = NULL;
+    HTTP *http = NULL;
+    char buf[CHUNK_SIZE], *status = NULL, *head = NULL, *size = NULL;
+    ssize_t n = 0;
+    size_t total = 0;
+    long length = -1;
+    int code = 0, stop = 0;
+
+    if((up = url_parse(e->url)) == NULL || url_method(up) == NULL || strcasecmp(url_method(up), "http")) {
+        goto failed;
+    }
+
+    if((http = http_open(url_addresses(up), url_port(up))) == NULL || http_request(http, up) || http_response(http) ||
+       (status = http_status(http, &code)) == NULL || (head = entry_head(http, status)) == NULL) {
+        goto failed;
+    }
+
+    if((length = http_length(http)) >= 0) {
+        asprintf(&size, "%ld", length);
+    }
+
+    pthread_mutex_lock(&lock);
+    e->head = head;
+    e->length = size;
+    if(code != 200) {
+        entry_drop(e);
+    }
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&lock);
+
+    while(!stop) {
+        if((n = http_read(http, buf, sizeof(buf))) <= 0) {
+            n = 0;
+            stop = 1;
+        }
+
+        pthread_mutex_lock(&lock);
+        if(entry_append(e, buf, n)) {
+            entry_finish(e, EN_FAILED);
+            pthread_mutex_unlock(&lock);
+            goto done;
+        }
+        total += n;
+        n = 0;
+        entry_trim(e);
+        pthread_cond_broadcast(&e->cond);
+
+        /*
+         * Wait for slow clients rather than buffer a document we are not
+         * keeping, and give up if nobody wants it any more.
+         */
+        while(!e->kept && e->waiters != NULL && e->len > WINDOW_SIZE) {
+            pthread_cond_wait(&e->cond, &lock);
+            entry_trim(e);
+        }
+        if(!e->kept && e->waiters == NULL) {
+            entry_finish(e, EN_FAILED);
+            pthread_mutex_unlock(&lock);
+            goto done;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    entry_finish(e, (!http_error(http) && (length < 0 || (size_t)length == total)) ? EN_DONE : EN_FAILED);
+    pthread_mutex_unlock(&lock);
+    goto done;
+
+failed:
+    free(head);
+    pthread_mutex_lock(&lock);
+    entry_finish(e, EN_FAILED);
+    pthread_mutex_unlock(&lock);
+
+done:
+    http_close(http);
+    url_free(up);
+    return(NULL);
+}
+
+/*
+ * Find the entry for a URL, creating it and starting its fetch if there
+ * is none.  The caller is added as a waiter.  Called with the lock held.
+ */
+
+static ENTRY *entry_get(char *url, WAITER *w) {
+    unsigned int h = url_hash(url);
+    ENTRY *e = NULL;
+    pthread_t tid;
+
+    for(e = table[h]; e != NULL && strcmp(e->url, url); e = e->hnext);
+
+    if(e != NULL) {
+        lru_unlink(e);
+        lru_push(e);
+    } else {
+        if((e = calloc(1, sizeof(*e))) == NULL || (e->url = strdup(url)) == NULL) {
+            free(e);
+            return(NULL);
+        }
+
+        pthread_cond_init(&e->cond, NULL);
+        e->state = EN_FETCHING;
+        e->kept = 1;
+        e->refs = 1;
+        if(pthread_create(&tid, NULL, proxy_fetch, e) != 0) {
+            entry_free(e);
+            return(NULL);
+        }
+        pthread_detach(tid);
+
+        e->hnext = table[h];
+        table[h] = e;
+        lru_push(e);
+    }
+
+    e->refs++;
+    w->off = 0;
+    w->next = e->waiters;
+    e->waiters = w;
+    return(e);
+}
+
+/*
+ * Remove a waiter from an entry.  Called with the lock held.
+ */
+
+static void entry_leave(ENTRY *e, WAITER *w) {
+    WAITER **wp = NULL;
+
+    for(wp = &e->waiters; *wp != w; wp = &(*wp)->next);
+    *wp = w->next;
+
+    entry_trim(e);
+    pthread_cond_broadcast(&e->cond);
+    entry_release(e);
+}
+
+static int send_all(int fd, char *buf, size_t len) {
+    ssize_t n = 0;
+
+    for(size_t done = 0; done < len; done += n) {
+        if((n = send(fd, buf + done, len - done, MSG_NOSIGNAL)) <= 0) {
+            return(1);
+        }
+    }
+
+    return(0);
+}
+
+static void send_error(int fd, int code, char *msg) {
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\n"
+             "Connection: close\r\n\r\n%s\r\n", code, msg, msg);
+    send_all(fd, buf, strlen(buf));
+}
+
+/*
+ * Serve one document from an entry to a client.
+ */
+
+static void proxy_serve(int fd, ENTRY *e, WAITER *w) {
+    char buf[CHUNK_SIZE], *head = NULL, *tail = NULL;
+    size_t n = 0;
+    int err = 0;
+
+    pthread_mutex_lock(&lock);
+    while(e->head == NULL && e->state == EN_FETCHING) {
+        pthread_cond_wait(&e->cond, &lock);
+    }
+
+    if(e->head == NULL) {
+        pthread_mutex_unlock(&lock);
+        send_error(fd, 502, "Bad Gateway");
+        return;
+    }
+
+    if(e->state == EN_DONE) {
+        err = asprintf(&tail, "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)e->len) < 0;
+    } else if(e->length != NULL) {
+        err = asprintf(&tail, "Content-Length: %s\r\nConnection: close\r\n\r\n", e->length) < 0;
+    } else {
+        err = (tail = strdup("Connection: close\r\n\r\n")) == NULL;
+    }
+    head = strdup(e->head);
+    pthread_mutex_unlock(&lock);
+
+    if(err || head == NULL || send_all(fd, head, strlen(head)) || send_all(fd, tail, strlen(tail))) {
+        free(head);
+        free(tail);
+        return;
+    }
+    free(head);
+    free(tail);
+
+    while(1) {
+        pthread_mutex_lock(&lock);
+        while(w->off >= e->base + e->len && e->state == EN_FETCHING) {
+            pthread_cond_wait(&e->cond, &lock);
+        }
+
+        n = e->base + e->len - w->off;
+        if(n > sizeof(buf)) {
+            n = sizeof(buf);
+        }
+        if(n > 0) {
+            memcpy(buf, e->body + (w->off - e->base), n);
+            w->off += n;
+        }
+        if(!e->kept) {
+            pthread_cond_broadcast(&e->cond);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if(n == 0 || send_all(fd, buf, n)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Thread that serves one client connection.
+ */
+
+static void *proxy_client(void *arg) {
+    int fd = *(int *)arg;
+    FILE *in = NULL;
+    char *line = NULL, *method = NULL, *url = NULL, *save = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    ENTRY *e = NULL;
+    WAITER w;
+
+    free(arg);
+
+    if((in = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return(NULL);
+    }
+
+    if((read = getline(&line, &len, in)) <= 0 ||
+       (method = strtok_r(line, " \r\n", &save)) == NULL ||
+       (url = strtok_r(NULL, " \r\n", &save)) == NULL) {
+        send_error(fd, 400, "Bad Request");
+        goto done;
+    }
+
+    /*
+     * The request headers are not needed.
+     */
+    char *hdr = NULL;
+    size_t hlen = 0;
+    while((read = getline(&hdr, &hlen, in)) > 0 && strcmp(hdr, "\r\n") && strcmp(hdr, "\n"));
+    free(hdr);
+
+    if(strcmp(method, "GET")) {
+        send_error(fd, 501, "Not Implemented");
+        goto done;
+    }
+
+    debug("Proxy request for %s", url);
+    pthread_mutex_lock(&lock);
+    e = entry_get(url, &w);
+    pthread_mutex_unlock(&lock);
+
+    if(e == NULL) {
+        send_error(fd, 503, "Service Unavailable");
+        goto done;
+    }
+
+    proxy_serve(fd, e, &w);
+
+    pthread_mutex_lock(&lock);
+    entry_leave(e, &w);
+    pthread_mutex_unlock(&lock);
+
+done:
+    free(line);
+    fclose(in);
+    return(NULL);
+}
+
+/*
+ * Run the proxy server on the loopback interface.
+ */
+
+int proxy_run(int port, size_t limit) {
+    struct sockaddr_in sa = {0};
+    int sock = -1, one = 1, *fdp = NULL;
+    pthread_t tid;
+
+    kept_limit = limit > 0 ? limit : PROXY_DEFAULT_LIMIT;
+
+    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return(1);
+    }
+
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(sock, 128) < 0) {
+        close(sock);
+        return(1);
+    }
+
+    info("Proxy listening on port %d", port);
+    while(1) {
+        if((fdp = malloc(sizeof(int))) == NULL) {
+            continue;
+        }
+
+        if((*fdp = accept(sock, NULL, NULL)) < 0) {
+            free(fdp);
+            continue;
+        }
+
+        if(pthread_create(&tid, NULL, proxy_client, fdp) != 0) {
+            close(*fdp);
+            free(fdp);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
@@ -0,0 +1,303 @@
+/*
+ * Routines for resuming an interrupted retrieval with a Range request,
+ * using a small metadata file kept next to the output.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "debug.h"
+#include "resume.h"
+
+struct resume {
+    char *side;				/* Name of the metadata file */
+    char *url;				/* URL of the document */
+    char *etag;				/* "ETag" validator, if any */
+    char *lastmod;			/* "Last-Modified" validator, if any */
+    FILE *out;				/* The output file */
+    off_t offset;			/* Length of the part kept from before */
+    off_t written;			/* Length of the output so far */
+    off_t synced;			/* Length last recorded in the metadata */
+    int ranged;				/* A Range request was sent */
+    int resumable;			/* The metadata file is being kept */
+};
+
+static char *dupvalue(char *line, char *key) {
+    size_t len = strlen(key);
+
+    if(strncmp(line, key, len) || line[len] != ' ') {
+        return(NULL);
+    }
+
+    return(strdup(line + len + 1));
+}
+
+/*
+ * Read the metadata left by an earlier attempt.  Returns the length of
+ * the document recorded there, or 0 if there is nothing to resume.
+ */
+
+static off_t resume_read(RESUME *rp) {
+    FILE *f = NULL;
+    char *line = NULL, *url = NULL, *value = NULL;
+    size_t len = 0;
+    ssize_t n = 0;
+    off_t length = 0;
+
+    if((f = fopen(rp->side, "r")) == NULL) {
+        return(0);
+    }
+
+    while((n = getline(&line, &len, f)) > 0) {
+        if(line[n-1] == '\n') {
+            line[n-1] = '\0';
+        }
+
+        if((value = dupvalue(line, "url")) != NULL) {
+            free(url);
+            url = value;
+        } else if((value = dupvalue(line, "etag")) != NULL) {
+            free(rp->etag);
+            rp->etag = value;
+        } else if((value = dupvalue(line, "last-modified")) != NULL) {
+            free(rp->lastmod);
+            rp->lastmod = value;
+        } else if(!strncmp(line, "length ", 7)) {
+            length = strtoll(line + 7, NULL, 10);
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    /*
+     * The saved part is only of use if it is of the same document,
+     * and can be validated.
+     */
+    if(url == NULL || strcmp(url, rp->url) || (rp->etag == NULL && rp->lastmod == NULL) || length < 0) {
+        length = 0;
+    }
+
+    free(url);
+    return(length);
+}
+
+/*
+ * Record the progress of the retrieval.  The metadata is written to a
+ * temporary file and renamed, so that it is never seen half written.
+ */
+
+static int resume_write(RESUME *rp) {
+    FILE *f = NULL;
+    char *tmp = NULL;
+    int err = 0;
+
+    if(asprintf(&tmp, "%s.tmp", rp->side) < 0) {
+        return(1);
+    }
+
+    if((f = fopen(tmp, "w")) == NULL) {
+        free(tmp);
+        return(1);
+    }
+
+    fprintf(f, "url %s\n", rp->url);
+    if(rp->etag != NULL) {
+        fprintf(f, "etag %s\n", rp->etag);
+    }
+    if(rp->lastmod != NULL) {
+        fprintf(f, "last-modified %s\n", rp->lastmod);
+    }
+    fprintf(f, "length %lld\n", (long long)rp->written);
+
+    if(fclose(f) == EOF || rename(tmp, rp->side) < 0) {
+        unlink(tmp);
+        err = 1;
+    }
+
+    free(tmp);
+    rp->synced = rp->written;
+    return(err);
+}
+
+/*
+ * Open the output for a retrieval, keeping whatever an earlier attempt
+ * saved of the same document.
+ */
+
+RESUME *resume_open(char *file, char *url) {
+    RESUME *rp = NULL;
+    struct stat st;
+    off_t length = 0;
+
+    if(file == NULL || url == NULL || (rp = calloc(1, sizeof(*rp))) == NULL) {
+        return(NULL);
+    }
+
+    if(asprintf(&rp->side, "%s%s", file, RESUME_SUFFIX) < 0 || (rp->url = strdup(url)) == NULL) {
+        free(rp->side);
+        free(rp);
+        return(NULL);
+    }
+
+    length = resume_read(rp);
+    if(length > 0 && stat(file, &st) == 0 && st.st_size >= length && (rp->out = fopen(file, "r+")) != NULL) {
+        /*
+         * Anything past the recorded length may not have been written
+         * completely, so it is fetched again.
+         */
+        if(ftruncate(fileno(rp->out), length) < 0 || fseeko(rp->out, length, SEEK_SET) < 0) {
+            fclose(rp->out);
+            rp->out = NULL;
+        } else {
+            rp->offset = rp->written = rp->synced = length;
+        }
+    }
+
+    if(rp->out == NULL && (rp->out = fopen(file, "w")) == NULL) {
+        resume_close(rp, 0);
+        return(NULL);
+    }
+
+    return(rp);
+}
+
+FILE *resume_file(RESUME *rp) {
+    return(rp != NULL ? rp->out : NULL);
+}
+
+off_t resume_offset(RESUME *rp) {
+    return(rp != NULL ? rp->offset : 0);
+}
+
+/*
+ * Ask for the rest of the document, provided that it has not changed.
+ * A weak ETag cannot be used with If-Range.
+ */
+
+int resume_request(RESUME *rp, FILE *f) {
+    char *validator = NULL;
+
+    if(rp == NULL || rp->offset == 0) {
+        return(0);
+    }
+
+    validator = (rp->etag != NULL && strncmp(rp->etag, "W/", 2)) ? rp->etag : rp->lastmod;
+    if(validator == NULL) {
+        return(1);
+    }
+
+    rp->ranged = 1;
+    return(fprintf(f, "Range: bytes=%lld-\r\nIf-Range: %s\r\n", (long long)rp->offset, validator) < 0);
+}
+
+/*
+ * Decide what to do with the body of a response.  A 206 reply must pick
+ * up exactly where the saved part ends.  A 200 reply is a whole new copy
+ * of the document, so the output is emptied.  Any other reply to a
+ * request for the rest leaves the saved part and its metadata alone.
+ */
+
+int resume_response(RESUME *rp, HTTP *http, int code) {
+    char *range = NULL, *etag = NULL, *lastmod = NULL;
+
+    if(rp == NULL) {
+        return(0);
+    }
+
+    if(code == 206) {
+        range = http_headers_lookup(http, "Content-Range");
+        if(!rp->ranged || range == NULL || strncasecmp(range, "bytes ", 6) ||
+           strtoll(range + 6, NULL, 10) != (long long)rp->offset ||
+           http_headers_lookup(http, "Content-Encoding") != NULL) {
+            return(1);
+        }
+        rp->resumable = 1;
+        return(0);
+    }
+
+    if(rp->offset > 0) {
+        if(code != 200) {
+            return(1);
+        }
+        if(fflush(rp->out) == EOF || ftruncate(fileno(rp->out), 0) < 0 || fseeko(rp->out, 0, SEEK_SET) < 0) {
+            return(1);
+        }
+        rp->offset = rp->written = rp->synced = 0;
+    }
+
+    etag = http_headers_lookup(http, "ETag");
+    lastmod = http_headers_lookup(http, "Last-Modified");
+    free(rp->etag);
+    free(rp->lastmod);
+    rp->etag = etag != NULL ? strdup(etag) : NULL;
+    rp->lastmod = lastmod != NULL ? strdup(lastmod) : NULL;
+
+    rp->resumable = code == 200 && (rp->etag != NULL || rp->lastmod != NULL) &&
+                    http_headers_lookup(http, "Content-Encoding") == NULL;
+    if(!rp->resumable) {
+        unlink(rp->side);
+        return(0);
+    }
+
+    return(resume_write(rp));
+}
+
+/*
+ * Account for a block of the body written to the output.  The metadata
+ * is only brought up to date once every RESUME_SYNC_BYTES.
+ */
+
+int resume_progress(RESUME *rp, size_t len) {
+    if(rp == NULL) {
+        return(0);
+    }
+
+    rp->written += len;
+    if(!rp->resumable || rp->written - rp->synced < RESUME_SYNC_BYTES) {
+        return(0);
+    }
+
+    if(fflush(rp->out) == EOF) {
+        return(1);
+    }
+
+    return(resume_write(rp));
+}
+
+/*
+ * Close the output.  Once the document is complete there is nothing
+ * left to resume; otherwise, record how far we got.
+ */
+
+int resume_close(RESUME *rp, int complete) {
+    int err = 0;
+
+    if(rp == NULL) {
+        return(1);
+    }
+
+    if(rp->out != NULL) {
+        err = fclose(rp->out) == EOF;
+    }
+
+    if(complete && !err) {
+        unlink(rp->side);
+    } else if(rp->resumable) {
+        err |= resume_write(rp);
+    }
+
+    free(rp->side);
+    free(rp->url);
+    free(rp->etag);
+    free(rp->lastmod);
+    free(rp);
+    return(err);
+}
@@ -18,42 +18,150 @@
 #include "http.h"
 #include "url.h"
 #include "snarf.h"
+#include "cache.h"
+#include "proxy.h"
+#include "timing.h"
+#include "crawl.h"
+#include "digest.h"
+#include "resume.h"
 
-int main(int argc, char *argv[]) {
+/*
+ * Output the response headers matching the keywords given with -q.
+ */
+
+static void query_headers(HTTP *http) {
+    char buf[sizeof(keywords)];
+    char *key = NULL;
+    char *token = NULL;
+    char *save = NULL;
+
+    char *search = " "; // Searching for a whitespace between header keys.
+
+    // Work on a copy, since strtok_r() modifies the string it scans.
+    strcpy(buf, keywords);
+    for(token = strtok_r(buf, search, &save); token != NULL; token = strtok_r(NULL, search, &save)) {
+        if((key = http_header_key(http, token)) != NULL) {
+            fprintf(stderr, "%s", key);
+            fprintf(stderr, "%s", ": ");
+            fprintf(stderr, "%s\n", http_headers_lookup(http, token)); // Print the header value to stderr.
+        }
+    }
+}
+
+/*
+ * Copy the saved copy of a document to the output through a buffer,
+ * so that its digest can be computed on the way.
+ */
+
+static int snarf_cached(CACHE_ENTRY *cached, FILE *out, DIGEST *dp) {
+    char buf[BUFSIZ];
+    size_t n = 0;
+    FILE *in = NULL;
+    int err = 0;
+
+    if((in = cache_body(cached)) == NULL) {
+        return(1);
+    }
+
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+        digest_update(dp, buf, n);
+    }
+
+    err = ferror(in) || ferror(out);
+    fclose(in);
+    return(err);
+}
+
+/*
+ * Feed the part of a document kept from an earlier attempt to the digest,
+ * so that the digest covers the whole document when it is resumed.
+ */
+
+static int digest_prefix(DIGEST *dp, char *file, off_t len) {
+    char buf[BUFSIZ];
+    size_t n = 0;
+    FILE *in = NULL;
+
+    if((in = fopen(file, "r")) == NULL) {
+        return(1);
+    }
+
+    while(len > 0 && (n = fread(buf, 1, len < (off_t)sizeof(buf) ? (size_t)len : sizeof(buf), in)) > 0) {
+        digest_update(dp, buf, n);
+        len -= n;
+    }
+
+    fclose(in);
+    return(len != 0);
+}
+
+/*
+ * Retrieve one document and write its body to a stream.
+ * Returns the HTTP status code, or -1 if any other kind of error occurs.
+ * If tp is not NULL, the phases of the retrieval are timed.  With -c,
+ * the digest of the body is computed on the way through and printed,
+ * and DIGEST_MISMATCH is returned if it is not the one expected.
+ * If rp is not NULL, the body goes to its file, picking up where an
+ * earlier attempt left off, and -1 is returned if it is incomplete.
+ */
+
+static int snarf(char *url, FILE *out, CACHE *cache, TIMING *tp, RESUME *rp) {
     URL *up = NULL; // Safety initialization.
     HTTP *http = NULL; // Safety initialization.
-    IPADDR *addr = NULL; // Safety initialization.
+    ADDRLIST *addrs = NULL; // Safety initialization.
 
-    int port, c, code;
-    port = c = 0; // Safety initialization.
+    int port, code;
+    port = 0; // Safety initialization.
     code = -1; // Safety initialization.
 
     char *status, *method;
     status = method = NULL; // Safety initialization.
 
-    parse_args(argc, argv);
-    if((up = url_parse(url_to_snarf)) == NULL) {
-        fprintf(stderr, "Illegal URL: '%s'\n", argv[1]);
-        url_free(up);
-        exit(-1); // Exit with -1 because the URL was null.
+    CACHE_ENTRY *cached = NULL, *store = NULL;
+    DIGEST digest, *dp = NULL;
+    char hex[DIGEST_HEX_MAX];
+
+    if(digest_alg != NULL && !digest_init(&digest, digest_alg)) {
+        dp = &digest;
+    }
+
+    timing_init(tp);
+    timing_start(tp, PH_TOTAL);
+
+    if((up = url_parse(url)) == NULL) {
+        fprintf(stderr, "Illegal URL: '%s'\n", url != NULL ? url : "(NULL)");
+        return(-1); // Return -1 because the URL was null.
     }
 
     method = url_method(up);
-    addr = url_address(up);
+    timing_start(tp, PH_DNS);
+    addrs = url_addresses(up);
+    timing_stop(tp, PH_DNS);
     port = url_port(up);
     if(method == NULL || strcasecmp(method, "http")) {
         fprintf(stderr, "Only HTTP access method is supported\n");
         url_free(up);
-        exit(-1); // Exit with -1 because the method is not provided or the method isn't http.
+        return(-1); // Return -1 because the method is not provided or the method isn't http.
     }
 
-    if((http = http_open(addr, port)) == NULL) {
+    timing_start(tp, PH_CONNECT);
+    if((http = http_open(addrs, port)) == NULL) {
         fprintf(stderr, "Unable to contact host '%s', port %d\n",
 	    url_hostname(up) != NULL ? url_hostname(up) : "(NULL)", port);
         url_free(up);
-        exit(-1); // Exit with -1 because the link might not exist (which is why we cannot contact it).
+        return(-1); // Return -1 because the link might not exist (which is why we cannot contact it).
     }
+    timing_stop(tp, PH_CONNECT);
 
+    /*
+     * A cached copy is no use when only the tail is wanted.
+     */
+    if(cache != NULL && resume_offset(rp) == 0) {
+        cached = cache_lookup(cache, url);
+    }
+
+    timing_start(tp, PH_TTFB);
     http_request(http, up);
   /*
    * Additional RFC822-style headers can be sent at this point,
@@ -62,8 +170,14 @@ int main(int argc, char *argv[]) {
    *     fprintf(url_file(up), "If-modified-since: 10 Jul 1997\r\n");
    *
    * would activate "Conditional GET" on most HTTP servers.
+   * If we have a saved copy of the document, we do exactly that.
    */
+    if(cached != NULL) {
+        cache_validate(cached, http_file(http));
+    }
+    resume_request(rp, http_file(http));
     http_response(http);
+    timing_stop(tp, PH_TTFB);
   /*
    * At this point, response status and headers are available for querying.
    *
@@ -91,32 +205,262 @@ int main(int argc, char *argv[]) {
 #endif
 
     if(keyPtr != NULL) {
-        if(keyPtr[strlen(keywords) - 1] == ' ') {
-            keyPtr[strlen(keywords) - 1] = '\0'; // There's an extra space at the end so we null terminate it.
+        query_headers(http);
+    }
+
+    if(resume_response(rp, http, code)) {
+        fprintf(stderr, "Unable to resume '%s' (status %d)\n", url, code);
+        code = -1;
+    } else if(code == 206 && rp != NULL) {
+        /*
+         * Only the tail is coming; the document as a whole is a success.
+         */
+        if(dp != NULL && digest_prefix(dp, output_file, resume_offset(rp))) {
+            fprintf(stderr, "Unable to read '%s'\n", output_file);
+            code = -1;
+        } else {
+            code = 200;
+        }
+    }
+
+  /*
+   * At this point, we can retrieve the body of the document,
+   * character by character using http_getc(), or in blocks using http_read()
+   */
+
+    timing_start(tp, PH_TRANSFER);
+    if(code == 304 && cached != NULL) {
+        /*
+         * Not modified: the saved copy is sent straight from the cache
+         * to the output, and counts as a successful retrieval.
+         */
+        fflush(out);
+        if(dp != NULL ? snarf_cached(cached, out, dp) : cache_serve(cached, fileno(out))) {
+            fprintf(stderr, "Unable to read cached copy of '%s'\n", url);
+            code = -1;
+        } else {
+            code = 200;
         }
+    } else if(code != -1) {
+        char buf[BUFSIZ];
+        ssize_t n = 0;
+        long total = 0;
 
-        char *key = NULL;
-        char *token = NULL;
+        if(code == 200 && cache != NULL && resume_offset(rp) == 0) {
+            store = cache_store(cache, url, http_headers_lookup(http, "ETag"),
+                                http_headers_lookup(http, "Last-Modified"));
+        }
 
-        char *search = " "; // Searching for a whitespace between header keys.
+        /*
+         * The body arrives already decoded, a block at a time, and goes
+         * straight to the output.
+         */
+        while((n = http_read(http, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, out);
+            digest_update(dp, buf, n);
+            resume_progress(rp, n);
+            if(store != NULL && cache_write(store, buf, n)) {
+                cache_entry_free(store);
+                store = NULL;
+            }
+            total += n;
+        }
+        timing_bytes(tp, total);
+
+        if(http_error(http)) {
+            fprintf(stderr, "Incomplete or corrupt document from '%s'\n", url);
+        }
+
+        /*
+         * What was saved of an incomplete document is kept to be resumed.
+         */
+        if(rp != NULL && (http_error(http) || (http_length(http) >= 0 && http_length(http) != total))) {
+            code = -1;
+        }
 
-        while((token = strtok(keyPtr, search)) != NULL) {
-            if((key = http_header_key(http, token)) != NULL) {
-                fprintf(stderr, "%s", key);
-                fprintf(stderr, "%s", ": ");
-                fprintf(stderr, "%s\n", http_headers_lookup(http, token)); // Print the header value to stderr.
+        /*
+         * Only a complete document is worth saving.
+         */
+        if(store != NULL) {
+            if(http_error(http) || (http_length(http) >= 0 && http_length(http) != total)) {
+                cache_abort(store);
+            } else {
+                cache_commit(store);
             }
-            keyPtr = NULL;
         }
     }
+    fflush(out);
+    timing_stop(tp, PH_TRANSFER);
+    timing_stop(tp, PH_TOTAL);
 
-  /*
-   * At this point, we can retrieve the body of the document,
-   * character by character, using http_getc()
-   */
+    if(dp != NULL && code == 200) {
+        fprintf(stderr, "%s  %s\n", digest_final(dp, hex), url);
+        if(digest_expect != NULL && strcasecmp(hex, digest_expect)) {
+            fprintf(stderr, "%s digest mismatch for '%s'\n", digest_alg, url);
+            code = DIGEST_MISMATCH;
+        }
+    }
+
+    cache_entry_free(store);
+    cache_entry_free(cached);
+
+    http_close(http);
+    url_free(up);
+    return(code);
+}
+
+/*
+ * Read the next URL from a list, one per line.
+ * Blank lines and lines starting with '#' are ignored.
+ * Returns NULL at the end of the list.
+ */
+
+static char *next_url(FILE *in, char **line, size_t *len) {
+    ssize_t read = 0;
+
+    while((read = getline(line, len, in)) != -1) {
+        while(read > 0 && ((*line)[read-1] == '\n' || (*line)[read-1] == '\r')) {
+            (*line)[--read] = '\0';
+        }
+
+        if(read > 0 && (*line)[0] != '#') {
+            return(*line);
+        }
+    }
+
+    return(NULL);
+}
+
+static FILE *open_list(char *list) {
+    FILE *in = NULL;
+
+    if(!strcmp(list, "-")) {
+        in = stdin;
+    } else if((in = fopen(list, "r")) == NULL) {
+        fprintf(stderr, "Unable to open URL list '%s'\n", list);
+    }
+
+    return(in);
+}
+
+/*
+ * Retrieve each URL listed in a file in turn.
+ * Returns 200 if every retrieval succeeded, otherwise the status (or -1)
+ * of the last one that did not.
+ */
+
+static int snarf_batch(char *list, FILE *out, CACHE *cache, TIMING *tp) {
+    FILE *in = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    int code = 0, result = 200;
+
+    if((in = open_list(list)) == NULL) {
+        return(-1);
+    }
+
+    while(next_url(in, &line, &len) != NULL) {
+        if((code = snarf(line, out, cache, tp, NULL)) != 200) {
+            result = code;
+        }
+
+        if(tp != NULL && code != -1 && code != DIGEST_MISMATCH) {
+            timing_report(tp, line, stderr);
+            timing_add(tp);
+        }
+    }
+
+    free(line);
+    if(in != stdin) {
+        fclose(in);
+    }
+
+    return(result);
+}
+
+/*
+ * Mirror everything reachable from a URL, or from each URL in a list,
+ * into a directory.
+ */
+
+static int snarf_crawl(char *url, char *list, char *dir) {
+    CRAWL *cp = NULL;
+    FILE *in = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    int code = 200;
+
+    if((cp = crawl_new(crawl_depth, dir, crawl_workers > 0 ? crawl_workers : CRAWL_DEFAULT_WORKERS,
+                       CRAWL_HOST_LIMIT)) == NULL) {
+        fprintf(stderr, "Unable to start mirroring into '%s'\n", dir);
+        return(-1);
+    }
+
+    if(list == NULL) {
+        if(crawl_add(cp, url)) {
+            fprintf(stderr, "Illegal URL: '%s'\n", url != NULL ? url : "(NULL)");
+            code = -1;
+        }
+    } else if((in = open_list(list)) != NULL) {
+        while(next_url(in, &line, &len) != NULL) {
+            if(crawl_add(cp, line)) {
+                fprintf(stderr, "Illegal URL: '%s'\n", line);
+                code = -1;
+            }
+        }
+        free(line);
+        if(in != stdin) {
+            fclose(in);
+        }
+    } else {
+        code = -1;
+    }
+
+    if(crawl_run(cp) != 200) {
+        code = -1;
+    }
+
+    crawl_free(cp);
+    return(code);
+}
+
+int main(int argc, char *argv[]) {
+    CACHE *cache = NULL;
+    RESUME *resume = NULL;
+    TIMING timing, *tp = NULL;
+    int code = -1; // Safety initialization.
+
+    parse_args(argc, argv);
+    if(timeout_secs > 0) {
+        http_timeouts(timeout_secs * 1000, timeout_secs * 1000);
+    }
+    if(proxy_port != 0) {
+        proxy_run(proxy_port, cache_limit);
+        fprintf(stderr, "Unable to listen on port %d\n", proxy_port);
+        exit(-1);
+    }
+
+    if(crawl_depth >= 0) {
+        code = snarf_crawl(url_to_snarf, url_list, output_file != NULL ? output_file : ".");
+        exit(code == 200 ? 0 : code);
+    }
+
+    if(cache_dir != NULL && (cache = cache_open(cache_dir, cache_limit)) == NULL) {
+        fprintf(stderr, "Unable to open cache directory '%s'\n", cache_dir);
+        exit(-1);
+    }
+
+    if(timing_option) {
+        tp = &timing;
+    }
 
    FILE *file = NULL;
-   if(output_file != NULL) { // If the output file is null, then there was no argument supplied to -o or -o wasn't specified.
+   if(resume_option) {
+       if((resume = resume_open(output_file, url_to_snarf)) == NULL) {
+           exit(-1);
+       }
+       file = resume_file(resume);
+   } else if(output_file != NULL) { // If the output file is null, then there was no argument supplied to -o or -o wasn't specified.
        file = fopen(output_file, "w"); // Open the file in write mode or create the file if it doesn't exist.
 
        if(file == NULL) {
@@ -124,19 +468,29 @@ int main(int argc, char *argv[]) {
        }
    }
 
-    while((c = http_getc(http)) != EOF) {
-        if(file != NULL) { // If we specified the file, print each char into the output file.
-            fprintf(file, "%c", c);
-        } else {
-            putchar(c); // Else, just print each char into stdout.
+    FILE *out = file != NULL ? file : stdout;
+
+    if(url_list != NULL) {
+        code = snarf_batch(url_list, out, cache, tp);
+        if(tp != NULL) {
+            timing_json(stderr);
+        }
+    } else {
+        code = snarf(url_to_snarf, out, cache, tp, resume);
+        if(tp != NULL && code != -1 && code != DIGEST_MISMATCH) {
+            timing_report(tp, url_to_snarf, stderr);
         }
     }
 
-    if(file != NULL) { // If the file was not null, close it.
+    if(resume != NULL) {
+        resume_close(resume, code == 200 || code == DIGEST_MISMATCH);
+    } else if(file != NULL) { // If the file was not null, close it.
         fclose(file);
     }
 
-    http_close(http);
-    url_free(up);
+    cache_close(cache);
+    if(code == DIGEST_MISMATCH) {
+        exit(EXIT_MISMATCH);
+    }
     exit(code == 200 ? 0 : code); // If the exit status was not 200, then exit with the code, otherwise exit with 0.
 }
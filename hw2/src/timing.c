@@ -0,0 +1,188 @@
+/*
+ * Routines for timing the phases of a document retrieval, and for
+ * summarizing the timings of many retrievals as percentiles.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timing.h"
+
+/*
+ * Histograms are log-linear: values below 16 have a bucket each, and
+ * every power of two above that is divided into 16 buckets, so that a
+ * percentile is reported within about 6% of its true value using a fixed,
+ * small amount of memory no matter how many values are added.
+ */
+
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t min, max;
+    double sum;
+} HISTOGRAM;
+
+static char *phase_names[NUM_PHASES] = { "dns", "connect", "ttfb", "transfer", "total" };
+
+static HISTOGRAM phase_hist[NUM_PHASES];	/* In microseconds */
+static HISTOGRAM rate_hist;			/* In bytes per second */
+
+static int bucket_index(uint64_t v) {
+    int e = 0;
+
+    if(v < SUB_COUNT) {
+        return((int)v);
+    }
+
+    e = 63 - __builtin_clzll(v);
+    return((e - SUB_BITS + 1) * SUB_COUNT + (int)((v >> (e - SUB_BITS)) & (SUB_COUNT - 1)));
+}
+
+/*
+ * Return a value in the middle of the range covered by a bucket.
+ */
+
+static uint64_t bucket_value(int i) {
+    int e = i / SUB_COUNT + SUB_BITS - 1;
+    uint64_t low = 0, width = 0;
+
+    if(i < SUB_COUNT) {
+        return((uint64_t)i);
+    }
+
+    width = 1ULL << (e - SUB_BITS);
+    low = (1ULL << e) + (uint64_t)(i % SUB_COUNT) * width;
+    return(low + width / 2);
+}
+
+static void hist_add(HISTOGRAM *hp, uint64_t v) {
+    hp->counts[bucket_index(v)]++;
+    if(hp->count == 0 || v < hp->min) {
+        hp->min = v;
+    }
+    if(v > hp->max) {
+        hp->max = v;
+    }
+    hp->count++;
+    hp->sum += v;
+}
+
+static uint64_t hist_percentile(HISTOGRAM *hp, double p) {
+    uint64_t rank = (uint64_t)(p / 100.0 * hp->count + 0.5), seen = 0;
+
+    if(rank == 0) {
+        rank = 1;
+    }
+
+    for(int i = 0; i < NUM_BUCKETS; i++) {
+        if((seen += hp->counts[i]) >= rank) {
+            uint64_t v = bucket_value(i);
+            return(v < hp->min ? hp->min : v > hp->max ? hp->max : v);
+        }
+    }
+
+    return(hp->max);
+}
+
+static void hist_json(HISTOGRAM *hp, char *name, char *unit, FILE *f) {
+    fprintf(f, "    \"%s\": { \"unit\": \"%s\", \"count\": %llu", name, unit, (unsigned long long)hp->count);
+    if(hp->count > 0) {
+        fprintf(f, ", \"min\": %llu, \"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu",
+                (unsigned long long)hp->min, hp->sum / hp->count,
+                (unsigned long long)hist_percentile(hp, 50),
+                (unsigned long long)hist_percentile(hp, 90),
+                (unsigned long long)hist_percentile(hp, 99),
+                (unsigned long long)hp->max);
+    }
+    fprintf(f, " }");
+}
+
+static double elapsed_since(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Clear the timings of a retrieval.
+ */
+
+void timing_init(TIMING *tp) {
+    if(tp != NULL) {
+        memset(tp, 0, sizeof(*tp));
+    }
+}
+
+void timing_start(TIMING *tp, PHASE ph) {
+    if(tp != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &tp->start[ph]);
+    }
+}
+
+void timing_stop(TIMING *tp, PHASE ph) {
+    if(tp != NULL) {
+        tp->elapsed[ph] = elapsed_since(&tp->start[ph]);
+    }
+}
+
+void timing_bytes(TIMING *tp, long bytes) {
+    if(tp != NULL) {
+        tp->bytes = bytes;
+    }
+}
+
+static double timing_rate(TIMING *tp) {
+    return(tp->elapsed[PH_TRANSFER] > 0 ? tp->bytes / tp->elapsed[PH_TRANSFER] : 0);
+}
+
+/*
+ * Print the timings of one retrieval on a single line.
+ */
+
+void timing_report(TIMING *tp, char *url, FILE *f) {
+    if(tp == NULL || f == NULL) {
+        return;
+    }
+
+    fprintf(f, "%s:", url != NULL ? url : "(NULL)");
+    for(int ph = 0; ph < NUM_PHASES; ph++) {
+        fprintf(f, " %s=%.3fms", phase_names[ph], tp->elapsed[ph] * 1e3);
+    }
+    fprintf(f, " bytes=%ld rate=%.0fB/s\n", tp->bytes, timing_rate(tp));
+}
+
+/*
+ * Add the timings of one retrieval to the histograms.
+ */
+
+void timing_add(TIMING *tp) {
+    if(tp == NULL) {
+        return;
+    }
+
+    for(int ph = 0; ph < NUM_PHASES; ph++) {
+        hist_add(&phase_hist[ph], (uint64_t)(tp->elapsed[ph] * 1e6 + 0.5));
+    }
+    hist_add(&rate_hist, (uint64_t)(timing_rate(tp) + 0.5));
+}
+
+/*
+ * Print the percentiles of all the retrievals added so far, as JSON.
+ */
+
+void timing_json(FILE *f) {
+    fprintf(f, "{\n  \"fetches\": %llu,\n  \"phases\": {\n", (unsigned long long)phase_hist[PH_TOTAL].count);
+    for(int ph = 0; ph < NUM_PHASES; ph++) {
+        hist_json(&phase_hist[ph], phase_names[ph], "us", f);
+        fprintf(f, ",\n");
+    }
+    hist_json(&rate_hist, "rate", "B/s", f);
+    fprintf(f, "\n  }\n}\n");
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -20,7 +22,7 @@ struct url {
     int port;			    /* The TCP port to contact */
     char *path;			    /* The path of the document on the server */
     int dnsdone;			/* Have we done DNS lookup yet? */
-    struct in_addr addr;	/* IP address of the server */
+    ADDRLIST *addrs;		/* Addresses of the server */
 };
 
 /*
@@ -37,6 +39,7 @@ void url_init(URL *url) {
         url->port = 0;
         url->path = NULL;
         url->dnsdone = 0;
+        url->addrs = NULL;
     }
 }
 
@@ -71,7 +74,7 @@ URL *url_parse(char *url) {
     }
 
     up->dnsdone = 0;
-    bzero(&up->addr, sizeof(struct in_addr));
+    up->addrs = NULL;
 
     /*
      * Now ready to parse the URL
@@ -158,6 +161,10 @@ void url_free(URL *up) {
             free(up->hostname);
         }
 
+        if(up->addrs != NULL) {
+            freeaddrinfo(up->addrs);
+        }
+
         free(up);
     }
 }
@@ -217,7 +224,25 @@ char *url_path(URL *up) {
  */
 
 IPADDR *url_address(URL *up) {
-    struct hostent *he = NULL; // Safety initialization.
+    ADDRLIST *ap = NULL; // Safety initialization.
+
+    for(ap = url_addresses(up); ap != NULL; ap = ap->ai_next) {
+        if(ap->ai_family == AF_INET) {
+            return(&((struct sockaddr_in *)ap->ai_addr)->sin_addr);
+        }
+    }
+
+    return(NULL);
+}
+
+/*
+ * Obtain all the IPv4 and IPv6 addresses of the host specified in a URL,
+ * in the order the resolver prefers them.  Unlike gethostbyname(),
+ * getaddrinfo() is safe to use from several threads at once.
+ */
+
+ADDRLIST *url_addresses(URL *up) {
+    struct addrinfo hints;
 
     if(up == NULL) { // If the URL is null, return NULL.
         return(NULL);
@@ -225,14 +250,252 @@ IPADDR *url_address(URL *up) {
 
     if(!up->dnsdone) {
         if(up->hostname != NULL && *up->hostname != '\0') {
-            if((he = gethostbyname(up->hostname)) == NULL) {
-	            return(NULL);
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if(getaddrinfo(up->hostname, NULL, &hints, &up->addrs)) {
+                up->addrs = NULL;
+                return(NULL);
             }
-
-            bcopy(he->h_addr, &up->addr, sizeof(struct in_addr));
         }
         up->dnsdone = 1;
     }
 
-    return(&up->addr);
+    return(up->addrs);
+}
+
+/*
+ * Remove "." and ".." segments from the path part of an absolute path,
+ * in place.  The query string, if any, is left alone.
+ */
+
+static void url_clean_path(char *path) {
+    char *in = path, *out = path, *end = path + strcspn(path, "?");
+
+    while(in < end) {
+        if(in[0] == '/' && in[1] == '.' && (in + 2 == end || in[2] == '/')) {
+            in += 2; // "/./" becomes "/"
+            if(in == end) {
+                *out++ = '/';
+            }
+        } else if(in[0] == '/' && in[1] == '.' && in[2] == '.' && (in + 3 == end || in[3] == '/')) {
+            in += 3; // "/x/../" becomes "/"
+            while(out > path && *--out != '/');
+            if(in == end) {
+                *out++ = '/';
+            }
+        } else {
+            do {
+                *out++ = *in++;
+            } while(in < end && *in != '/');
+        }
+    }
+
+    memmove(out, end, strlen(end) + 1);
+}
+
+/*
+ * Resolve a link found in a document against the URL of that document,
+ * giving an absolute URL with any "#fragment" removed.  The base is
+ * taken apart with url_parse().  Returns a string that must be freed,
+ * or NULL if the link cannot be resolved.
+ */
+
+char *url_resolve(char *base, char *ref) {
+    URL *up = NULL;
+    char *abs = NULL, *path = NULL, *cp = NULL;
+    size_t dir = 0;
+    int err = 0;
+
+    if(base == NULL || ref == NULL || (up = url_parse(base)) == NULL) {
+        return(NULL);
+    }
+
+    while(isspace((unsigned char)*ref)) {
+        ref++;
+    }
+
+    for(cp = ref; isalnum((unsigned char)*cp) || *cp == '+' || *cp == '-' || *cp == '.'; cp++);
+
+    if(*cp == ':' && cp != ref) {
+        /*
+         * Already absolute.  Resolving an empty link against it puts
+         * an http URL into the same form as any other.
+         */
+        if(!strncasecmp(ref, "http:", 5) && strcmp(base, ref)) {
+            abs = url_resolve(ref, "");
+        } else {
+            abs = strdup(ref);
+        }
+    } else if(up->method == NULL || up->hostname == NULL) {
+        err = 1;
+    } else if(ref[0] == '/' && ref[1] == '/') {
+        err = asprintf(&abs, "%s:%s", up->method, ref) < 0;
+    } else {
+        if(ref[0] == '/') {
+            err = asprintf(&path, "%s", ref) < 0;
+        } else if(ref[0] == '?' || ref[0] == '#' || ref[0] == '\0') {
+            dir = strcspn(up->path, ref[0] == '?' ? "?#" : "#");
+            err = asprintf(&path, "%.*s%s", (int)dir, up->path, ref) < 0;
+        } else {
+            dir = strcspn(up->path, "?#");
+            while(dir > 0 && up->path[dir-1] != '/') {
+                dir--;
+            }
+            err = asprintf(&path, "%s%.*s%s", up->path[0] == '/' ? "" : "/", (int)dir, up->path, ref) < 0;
+        }
+
+        if(!err) {
+            path[strcspn(path, "#")] = '\0';
+            url_clean_path(path);
+            if(up->port == 80 && !strcasecmp(up->method, "http")) {
+                err = asprintf(&abs, "%s://%s%s", up->method, up->hostname, path) < 0;
+            } else {
+                err = asprintf(&abs, "%s://%s:%d%s", up->method, up->hostname, up->port, path) < 0;
+            }
+            free(path);
+        }
+    }
+
+    url_free(up);
+    if(err || abs == NULL) {
+        return(NULL);
+    }
+
+    abs[strcspn(abs, "#")] = '\0';
+    return(abs);
+}
+
+/*
+ * Characters that end each part of a URL, for url_parse_view().
+ */
+
+#define END_HOST 1		/* ':' '/' '?' '#' end a method or host name */
+#define END_PATH 2		/* '?' '#' end a path */
+
+static const unsigned char url_ends[256] = {
+    [':'] = END_HOST,
+    ['/'] = END_HOST,
+    ['?'] = END_HOST | END_PATH,
+    ['#'] = END_HOST | END_PATH,
+};
+
+static char *url_scan(char *cp, char *end, int mask) {
+    while(cp < end && !(url_ends[(unsigned char)*cp] & mask)) {
+        cp++;
+    }
+
+    return(cp);
+}
+
+/*
+ * Parse the first len characters of a URL into a view, in one pass and
+ * without allocating memory.  The slices point into the URL itself, which
+ * need not be NUL-terminated and must outlive the view.
+ */
+
+int url_parse_view(char *url, size_t len, URL_VIEW *vp) {
+    static char root[] = "/";
+    char *cp = url, *end = url + len, *start = NULL;
+
+    if(url == NULL || vp == NULL || len == 0) {
+        return(1);
+    }
+
+    bzero(vp, sizeof(*vp));
+    vp->url.ptr = url;
+    vp->url.len = len;
+
+    /*
+     * If a colon occurs before any slashes, then the portion of the URL
+     * before the colon is the access method.
+     */
+    cp = url_scan(start = cp, end, END_HOST);
+    if(cp < end && *cp == ':') {
+        vp->method.ptr = start;
+        vp->method.len = cp - start;
+        if(vp->method.len == 4 && !strncasecmp(start, "http", 4)) {
+            vp->port = 80;
+        }
+        cp++;
+    } else {
+        cp = url;
+    }
+
+    /*
+     * Two slashes introduce the host name, and perhaps a port number.
+     */
+    if(end - cp >= 2 && cp[0] == '/' && cp[1] == '/') {
+        cp = url_scan(start = cp + 2, end, END_HOST);
+        vp->hostname.ptr = start;
+        vp->hostname.len = cp - start;
+
+        if(cp < end && *cp == ':') {
+            for(vp->port = 0, cp++; cp < end && isdigit((unsigned char)*cp); cp++) {
+                vp->port = vp->port * 10 + (*cp - '0');
+            }
+        }
+    }
+
+    cp = url_scan(start = cp, end, END_PATH);
+    if(cp > start) {
+        vp->path.ptr = start;
+        vp->path.len = cp - start;
+    } else if(vp->hostname.ptr != NULL) {
+        vp->path.ptr = root;
+        vp->path.len = 1;
+    }
+
+    if(cp < end && *cp == '?') {
+        start = ++cp;
+        if((cp = memchr(start, '#', end - start)) == NULL) {
+            cp = end;
+        }
+        vp->query.ptr = start;
+        vp->query.len = cp - start;
+    }
+
+    if(cp < end && *cp == '#') {
+        vp->fragment.ptr = cp + 1;
+        vp->fragment.len = end - cp - 1;
+    }
+
+    return(0);
+}
+
+/*
+ * Parse each line of a buffer into consecutive elements of an array of
+ * views, stopping when the buffer or the array is used up.  Blank lines
+ * are skipped, and a trailing '\r' is not part of a URL.  Returns the
+ * number of views filled in; if used is not NULL, the number of bytes of
+ * the buffer consumed is stored there, so that parsing can carry on
+ * from that point with another call.
+ */
+
+size_t url_parse_batch(char *buf, size_t len, URL_VIEW *views, size_t max, size_t *used) {
+    char *cp = buf, *end = buf + len, *nl = NULL;
+    size_t n = 0, llen = 0;
+
+    if(buf == NULL || views == NULL) {
+        max = 0;
+    }
+
+    while(n < max && cp < end) {
+        if((nl = memchr(cp, '\n', end - cp)) == NULL) {
+            nl = end;
+        }
+
+        for(llen = nl - cp; llen > 0 && cp[llen-1] == '\r'; llen--);
+        if(!url_parse_view(cp, llen, &views[n])) {
+            n++;
+        }
+
+        cp = nl < end ? nl + 1 : end;
+    }
+
+    if(used != NULL) {
+        *used = cp - buf;
+    }
+
+    return(n);
 }
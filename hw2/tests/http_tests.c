@@ -0,0 +1,738 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "http.h"
+#include "url.h"
+#include "digest.h"
+#include "server.h"
+
+static TEST_SERVER *server;
+
+static void server_setup(void) {
+    server = server_start();
+    cr_assert_not_null(server, "Unable to start the test server");
+}
+
+static void server_teardown(void) {
+    server_stop(server);
+}
+
+/*
+ * Retrieve a document from the test server with the HTTP package.
+ * Returns the body, which must be freed, and stores its length and the
+ * response code.
+ */
+
+static char *fetch(char *path, size_t *lenp, int *codep, HTTP **httpp) {
+    char url[256], *body = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n = 0;
+    URL *up = NULL;
+    HTTP *http = NULL;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server_port(server), path);
+    cr_assert_not_null(up = url_parse(url));
+    cr_assert_not_null(http = http_open(url_addresses(up), url_port(up)), "Unable to connect to test server");
+    cr_assert_eq(http_request(http, up), 0);
+    cr_assert_eq(http_response(http), 0);
+    cr_assert_not_null(http_status(http, codep));
+
+    do {
+        if(cap - len < 4096) {
+            cr_assert_not_null(body = realloc(body, cap = cap * 2 + 4096));
+        }
+        n = http_read(http, body + len, cap - len);
+        if(n > 0) {
+            len += n;
+        }
+    } while(n > 0);
+
+    cr_assert_eq(n, 0, "http_read() failed after %zu bytes", len);
+    url_free(up);
+    *lenp = len;
+    if(httpp != NULL) {
+        *httpp = http;
+    } else {
+        http_close(http);
+    }
+    return(body);
+}
+
+static void assert_body(char *body, size_t len, size_t expect) {
+    cr_assert_eq(len, expect, "Body is %zu bytes, expected %zu", len, expect);
+    for(size_t i = 0; i < len; i++) {
+        cr_assert_eq((unsigned char)body[i], server_byte(i), "Wrong byte at offset %zu", i);
+    }
+}
+
+Test(http_suite, content_length_body, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    HTTP *http = NULL;
+    char *body = fetch("/bytes/100000", &len, &code, &http);
+
+    cr_assert_eq(code, 200);
+    assert_body(body, len, 100000);
+    cr_assert_eq(http_length(http), 100000);
+    cr_assert_eq(http_error(http), 0);
+    http_close(http);
+    free(body);
+}
+
+Test(http_suite, chunked_body, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    HTTP *http = NULL;
+    char *body = fetch("/bytes/100000?chunk=777", &len, &code, &http);
+
+    assert_body(body, len, 100000);
+    cr_assert_eq(http_length(http), -1, "Length of a chunked body is not known in advance");
+    http_close(http);
+    free(body);
+}
+
+Test(http_suite, gzip_body, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    HTTP *http = NULL;
+    char *body = fetch("/bytes/300000?gzip", &len, &code, &http);
+
+    assert_body(body, len, 300000);
+    cr_assert_null(http_encoding(http), "Content encoding should have been removed");
+    http_close(http);
+    free(body);
+}
+
+Test(http_suite, gzip_chunked_body, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    char *body = fetch("/bytes/300000?gzip&chunk=13", &len, &code, NULL);
+
+    assert_body(body, len, 300000);
+    free(body);
+}
+
+Test(http_suite, empty_body, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    char *body = fetch("/bytes/0?chunk=10", &len, &code, NULL);
+
+    cr_assert_eq(len, 0);
+    free(body);
+}
+
+Test(http_suite, getc_matches_read, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[256];
+    URL *up = NULL;
+    HTTP *http = NULL;
+    int c = 0, code = 0;
+    size_t i = 0;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/5000?chunk=100", server_port(server));
+    up = url_parse(url);
+    http = http_open(url_addresses(up), url_port(up));
+    cr_assert_not_null(http);
+    http_request(http, up);
+    http_response(http);
+    http_status(http, &code);
+
+    while((c = http_getc(http)) != EOF) {
+        cr_assert_eq(c, server_byte(i), "Wrong byte at offset %zu", i);
+        i++;
+    }
+    cr_assert_eq(i, 5000);
+
+    http_close(http);
+    url_free(up);
+}
+
+Test(http_suite, garbled_chunk_size, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[256];
+    URL *up = NULL;
+    HTTP *http = NULL;
+    int code = 0;
+    size_t i = 0;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/5000?chunk=1000&garble", server_port(server));
+    up = url_parse(url);
+    http = http_open(url_addresses(up), url_port(up));
+    cr_assert_not_null(http);
+    http_request(http, up);
+    http_response(http);
+    http_status(http, &code);
+
+    /*
+     * The line that cannot be a chunk size is not taken for the last chunk.
+     */
+    while(http_getc(http) != EOF) {
+        i++;
+    }
+    cr_assert_eq(i, 1000);
+    cr_assert_neq(http_error(http), 0, "A body cut short by a garbled chunk size should be an error");
+
+    http_close(http);
+    url_free(up);
+}
+
+Test(http_suite, status_code, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    char *body = fetch("/nothing", &len, &code, NULL);
+
+    cr_assert_eq(code, 404);
+    free(body);
+
+    body = fetch("/bytes/10?status=503", &len, &code, NULL);
+    cr_assert_eq(code, 503);
+    free(body);
+}
+
+Test(http_suite, latency, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    size_t len = 0;
+    int code = 0;
+    char *body = fetch("/bytes/10?delay=200", &len, &code, NULL);
+
+    assert_body(body, len, 10);
+    cr_assert_eq(server_requests(server), 1);
+    free(body);
+}
+
+static long elapsed_ms(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+/*
+ * Make one entry of an address list by hand.
+ */
+
+static ADDRLIST *address(ADDRLIST *ap, struct sockaddr_storage *ss, int family, char *ip, ADDRLIST *next) {
+    memset(ap, 0, sizeof(*ap));
+    memset(ss, 0, sizeof(*ss));
+    ap->ai_family = family;
+    ap->ai_socktype = SOCK_STREAM;
+    ap->ai_addr = (struct sockaddr *)ss;
+    ap->ai_next = next;
+    if(family == AF_INET6) {
+        ((struct sockaddr_in6 *)ss)->sin6_family = AF_INET6;
+        inet_pton(AF_INET6, ip, &((struct sockaddr_in6 *)ss)->sin6_addr);
+        ap->ai_addrlen = sizeof(struct sockaddr_in6);
+    } else {
+        ((struct sockaddr_in *)ss)->sin_family = AF_INET;
+        inet_pton(AF_INET, ip, &((struct sockaddr_in *)ss)->sin_addr);
+        ap->ai_addrlen = sizeof(struct sockaddr_in);
+    }
+    return(ap);
+}
+
+/*
+ * Listen on 127.0.0.2 and fill up the backlog without accepting, so that
+ * the kernel drops any further SYN and a connection attempt just hangs.
+ * The sockets are left in fds[0..2], to be closed by the caller.
+ */
+
+static void blackhole(int port, int fds[3]) {
+    struct sockaddr_in sa;
+    int one = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.2", &sa.sin_addr);
+
+    cr_assert((fds[0] = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    setsockopt(fds[0], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    cr_assert_eq(bind(fds[0], (struct sockaddr *)&sa, sizeof(sa)), 0);
+    cr_assert_eq(listen(fds[0], 0), 0);
+    for(int i = 1; i < 3; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        connect(fds[i], (struct sockaddr *)&sa, sizeof(sa));
+    }
+    usleep(100000);
+}
+
+Test(connect_suite, race_past_blackhole, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    ADDRLIST ai[3];
+    struct sockaddr_storage ss[3];
+    struct timespec start;
+    URL *up = NULL;
+    HTTP *http = NULL;
+    int fds[3], code = 0;
+
+    /*
+     * The first address never answers, and the second (IPv6) is refused
+     * or unsupported; the third is the server.
+     */
+    blackhole(server_port(server), fds);
+    address(&ai[2], &ss[2], AF_INET, "127.0.0.1", NULL);
+    address(&ai[1], &ss[1], AF_INET6, "::1", &ai[2]);
+    address(&ai[0], &ss[0], AF_INET, "127.0.0.2", &ai[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cr_assert_not_null(http = http_open(ai, server_port(server)));
+    cr_assert_lt(elapsed_ms(&start), 2000, "Waited for the unreachable address");
+
+    cr_assert_not_null(up = url_parse("http://127.0.0.1/bytes/10"));
+    cr_assert_eq(http_request(http, up), 0);
+    cr_assert_eq(http_response(http), 0);
+    cr_assert_not_null(http_status(http, &code));
+    cr_assert_eq(code, 200);
+    http_close(http);
+    url_free(up);
+
+    for(int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+}
+
+Test(connect_suite, connect_timeout, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    ADDRLIST ai;
+    struct sockaddr_storage ss;
+    struct timespec start;
+    int fds[3];
+    long ms = 0;
+
+    blackhole(server_port(server), fds);
+    address(&ai, &ss, AF_INET, "127.0.0.2", NULL);
+
+    http_timeouts(300, HTTP_READ_TIMEOUT);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cr_assert_null(http_open(&ai, server_port(server)));
+    ms = elapsed_ms(&start);
+    http_timeouts(HTTP_CONNECT_TIMEOUT, HTTP_READ_TIMEOUT);
+
+    cr_assert(ms >= 250 && ms < 2000, "Gave up after %ld ms, expected about 300", ms);
+    for(int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+}
+
+Test(connect_suite, read_timeout, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[128];
+    struct timespec start;
+    URL *up = NULL;
+    HTTP *http = NULL;
+    long ms = 0;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/10?delay=1500", server_port(server));
+    cr_assert_not_null(up = url_parse(url));
+    cr_assert_not_null(http = http_open(url_addresses(up), url_port(up)));
+    cr_assert_eq(http_request(http, up), 0);
+
+    http_timeouts(HTTP_CONNECT_TIMEOUT, 200);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cr_assert_neq(http_response(http), 0, "A response arrived despite the delay");
+    ms = elapsed_ms(&start);
+    http_timeouts(HTTP_CONNECT_TIMEOUT, HTTP_READ_TIMEOUT);
+
+    cr_assert(ms >= 150 && ms < 1000, "Gave up after %ld ms, expected about 200", ms);
+    http_close(http);
+    url_free(up);
+}
+
+Test(url_suite, parse_view) {
+    char url[] = "http://example.com:8080/a/b?x=1&y=2#top";
+    URL_VIEW v;
+
+    cr_assert_eq(url_parse_view(url, strlen(url), &v), 0);
+    cr_assert(v.method.len == 4 && !strncmp(v.method.ptr, "http", 4));
+    cr_assert(v.hostname.len == 11 && !strncmp(v.hostname.ptr, "example.com", 11));
+    cr_assert_eq(v.port, 8080);
+    cr_assert(v.path.len == 4 && !strncmp(v.path.ptr, "/a/b", 4));
+    cr_assert(v.query.len == 7 && !strncmp(v.query.ptr, "x=1&y=2", 7));
+    cr_assert(v.fragment.len == 3 && !strncmp(v.fragment.ptr, "top", 3));
+}
+
+Test(url_suite, parse_batch) {
+    char buf[] = "http://a.com/\r\n\nhttp://b.com:81/x\nrel/path?q";
+    URL_VIEW v[4];
+    size_t used = 0;
+
+    cr_assert_eq(url_parse_batch(buf, strlen(buf), v, 4, &used), 3);
+    cr_assert_eq(used, strlen(buf));
+    cr_assert_eq(v[0].url.len, 13, "Trailing CR should not be part of the URL");
+    cr_assert_eq(v[1].port, 81);
+    cr_assert_null(v[2].hostname.ptr);
+    cr_assert(v[2].query.len == 1 && v[2].query.ptr[0] == 'q');
+}
+
+Test(url_suite, resolve) {
+    char *base = "http://h.com/a/b/c.html?x#f";
+    char *cases[][2] = {
+        { "d.html", "http://h.com/a/b/d.html" },
+        { "../d", "http://h.com/a/d" },
+        { "/e", "http://h.com/e" },
+        { "?y", "http://h.com/a/b/c.html?y" },
+        { "//o.com/p", "http://o.com/p" },
+        { "http://h.com:80/./x/../y#z", "http://h.com/y" },
+    };
+
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char *abs = url_resolve(base, cases[i][0]);
+        cr_assert_str_eq(abs, cases[i][1], "Resolving '%s' gave '%s'", cases[i][0], abs);
+        free(abs);
+    }
+}
+
+Test(digest_suite, known_values) {
+    DIGEST d;
+    char hex[DIGEST_HEX_MAX];
+
+    cr_assert_eq(digest_init(&d, "sha256"), 0);
+    digest_update(&d, "abc", 3);
+    cr_assert_str_eq(digest_final(&d, hex), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    cr_assert_eq(digest_init(&d, "crc32c"), 0);
+    digest_update(&d, "1234", 4);
+    digest_update(&d, "56789", 5);
+    cr_assert_str_eq(digest_final(&d, hex), "e3069283");
+
+    cr_assert_neq(digest_init(&d, "md5"), 0);
+}
+
+Test(snarf_suite, digest_mismatch_exit, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char cmd[512];
+    int status = 0;
+
+    snprintf(cmd, sizeof(cmd), "bin/snarf -c crc32c:00000000 -o /dev/null http://127.0.0.1:%d/bytes/1000 2>/dev/null",
+             server_port(server));
+    status = system(cmd);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 3, "Expected exit status 3 on a digest mismatch");
+}
+
+/*
+ * Leave the first part of a document in a file, with the metadata that
+ * snarf -C would have saved for it.
+ */
+
+static void partial_file(char *file, char *url, char *etag, int keep) {
+    char side[256];
+    FILE *f = NULL;
+
+    cr_assert_not_null(f = fopen(file, "w"));
+    for(int i = 0; i < keep; i++) {
+        fputc(server_byte(i), f);
+    }
+    fclose(f);
+
+    snprintf(side, sizeof(side), "%s.snarf", file);
+    cr_assert_not_null(f = fopen(side, "w"));
+    fprintf(f, "url %s\netag %s\nlength %d\n", url, etag, keep);
+    fclose(f);
+}
+
+static void assert_file(char *file, size_t expect) {
+    char side[256];
+    size_t len = 0;
+    int c = 0;
+    FILE *f = NULL;
+
+    cr_assert_not_null(f = fopen(file, "r"));
+    while((c = fgetc(f)) != EOF) {
+        cr_assert_eq(c, server_byte(len), "Byte %zu differs", len);
+        len++;
+    }
+    fclose(f);
+    cr_assert_eq(len, expect);
+
+    snprintf(side, sizeof(side), "%s.snarf", file);
+    cr_assert_eq(access(side, F_OK), -1, "Metadata left behind after a complete retrieval");
+}
+
+Test(snarf_suite, resume_tail, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[128], cmd[512], file[] = "/tmp/snarf_resume_XXXXXX";
+    int status = 0;
+
+    close(mkstemp(file));
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/100000", server_port(server));
+    partial_file(file, url, "\"bytes-100000\"", 40000);
+
+    /*
+     * Only the missing tail should be asked for.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -C -q Content-Range -o %s %s 2>%s.err", file, url, file);
+    status = system(cmd);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert_file(file, 100000);
+
+    snprintf(cmd, sizeof(cmd), "grep -q 'bytes 40000-99999/100000' %s.err", file);
+    cr_assert_eq(system(cmd), 0, "Expected a 206 reply for the tail");
+    snprintf(cmd, sizeof(cmd), "%s.err", file);
+    unlink(cmd);
+    unlink(file);
+}
+
+Test(snarf_suite, resume_changed, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[128], cmd[512], file[] = "/tmp/snarf_resume_XXXXXX";
+    int status = 0;
+
+    close(mkstemp(file));
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/100000", server_port(server));
+    partial_file(file, url, "\"stale\"", 40000);
+
+    /*
+     * The validator no longer matches, so the whole document comes back
+     * and replaces what was there.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -C -o %s %s", file, url);
+    status = system(cmd);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert_file(file, 100000);
+    unlink(file);
+}
+
+/*
+ * Count the documents saved in a cache directory.  The body of the last
+ * one found is described in *stp, and the name of its metadata file is
+ * left in meta.
+ */
+
+static int cache_entries(char *dir, struct stat *stp, char *meta, size_t len) {
+    DIR *dp = NULL;
+    struct dirent *de = NULL;
+    char path[512];
+    int count = 0;
+
+    cr_assert_not_null(dp = opendir(dir));
+    while((de = readdir(dp)) != NULL) {
+        char *dot = strrchr(de->d_name, '.');
+
+        if(dot == NULL || strcmp(dot, ".body")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        cr_assert_eq(stat(path, stp), 0);
+        snprintf(meta, len, "%s/%.*s.meta", dir, (int)(dot - de->d_name), de->d_name);
+        count++;
+    }
+    closedir(dp);
+
+    return(count);
+}
+
+Test(snarf_suite, cache_hit_and_eviction, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char dir[] = "/tmp/snarf_cache_XXXXXX", cache[64], out[64], meta[512], cmd[512];
+    struct stat first, st;
+
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    snprintf(out, sizeof(out), "%s/out", dir);
+
+    /*
+     * The first retrieval misses and saves the document.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -d %s -m 150000 -o %s http://127.0.0.1:%d/bytes/100000",
+             cache, out, server_port(server));
+    cr_assert_eq(system(cmd), 0);
+    assert_file(out, 100000);
+    cr_assert_eq(cache_entries(cache, &first, meta, sizeof(meta)), 1);
+
+    /*
+     * The second hits: the server only confirms the saved copy, which is
+     * sent to the output without being stored again.
+     */
+    cr_assert_eq(system(cmd), 0);
+    assert_file(out, 100000);
+    cr_assert_eq(server_requests(server), 2);
+    cr_assert_eq(cache_entries(cache, &st, meta, sizeof(meta)), 1);
+    cr_assert_eq(st.st_ino, first.st_ino, "A cache hit should not replace the saved body");
+
+    /*
+     * A second document takes the cache past its limit, and the entry
+     * used longest ago is evicted, though it was used within the second.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -d %s -m 150000 -o %s http://127.0.0.1:%d/bytes/60000",
+             cache, out, server_port(server));
+    cr_assert_eq(system(cmd), 0);
+    cr_assert_eq(cache_entries(cache, &st, meta, sizeof(meta)), 1);
+    cr_assert_eq(st.st_size, 60000, "The older entry should have been evicted");
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+/*
+ * Find a loopback port that nothing is listening on.
+ */
+
+static int unused_port(void) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int sock = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cr_assert((sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    cr_assert_eq(bind(sock, (struct sockaddr *)&sa, sizeof(sa)), 0);
+    cr_assert_eq(getsockname(sock, (struct sockaddr *)&sa, &len), 0);
+    close(sock);
+
+    return(ntohs(sa.sin_port));
+}
+
+/*
+ * Retrieve a document from the test server through a proxy, waiting
+ * for the proxy to start listening if need be.
+ */
+
+static char *proxy_fetch(int port, char *path, size_t *lenp, int *codep) {
+    char url[256], via[64], *body = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n = 0;
+    URL *up = NULL, *pp = NULL;
+    HTTP *http = NULL;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server_port(server), path);
+    snprintf(via, sizeof(via), "http://127.0.0.1:%d/", port);
+    cr_assert_not_null(up = url_parse(url));
+    cr_assert_not_null(pp = url_parse(via));
+    for(int i = 0; i < 100 && (http = http_open(url_addresses(pp), port)) == NULL; i++) {
+        usleep(20000);
+    }
+    cr_assert_not_null(http, "Unable to connect to the proxy");
+    cr_assert_eq(http_request(http, up), 0);
+    cr_assert_eq(http_response(http), 0);
+    cr_assert_not_null(http_status(http, codep));
+
+    do {
+        if(cap - len < 4096) {
+            cr_assert_not_null(body = realloc(body, cap = cap * 2 + 4096));
+        }
+        if((n = http_read(http, body + len, cap - len)) > 0) {
+            len += n;
+        }
+    } while(n > 0);
+
+    cr_assert_eq(n, 0, "http_read() failed after %zu bytes", len);
+    http_close(http);
+    url_free(up);
+    url_free(pp);
+    *lenp = len;
+    return(body);
+}
+
+Test(snarf_suite, proxy_forwards_once, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char port[16], *body = NULL;
+    size_t len = 0;
+    int code = 0, status = 0;
+    pid_t pid = 0;
+
+    snprintf(port, sizeof(port), "%d", unused_port());
+    cr_assert((pid = fork()) >= 0);
+    if(pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        execl("bin/snarf", "snarf", "-P", port, (char *)NULL);
+        _exit(127);
+    }
+
+    /*
+     * The request is passed on to the server, and the document comes
+     * back through the proxy.  Asking again is answered from the copy
+     * the proxy kept.
+     */
+    for(int i = 0; i < 2; i++) {
+        body = proxy_fetch(atoi(port), "/bytes/50000?chunk=1000", &len, &code);
+        cr_assert_eq(code, 200);
+        assert_body(body, len, 50000);
+        free(body);
+    }
+    cr_assert_eq(server_requests(server), 1, "Only the first request should reach the server");
+
+    kill(pid, SIGTERM);
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+}
+
+Test(snarf_suite, crawl_depth, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char dir[] = "/tmp/snarf_crawl_XXXXXX", site[128], path[256], cmd[512];
+    char *fetched[] = { "page/0", "page/1", "page/2", "bytes/100", "bytes/200" };
+    char *beyond[] = { "page/3", "bytes/300" };
+
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(site, sizeof(site), "%s/127.0.0.1:%d", dir, server_port(server));
+
+    /*
+     * Links are followed two steps from the first page, and no further.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -r 2 -j 2 -o %s http://127.0.0.1:%d/page/0", dir, server_port(server));
+    cr_assert_eq(system(cmd), 0);
+
+    for(size_t i = 0; i < sizeof(fetched) / sizeof(fetched[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", site, fetched[i]);
+        cr_assert_eq(access(path, F_OK), 0, "'%s' should have been mirrored", fetched[i]);
+    }
+    for(size_t i = 0; i < sizeof(beyond) / sizeof(beyond[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", site, beyond[i]);
+        cr_assert_eq(access(path, F_OK), -1, "'%s' is deeper than the crawl", beyond[i]);
+    }
+    snprintf(path, sizeof(path), "%s/bytes/200", site);
+    assert_file(path, 200);
+    cr_assert_eq(server_requests(server), 5);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+Test(snarf_suite, crawl_nested_paths, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char dir[] = "/tmp/snarf_crawl_XXXXXX", site[128], path[256], cmd[512];
+    char *saved[] = { "nest/a/b/index.html", "nest/a/b/more", "nest/a/index.html" };
+
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(site, sizeof(site), "%s/127.0.0.1:%d", dir, server_port(server));
+
+    /*
+     * /nest/a/b is saved first, and becomes a directory when /nest/a/b/more
+     * is saved.  /nest/a is a directory by the time it is saved.  Both go
+     * in their directories as index.html.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -r 1 -j 2 -o %s http://127.0.0.1:%d/nest/a/b", dir, server_port(server));
+    cr_assert_eq(system(cmd), 0);
+
+    for(size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", site, saved[i]);
+        cr_assert_eq(access(path, F_OK), 0, "'%s' should have been mirrored", saved[i]);
+    }
+    snprintf(cmd, sizeof(cmd), "grep -q '/nest/a/b/more' %s/nest/a/b/index.html", site);
+    cr_assert_eq(system(cmd), 0, "The page first saved as /nest/a/b should have been moved");
+    cr_assert_eq(server_requests(server), 3);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+Test(snarf_suite, resume_refused, .init = server_setup, .fini = server_teardown, .timeout = 10) {
+    char url[128], cmd[512], side[256], file[] = "/tmp/snarf_resume_XXXXXX";
+    struct stat st;
+    int status = 0;
+
+    close(mkstemp(file));
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bytes/100000?status=503", server_port(server));
+    partial_file(file, url, "\"bytes-100000\"", 40000);
+
+    /*
+     * An error reply is not a new copy of the document: the part already
+     * saved, and what is known about it, must survive for the next try.
+     */
+    snprintf(cmd, sizeof(cmd), "bin/snarf -C -o %s '%s' 2>/dev/null", file, url);
+    status = system(cmd);
+    cr_assert(!WIFEXITED(status) || WEXITSTATUS(status) != 0, "Expected a failure on a 503 reply");
+    cr_assert_eq(stat(file, &st), 0);
+    cr_assert_eq(st.st_size, 40000, "The saved part should be left alone");
+    snprintf(side, sizeof(side), "%s.snarf", file);
+    cr_assert_eq(access(side, F_OK), 0, "The metadata should be kept");
+
+    unlink(side);
+    unlink(file);
+}
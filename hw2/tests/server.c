@@ -0,0 +1,482 @@
+/*
+ * A loopback HTTP server that makes up documents of any size, for tests
+ * and benchmarks.  See server.h for the requests it understands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "server.h"
+
+#define REQUEST_MAX 8192
+#define BLOCK_SIZE 65536
+
+struct test_server {
+    int sock;			/* Listening socket */
+    int port;			/* ... and its port */
+    pthread_t tid;		/* Thread accepting connections */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int active;			/* Connections being handled */
+    long requests;		/* Requests answered so far */
+};
+
+typedef struct {
+    TEST_SERVER *server;
+    int sock;
+} CONNECTION;
+
+static int send_all(int sock, const void *buf, size_t len) {
+    const char *cp = buf;
+
+    while(len > 0) {
+        ssize_t n = send(sock, cp, len, MSG_NOSIGNAL);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return(1);
+        }
+        cp += n;
+        len -= n;
+    }
+
+    return(0);
+}
+
+/*
+ * Send a piece of the body, as a chunk if the body is chunked.
+ */
+
+static int send_body(int sock, size_t chunk, const void *buf, size_t len) {
+    char size[32];
+
+    if(len == 0) {
+        return(0);
+    }
+
+    if(chunk == 0) {
+        return(send_all(sock, buf, len));
+    }
+
+    snprintf(size, sizeof(size), "%zx\r\n", len);
+    return(send_all(sock, size, strlen(size)) || send_all(sock, buf, len) || send_all(sock, "\r\n", 2));
+}
+
+/*
+ * Send the body in chunks of the requested size (or in large blocks if
+ * it is not chunked), compressing it on the way if asked to.
+ */
+
+static int send_document(int sock, long long off, long long length, size_t chunk, int gzip, int garble) {
+    unsigned char *in = NULL, *out = NULL;
+    size_t block = chunk > 0 ? chunk : BLOCK_SIZE;
+    z_stream zs;
+    int err = 0, flush = Z_NO_FLUSH;
+
+    memset(&zs, 0, sizeof(zs));
+    if((in = malloc(block)) == NULL || (out = malloc(block)) == NULL ||
+       (gzip && deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)) {
+        free(in);
+        free(out);
+        return(1);
+    }
+
+    while(!err && (off < length || (gzip && flush != Z_FINISH))) {
+        size_t n = length - off < (long long)block ? (size_t)(length - off) : block;
+
+        for(size_t i = 0; i < n; i++) {
+            in[i] = server_byte(off + i);
+        }
+        off += n;
+
+        if(!gzip) {
+            err = send_body(sock, chunk, in, n);
+            if(!err && chunk > 0 && garble) {
+                err = send_all(sock, "zz\r\n\r\n", 6);
+                break;
+            }
+            continue;
+        }
+
+        flush = off == length ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = block;
+            deflate(&zs, flush);
+            err = send_body(sock, chunk, out, block - zs.avail_out);
+        } while(!err && zs.avail_out == 0);
+    }
+
+    if(gzip) {
+        deflateEnd(&zs);
+    }
+    if(!err && chunk > 0 && !garble) {
+        err = send_all(sock, "0\r\n\r\n", 5);
+    }
+
+    free(in);
+    free(out);
+    return(err);
+}
+
+/*
+ * Find the value of a query parameter, or NULL if it is absent.
+ * A parameter without a value gives "".
+ */
+
+static char *query_param(char *query, char *name) {
+    size_t len = strlen(name);
+
+    for(char *cp = query; cp != NULL && *cp != '\0'; cp = strchr(cp, '&') ? strchr(cp, '&') + 1 : NULL) {
+        if(!strncmp(cp, name, len) && (cp[len] == '=' || cp[len] == '&' || cp[len] == '\0')) {
+            return(cp[len] == '=' ? cp + len + 1 : "");
+        }
+    }
+
+    return(NULL);
+}
+
+/*
+ * Find the value of a request header, or NULL if it is absent.
+ */
+
+static char *request_header(char *request, char *name) {
+    size_t len = strlen(name);
+
+    for(char *cp = strstr(request, "\r\n"); cp != NULL; cp = strstr(cp + 2, "\r\n")) {
+        if(!strncasecmp(cp + 2, name, len) && cp[len+2] == ':') {
+            return(cp + len + 3 + strspn(cp + len + 3, " "));
+        }
+    }
+
+    return(NULL);
+}
+
+/*
+ * Send an HTML page, and count the request.
+ */
+
+static void answer_html(TEST_SERVER *sp, int sock, char *body) {
+    char head[128];
+
+    snprintf(head, sizeof(head), "HTTP/1.0 200 Synthetic\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n",
+             strlen(body));
+
+    pthread_mutex_lock(&sp->lock);
+    sp->requests++;
+    pthread_mutex_unlock(&sp->lock);
+
+    if(!send_all(sock, head, strlen(head))) {
+        send_all(sock, body, strlen(body));
+    }
+}
+
+/*
+ * Send page N of an endless chain of HTML pages, each linking to the
+ * next one and to a document of bytes.
+ */
+
+static void answer_page(TEST_SERVER *sp, int sock, long long n) {
+    char body[256];
+
+    snprintf(body, sizeof(body), "<html><body><a href=\"/page/%lld\">Next</a> <img src='/bytes/%lld'></body></html>\n",
+             n + 1, (n + 1) * 100);
+    answer_html(sp, sock, body);
+}
+
+/*
+ * Send the HTML page at a path under /nest/, linking to the path below
+ * it and to the one above it, for testing paths that are both a document
+ * and a directory.
+ */
+
+static void answer_nest(TEST_SERVER *sp, int sock, char *path) {
+    char body[512];
+    int up = strrchr(path, '/') - path;
+
+    if(up > 5) {
+        snprintf(body, sizeof(body), "<html><body><a href=\"%s/more\">Down</a> <a href=\"%.*s\">Up</a></body></html>\n",
+                 path, up, path);
+    } else {
+        snprintf(body, sizeof(body), "<html><body><a href=\"%s/more\">Down</a></body></html>\n", path);
+    }
+    answer_html(sp, sock, body);
+}
+
+static void answer(TEST_SERVER *sp, int sock, char *request) {
+    char head[640], filler[128], etag[32], *target = NULL, *query = NULL, *value = NULL, *end = NULL;
+    long long length = 0, start = 0;
+    size_t chunk = 0;
+    char *range = NULL, *if_range = NULL, *if_none = NULL;
+    int gzip = 0, garble = 0, status = 200, headers = 0;
+
+    /*
+     * "GET target HTTP/1.x", where target may be an absolute URL.
+     */
+    if(strncmp(request, "GET ", 4) || (end = strchr(request + 4, ' ')) == NULL) {
+        send_all(sock, "HTTP/1.0 400 Bad Request\r\n\r\n", 28);
+        return;
+    }
+    *end = '\0';
+    target = request + 4;
+
+    /*
+     * The request line has been cut short, so headers are looked for
+     * after it.
+     */
+    range = request_header(end + 1, "Range");
+    if_range = request_header(end + 1, "If-Range");
+    if_none = request_header(end + 1, "If-None-Match");
+    if(strstr(target, "://") != NULL && (target = strchr(strstr(target, "://") + 3, '/')) == NULL) {
+        target = "/";
+    }
+
+    if((query = strchr(target, '?')) != NULL) {
+        *query++ = '\0';
+    }
+
+    if(!strncmp(target, "/nest/", 6) && strlen(target) > 6 && strlen(target) < 200) {
+        answer_nest(sp, sock, target);
+        return;
+    }
+
+    if(!strncmp(target, "/page/", 6) && (length = strtoll(target + 6, &end, 10)) >= 0 && *end == '\0') {
+        answer_page(sp, sock, length);
+        return;
+    }
+
+    if(strncmp(target, "/bytes/", 7) || (length = strtoll(target + 7, &end, 10)) < 0 || *end != '\0') {
+        send_all(sock, "HTTP/1.0 404 Not Found\r\n\r\n", 26);
+        return;
+    }
+
+    if((value = query_param(query, "chunk")) != NULL) {
+        chunk = strtoul(value, NULL, 10);
+    }
+    if((value = query_param(query, "delay")) != NULL) {
+        struct timespec ts = { atol(value) / 1000, (atol(value) % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    if((value = query_param(query, "status")) != NULL) {
+        status = atoi(value);
+    }
+    if((value = query_param(query, "headers")) != NULL) {
+        headers = atoi(value);
+    }
+    gzip = query_param(query, "gzip") != NULL;
+    garble = query_param(query, "garble") != NULL;
+
+    /*
+     * A client whose copy has the current ETag is told it is not modified.
+     * A range is only honoured for an unencoded document, and only if
+     * If-Range, when present, names the current ETag.
+     */
+    snprintf(etag, sizeof(etag), "\"bytes-%lld\"", length);
+    if(if_none != NULL && status == 200 && !strncmp(if_none, etag, strlen(etag))) {
+        status = 304;
+    }
+    if(range != NULL && status == 200 && !gzip && !strncmp(range, "bytes=", 6) &&
+       (if_range == NULL || !strncmp(if_range, etag, strlen(etag)))) {
+        start = strtoll(range + 6, NULL, 10);
+        if(start > 0 && start < length) {
+            status = 206;
+        } else {
+            start = 0;
+        }
+    }
+
+    snprintf(head, sizeof(head), "HTTP/1.0 %d Synthetic\r\nContent-Type: application/octet-stream\r\nETag: %s\r\n%s",
+             status, etag, gzip ? "Content-Encoding: gzip\r\n" : "");
+    if(status == 206) {
+        snprintf(head + strlen(head), sizeof(head) - strlen(head), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 start, length - 1, length);
+    }
+    if(status == 304) {
+        strcat(head, "\r\n");
+        length = chunk = gzip = 0;
+    } else if(chunk > 0) {
+        strcat(head, "Transfer-Encoding: chunked\r\n\r\n");
+    } else if(!gzip) {
+        snprintf(head + strlen(head), sizeof(head) - strlen(head), "Content-Length: %lld\r\n\r\n", length - start);
+    } else {
+        strcat(head, "\r\n");
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    sp->requests++;
+    pthread_mutex_unlock(&sp->lock);
+
+    /*
+     * Filler headers go out first, after the status line.
+     */
+    end = strchr(head, '\n') + 1;
+    if(send_all(sock, head, end - head)) {
+        return;
+    }
+    for(int i = 0; i < headers; i++) {
+        snprintf(filler, sizeof(filler), "X-Filler-%d: %064d\r\n", i, i);
+        if(send_all(sock, filler, strlen(filler))) {
+            return;
+        }
+    }
+
+    if(!send_all(sock, end, strlen(end))) {
+        send_document(sock, start, length, chunk, gzip, garble);
+    }
+}
+
+static void *connection_thread(void *arg) {
+    CONNECTION *cp = arg;
+    TEST_SERVER *sp = cp->server;
+    char request[REQUEST_MAX];
+    size_t len = 0;
+    ssize_t n = 0;
+
+    /*
+     * Read up to the blank line that ends the request headers.
+     */
+    while(len < sizeof(request) - 1 && (n = recv(cp->sock, request + len, sizeof(request) - 1 - len, 0)) > 0) {
+        len += n;
+        request[len] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL) {
+            answer(sp, cp->sock, request);
+            break;
+        }
+    }
+
+    close(cp->sock);
+    free(cp);
+
+    pthread_mutex_lock(&sp->lock);
+    sp->active--;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    return(NULL);
+}
+
+static void *accept_thread(void *arg) {
+    TEST_SERVER *sp = arg;
+    CONNECTION *cp = NULL;
+    pthread_t tid;
+    int sock = -1, one = 1;
+
+    while((sock = accept(sp->sock, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        if(sock < 0) {
+            continue;
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if((cp = malloc(sizeof(CONNECTION))) == NULL) {
+            close(sock);
+            continue;
+        }
+        cp->server = sp;
+        cp->sock = sock;
+
+        pthread_mutex_lock(&sp->lock);
+        sp->active++;
+        pthread_mutex_unlock(&sp->lock);
+        if(pthread_create(&tid, NULL, connection_thread, cp)) {
+            close(sock);
+            free(cp);
+            pthread_mutex_lock(&sp->lock);
+            sp->active--;
+            pthread_mutex_unlock(&sp->lock);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return(NULL);
+}
+
+TEST_SERVER *server_start(void) {
+    TEST_SERVER *sp = NULL;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int one = 1;
+
+    if((sp = calloc(1, sizeof(TEST_SERVER))) == NULL) {
+        return(NULL);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    if((sp->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        free(sp);
+        return(NULL);
+    }
+    setsockopt(sp->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(sp->sock, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(sp->sock, 128) < 0 ||
+       getsockname(sp->sock, (struct sockaddr *)&sa, &len) < 0) {
+        close(sp->sock);
+        free(sp);
+        return(NULL);
+    }
+    sp->port = ntohs(sa.sin_port);
+
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+    if(pthread_create(&sp->tid, NULL, accept_thread, sp)) {
+        close(sp->sock);
+        free(sp);
+        return(NULL);
+    }
+
+    return(sp);
+}
+
+int server_port(TEST_SERVER *sp) {
+    return(sp != NULL ? sp->port : -1);
+}
+
+long server_requests(TEST_SERVER *sp) {
+    long n = 0;
+
+    pthread_mutex_lock(&sp->lock);
+    n = sp->requests;
+    pthread_mutex_unlock(&sp->lock);
+    return(n);
+}
+
+void server_stop(TEST_SERVER *sp) {
+    if(sp == NULL) {
+        return;
+    }
+
+    /*
+     * Shutting down the listening socket makes accept() fail.
+     */
+    shutdown(sp->sock, SHUT_RDWR);
+    pthread_join(sp->tid, NULL);
+    close(sp->sock);
+
+    pthread_mutex_lock(&sp->lock);
+    while(sp->active > 0) {
+        pthread_cond_wait(&sp->cond, &sp->lock);
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->cond);
+    free(sp);
+}
@@ -0,0 +1,49 @@
+/*
+ * A small HTTP server on the loopback interface, for testing snarf and
+ * the HTTP package without a real server.
+ *
+ * Usage:
+ *	Start a server with server_start(), which listens on a port chosen
+ *	by the kernel; server_port() tells which.  Stop it with
+ *	server_stop(), which waits for connections in progress to finish.
+ *
+ * Every document is made up on the fly.  A request for
+ *
+ *	/bytes/N?chunk=C&delay=D&garble&gzip&headers=H&status=S
+ *
+ * is answered with status S (default 200) and a body of N bytes, where
+ * byte i is server_byte(i).  All of the query parameters are optional:
+ *	chunk=C		Send the body with chunked transfer encoding, in
+ *			chunks of C bytes, instead of with Content-Length.
+ *	delay=D		Wait D milliseconds before answering.
+ *	garble		With chunk=C and no gzip, follow the first chunk
+ *			with a chunk-size line of "zz", and end there.
+ *	gzip		Compress the body with Content-Encoding: gzip.
+ *	headers=H	Add H filler headers to the response.
+ *	status=S	Answer with status S.
+ * Every document has the ETag "bytes-N".  A request with "Range: bytes=M-"
+ * for a document without gzip is answered with 206 and the bytes from M
+ * on, unless it also has an If-Range that does not match the ETag.
+ * A request with an If-None-Match that matches the ETag is answered
+ * with 304 and no body.
+ * A request for /page/N gets a small HTML page with links to /page/N+1
+ * and to /bytes/M, where M is 100 * (N+1), for testing crawls.
+ * A request for /nest/P gets a small HTML page with links to /nest/P/more
+ * and, if P has a slash in it, to the path one level up.
+ * Any other path gets 404.  Requests may use the absolute form that
+ * snarf sends, or an ordinary path.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#define server_byte(i) ((unsigned char)((i) % 251))
+
+typedef struct test_server TEST_SERVER;
+
+TEST_SERVER *server_start(void);
+int server_port(TEST_SERVER *sp);
+long server_requests(TEST_SERVER *sp);
+void server_stop(TEST_SERVER *sp);
+
+#endif
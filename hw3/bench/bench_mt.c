@@ -0,0 +1,153 @@
+/*
+ * Multi-threaded benchmark of budmm in threaded mode against the C library
+ * malloc().
+ *
+ * Each thread keeps a window of live blocks. At every step it picks a slot
+ * at random, frees the block there (if any) and allocates a new one of a
+ * random size. Both allocators run the same sequence of sizes, with 1, 2,
+ * 4, ... threads, and the throughput of each is reported.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "budmm.h"
+#include "budext.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-t threads] [-n steps] [-s size] [-w window]\n"            \
+            "\n"                                                               \
+            "-t threads  Run with 1, 2, 4, ... up to 'threads' threads (default 4).\n" \
+            "-n steps    Steps taken by each thread (default 1000000).\n"      \
+            "-s size     Largest block requested, in bytes (default 200).\n"   \
+            "-w window   Live blocks kept by each thread (default 8).\n",       \
+            (prog_name));                                                      \
+  } while (0)
+
+#define BENCH_ORDER_MAX 21   /* Heap grows 1 MiB at a time */
+
+typedef struct worker {
+    pthread_t tid;
+    int use_bud;            /* budmm, or the C library */
+    long steps;
+    int size;
+    int window;
+    unsigned seed;
+    long failed;            /* Allocations that returned NULL */
+} worker;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_worker(void *arg) {
+    worker *w = arg;
+    void **slots = calloc(w->window, sizeof(void *));
+    unsigned seed = w->seed;
+
+    for(long i = 0; i < w->steps; i++) {
+        int slot = rand_r(&seed) % w->window;
+        uint32_t size = rand_r(&seed) % w->size + 1;
+
+        if(slots[slot] != NULL) {
+            w->use_bud ? bud_free(slots[slot]) : free(slots[slot]);
+        }
+
+        slots[slot] = w->use_bud ? bud_malloc(size) : malloc(size);
+        if(slots[slot] == NULL) {
+            w->failed++;
+        } else {
+            *(char *) slots[slot] = (char) i;
+        }
+    }
+
+    for(int i = 0; i < w->window; i++) {
+        if(slots[i] != NULL) {
+            w->use_bud ? bud_free(slots[i]) : free(slots[i]);
+        }
+    }
+
+    free(slots);
+    return NULL;
+}
+
+/*
+ * Runs the workload on n threads.
+ *
+ * @return the number of steps per second, over all threads.
+ */
+static double run(int use_bud, int n, long steps, int size, int window, long *failed) {
+    worker *workers = calloc(n, sizeof(worker));
+    double start = 0, elapsed = 0;
+
+    if(use_bud) {
+        bud_mem_init_ex(ORDER_MIN, BENCH_ORDER_MAX);
+        bud_mem_mode(BUD_THREADED);
+    }
+
+    start = now();
+    for(int i = 0; i < n; i++) {
+        workers[i] = (worker) { .use_bud = use_bud, .steps = steps, .size = size,
+                                .window = window, .seed = i + 1 };
+        pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+    }
+
+    *failed = 0;
+    for(int i = 0; i < n; i++) {
+        pthread_join(workers[i].tid, NULL);
+        *failed += workers[i].failed;
+    }
+    elapsed = now() - start;
+
+    if(use_bud) {
+        bud_mem_mode(0);
+        bud_mem_fini_ex();
+    }
+
+    free(workers);
+    return n * steps / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 4, size = 200, window = 8, option = 0;
+    long steps = 1000000, bud_failed = 0, libc_failed = 0;
+
+    while((option = getopt(argc, argv, "t:n:s:w:")) != -1) {
+        switch(option) {
+            case 't': threads = atoi(optarg); break;
+            case 'n': steps = atol(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            default:
+                USAGE(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(threads <= 0 || steps <= 0 || size <= 0 || window <= 0) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %16s %16s %8s\n", "threads", "budmm steps/s", "malloc steps/s", "ratio");
+    for(int n = 1; n <= threads; n *= 2) {
+        double bud = run(1, n, steps, size, window, &bud_failed);
+        double libc = run(0, n, steps, size, window, &libc_failed);
+
+        printf("%8d %16.0f %16.0f %8.2f", n, bud, libc, bud / libc);
+        if(bud_failed > 0) {
+            printf("  (%ld budmm allocations failed)", bud_failed);
+        }
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
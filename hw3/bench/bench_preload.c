@@ -0,0 +1,124 @@
+/*
+ * Runs a program with the C library malloc() and again with budmm preloaded
+ * (bin/libbudmm.so, see shim/budmalloc.c), and reports the wall time and
+ * peak resident set size of each.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-n runs] [-l library] command [args ...]\n"                \
+            "\n"                                                               \
+            "-n runs     Times to run the command with each allocator (default 3).\n" \
+            "-l library  The shim to preload (default bin/libbudmm.so).\n",    \
+            (prog_name));                                                      \
+  } while (0)
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs the command once, with the library preloaded if it is not NULL.
+ *
+ * @return 0 if the command exited with status 0, -1 otherwise.
+ */
+static int run(char *library, char *argv[], double *elapsed, long *maxrss) {
+    struct rusage usage;
+    double start = now();
+    int status = 0;
+    pid_t pid = fork();
+
+    if(pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    if(pid == 0) {
+        if(library != NULL) {
+            setenv("LD_PRELOAD", library, 1);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    if(wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+
+    *elapsed = now() - start;
+    *maxrss = usage.ru_maxrss;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *library = "bin/libbudmm.so", *path = NULL;
+    char *libraries[2] = { NULL, NULL };
+    char *names[2] = { "malloc", "budmm" };
+    int runs = 3, option = 0;
+
+    while((option = getopt(argc, argv, "+n:l:")) != -1) {
+        switch(option) {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'l':
+            library = optarg;
+            break;
+        default:
+            USAGE(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(optind == argc || runs <= 0) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The dynamic linker wants a path it does not have to search for.
+    if((path = realpath(library, NULL)) == NULL) {
+        perror(library);
+        return EXIT_FAILURE;
+    }
+    libraries[1] = path;
+
+    printf("%10s %12s %14s\n", "allocator", "seconds", "max RSS (KiB)");
+    for(int i = 0; i < 2; i++) {
+        double best = 0, elapsed = 0;
+        long rss = 0, maxrss = 0;
+
+        for(int n = 0; n < runs; n++) {
+            if(run(libraries[i], &argv[optind], &elapsed, &maxrss) == -1) {
+                fprintf(stderr, "%s failed with %s\n", argv[optind], names[i]);
+                return EXIT_FAILURE;
+            }
+            if(n == 0 || elapsed < best) {
+                best = elapsed;
+            }
+            if(maxrss > rss) {
+                rss = maxrss;
+            }
+        }
+
+        printf("%10s %12.3f %14ld\n", names[i], best, rss);
+    }
+
+    free(path);
+    return EXIT_SUCCESS;
+}
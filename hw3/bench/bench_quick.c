@@ -0,0 +1,114 @@
+/*
+ * Ping-pong benchmark of budmm with and without quick lists (BUD_QUICK)
+ * against the C library malloc().
+ *
+ * Each step allocates two blocks of the same size and frees them again.
+ * Without quick lists every free coalesces the blocks back up to the
+ * largest order and the next allocation splits them down again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "budmm.h"
+#include "budext.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-n steps] [-s size]\n"                                      \
+            "\n"                                                               \
+            "-n steps    Allocate-allocate-free-free steps (default 2000000).\n" \
+            "-s size     Size of the blocks, in bytes (default 24).\n",        \
+            (prog_name));                                                      \
+  } while (0)
+
+#define BENCH_ORDER_MAX 21   /* Heap grows 1 MiB at a time */
+
+enum allocator { BUDMM, BUDMM_QUICK, LIBC };
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs the ping-pong with one allocator.
+ *
+ * @return nanoseconds per step.
+ */
+static double run(enum allocator which, long steps, uint32_t size) {
+    double start = 0, elapsed = 0;
+
+    if(which != LIBC) {
+        bud_mem_init_ex(ORDER_MIN, BENCH_ORDER_MAX);
+        bud_mem_mode(which == BUDMM_QUICK ? BUD_QUICK : 0);
+    }
+
+    start = now();
+    for(long i = 0; i < steps; i++) {
+        char *a = (which == LIBC) ? malloc(size) : bud_malloc(size);
+        char *b = (which == LIBC) ? malloc(size) : bud_malloc(size);
+
+        if(a == NULL || b == NULL) {
+            fprintf(stderr, "Allocation failed at step %ld\n", i);
+            exit(EXIT_FAILURE);
+        }
+        a[0] = b[0] = (char) i;
+
+        if(which == LIBC) {
+            free(a);
+            free(b);
+        } else {
+            bud_free(a);
+            bud_free(b);
+        }
+    }
+    elapsed = now() - start;
+
+    if(which != LIBC) {
+        bud_mem_mode(0);
+        bud_mem_fini_ex();
+    }
+
+    return elapsed * 1e9 / steps;
+}
+
+int main(int argc, char *argv[]) {
+    long steps = 2000000;
+    int size = 24, option = 0;
+    double plain = 0, quick = 0, libc = 0;
+
+    while((option = getopt(argc, argv, "n:s:")) != -1) {
+        switch(option) {
+        case 'n':
+            steps = atol(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            USAGE(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(steps <= 0 || size <= 0) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    plain = run(BUDMM, steps, size);
+    quick = run(BUDMM_QUICK, steps, size);
+    libc = run(LIBC, steps, size);
+
+    printf("%14s %10s\n", "allocator", "ns/step");
+    printf("%14s %10.1f\n", "budmm", plain);
+    printf("%14s %10.1f\n", "budmm quick", quick);
+    printf("%14s %10.1f\n", "malloc", libc);
+    printf("quick lists are %.1fx faster\n", plain / quick);
+    return EXIT_SUCCESS;
+}
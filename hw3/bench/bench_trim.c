@@ -0,0 +1,180 @@
+/*
+ * Benchmark of budmm giving memory back after a peak (BUD_TRIM).
+ *
+ * The heap is filled with objects of random sizes, each written to, and
+ * then all of them are freed in random order. The resident set size of the
+ * process is reported at the peak and after the frees, with and without
+ * trimming, along with the time taken to fill the heap a second time, when
+ * trimmed pages have to be faulted back in.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include "budmm.h"
+#include "budext.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-m megabytes] [-s size] [-k keep] [-d delay] [-l]\n"      \
+            "\n"                                                               \
+            "-m megabytes  Bytes of objects at the peak, in MiB (default 64).\n" \
+            "-s size       Largest object, in bytes (default 4096).\n"         \
+            "-k keep       MiB of free blocks left alone when trimming (default 0).\n" \
+            "-d delay      Milliseconds a block stays free before it is trimmed (default 0).\n" \
+            "-l            Trim with MADV_FREE rather than MADV_DONTNEED.\n",  \
+            (prog_name));                                                      \
+  } while (0)
+
+#define BENCH_ORDER_MAX 21   /* Heap grows 1 MiB at a time */
+
+typedef struct result {
+    long peak;               /* Resident bytes with the heap full */
+    long after;              /* And once it has all been freed */
+    double refill;           /* Seconds to fill it again */
+} result;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Resident set size of the process, in bytes. */
+static long rss(void) {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if(statm != NULL) {
+        if(fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Allocates the objects, writing to each.
+ */
+static void fill(char **objects, uint32_t *sizes, long count) {
+    for(long i = 0; i < count; i++) {
+        if((objects[i] = bud_malloc(sizes[i])) == NULL) {
+            fprintf(stderr, "Allocation failed at object %ld\n", i);
+            exit(EXIT_FAILURE);
+        }
+        memset(objects[i], 1, sizes[i]);
+    }
+}
+
+/*
+ * Fills the heap, frees it all and fills it again.
+ *
+ * @param mode the mode of budmm
+ * @param sizes the size of each object
+ * @param order the order the objects are freed in
+ * @param count the number of objects
+ */
+static result run(int mode, uint32_t *sizes, long *order, long count) {
+    char **objects = calloc(count, sizeof(char *));
+    double start = 0;
+    result r;
+
+    bud_mem_init_ex(ORDER_MIN, BENCH_ORDER_MAX);
+    bud_mem_mode(mode);
+
+    fill(objects, sizes, count);
+    r.peak = rss();
+
+    for(long i = 0; i < count; i++) {
+        bud_free(objects[order[i]]);
+    }
+    r.after = rss();
+
+    start = now();
+    fill(objects, sizes, count);
+    r.refill = now() - start;
+
+    for(long i = 0; i < count; i++) {
+        bud_free(objects[i]);
+    }
+    bud_mem_mode(0);
+    bud_mem_fini_ex();
+    free(objects);
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    long megabytes = 64, keep = 0, total = 0, count = 0, capacity = 1024;
+    int size = 4096, delay = 0, lazy = 0, option = 0;
+    unsigned seed = 1;
+    uint32_t *sizes = NULL;
+    long *order = NULL;
+    result plain, trimmed;
+    long before = 0;
+
+    while((option = getopt(argc, argv, "m:s:k:d:l")) != -1) {
+        switch(option) {
+        case 'm':
+            megabytes = atol(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'k':
+            keep = atol(optarg);
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        case 'l':
+            lazy = 1;
+            break;
+        default:
+            USAGE(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(megabytes <= 0 || size <= 0 || keep < 0 || delay < 0) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The same sizes and order of frees for both runs.
+    sizes = malloc(capacity * sizeof(uint32_t));
+    for(total = 0; total < megabytes << 20; total += sizes[count++]) {
+        if(count == capacity) {
+            capacity *= 2;
+            sizes = realloc(sizes, capacity * sizeof(uint32_t));
+        }
+        sizes[count] = rand_r(&seed) % size + 1;
+    }
+    order = malloc(count * sizeof(long));
+    for(long i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for(long i = count - 1; i > 0; i--) {
+        long j = rand_r(&seed) % (i + 1), t = order[i];
+
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    before = rss();
+    plain = run(0, sizes, order, count);
+    bud_trim_policy(keep << 20, delay, lazy);
+    trimmed = run(BUD_TRIM, sizes, order, count);
+
+    printf("RSS before the heap was made: %8.1f MiB\n", before / 1048576.0);
+    printf("%14s %12s %12s %12s\n", "mode", "peak MiB", "freed MiB", "refill ms");
+    printf("%14s %12.1f %12.1f %12.1f\n", "budmm", plain.peak / 1048576.0,
+           plain.after / 1048576.0, plain.refill * 1e3);
+    printf("%14s %12.1f %12.1f %12.1f\n", "budmm trim", trimmed.peak / 1048576.0,
+           trimmed.after / 1048576.0, trimmed.refill * 1e3);
+    return EXIT_SUCCESS;
+}
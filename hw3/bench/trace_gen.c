@@ -0,0 +1,197 @@
+/*
+ * Writes synthetic traces of allocations, in the format of bud_trace_start(),
+ * for bench/trace_replay.c.
+ *
+ * uniform   Objects of sizes spread evenly up to the largest size. At each
+ *           call a slot of the live set is picked at random: an empty slot
+ *           is filled, and a full one is freed, or now and then resized.
+ * powerlaw  The same, but with sizes drawn from a power law, so that most
+ *           objects are small and a few are very large, as in most programs.
+ * prodcons  A producer thread allocates messages onto a queue, and a
+ *           consumer thread frees them from its other end, each in bursts.
+ *           Objects then die in the order they were made, after living for
+ *           as long as the queue is.
+ *
+ * Handles are numbers from 1 up, never used twice, and the calls are 100
+ * nanoseconds apart.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include "budmm.h"
+#include "budext.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-k kind] [-n calls] [-l live] [-s size] [-r seed] trace\n" \
+            "\n"                                                               \
+            "-k kind     uniform, powerlaw or prodcons (default uniform).\n"   \
+            "-n calls    Calls in the trace (default 1000000).\n"              \
+            "-l live     Most objects live at once (default 1000).\n"          \
+            "-s size     Largest object, in bytes (default 4096).\n"           \
+            "-r seed     Seed of the random numbers (default 1).\n",           \
+            (prog_name));                                                      \
+  } while (0)
+
+#define GEN_TICK 100        /* Nanoseconds between calls */
+#define GEN_ALPHA 1.2       /* Exponent of the power law */
+#define GEN_SMALLEST 8      /* Most common size of the power law */
+
+typedef struct generator {
+    FILE *out;
+    long calls;             /* Written so far */
+    uint64_t handles;       /* Handed out so far */
+    uint32_t size;
+    unsigned seed;
+} generator;
+
+static uint32_t uniform_size(generator *g) {
+    return rand_r(&g->seed) % g->size + 1;
+}
+
+/*
+ * A size from a Pareto distribution, which has P(size > x) = (8 / x)^1.2,
+ * cut off at the largest size.
+ */
+static uint32_t power_size(generator *g) {
+    double u = (rand_r(&g->seed) + 1.0) / ((double) RAND_MAX + 2.0);
+    double size = GEN_SMALLEST / pow(u, 1 / GEN_ALPHA);
+
+    return (size > g->size) ? g->size : (uint32_t) size;
+}
+
+static void emit(generator *g, int op, int thread, uint32_t size, uint64_t handle, uint64_t result) {
+    struct bud_trace_record record = {
+        .time = g->calls * GEN_TICK, .op = op, .thread = thread, .size = size,
+        .handle = handle, .result = result
+    };
+
+    if(fwrite(&record, sizeof(record), 1, g->out) != 1) {
+        perror("trace_gen");
+        exit(EXIT_FAILURE);
+    }
+    g->calls++;
+}
+
+/*
+ * The uniform and power-law traces.
+ */
+static void random_slots(generator *g, long calls, int live, uint32_t (*next_size)(generator *)) {
+    uint64_t *slots = calloc(live, sizeof(uint64_t));
+
+    if(slots == NULL) {
+        perror("trace_gen");
+        exit(EXIT_FAILURE);
+    }
+
+    while(g->calls < calls) {
+        int slot = rand_r(&g->seed) % live;
+
+        if(slots[slot] == 0) {
+            slots[slot] = ++g->handles;
+            emit(g, BUD_TRACE_MALLOC, 0, next_size(g), slots[slot], 0);
+        } else if(rand_r(&g->seed) % 5 == 0) {
+            // A resized object keeps its handle, as if it grew in place.
+            emit(g, BUD_TRACE_REALLOC, 0, next_size(g), slots[slot], slots[slot]);
+        } else {
+            emit(g, BUD_TRACE_FREE, 0, 0, slots[slot], 0);
+            slots[slot] = 0;
+        }
+    }
+    free(slots);
+}
+
+/*
+ * The producer/consumer trace. The queue is a ring of handles.
+ */
+static void producer_consumer(generator *g, long calls, int live) {
+    uint64_t *queue = calloc(live, sizeof(uint64_t));
+    int head = 0, length = 0, burst = 0;
+
+    if(queue == NULL) {
+        perror("trace_gen");
+        exit(EXIT_FAILURE);
+    }
+
+    while(g->calls < calls) {
+        // The producer fills some of the room left, then the consumer
+        // empties some of what is there.
+        burst = (length < live) ? rand_r(&g->seed) % (live - length) + 1 : 0;
+        for(int i = 0; i < burst && g->calls < calls; i++, length++) {
+            queue[(head + length) % live] = ++g->handles;
+            emit(g, BUD_TRACE_MALLOC, 0, uniform_size(g), g->handles, 0);
+        }
+
+        burst = (length > 0) ? rand_r(&g->seed) % length + 1 : 0;
+        for(int i = 0; i < burst && g->calls < calls; i++, length--) {
+            emit(g, BUD_TRACE_FREE, 1, 0, queue[head], 0);
+            head = (head + 1) % live;
+        }
+    }
+    free(queue);
+}
+
+int main(int argc, char *argv[]) {
+    struct bud_trace_header header = {
+        .version = BUD_TRACE_VERSION,
+        .record_size = sizeof(struct bud_trace_record)
+    };
+    generator g = { .size = 4096, .seed = 1 };
+    char *kind = "uniform";
+    long calls = 1000000;
+    int live = 1000, option = 0;
+
+    while((option = getopt(argc, argv, "k:n:l:s:r:")) != -1) {
+        switch(option) {
+        case 'k':
+            kind = optarg;
+            break;
+        case 'n':
+            calls = atol(optarg);
+            break;
+        case 'l':
+            live = atoi(optarg);
+            break;
+        case 's':
+            g.size = atoi(optarg);
+            break;
+        case 'r':
+            g.seed = atoi(optarg);
+            break;
+        default:
+            USAGE(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(optind != argc - 1 || calls <= 0 || live <= 0 || g.size == 0 ||
+       (strcmp(kind, "uniform") != 0 && strcmp(kind, "powerlaw") != 0 && strcmp(kind, "prodcons") != 0)) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if((g.out = fopen(argv[optind], "wb")) == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    memcpy(header.magic, BUD_TRACE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, g.out);
+
+    if(strcmp(kind, "uniform") == 0) {
+        random_slots(&g, calls, live, uniform_size);
+    } else if(strcmp(kind, "powerlaw") == 0) {
+        random_slots(&g, calls, live, power_size);
+    } else {
+        producer_consumer(&g, calls, live);
+    }
+
+    if(fclose(g.out) == EOF) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,459 @@
+/*
+ * Replays a trace of allocations, written by bud_trace_start() or by
+ * bench/trace_gen.c, against budmm, the C library malloc(), or any library
+ * with the same malloc(), realloc() and free(), and reports the throughput
+ * and how big the heap was along the way.
+ *
+ * The trace is read in whole and sorted by time first, and each handle is
+ * turned into the index of a slot, so that the replay itself does nothing
+ * but the calls. The calls of all threads are made from one thread, in the
+ * order they were made in. At each sample the replay stops the clock and
+ * reports the bytes live, the size of the heap, how much of it the live
+ * bytes use and, for budmm, the fragmentation of its free blocks. The
+ * heap is measured from where it stood before the replay, and the replay
+ * keeps its own arrays in mappings of their own, so that they are not
+ * counted in the heap of malloc().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "budmm.h"
+#include "budext.h"
+
+#define USAGE(prog_name)                                                       \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "\n%s [-a allocator] [-m mode] [-p prefix] [-s samples] trace\n"  \
+            "\n"                                                               \
+            "-a allocator  budmm, malloc, or a shared library (default budmm).\n" \
+            "-m mode       Mode of budmm, as for bud_mem_mode() (default 0).\n" \
+            "-p prefix     Prefix of the functions of a library, as in je_malloc.\n" \
+            "-s samples    Times to sample the heap (default 10).\n",         \
+            (prog_name));                                                      \
+  } while (0)
+
+#define REPLAY_ORDER_MAX 21  /* Heap grows 1 MiB at a time */
+
+/* A call of the trace, with its handle turned into a slot. */
+typedef struct step {
+    uint64_t time;
+    uint32_t seq;           /* Place in the file, to keep the sort stable */
+    uint8_t op;             /* 0 if its object is not in the trace */
+    uint32_t size;
+    uint32_t slot;
+    uint64_t handle;        /* Only until the slots are found */
+    uint64_t result;
+} step;
+
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    void (*sample)(size_t *heap, double *frag);
+} allocator;
+
+/* Handles of live objects, and the slot each is in. */
+typedef struct handle_map {
+    uint64_t *keys;         /* 0 is an empty entry */
+    uint32_t *slots;
+    size_t capacity;        /* A power of two */
+    size_t count;
+} handle_map;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A zeroed array that is not on the heap of malloc(). */
+static void *array(size_t count, size_t size) {
+    void *ptr = mmap(NULL, count * size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(ptr == MAP_FAILED) {
+        perror("trace_replay");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void array_free(void *ptr, size_t count, size_t size) {
+    if(ptr != NULL) {
+        munmap(ptr, count * size + 1);
+    }
+}
+
+/*
+ * The entry of a handle, or the empty one where it would go. Handles are
+ * mixed first, since addresses differ mostly in their middle bits.
+ */
+static size_t map_find(handle_map *m, uint64_t key) {
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20;
+
+    for(i &= m->capacity - 1; m->keys[i] != 0 && m->keys[i] != key; i = (i + 1) & (m->capacity - 1)) {
+        continue;
+    }
+    return i;
+}
+
+static void map_put(handle_map *m, uint64_t key, uint32_t slot);
+
+static void map_grow(handle_map *m) {
+    handle_map old = *m;
+
+    m->capacity = old.capacity ? old.capacity * 2 : 1024;
+    m->keys = array(m->capacity, sizeof(uint64_t));
+    m->slots = array(m->capacity, sizeof(uint32_t));
+    m->count = 0;
+    for(size_t i = 0; i < old.capacity; i++) {
+        if(old.keys[i] != 0) {
+            map_put(m, old.keys[i], old.slots[i]);
+        }
+    }
+    array_free(old.keys, old.capacity, sizeof(uint64_t));
+    array_free(old.slots, old.capacity, sizeof(uint32_t));
+}
+
+static void map_put(handle_map *m, uint64_t key, uint32_t slot) {
+    size_t i = 0;
+
+    if(2 * (m->count + 1) > m->capacity) {
+        map_grow(m);
+    }
+    i = map_find(m, key);
+    if(m->keys[i] == 0) {
+        m->count++;
+    }
+    m->keys[i] = key;
+    m->slots[i] = slot;
+}
+
+/*
+ * Takes a handle out of the map.
+ *
+ * @return its slot, or -1 if it was not in it.
+ */
+static int64_t map_take(handle_map *m, uint64_t key) {
+    size_t i = 0, j = 0;
+    uint32_t slot = 0;
+
+    if(m->capacity == 0 || m->keys[i = map_find(m, key)] == 0) {
+        return -1;
+    }
+    slot = m->slots[i];
+
+    // Entries after it that were pushed past their place move back into the gap.
+    for(j = (i + 1) & (m->capacity - 1); m->keys[j] != 0; j = (j + 1) & (m->capacity - 1)) {
+        size_t home = ((m->keys[j] * 0x9e3779b97f4a7c15ULL) >> 20) & (m->capacity - 1);
+
+        if(((j - home) & (m->capacity - 1)) >= ((j - i) & (m->capacity - 1))) {
+            m->keys[i] = m->keys[j];
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+    m->count--;
+    return slot;
+}
+
+static int step_compare(const void *a, const void *b) {
+    const step *x = a, *y = b;
+
+    if(x->time != y->time) {
+        return (x->time < y->time) ? -1 : 1;
+    }
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+/*
+ * Reads a trace and sorts its calls by time.
+ *
+ * @return the calls, with their number in *count.
+ */
+static step *load(const char *path, size_t *count, int *threads) {
+    struct bud_trace_header header;
+    struct bud_trace_record record;
+    struct stat st;
+    step *steps = NULL;
+    FILE *in = fopen(path, "rb");
+    handle_map seen = {0};                  /* Threads, off by one as 0 is empty */
+
+    if(in == NULL || fstat(fileno(in), &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if(fread(&header, sizeof(header), 1, in) != 1 ||
+       memcmp(header.magic, BUD_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != BUD_TRACE_VERSION || header.record_size != sizeof(record)) {
+        fprintf(stderr, "%s: not a trace of this version\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    *count = *threads = 0;
+    steps = array(st.st_size / sizeof(record), sizeof(step));
+    while(fread(&record, sizeof(record), 1, in) == 1) {
+        steps[*count] = (step) {
+            .time = record.time, .seq = *count, .op = record.op, .size = record.size,
+            .handle = record.handle, .result = record.result
+        };
+        (*count)++;
+        map_put(&seen, (uint64_t) record.thread + 1, 0);
+    }
+    fclose(in);
+
+    *threads = seen.count;
+    array_free(seen.keys, seen.capacity, sizeof(uint64_t));
+    array_free(seen.slots, seen.capacity, sizeof(uint32_t));
+
+    qsort(steps, *count, sizeof(step), step_compare);
+    return steps;
+}
+
+/*
+ * Gives each object a slot, reusing those of freed objects, and drops the
+ * calls on objects made before the trace started.
+ *
+ * @return the number of slots.
+ */
+static uint32_t assign_slots(step *steps, size_t count, size_t *dropped) {
+    handle_map map = {0};
+    uint32_t *unused = array(count, sizeof(uint32_t));
+    uint32_t nslots = 0, nunused = 0;
+    int64_t slot = 0;
+
+    *dropped = 0;
+    for(size_t i = 0; i < count; i++) {
+        step *s = &steps[i];
+
+        switch(s->op) {
+        case BUD_TRACE_MALLOC:
+            s->slot = nunused ? unused[--nunused] : nslots++;
+            map_put(&map, s->handle, s->slot);
+            continue;
+        case BUD_TRACE_REALLOC:
+            if((slot = map_take(&map, s->handle)) != -1) {
+                s->slot = slot;
+                map_put(&map, s->result, s->slot);
+                continue;
+            }
+            break;
+        case BUD_TRACE_FREE:
+            if((slot = map_take(&map, s->handle)) != -1) {
+                s->slot = slot;
+                unused[nunused++] = s->slot;
+                continue;
+            }
+            break;
+        }
+        s->op = 0;
+        (*dropped)++;
+    }
+
+    array_free(unused, count, sizeof(uint32_t));
+    array_free(map.keys, map.capacity, sizeof(uint64_t));
+    array_free(map.slots, map.capacity, sizeof(uint32_t));
+    return nslots;
+}
+
+static void *bud_malloc_sized(size_t size) {
+    return (size > UINT32_MAX) ? NULL : bud_malloc(size);
+}
+
+static void *bud_realloc_sized(void *ptr, size_t size) {
+    return (size > UINT32_MAX) ? NULL : bud_realloc(ptr, size);
+}
+
+static void bud_sample(size_t *heap, double *frag) {
+    struct bud_stats stats;
+
+    bud_stats(&stats);
+    *heap = stats.heap_size;
+    *frag = stats.fragmentation;
+}
+
+static void libc_sample(size_t *heap, double *frag) {
+    struct mallinfo2 info = mallinfo2();
+
+    *heap = info.arena + info.hblkhd;
+    *frag = -1;
+}
+
+/* For a library, the heap is taken to be all the memory of the process. */
+static void rss_sample(size_t *heap, double *frag) {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if(statm != NULL) {
+        if(fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    *heap = resident * sysconf(_SC_PAGESIZE);
+    *frag = -1;
+}
+
+/*
+ * Finds malloc(), realloc() and free() in a library, under a prefix.
+ */
+static void load_library(allocator *a, const char *path, const char *prefix) {
+    char name[256];
+    void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if(lib == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(name, sizeof(name), "%smalloc", prefix);
+    a->malloc = dlsym(lib, name);
+    snprintf(name, sizeof(name), "%srealloc", prefix);
+    a->realloc = dlsym(lib, name);
+    snprintf(name, sizeof(name), "%sfree", prefix);
+    a->free = dlsym(lib, name);
+
+    if(a->malloc == NULL || a->realloc == NULL || a->free == NULL) {
+        fprintf(stderr, "%s has no %smalloc(), %srealloc() and %sfree()\n", path, prefix, prefix, prefix);
+        exit(EXIT_FAILURE);
+    }
+    a->name = path;
+    a->sample = rss_sample;
+}
+
+int main(int argc, char *argv[]) {
+    allocator a = { "budmm", bud_malloc_sized, bud_realloc_sized, bud_free, bud_sample };
+    char *which = "budmm", *prefix = "";
+    int mode = 0, samples = 10, option = 0, threads = 0;
+    size_t count = 0, dropped = 0, failed = 0, live = 0, peak_live = 0, peak_heap = 0, heap = 0, base = 0;
+    size_t counts[4] = {0};
+    uint32_t nslots = 0;
+    double elapsed = 0, start = 0, frag = 0;
+    step *steps = NULL;
+    void **slots = NULL;
+    uint32_t *sizes = NULL;
+
+    while((option = getopt(argc, argv, "a:m:p:s:")) != -1) {
+        switch(option) {
+        case 'a':
+            which = optarg;
+            break;
+        case 'm':
+            mode = strtol(optarg, NULL, 0);
+            break;
+        case 'p':
+            prefix = optarg;
+            break;
+        case 's':
+            samples = atoi(optarg);
+            break;
+        default:
+            USAGE(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(optind != argc - 1 || samples <= 0) {
+        USAGE(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    steps = load(argv[optind], &count, &threads);
+    nslots = assign_slots(steps, count, &dropped);
+    slots = array(nslots, sizeof(void *));
+    sizes = array(nslots, sizeof(uint32_t));
+    for(size_t i = 0; i < count; i++) {
+        counts[steps[i].op]++;
+    }
+
+    if(strcmp(which, "budmm") == 0) {
+        if(bud_mem_init_ex(ORDER_MIN, REPLAY_ORDER_MAX) == -1) {
+            perror("bud_mem_init_ex");
+            return EXIT_FAILURE;
+        }
+        bud_mem_mode(mode);
+    } else if(strcmp(which, "malloc") == 0) {
+        a = (allocator) { "malloc", malloc, realloc, free, libc_sample };
+    } else {
+        load_library(&a, which, prefix);
+    }
+
+    a.sample(&base, &frag);
+
+    printf("%s: %zu calls from %d threads, %zu malloc, %zu realloc, %zu free, %zu dropped\n",
+           argv[optind], count, threads, counts[BUD_TRACE_MALLOC], counts[BUD_TRACE_REALLOC],
+           counts[BUD_TRACE_FREE], dropped);
+    printf("%12s %14s %14s %7s %7s\n", "calls", "live", "heap", "used", "frag");
+
+    for(int sample = 1; sample <= samples; sample++) {
+        size_t end = count * sample / samples;
+
+        start = now();
+        for(size_t i = count * (sample - 1) / samples; i < end; i++) {
+            step *s = &steps[i];
+            void *ptr = NULL;
+
+            switch(s->op) {
+            case BUD_TRACE_MALLOC:
+                if((ptr = slots[s->slot] = a.malloc(s->size)) == NULL) {
+                    failed++;
+                    break;
+                }
+                *(char *) ptr = 0;
+                live += sizes[s->slot] = s->size;
+                break;
+            case BUD_TRACE_REALLOC:
+                // An object whose malloc failed stays missing.
+                if(slots[s->slot] == NULL) {
+                    break;
+                }
+                if((ptr = a.realloc(slots[s->slot], s->size)) == NULL) {
+                    failed++;
+                    break;
+                }
+                slots[s->slot] = ptr;
+                live += s->size - (size_t) sizes[s->slot];
+                sizes[s->slot] = s->size;
+                break;
+            case BUD_TRACE_FREE:
+                if(slots[s->slot] != NULL) {
+                    a.free(slots[s->slot]);
+                    slots[s->slot] = NULL;
+                    live -= sizes[s->slot];
+                }
+                break;
+            }
+            if(live > peak_live) {
+                peak_live = live;
+            }
+        }
+        elapsed += now() - start;
+
+        a.sample(&heap, &frag);
+        heap = (heap > base) ? heap - base : 0;
+        if(heap > peak_heap) {
+            peak_heap = heap;
+        }
+        printf("%12zu %14zu %14zu %6.1f%% ", end, live, heap, heap ? 100.0 * live / heap : 0);
+        if(frag >= 0) {
+            printf("%7.3f\n", frag);
+        } else {
+            printf("%7s\n", "-");
+        }
+    }
+
+    printf("%s: %.2f Mcalls/s, peak heap %zu, peak live %zu, %zu failed\n",
+           a.name, (count - dropped) / elapsed / 1e6, peak_heap, peak_live, failed);
+    return EXIT_SUCCESS;
+}
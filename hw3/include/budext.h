@@ -0,0 +1,402 @@
+#ifndef BUDEXT_H
+#define BUDEXT_H
+#include <stdio.h>
+#include "budmm.h"
+
+/*
+ * Extensions to the budmm allocator. budmm.h is fixed by the assignment,
+ * so everything added to the interface since lives here.
+ */
+
+/*
+ * Largest order_max bud_mem_init_ex() accepts.
+ */
+#define BUD_ORDER_LIMIT 31
+
+/*
+ * Sets up a heap that is not limited to the MAX_HEAP_SIZE of bud_mem_init(),
+ * and whose blocks range from order order_min up to, but not including,
+ * order_max. Use it in place of bud_mem_init(), and bud_mem_fini_ex() in
+ * place of bud_mem_fini().
+ *
+ * The heap reserves address space with mmap() and commits it a block of
+ * order order_max - 1 at a time, as it is needed. Requests too big for
+ * such a block are mapped on their own rather than failing with EINVAL.
+ *
+ * order_min may not be below ORDER_MIN, and the largest block must be at
+ * least a page.
+ *
+ * @return 0 on success, or -1 with errno set to EINVAL if the orders are
+ * out of range.
+ */
+int bud_mem_init_ex(int order_min, int order_max);
+
+/*
+ * Unmaps the memory of a heap set up by bud_mem_init_ex().
+ */
+void bud_mem_fini_ex(void);
+
+/*
+ * Largest order_max of a heap set up by bud_mem_init_file(), whose largest
+ * block is then 16 MiB.
+ */
+#define BUD_FILE_ORDER_MAX 25
+
+/*
+ * Sets up a heap in the file at path, mapped with MAP_SHARED, so that what
+ * is allocated there is still there when the file is opened again. Use it
+ * in place of bud_mem_init(), and bud_mem_fini_file() in place of
+ * bud_mem_fini().
+ *
+ * If the file is empty or does not exist, a heap of size bytes is made in
+ * it. Its largest block is the largest power of two no bigger than size,
+ * up to order BUD_FILE_ORDER_MAX - 1, and size is rounded down to a
+ * multiple of that block. The file is sparse, so it only takes up disk as
+ * the heap is used. Otherwise the heap already in the file is opened as it
+ * was left, and size is ignored.
+ *
+ * The free lists and the break of the heap are kept in the file, so
+ * opening it takes the same time however much it holds. It is mapped at
+ * the address it had last time if that is free. If not, the links of the
+ * free lists are moved with it, a walk through the free blocks, but
+ * nothing else is, so pointers stored in the heap should be kept as
+ * struct bud_off. Requests too big for the largest block fail with EINVAL,
+ * as with bud_mem_init().
+ *
+ * One process at a time may have the heap open, which it holds with an
+ * flock() on the file. If a process dies with the heap open, the next to
+ * open it checks its free lists and carries on with it as it was left,
+ * less any blocks the process had cached in quick lists or magazines.
+ *
+ * @return 0 on success, or -1 with errno set to EINVAL if size is less
+ * than a page or the file holds something other than a heap, EBUSY if
+ * the heap is open, ENOTRECOVERABLE if a process died with it open and
+ * left its free lists broken, or as open() or mmap() set it.
+ */
+int bud_mem_init_file(const char *path, size_t size);
+
+/*
+ * Closes the heap of bud_mem_init_file(), after turning any mode off, and
+ * waits for it to be written to its file.
+ *
+ * @return 0 on success, or -1 with errno set if there is no such heap or
+ * it could not be written.
+ */
+int bud_mem_fini_file(void);
+
+/*
+ * Sets up a heap in shared memory that several processes use at once, so
+ * that one can allocate an object, pass its offset to another, and have
+ * that one read it and free it, with no copying. Use it in place of
+ * bud_mem_init(), and bud_mem_fini_shared() in place of bud_mem_fini().
+ *
+ * If name is NULL, the memory is a memfd, and the processes that share the
+ * heap are those forked after this call. Otherwise it is the POSIX shared
+ * memory object of that name. The process whose call creates it makes the
+ * heap in it, and the others wait up to a second for that before they open
+ * the heap. It lasts until it is removed with shm_unlink(). size is as for
+ * bud_mem_init_file(), and is ignored unless the heap is made.
+ *
+ * Every process maps the heap at the same address, so that the links of
+ * its free lists hold in all of them. The heap is guarded by a robust,
+ * process-shared mutex in the shared memory: if a process dies holding it,
+ * the next to take it checks the free lists and carries on with the heap
+ * as it was left, or aborts if they are broken, as does every process
+ * that uses the heap after that. The heap is
+ * always in BUD_THREADED mode, with no magazines, and BUD_QUICK and
+ * BUD_SLAB are ignored, since their lists would be those of one process.
+ * Requests too big for the largest block fail with EINVAL.
+ *
+ * @return 0 on success, or -1 with errno set to EINVAL if size is less
+ * than a page or the memory holds something other than a shared heap,
+ * EADDRINUSE if the address of the heap is taken in this process,
+ * ETIMEDOUT if the process that created the memory never made the heap in
+ * it, or as shm_open(), memfd_create() or mmap() set it.
+ */
+int bud_mem_init_shared(const char *name, size_t size);
+
+/*
+ * Unmaps the heap of bud_mem_init_shared() from this process. Its objects
+ * stay where they are for the other processes.
+ *
+ * @return 0 on success, or -1 with errno set to EINVAL if there is no
+ * such heap.
+ */
+int bud_mem_fini_shared(void);
+
+/*
+ * A pointer into the heap of bud_mem_init_file() or bud_mem_init_shared(),
+ * kept as its offset from the start of the file so that it holds wherever
+ * the file is mapped. An offset of 0 is NULL.
+ */
+struct bud_off {
+    uint64_t off;
+};
+
+/*
+ * @param ptr a pointer into the heap of bud_mem_init_file() or
+ * bud_mem_init_shared(), or NULL
+ * @return its offset, or an offset of 0 with errno set to EINVAL if there
+ * is no such heap or ptr is not in it.
+ */
+struct bud_off bud_to_off(void *ptr);
+
+/*
+ * @return the pointer an offset into the heap stands for, or NULL with
+ * errno set to EINVAL if there is no such heap or the offset is not in it.
+ */
+void *bud_from_off(struct bud_off off);
+
+/*
+ * The root of the heap of bud_mem_init_file() or bud_mem_init_shared():
+ * the object a program finds the rest of its data from when it opens the
+ * heap. NULL at first.
+ *
+ * bud_set_root() returns 0 on success, or -1 with errno set to EINVAL as
+ * for bud_to_off(). bud_root() returns NULL with errno set to EINVAL if
+ * there is no such heap.
+ */
+int bud_set_root(void *ptr);
+void *bud_root(void);
+
+/*
+ * @return the number of bytes that may be used at ptr, which is at least
+ * what was asked for, or 0 if ptr is NULL. An invalid ptr aborts, as in
+ * bud_free().
+ */
+size_t bud_usable_size(void *ptr);
+
+/*
+ * Allocates size bytes whose address is a multiple of alignment, a power
+ * of two. The payload is placed alignment bytes into a block, after a
+ * copy of the block's header, and the block itself is aligned to its size.
+ * So a request that is a multiple of its alignment, like 64 bytes on 64,
+ * gets the same block bud_malloc() would give it. alignment plus size must
+ * fit in the largest block. The pointer is freed, resized and checked like
+ * any other, and bud_realloc() keeps it aligned, so it fails with EINVAL
+ * to grow it past the largest block even in a mapped heap.
+ *
+ * @return the payload, or NULL with errno set to EINVAL if the alignment
+ * or size is invalid, or ENOMEM if the heap is full.
+ */
+void *bud_memalign(size_t alignment, uint32_t size);
+
+/*
+ * Like bud_memalign(), except that size must be a multiple of alignment,
+ * as for aligned_alloc() in C11.
+ */
+void *bud_aligned_alloc(size_t alignment, uint32_t size);
+
+/*
+ * Modes that change how bud_malloc(), bud_realloc() and bud_free() work.
+ *
+ * BUD_THREADED makes them safe to call from several threads at once. Each
+ * thread keeps a small cache ("magazine") of free blocks for each small
+ * order. An allocation is taken from the cache and a free goes back to it,
+ * so neither takes a lock. Only when a magazine runs empty or fills up
+ * does the thread lock the heap, and then it moves a batch of blocks at
+ * once. A thread's magazines are emptied when it exits.
+ */
+#define BUD_THREADED 0x1
+
+/*
+ * BUD_GROW_IN_PLACE lets bud_realloc() grow a block without moving it, when
+ * the block is the lower buddy at each order it grows through and the
+ * higher buddies are free. Otherwise, as without the flag, the block is
+ * copied to a new one. A buffer that keeps doubling from the start of a
+ * fresh heap is then never copied.
+ */
+#define BUD_GROW_IN_PLACE 0x2
+
+/*
+ * BUD_QUICK defers coalescing. A freed block goes on a short LIFO "quick
+ * list" for its order, as it is, and the next allocation of that order
+ * takes it back without splitting anything. A block is coalesced as usual
+ * only when its quick list is full. The quick lists are emptied into the
+ * heap when an allocation would otherwise have to grow it, and when the
+ * mode is turned off, which should be done before bud_mem_fini().
+ */
+#define BUD_QUICK 0x4
+
+/*
+ * BUD_SLAB serves requests of up to BUD_SLAB_MAX bytes from slabs: blocks
+ * of 4 KiB cut into slots of one size, a multiple of 8 bytes, with no
+ * header in front of each slot. A slab goes back to the heap when its
+ * last object is freed, except for one slab of each size, which is kept
+ * until BUD_SLAB mode is left. Objects from slabs are freed, resized and checked
+ * like any other, whatever the mode is by then. Like a payload, a slot is
+ * 8-byte aligned, and if its size is a multiple of 16 it lies 8 bytes past
+ * a multiple of 16. A heap whose order_min is above 12 has no slabs.
+ */
+#define BUD_SLAB 0x8
+#define BUD_SLAB_MAX 128
+
+/*
+ * BUD_TRIM gives memory back to the OS after a peak. When a block of the
+ * largest order is free again, whole, the pages of free blocks of that
+ * order are given back with madvise(), as bud_trim_policy() allows: all
+ * but the first page of each, which keeps the block's header, marked as
+ * decommitted. Such blocks are taken last, and their pages are faulted
+ * back in as they are touched again. Only a heap set up by
+ * bud_mem_init_ex() is trimmed.
+ */
+#define BUD_TRIM 0x10
+
+/*
+ * BUD_OOB gives blocks with no header in front of the payload: their order
+ * is kept in a table of the heap instead. A request of 2^k bytes then takes
+ * a block of 2^k, aligned to 2^k, rather than one twice the size. Requests
+ * that BUD_SLAB serves, if it is set, still go to slabs. Such blocks are
+ * freed, resized and checked like any other, whatever the mode is by then,
+ * and count in bud_stats() as having asked for the whole block.
+ */
+#define BUD_OOB 0x20
+
+/*
+ * Sets the mode of the allocator, a combination of the flags above, and
+ * returns the previous one. Call it
+ * after bud_mem_init() and before starting any threads that allocate.
+ * Turning BUD_THREADED off empties the magazines of the calling thread,
+ * which should by then be the only one using the allocator.
+ */
+int bud_mem_mode(int mode);
+
+/*
+ * Sets when BUD_TRIM gives pages back. The first keep bytes of free blocks
+ * of the largest order, the ones freed last, are left alone, and the rest
+ * are given back once they have been free for delay_ms milliseconds. Since
+ * the heap is only looked at when such a block is freed, a block freed
+ * less than delay_ms before the heap goes idle stays until bud_trim(). If
+ * lazy, pages are given back with MADV_FREE, which lets the OS take them
+ * only when it runs short, rather than MADV_DONTNEED. By default nothing
+ * is kept and there is no delay.
+ */
+void bud_trim_policy(size_t keep, unsigned delay_ms, int lazy);
+
+/*
+ * Gives back the pages of free blocks of the largest order now, as
+ * BUD_TRIM would but with no delay, whatever the mode. Like BUD_TRIM, it
+ * does nothing to a heap in a file or in shared memory.
+ *
+ * @return the bytes given back.
+ */
+size_t bud_trim(void);
+
+/*
+ * Counters of the allocator, from bud_stats().
+ *
+ * The counters by order are indexed by the order of the block itself, and
+ * index 0 counts the large objects of a mapped heap. Objects in slabs are
+ * counted apart, and as the size of their slot. A bud_realloc() that
+ * changes the order of the object counts as a free and an alloc.
+ * The counters run for the life of the process, so objects still live
+ * when a heap is torn down stay counted.
+ */
+struct bud_stats {
+    int order_min;                          /* Orders of the current heap */
+    int order_max;
+    uint64_t allocs[BUD_ORDER_LIMIT];
+    uint64_t frees[BUD_ORDER_LIMIT];
+    uint64_t live[BUD_ORDER_LIMIT];         /* allocs - frees */
+    uint64_t splits[BUD_ORDER_LIMIT];       /* Blocks of the order split in two */
+    uint64_t coalesces[BUD_ORDER_LIMIT];    /* Pairs of buddies of the order merged */
+    uint64_t slab_allocs;
+    uint64_t slab_frees;
+    uint64_t slab_live;
+    uint64_t growths;                       /* Times the heap grew by a largest block */
+    uint64_t requested;                     /* Bytes asked for by live objects */
+    uint64_t reserved;                      /* Bytes of the blocks, slots and mappings holding them */
+    uint64_t peak_reserved;                 /* Most reserved seen when the heap grew, or by bud_stats() */
+    uint64_t heap_size;                     /* Bytes of the current heap */
+    uint64_t free_bytes;                    /* Bytes in its free lists */
+    uint64_t largest_free;                  /* Bytes of its largest free block */
+    uint64_t decommitted;                   /* Free bytes given back to the OS by BUD_TRIM */
+    double fragmentation;                   /* 1 - largest_free / free_bytes, or 0 if nothing is free */
+};
+
+/*
+ * Fills in the counters of the allocator. The counters are kept by each
+ * thread for itself without locking, and summed here. The free lists are
+ * walked to find the free bytes, under the lock of the heap in threaded
+ * mode.
+ */
+void bud_stats(struct bud_stats *stats);
+
+/*
+ * Writes the counters of bud_stats() to out as one line of JSON.
+ *
+ * @return 0 on success, or -1 if the write failed.
+ */
+int bud_stats_json(FILE *out);
+
+/*
+ * Starts a thread that calls bud_stats_json(out) every given number of
+ * seconds, replacing any started before. 0 seconds stops it.
+ *
+ * @return 0 on success, or -1 with errno set if the thread cannot start.
+ */
+int bud_stats_every(FILE *out, unsigned seconds);
+
+/*
+ * Traces of the calls made to the allocator, written by bud_trace_start()
+ * and read by bench/trace_replay.c. A trace is a bud_trace_header followed
+ * by records, each thread's in the order it made its calls but the threads
+ * interleaved in no particular order, so they are to be sorted by time.
+ */
+#define BUD_TRACE_MAGIC "BUDTRACE"
+#define BUD_TRACE_VERSION 2
+
+#define BUD_TRACE_MALLOC 1
+#define BUD_TRACE_REALLOC 2
+#define BUD_TRACE_FREE 3
+
+struct bud_trace_header {
+    char magic[8];                          /* BUD_TRACE_MAGIC, with no NUL */
+    uint32_t version;
+    uint32_t record_size;                   /* sizeof(struct bud_trace_record) */
+};
+
+/*
+ * One call. An object is known by a handle, which no two live objects
+ * share, so a handle may be used again once its object is freed. Traces
+ * of budmm use the address of the object.
+ */
+struct bud_trace_record {
+    uint64_t time : 56;                     /* Nanoseconds since the trace started */
+    uint64_t op : 8;                        /* BUD_TRACE_MALLOC, _REALLOC or _FREE */
+    uint32_t size;                          /* Bytes asked for, 0 for a free */
+    uint32_t thread;                        /* Numbered as threads first make a call */
+    uint64_t handle;                        /* The object made, resized or freed */
+    uint64_t result;                        /* Its handle after a realloc */
+};
+
+/*
+ * Starts writing a trace of every successful bud_malloc(), bud_realloc(),
+ * bud_free() and bud_memalign(), which is recorded as a malloc, to the
+ * file at path. Calls that fail are left out, and a realloc to or from
+ * nothing is recorded as the free or malloc it is. Each call is recorded
+ * once it returns, a malloc with the time it returned and a realloc or
+ * free with the time it was made, so that no handle is seen made again
+ * before its object is freed. Each thread fills a buffer of its own, with
+ * no lock, and writes it out when it is full or the thread exits.
+ *
+ * A "%p" in path stands for the id of the process. A child forked while
+ * the trace is written drops the records it inherited, and goes on in a
+ * trace of its own if path has a "%p" in it, or stops tracing if not.
+ *
+ * @return 0 on success, or -1 with errno set to EBUSY if a trace is
+ * already being written, to ENAMETOOLONG if path is too long, or as
+ * open() sets it.
+ */
+int bud_trace_start(const char *path);
+
+/*
+ * Writes out the buffers of all threads and closes the trace. Call it when
+ * no other thread is using the allocator.
+ *
+ * @return 0 on success, or -1 with errno set if a write failed or no trace
+ * was being written.
+ */
+int bud_trace_stop(void);
+
+#endif
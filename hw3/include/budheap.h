@@ -0,0 +1,549 @@
+#ifndef BUDHEAP_H
+#define BUDHEAP_H
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "budmm.h"
+#include "budext.h"
+
+/*
+ * Internal interface between the parts of the allocator.
+ *
+ * The buddy system in budmm.c works on a bud_heap, which holds the free
+ * lists of a heap, the range of orders its blocks come in, where its memory
+ * comes from, and the lock that guards it. The functions in budmm.h use the
+ * default heap. After bud_mem_init() its free lists are the global
+ * free_list_heads[] and its memory comes from bud_sbrk(). After
+ * bud_mem_init_ex() its memory is mapped by budmap.c, and after
+ * bud_mem_init_file() it is a file mapped by budfile.c, which also holds
+ * its free lists. bud_mem_init_shared() maps shared memory the same way,
+ * lock and all, for several processes to use at once.
+ *
+ * A free list may be empty while its bit in nonempty is still set, since
+ * bud_mem_init() resets the lists without knowing about the bitmap. The
+ * bit is cleared the next time the list is looked at. A list is never
+ * non-empty with its bit clear.
+ *
+ * None of the heap_*() functions take the lock. In threaded mode, callers
+ * hold it around them, with heap_lock().
+ */
+
+#define BUD_MAX_ORDERS 32               /* Most orders a heap has, one per bit of nonempty */
+#define BUD_MAX_REGIONS 16              /* Most regions a mapped heap reserves */
+#define QUICK_CAPACITY 32               /* Most blocks a quick list holds */
+#define BUD_REGION_SIZE (1UL << 30)     /* Address space reserved by a region */
+#define SLAB_ORDER 12                   /* Order of the blocks carved into slabs */
+#define SLAB_CLASSES (BUD_SLAB_MAX / 8) /* Slot sizes 8, 16, ..., BUD_SLAB_MAX */
+
+// Macro to get the correct index for a specific order in the free list.
+#define FREE_LIST_INDEX(h, ord) ((ord) - (h)->order_min)
+
+// Bit of an order in bud_heap.nonempty.
+#define ORDER_BIT(h, ord) (1u << FREE_LIST_INDEX(h, ord))
+
+/* Size of a block of the given order, for orders ORDER_TO_BLOCK_SIZE() cannot hold. */
+#define BLOCK_SIZE(ord) (((size_t) 1) << (ord))
+
+/* Largest request that fits in a block of the heap. */
+#define MAX_RSIZE(h) (BLOCK_SIZE((h)->order_max - 1) - sizeof(bud_header))
+
+/* Whether a heap maps requests too big for any block on their own. */
+#define MAPS_LARGE(h) ((h)->mapped && (h)->file == NULL)
+
+/* Converts between a block and the payload handed out for it. */
+#define BLOCK_TO_PAYLOAD(block) ((void *) (((char *) (block)) + sizeof(bud_header)))
+#define PAYLOAD_TO_BLOCK(ptr) ((bud_free_block *) (((char *) (ptr)) - sizeof(bud_header)))
+
+/*
+ * The order and requested size of a block. budmm.h gives the order four
+ * bits and the requested size sixteen, which is too few for a mapped heap,
+ * so the fifth bit of the order is kept in the low bit of unused1 and the
+ * high bits of the requested size in unused2. Both are zero in a heap set
+ * up by bud_mem_init().
+ */
+#define BLOCK_ORDER(block) ((uint8_t) ((block)->header.order | (((block)->header.unused1 & 1) << 4)))
+#define BLOCK_RSIZE(block) ((uint32_t) ((block)->header.rsize | ((block)->header.unused2 << 16)))
+
+static inline void set_block_order(bud_free_block *block, uint8_t order) {
+    block->header.order = order & 0xf;
+    block->header.unused1 = (block->header.unused1 & ~1) | (order >> 4);
+}
+
+/*
+ * Whether a block sits in a quick list or in the magazine of a thread. Such
+ * a block is still marked allocated, so that it is not coalesced, but is not
+ * a valid pointer.
+ */
+#define BLOCK_QUICK(block) (((block)->header.unused1 >> 1) & 1)
+
+static inline void set_block_quick(bud_free_block *block, int quick) {
+    block->header.unused1 = (block->header.unused1 & ~2) | (quick << 1);
+}
+
+/*
+ * log2 of the alignment of a block from bud_memalign(), or 0. The payload
+ * of such a block lies BLOCK_SIZE(shift) bytes into it, where the block's
+ * own alignment makes it aligned, and a copy of the block's header sits
+ * right in front of the payload.
+ */
+#define BLOCK_ALIGN(block) (((block)->header.unused1 >> 2) & 0x1f)
+
+static inline void set_block_align(bud_free_block *block, int shift) {
+    block->header.unused1 = (block->header.unused1 & ~(0x1f << 2)) | (shift << 2);
+}
+
+/*
+ * Whether the pages of a free block of the largest order, all but the
+ * first, have been given back to the OS in BUD_TRIM mode. The first page
+ * holds its header and links, and is kept. The mark is cleared when the
+ * block leaves its free list, as its pages are then faulted back in.
+ */
+#define BLOCK_DECOMMITTED(block) (((block)->header.unused1 >> 7) & 1)
+
+static inline void set_block_decommitted(bud_free_block *block, int decommitted) {
+    block->header.unused1 = (block->header.unused1 & ~(1 << 7)) | (decommitted << 7);
+}
+
+/*
+ * Order in the header of an object too big for any block. Such an object
+ * is mapped on its own, behind a bud_large.
+ */
+#define LARGE_ORDER 0
+
+/* A reservation of address space, committed a largest block at a time. */
+typedef struct bud_region {
+    char *start;            /* First byte of the region */
+    char *end;              /* First byte not yet committed */
+    char *limit;            /* Last byte of the region + 1 */
+    uint64_t *slab_map;     /* A bit for each block of SLAB_ORDER in the region, set if it is a slab */
+    uint8_t *oob_map;       /* A byte for each block of order_min, the order of a block of BUD_OOB there */
+} bud_region;
+
+/*
+ * The start of the mapping of a large object. The payload follows it, so
+ * like the payload of a block it lies 8 bytes past a multiple of 16. The
+ * length of the mapping is the requested size rounded up to whole pages.
+ */
+typedef struct bud_large {
+    struct bud_large *next;
+    struct bud_large *prev;
+    struct bud_heap *heap;  /* Heap the object belongs to */
+    uint64_t check;         /* LARGE_MAGIC xor its own address, while it is live */
+    bud_header header;      /* order is LARGE_ORDER */
+} bud_large;
+
+typedef struct bud_heap {
+    bud_free_block *heads;  /* Sentinels of the free lists, one per order */
+    uint32_t nonempty;      /* ORDER_BIT() of each order whose free list is not empty */
+    uint8_t order_min;      /* Order of the smallest block */
+    uint8_t order_max;      /* Order of the largest block + 1 */
+    int mapped;             /* Memory comes from map_grow() rather than bud_sbrk() */
+    bud_region regions[BUD_MAX_REGIONS];
+    int nregions;
+    bud_large *large;       /* Live large objects, if mapped */
+    bud_free_block *quick[BUD_MAX_ORDERS];  /* Recently freed blocks of each order, linked through next */
+    int quick_count[BUD_MAX_ORDERS];
+    struct bud_slab *slabs[SLAB_CLASSES];   /* Slabs of each size with a free slot */
+    pthread_mutex_t slab_locks[SLAB_CLASSES];   /* Guard the lists of slabs in threaded mode */
+    pthread_mutex_t *lock;  /* Guards the heap in threaded mode, and its large objects always */
+    pthread_mutex_t own_lock;   /* The lock, unless it is in the memory of a shared heap */
+    int mode;               /* BUD_* flags from budext.h */
+    size_t trim_keep;       /* Bytes of free largest blocks BUD_TRIM leaves alone */
+    unsigned trim_delay;    /* Milliseconds a largest block stays free before it is trimmed */
+    int trim_lazy;          /* Trim with MADV_FREE rather than MADV_DONTNEED */
+    int oob_used;           /* Blocks of BUD_OOB have been handed out since the heap was reset */
+    struct bud_file *file;  /* Header of the file the heap is mapped from, or NULL */
+    int shared;             /* Other processes use the heap too */
+    unsigned generation;    /* Changes whenever the heap starts over, so magazines from before are dropped */
+} bud_heap;
+
+extern bud_heap bud_default_heap;
+
+/*
+ * budfile.c: takes over a shared heap whose lock was held by a process
+ * that died, after checking its free lists. If they are broken, the lock
+ * is given up without being made consistent, so that it fails for every
+ * process from then on.
+ *
+ * @return 0 if the heap is taken, or ENOTRECOVERABLE.
+ */
+int shared_recover(bud_heap *h);
+
+/*
+ * Takes the lock of a heap. If a process died holding the lock of a shared
+ * heap, the heap is taken over as that process left it, or the allocator
+ * aborts if it was left broken.
+ */
+static inline void heap_lock(bud_heap *h) {
+    int ret = pthread_mutex_lock(h->lock);
+
+    if(ret == EOWNERDEAD) {
+        ret = shared_recover(h);
+    }
+    if(ret != 0) {
+        abort();
+    }
+
+    // Other processes may have filled free lists whose bits are clear here.
+    if(h->shared) {
+        h->nonempty = BLOCK_SIZE(h->order_max - h->order_min) - 1;
+    }
+}
+
+static inline void heap_unlock(bud_heap *h) {
+    pthread_mutex_unlock(h->lock);
+}
+
+/*
+ * Takes a block of exactly the given order off the heap, splitting a larger
+ * one or growing the heap if need be. The block is marked allocated.
+ *
+ * @return the block, or NULL if the heap cannot grow.
+ */
+bud_free_block *heap_take(bud_heap *h, uint8_t order);
+
+/*
+ * Like heap_take(), but splits the block off the front of the largest free
+ * block if that is larger, so that it has room to grow in place.
+ */
+bud_free_block *heap_take_lower(bud_heap *h, uint8_t order);
+
+/*
+ * Returns an allocated block to the free lists, coalescing it with its buddies.
+ */
+void heap_give(bud_heap *h, bud_free_block *block);
+
+/*
+ * Returns the blocks in the quick lists of a heap to its free lists.
+ *
+ * @return the number of blocks returned.
+ */
+int heap_flush_quick(bud_heap *h);
+
+/*
+ * The bud_malloc(), bud_realloc() and bud_free() of a heap, for requests
+ * that have already been checked.
+ */
+void *heap_malloc(bud_heap *h, uint32_t rsize);
+void *heap_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void heap_free(bud_heap *h, void *ptr);
+
+/*
+ * Grows an allocated block in place to the given order by absorbing its free
+ * higher buddies, without moving it.
+ *
+ * @return 1 if the block was grown, 0 if it was left alone.
+ */
+int heap_grow(bud_heap *h, bud_free_block *block, uint8_t order);
+
+/*
+ * Records the requested size of an allocated block, setting the padded bit to match.
+ */
+void set_requested_size(bud_free_block *block, uint32_t rsize);
+
+/*
+ * The block a checked payload belongs to, which for a payload from
+ * bud_memalign() is further back than PAYLOAD_TO_BLOCK().
+ */
+bud_free_block *payload_block(void *ptr);
+
+/*
+ * The order of the block needed for a request, which is past the largest
+ * order of the heap if the request is too big for any block.
+ */
+uint8_t get_required_order(bud_heap *h, uint32_t rsize);
+int validate_pointer(bud_heap *h, void *ptr);
+
+/*
+ * Resets the free lists of a heap to empty.
+ */
+void heap_reset(bud_heap *h, bud_free_block *heads, uint8_t order_min, uint8_t order_max);
+
+/*
+ * Like heap_reset(), but takes over free lists that may already hold blocks.
+ */
+void heap_attach(bud_heap *h, bud_free_block *heads, uint8_t order_min, uint8_t order_max);
+
+/* budmap.c: memory of a heap set up by bud_mem_init_ex() or bud_mem_init_file(). */
+
+/*
+ * Commits the next largest block of the heap, reserving a new region if
+ * the last one is full. A heap mapped from a file has a single region,
+ * already committed, and records how far it has grown in the file.
+ *
+ * @return the block, or (void *) -1 with errno set to ENOMEM.
+ */
+void *map_grow(bud_heap *h);
+
+/*
+ * @return 1 if ptr lies in the committed part of one of the regions of the heap.
+ */
+int map_contains(bud_heap *h, void *ptr);
+
+/*
+ * Notes when a block of the largest order was freed, just after it went
+ * into its free list, and trims the heap in BUD_TRIM mode.
+ */
+void map_freed(bud_heap *h, bud_free_block *block);
+
+/*
+ * Gives back the pages of the free blocks of the largest order, beyond the
+ * first trim_keep bytes of them, that have been free for trim_delay. Those
+ * blocks are kept at the end of their free list, so that committed blocks
+ * are taken first.
+ *
+ * @param h the heap, locked in threaded mode
+ * @param force whether to trim blocks however long they have been free
+ * @return the bytes given back.
+ */
+size_t map_trim(bud_heap *h, int force);
+
+/*
+ * Large objects, mapped one by one. These take the lock themselves.
+ * large_realloc() also moves objects between the heap and their own mapping,
+ * as the new size requires.
+ */
+void *large_malloc(bud_heap *h, uint32_t rsize);
+void *large_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void large_free(bud_heap *h, void *ptr);
+size_t large_usable_size(bud_heap *h, void *ptr);
+
+/*
+ * @return 1 if ptr is the payload of a live large object of the heap.
+ */
+int large_validate(bud_heap *h, void *ptr);
+
+/*
+ * budfile.c: a heap mapped from a file by bud_mem_init_file(), or from
+ * shared memory by bud_mem_init_shared(). The whole file is mapped, so its
+ * single region ends at its limit, and how far the heap has grown is kept
+ * in the file instead.
+ */
+
+/*
+ * The map_grow() of such a heap.
+ *
+ * @return the next largest block, or (void *) -1 with errno set to ENOMEM.
+ */
+void *file_grow(bud_heap *h);
+
+/*
+ * @return the bytes of blocks the heap has grown to.
+ */
+size_t file_brk(bud_heap *h);
+
+/*
+ * budslab.c: objects of up to BUD_SLAB_MAX bytes, in BUD_SLAB mode. These
+ * take the locks themselves in threaded mode: the lock of the size class,
+ * then the lock of the heap only to take or give back a block.
+ *
+ * A slab is an allocated block of SLAB_ORDER cut into equal slots. Its
+ * objects have no header of their own, so whether a pointer lies in a
+ * slab is looked up in a bitmap with a bit for each block of SLAB_ORDER in
+ * the heap. slab_owns() must be asked before the header of a pointer is.
+ */
+void *slab_malloc(bud_heap *h, uint32_t rsize);
+void *slab_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void slab_free(bud_heap *h, void *ptr);
+size_t slab_usable_size(bud_heap *h, void *ptr);
+
+/*
+ * @return 1 if ptr lies in a slab of the heap.
+ */
+int slab_owns(bud_heap *h, void *ptr);
+
+/*
+ * @return 1 if ptr, which lies in a slab, is a live object of it.
+ */
+int slab_validate(bud_heap *h, void *ptr);
+
+/*
+ * Forgets any slabs in memory the heap has just been given, which may be
+ * where the heap was before bud_mem_init() last reset it.
+ */
+void slab_forget(bud_heap *h, void *block);
+
+/*
+ * Gives back the empty slabs kept for reuse, when BUD_SLAB mode is left.
+ */
+void slab_flush(bud_heap *h);
+
+/*
+ * Takes, or releases, the locks of all the size classes, for fork().
+ */
+void slab_lock_all(bud_heap *h);
+void slab_unlock_all(bud_heap *h);
+
+/*
+ * Moves the lists of slabs with a free slot by delta bytes, after the
+ * memory of the heap has been mapped that much further on.
+ */
+void slab_relocate(bud_heap *h, ptrdiff_t delta);
+
+/*
+ * Puts the slabs with a free slot back on their lists from the slab map,
+ * for a heap whose lists were lost with the process that had it open, and
+ * gives back those that are empty.
+ */
+void slab_rebuild(bud_heap *h);
+
+/*
+ * budoob.c: blocks with no header, in BUD_OOB mode. Their payload is the
+ * block itself, and their order is looked up in a map with a byte for each
+ * block of order_min in the heap. oob_order() must be asked before the
+ * header of a pointer is, and after slab_owns().
+ */
+void *oob_malloc(bud_heap *h, uint32_t rsize);
+void *oob_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void oob_free(bud_heap *h, void *ptr);
+
+/*
+ * @return the order of the block at ptr if it is a live block with no
+ * header, or 0.
+ */
+uint8_t oob_order(bud_heap *h, void *ptr);
+
+/*
+ * @return 1 if ptr starts a block of order_min in the heap that is neither
+ * a live block with no header nor a payload of bud_memalign(), so that no
+ * header lies in front of it, or 0.
+ */
+int oob_stray(bud_heap *h, void *ptr);
+
+/*
+ * Marks a payload of bud_memalign() in the order map if it starts on a
+ * block of order_min, or takes the mark away when it is freed.
+ *
+ * @param live 1 when the payload is handed out, 0 when it is freed
+ */
+void oob_mark_aligned(bud_heap *h, void *ptr, int live);
+
+/*
+ * Forgets any blocks with no header in memory the heap has just been
+ * given, which may be where the heap was before bud_mem_init() last reset it.
+ */
+void oob_forget(bud_heap *h, void *block);
+
+/*
+ * budstats.c: counters of the allocator. Each thread keeps its own, which
+ * only it writes, so counting takes no lock. bud_stats() sums the counters
+ * of all threads, and those of threads that have exited.
+ */
+typedef struct bud_counters {
+    uint64_t allocs[BUD_MAX_ORDERS];
+    uint64_t frees[BUD_MAX_ORDERS];
+    uint64_t splits[BUD_MAX_ORDERS];
+    uint64_t coalesces[BUD_MAX_ORDERS];
+    uint64_t slab_allocs;
+    uint64_t slab_frees;
+    uint64_t growths;
+    int64_t requested;      /* Negative in a thread that frees more than it allocates */
+    int64_t reserved;
+    int busy;               /* Inside bud_realloc(), which counts for what it calls */
+    int registered;
+    struct bud_counters *next;
+    struct bud_counters *prev;
+} bud_counters;
+
+/* What an object counts as in the counters. */
+typedef struct bud_object {
+    int order;              /* Order of its block, LARGE_ORDER, or -1 in a slab */
+    uint64_t requested;
+    uint64_t reserved;
+} bud_object;
+
+extern __thread bud_counters bud_thread_counters;
+
+bud_counters *stats_register(void);
+
+static inline bud_counters *stats_mine(void) {
+    return bud_thread_counters.registered ? &bud_thread_counters : stats_register();
+}
+
+/*
+ * Adds to a counter of the calling thread, c being stats_mine(). Other
+ * threads may be reading it, but none writes it.
+ */
+#define STAT_ADD(c, field, n) __atomic_store_n(&(c)->field, (c)->field + (n), __ATOMIC_RELAXED)
+
+/*
+ * Count an object as allocated or freed. The pointer must be checked.
+ * stats_alloc() returns the pointer, and lets NULL through uncounted.
+ */
+void *stats_alloc(bud_heap *h, void *ptr);
+void stats_free(bud_heap *h, void *ptr);
+
+/*
+ * Like stats_alloc() and stats_free(), for an object known to be a block
+ * of the heap, with sign 1 for an alloc and -1 for a free.
+ */
+static inline void stats_block(uint8_t order, uint64_t requested, int sign) {
+    bud_counters *c = stats_mine();
+
+    if(c->busy) {
+        return;
+    }
+
+    if(sign > 0) {
+        STAT_ADD(c, allocs[order], 1);
+    } else {
+        STAT_ADD(c, frees[order], 1);
+    }
+    STAT_ADD(c, requested, sign * (int64_t) requested);
+    STAT_ADD(c, reserved, sign * (int64_t) BLOCK_SIZE(order));
+}
+
+/*
+ * Bracket a bud_realloc(). The mallocs and frees it makes on the way are
+ * not counted, and the object counts as freed and allocated again if its
+ * order changed.
+ */
+void stats_realloc_begin(bud_heap *h, void *ptr, bud_object *old);
+void stats_realloc_end(bud_heap *h, bud_object *old, void *new_ptr);
+
+/*
+ * Counts a growth of the heap, and samples the peak of the reserved bytes.
+ */
+void stats_grow(bud_heap *h);
+
+/*
+ * budtrace.c: the trace of bud_trace_start(). bud_tracing is set while a
+ * trace is being written, so that a call that is not traced costs a test.
+ */
+extern int bud_tracing;
+
+/*
+ * The clock of the trace, in nanoseconds.
+ */
+uint64_t trace_clock(void);
+
+/*
+ * Records a call in the buffer of the calling thread, unless it is made
+ * from inside bud_realloc().
+ *
+ * @param op BUD_TRACE_MALLOC, _REALLOC or _FREE
+ * @param since the clock when the call was made, or 0 for now
+ * @param size the bytes asked for, 0 for a free
+ * @param handle the object made, resized or freed
+ * @param result where a resized object went
+ */
+void trace_record(int op, uint64_t since, uint32_t size, void *handle, void *result);
+
+/* The clock to record a call that frees with, read before it frees. */
+#define TRACE_CLOCK() (bud_tracing ? trace_clock() : 0)
+
+#define TRACE(op, since, size, handle, result)                                \
+    do {                                                                       \
+        if(bud_tracing) {                                                      \
+            trace_record((op), (since), (size), (handle), (result));           \
+        }                                                                      \
+    } while(0)
+
+/* budmt.c: threaded mode, with a cache of free blocks in each thread. */
+void *mt_malloc(bud_heap *h, uint32_t rsize);
+void *mt_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void mt_free(bud_heap *h, void *ptr);
+void mt_flush(bud_heap *h);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * malloc() and friends on top of budmm, built as bin/libbudmm.so by
+ * "make shim" so that real programs can be run on the allocator:
+ *
+ *     LD_PRELOAD=bin/libbudmm.so program ...
+ *
+ * The heap is set up with bud_mem_init_ex() on the first call, in threaded
+ * mode with realloc() growing blocks in place where it can, small objects
+ * in slabs and free memory beyond SHIM_TRIM_KEEP given back to the OS, and
+ * the locks of the heap are held across fork() so that the child never
+ * inherits one locked.
+ *
+ * If BUD_TRACE is set in the environment, the calls are traced with
+ * bud_trace_start() to the file it names, in which "%p" stands for the id
+ * of the process, so that the programs a traced program runs, and the
+ * children it forks, each write a trace of their own.
+ *
+ * A budmm payload is only 8-byte aligned, but callers of malloc() expect
+ * 16. So every pointer handed out is preceded by a word holding its
+ * distance from the budmm payload it lies in. For malloc() that is 8, and
+ * the word is the first word of the payload. For posix_memalign() and the
+ * like it is however far the aligned pointer had to be moved.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+#define SHIM_ORDER_MAX 21   /* Blocks up to 1 MiB, larger requests are mapped */
+#define SHIM_TRIM_KEEP (4 << 20)  /* Free bytes kept to grow into again */
+#define SHIM_ALIGN 16       /* Alignment of malloc() */
+
+/* Distance from a pointer handed out back to its budmm payload. */
+#define SHIM_OFFSET(ptr) (((size_t *) (ptr))[-1])
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+
+static void shim_prepare(void) {
+    slab_lock_all(&bud_default_heap);
+    heap_lock(&bud_default_heap);
+}
+
+static void shim_release(void) {
+    heap_unlock(&bud_default_heap);
+    slab_unlock_all(&bud_default_heap);
+}
+
+static void shim_trace_stop(void) {
+    bud_trace_stop();
+}
+
+/*
+ * Starts a trace if BUD_TRACE asks for one. Nothing here may allocate.
+ */
+static void shim_trace_start(void) {
+    char *path = getenv("BUD_TRACE");
+
+    if(path == NULL || *path == '\0') {
+        return;
+    }
+
+    if(bud_trace_start(path) == 0) {
+        atexit(shim_trace_stop);
+    }
+}
+
+static void shim_init(void) {
+    if(bud_mem_init_ex(ORDER_MIN, SHIM_ORDER_MAX) == -1) {
+        abort();
+    }
+    bud_trim_policy(SHIM_TRIM_KEEP, 0, 0);
+    bud_mem_mode(BUD_THREADED | BUD_GROW_IN_PLACE | BUD_SLAB | BUD_TRIM);
+    pthread_atfork(shim_prepare, shim_release, shim_release);
+    shim_trace_start();
+}
+
+/*
+ * The size to ask budmm for, given the bytes needed. Only slots whose size
+ * is a multiple of 16 lie 8 past a multiple of 16, as payloads do.
+ */
+static size_t shim_rsize(size_t rsize) {
+    if(rsize <= BUD_SLAB_MAX) {
+        rsize = (rsize + SHIM_ALIGN - 1) & ~(SHIM_ALIGN - 1);
+    }
+    return rsize;
+}
+
+/*
+ * Allocates size bytes aligned to align, a power of two of at least
+ * SHIM_ALIGN.
+ */
+static void *shim_alloc(size_t align, size_t size) {
+    // Room for the offset word, and to move the pointer up to alignment.
+    size_t extra = sizeof(size_t) + align - SHIM_ALIGN;
+    char *payload = NULL, *ptr = NULL;
+
+    pthread_once(&shim_once, shim_init);
+
+    // An alignment too large for any request wraps nothing around.
+    if(extra > UINT32_MAX || size > UINT32_MAX - extra) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if((payload = bud_malloc(shim_rsize(size + extra))) == NULL) {
+        return NULL;
+    }
+
+    ptr = (char *) (((uintptr_t) payload + sizeof(size_t) + align - 1) & ~(align - 1));
+    SHIM_OFFSET(ptr) = ptr - payload;
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return shim_alloc(SHIM_ALIGN, size);
+}
+
+void free(void *ptr) {
+    if(ptr != NULL) {
+        bud_free((char *) ptr - SHIM_OFFSET(ptr));
+    }
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = NULL;
+
+    if(size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Not malloc(), or the compiler may turn this into a call to calloc().
+    if((ptr = shim_alloc(SHIM_ALIGN, nmemb * size)) != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if(ptr == NULL) {
+        return 0;
+    }
+
+    return bud_usable_size((char *) ptr - SHIM_OFFSET(ptr)) - SHIM_OFFSET(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    char *payload = NULL, *new_ptr = NULL;
+    size_t used = 0;
+
+    if(ptr == NULL) {
+        return malloc(size);
+    }
+
+    if(size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // Pointers from malloc() sit right after their offset word, so bud_realloc()
+    // keeps them aligned wherever it moves them.
+    if(SHIM_OFFSET(ptr) == sizeof(size_t)) {
+        if(size > UINT32_MAX - sizeof(size_t)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if((payload = bud_realloc((char *) ptr - sizeof(size_t), shim_rsize(size + sizeof(size_t)))) == NULL) {
+            return NULL;
+        }
+        return payload + sizeof(size_t);
+    }
+
+    // Pointers with a larger alignment are copied to one from malloc().
+    if((new_ptr = malloc(size)) == NULL) {
+        return NULL;
+    }
+
+    used = malloc_usable_size(ptr);
+    memcpy(new_ptr, ptr, (used < size) ? used : size);
+    free(ptr);
+    return new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *ptr = NULL;
+
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    if((ptr = shim_alloc((alignment < SHIM_ALIGN) ? SHIM_ALIGN : alignment, size)) == NULL) {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    int error = 0;
+
+    if((error = posix_memalign(&ptr, alignment, size)) != 0) {
+        errno = error;
+        return NULL;
+    }
+    return ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if(size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+/*
+ * Not asked for by the C library's callers as often, but a program that
+ * uses them would otherwise hand their pointers to our free().
+ */
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
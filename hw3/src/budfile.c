@@ -0,0 +1,620 @@
+/*
+ * A heap mapped from a file, set up by bud_mem_init_file(), or from shared
+ * memory by bud_mem_init_shared().
+ *
+ * The file starts with a bud_file, which holds what the heap needs to be
+ * opened again as it was: the sentinels of its free lists, how far it has
+ * grown, and the lists of slabs with a free slot. The slab map and order
+ * map of its single region follow, and then its blocks. The file is
+ * mapped so that the first block lies on a multiple of the largest block,
+ * as the buddy of a block is found from its address.
+ *
+ * The links of the free lists are addresses. The file is mapped where it
+ * was last time if it can be, and otherwise every link is moved by the
+ * distance the heap moved, which touches each free block once. That cannot
+ * be done under other processes using the heap, so every process maps a
+ * shared heap at the same address, and the lock of the heap lies in its
+ * header.
+ *
+ * A shared heap with a name is made by the process whose shm_open() creates
+ * it, and the others wait for it to be marked open before they map it.
+ *
+ * A file heap is held open with an flock() on its file, which the kernel
+ * lets go of if the process dies. A heap marked open that can be locked
+ * was left by a process that died with it open, so its free lists are
+ * checked before it is used again, and its lists of slabs, which are only
+ * written out when it is closed, are made again from the slab map.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+/* Linux 4.17 and later. Older kernels take the address as a hint. */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define BUD_FILE_MAGIC "BUDHEAP"
+#define BUD_FILE_VERSION 1
+#define BUD_SHARED_MAGIC "BUDSHRD"
+#define SHARED_WAIT_TRIES 1000      /* Milliseconds to wait for another process to make a shared heap */
+
+/* The start of the file of a heap. */
+typedef struct bud_file {
+    char magic[8];          /* BUD_FILE_MAGIC, or BUD_SHARED_MAGIC for a shared heap */
+    uint32_t version;
+    uint32_t open;          /* Set while a process has the heap open, or once a shared heap is made */
+    uint64_t base;          /* Address of the first block when the heap was last open */
+    uint64_t meta;          /* Bytes of the file before the first block */
+    uint64_t size;          /* Bytes of blocks the heap may grow to */
+    uint64_t brk;           /* Bytes of blocks it has grown to */
+    uint64_t root;          /* Offset of the root object, or 0 */
+    uint64_t slab_map;      /* Offsets of the slab map and order map of the region */
+    uint64_t oob_map;
+    uint8_t order_min;
+    uint8_t order_max;
+    bud_free_block heads[BUD_ORDER_LIMIT];
+    struct bud_slab *slabs[SLAB_CLASSES];   /* Slabs with a free slot, when the heap was closed */
+    pthread_mutex_t lock;   /* Lock of a shared heap, robust and process-shared */
+} bud_file;
+
+static int file_fd = -1;    /* The file of the heap of bud_mem_init_file(), locked while it is open */
+
+static size_t round_page(size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+/*
+ * Lays out the file of a new heap.
+ *
+ * @param file filled in
+ * @param size the bytes of blocks asked for
+ * @param magic BUD_FILE_MAGIC or BUD_SHARED_MAGIC
+ * @return 0 on success, or -1 with errno set to EINVAL if size is too small.
+ */
+static int file_layout(bud_file *file, size_t size, const char *magic) {
+    uint8_t order = 0;
+
+    if(size < (size_t) sysconf(_SC_PAGESIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The largest block is the largest power of two that fits.
+    order = 63 - __builtin_clzll(size);
+    if(order > BUD_FILE_ORDER_MAX - 1) {
+        order = BUD_FILE_ORDER_MAX - 1;
+    }
+
+    memset(file, 0, sizeof(bud_file));
+    memcpy(file->magic, magic, sizeof(file->magic));
+    file->version = BUD_FILE_VERSION;
+    file->order_min = ORDER_MIN;
+    file->order_max = order + 1;
+    file->size = size & ~(BLOCK_SIZE(order) - 1);
+
+    file->slab_map = round_page(sizeof(bud_file));
+    file->oob_map = file->slab_map + round_page(((file->size >> SLAB_ORDER) + 63) / 64 * sizeof(uint64_t));
+    file->meta = file->oob_map + round_page(file->size >> file->order_min);
+    return 0;
+}
+
+/*
+ * @return 1 if file is the start of a heap of the given magic that fits in
+ * a file of length bytes.
+ */
+static int file_valid(bud_file *file, const char *magic, size_t length) {
+    return memcmp(file->magic, magic, sizeof(file->magic)) == 0 &&
+           file->version == BUD_FILE_VERSION &&
+           file->order_min >= ORDER_MIN && file->order_max <= BUD_FILE_ORDER_MAX &&
+           file->order_min < file->order_max &&
+           (file->size & (BLOCK_SIZE(file->order_max - 1) - 1)) == 0 &&
+           (file->brk & (BLOCK_SIZE(file->order_max - 1) - 1)) == 0 &&
+           file->brk <= file->size &&
+           file->meta + file->size <= length;
+}
+
+/*
+ * Maps the file of a heap so that its first block lies on a multiple of
+ * the largest block.
+ *
+ * @param fd the file
+ * @param file its start, as read from it
+ * @param want where the first block should go, or NULL for anywhere
+ * @return the mapping, or MAP_FAILED with errno set.
+ */
+static bud_file *map_file(int fd, bud_file *file, char *want) {
+    size_t length = file->meta + file->size, chunk = BLOCK_SIZE(file->order_max - 1);
+    char *base = NULL, *start = NULL;
+
+    if(want != NULL) {
+        base = mmap(want - file->meta, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if(base == want - file->meta) {
+            return (bud_file *) base;
+        }
+        if(base != MAP_FAILED) {
+            munmap(base, length);
+        }
+    }
+
+    // Reserve a largest block more than needed, then map the file over the
+    // reservation and unmap what is left at either end.
+    base = mmap(NULL, length + chunk, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    start = (char *) (((uintptr_t) base + file->meta + chunk - 1) & ~(chunk - 1)) - file->meta;
+    if(mmap(start, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, length + chunk);
+        return MAP_FAILED;
+    }
+
+    if(start > base) {
+        munmap(base, start - base);
+    }
+    if(base + length + chunk > start + length) {
+        munmap(start + length, (base + length + chunk) - (start + length));
+    }
+    return (bud_file *) start;
+}
+
+/*
+ * Moves every link of the free lists of a heap by delta bytes.
+ */
+static void relocate_lists(bud_heap *h, ptrdiff_t delta) {
+    for(int i = 0; i < h->order_max - h->order_min; i++) {
+        bud_free_block *block = &h->heads[i];
+
+        do {
+            block->next = (bud_free_block *) ((char *) block->next + delta);
+            block->prev = (bud_free_block *) ((char *) block->prev + delta);
+            block = block->next;
+        } while(block != &h->heads[i]);
+    }
+}
+
+/*
+ * Walks the free lists of a heap in its mapping, which may lie elsewhere
+ * than where the links point. Each block must lie in the heap on a
+ * multiple of its size, be free and of the order of its list, and be
+ * linked both ways.
+ *
+ * @return 1 if the lists hold together, 0 if not.
+ */
+static int file_check(bud_file *file) {
+    ptrdiff_t delta = (char *) file - ((char *) (uintptr_t) file->base - file->meta);
+    char *start = (char *) file + file->meta;
+
+    for(int i = 0; i < file->order_max - file->order_min; i++) {
+        uint8_t order = file->order_min + i;
+        bud_free_block *head = &file->heads[i], *prev = head;
+        size_t left = file->brk >> order;   // More blocks than fit is a loop
+
+        for(bud_free_block *block = (bud_free_block *) ((char *) head->next + delta); block != head;
+            prev = block, block = (bud_free_block *) ((char *) block->next + delta)) {
+            if(left-- == 0 || (char *) block < start || (char *) block + BLOCK_SIZE(order) > start + file->brk ||
+               ((char *) block - start) % BLOCK_SIZE(order) != 0 ||
+               block->header.allocated || BLOCK_ORDER(block) != order ||
+               (bud_free_block *) ((char *) block->prev + delta) != prev) {
+                return 0;
+            }
+        }
+        if((bud_free_block *) ((char *) head->prev + delta) != prev) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Makes the mapped file the memory of the default heap.
+ *
+ * @param h the heap
+ * @param file the mapping
+ * @param made whether the heap is new
+ */
+static void file_attach(bud_heap *h, bud_file *file, int made) {
+    char *start = (char *) file + file->meta;
+    bud_region *rp = &h->regions[0];
+
+    rp->start = start;
+    rp->end = rp->limit = start + file->size;
+    rp->slab_map = (uint64_t *) ((char *) file + file->slab_map);
+    rp->oob_map = (uint8_t *) file + file->oob_map;
+
+    h->mapped = 1;
+    h->nregions = 1;
+    h->large = NULL;
+    h->file = file;
+
+    if(made) {
+        heap_reset(h, file->heads, file->order_min, file->order_max);
+    } else {
+        heap_attach(h, file->heads, file->order_min, file->order_max);
+        memcpy(h->slabs, file->slabs, sizeof(h->slabs));
+
+        // Blocks of BUD_OOB may have been left in the heap.
+        h->oob_used = 1;
+
+        if(start != (char *) (uintptr_t) file->base) {
+            relocate_lists(h, start - (char *) (uintptr_t) file->base);
+            slab_relocate(h, start - (char *) (uintptr_t) file->base);
+        }
+    }
+
+    debug("file_attach: %p - %p, moved by %td", rp->start, rp->limit,
+          made ? 0 : start - (char *) (uintptr_t) file->base);
+    file->base = (uintptr_t) start;
+
+    // Last, as other processes take a shared heap marked open as made.
+    __atomic_store_n(&file->open, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reads the start of a file, laying out a new heap in it if it is empty.
+ *
+ * @param fd the file
+ * @param header filled in
+ * @param size the bytes of blocks of a new heap
+ * @param magic the magic of the heap
+ * @return 1 if the heap is new, 0 if not, or -1 with errno set.
+ */
+static int file_read(int fd, bud_file *header, size_t size, const char *magic) {
+    struct stat st;
+
+    if(fstat(fd, &st) == -1) {
+        return -1;
+    }
+
+    if(st.st_size == 0) {
+        if(file_layout(header, size, magic) == -1 || ftruncate(fd, header->meta + header->size) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if(pread(fd, header, sizeof(bud_file), 0) != sizeof(bud_file) || !file_valid(header, magic, st.st_size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Closes fd, keeping errno, and fails. */
+static int fail_closing(int fd) {
+    int saved = errno;
+
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_init_file(const char *path, size_t size) {
+    bud_heap *h = &bud_default_heap;
+    bud_file header, *file = NULL;
+    int fd = -1, made = 0, died = 0;
+
+    if((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1) {
+        return -1;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        if(errno == EWOULDBLOCK) {
+            errno = EBUSY;
+        }
+        return fail_closing(fd);
+    }
+
+    if((made = file_read(fd, &header, size, BUD_FILE_MAGIC)) == -1) {
+        return fail_closing(fd);
+    }
+    died = !made && header.open;
+
+    file = map_file(fd, &header, made ? NULL : (char *) (uintptr_t) header.base);
+    if(file == MAP_FAILED) {
+        return fail_closing(fd);
+    }
+
+    if(made) {
+        *file = header;
+    } else if(died) {
+        if(!file_check(file)) {
+            munmap(file, header.meta + header.size);
+            errno = ENOTRECOVERABLE;
+            return fail_closing(fd);
+        }
+        memset(file->slabs, 0, sizeof(file->slabs));
+    }
+
+    file_attach(h, file, made);
+    if(died) {
+        slab_rebuild(h);
+    }
+    file_fd = fd;
+    return 0;
+}
+
+/*
+ * Sets up the lock of a new shared heap, which any process may take and
+ * which is given up if its holder dies.
+ *
+ * @return 0 on success, or an error number.
+ */
+static int shared_lock_init(pthread_mutex_t *lock) {
+    pthread_mutexattr_t attr;
+    int ret = 0;
+
+    pthread_mutexattr_init(&attr);
+    if((ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) == 0 &&
+       (ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) == 0) {
+        ret = pthread_mutex_init(lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+/*
+ * Waits for the process that created a shared heap to make it.
+ *
+ * @param fd the shared memory
+ * @param header filled in
+ * @return 0 once the heap is made, or -1 with errno set to EINVAL if the
+ * memory holds something other than a shared heap, or ETIMEDOUT.
+ */
+static int shared_wait(int fd, bud_file *header) {
+    struct timespec pause = { 0, 1000000 };
+    struct stat st;
+
+    for(int i = 0; i < SHARED_WAIT_TRIES; i++) {
+        if(fstat(fd, &st) == -1) {
+            return -1;
+        }
+        if(st.st_size >= (off_t) sizeof(bud_file) && pread(fd, header, sizeof(bud_file), 0) == sizeof(bud_file) &&
+           __atomic_load_n(&header->open, __ATOMIC_ACQUIRE)) {
+            if(!file_valid(header, BUD_SHARED_MAGIC, st.st_size)) {
+                errno = EINVAL;
+                return -1;
+            }
+            return 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * Closes fd and fails, removing memory this process created but made no
+ * heap in, which others would wait on in vain.
+ */
+static int shared_fail(int fd, const char *name, int created) {
+    int saved = errno;
+
+    if(created && name != NULL) {
+        shm_unlink(name);
+    }
+    errno = saved;
+    return fail_closing(fd);
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_init_shared(const char *name, size_t size) {
+    bud_heap *h = &bud_default_heap;
+    bud_file header, *file = NULL;
+    char *want = NULL;
+    int fd = -1, made = 0, ret = 0, exists = 0;
+
+    if(name == NULL) {
+        fd = memfd_create("budmm", MFD_CLOEXEC);
+    } else if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1 && errno == EEXIST) {
+        exists = 1;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if(fd == -1) {
+        return -1;
+    }
+
+    // Only the process that created the memory makes the heap in it.
+    made = exists ? shared_wait(fd, &header) : file_read(fd, &header, size, BUD_SHARED_MAGIC);
+    if(made == -1) {
+        return shared_fail(fd, name, !exists);
+    }
+
+    // Others may be using the heap, so it cannot move.
+    want = made ? NULL : (char *) (uintptr_t) header.base;
+    if((file = map_file(fd, &header, want)) == MAP_FAILED) {
+        return shared_fail(fd, name, made);
+    }
+    if(want != NULL && (char *) file + file->meta != want) {
+        munmap(file, header.meta + header.size);
+        errno = EADDRINUSE;
+        return fail_closing(fd);
+    }
+
+    if(made) {
+        *file = header;
+        if((ret = shared_lock_init(&file->lock)) != 0) {
+            munmap(file, header.meta + header.size);
+            errno = ret;
+            return shared_fail(fd, name, made);
+        }
+    }
+    close(fd);
+
+    file_attach(h, file, made);
+    h->lock = &file->lock;
+    h->shared = 1;
+    h->mode = BUD_THREADED;
+
+    // Other processes may hand out blocks of BUD_OOB at any time.
+    h->oob_used = 1;
+    return 0;
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_fini_file(void) {
+    bud_heap *h = &bud_default_heap;
+    bud_file *file = h->file;
+    size_t length = 0;
+    int ret = 0;
+
+    if(file == NULL || h->shared) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Magazines and quick lists go back to the free lists, which are kept.
+    bud_mem_mode(0);
+    memcpy(file->slabs, h->slabs, sizeof(file->slabs));
+    file->open = 0;
+
+    length = file->meta + file->size;
+    ret = msync(file, length, MS_SYNC);
+    munmap(file, length);
+    close(file_fd);
+    file_fd = -1;
+
+    // Back to the heap bud_mem_init() sets up.
+    heap_reset(h, free_list_heads, ORDER_MIN, ORDER_MAX);
+    h->mapped = 0;
+    h->nregions = 0;
+    h->file = NULL;
+    return ret;
+}
+
+/* Check budheap.h for documentation. */
+int shared_recover(bud_heap *h) {
+    if(!file_check(h->file)) {
+        pthread_mutex_unlock(h->lock);
+        return ENOTRECOVERABLE;
+    }
+
+    pthread_mutex_consistent(h->lock);
+    return 0;
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_fini_shared(void) {
+    bud_heap *h = &bud_default_heap;
+    bud_file *file = h->file;
+
+    if(file == NULL || !h->shared) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Nothing is cached in this process, so the heap is left as it is.
+    munmap(file, file->meta + file->size);
+
+    heap_reset(h, free_list_heads, ORDER_MIN, ORDER_MAX);
+    h->lock = &h->own_lock;
+    h->mode = 0;
+    h->mapped = 0;
+    h->nregions = 0;
+    h->file = NULL;
+    h->shared = 0;
+    return 0;
+}
+
+/* Check budheap.h for documentation. */
+void *file_grow(bud_heap *h) {
+    bud_file *file = h->file;
+    size_t chunk = BLOCK_SIZE(h->order_max - 1);
+    char *block = NULL;
+
+    if(file->brk + chunk > file->size) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+
+    block = h->regions[0].start + file->brk;
+    file->brk += chunk;
+    debug("file_grow: %p, %lu bytes", block, (unsigned long) file->brk);
+    return block;
+}
+
+/* Check budheap.h for documentation. */
+size_t file_brk(bud_heap *h) {
+    return h->file->brk;
+}
+
+/*
+ * @return 1 if an offset lies among the blocks of the heap of a file.
+ */
+static int file_holds(bud_file *file, uint64_t off) {
+    return file != NULL && off >= file->meta && off < file->meta + file->size;
+}
+
+/* Check budext.h for documentation. */
+struct bud_off bud_to_off(void *ptr) {
+    bud_file *file = bud_default_heap.file;
+    struct bud_off off = { 0 };
+
+    if(ptr == NULL) {
+        return off;
+    }
+    if(file == NULL || (char *) ptr < (char *) file || !file_holds(file, (char *) ptr - (char *) file)) {
+        errno = EINVAL;
+        return off;
+    }
+
+    off.off = (char *) ptr - (char *) file;
+    return off;
+}
+
+/* Check budext.h for documentation. */
+void *bud_from_off(struct bud_off off) {
+    bud_file *file = bud_default_heap.file;
+
+    if(off.off == 0) {
+        return NULL;
+    }
+    if(!file_holds(file, off.off)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return (char *) file + off.off;
+}
+
+/* Check budext.h for documentation. */
+int bud_set_root(void *ptr) {
+    struct bud_off off = bud_to_off(ptr);
+
+    if(bud_default_heap.file == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(ptr != NULL && off.off == 0) {
+        return -1;
+    }
+    bud_default_heap.file->root = off.off;
+    return 0;
+}
+
+/* Check budext.h for documentation. */
+void *bud_root(void) {
+    struct bud_off off = { 0 };
+
+    if(bud_default_heap.file == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    off.off = bud_default_heap.file->root;
+    return bud_from_off(off);
+}
@@ -0,0 +1,470 @@
+/*
+ * Memory of a heap set up by bud_mem_init_ex().
+ *
+ * The heap reserves address space in regions of BUD_REGION_SIZE, each
+ * aligned to the largest block so that no block straddles two blocks of
+ * the largest order. A region is mapped with no access and committed one
+ * largest block at a time as the heap grows. Requests too big for the
+ * largest block are mapped on their own and kept on a list, so that they
+ * can all be unmapped. The start of each mapping is marked, so that
+ * bud_free() can tell them from bad pointers without searching the list.
+ *
+ * In BUD_TRIM mode, the pages of free blocks of the largest order are given
+ * back with madvise(), all but the first, which holds the block's header
+ * and links and the time the block was freed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+/* Converts between a large object and its payload. */
+#define LARGE_TO_PAYLOAD(lp) ((void *) ((lp) + 1))
+#define PAYLOAD_TO_LARGE(ptr) (((bud_large *) (ptr)) - 1)
+
+/* Length of the mapping of a large object. */
+#define LARGE_LENGTH(lp) large_length(BLOCK_RSIZE(lp))
+
+/* Marks a live large object, mixed with its address so a copy does not pass. */
+#define LARGE_MAGIC 0x4255444c41524745ULL
+
+/* When a free block of the largest order was freed, in milliseconds, kept after its links. */
+#define FREE_SINCE(block) (*(uint64_t *) ((block) + 1))
+
+/* Sentinels of the free lists of a mapped heap, enough for any order range. */
+static bud_free_block mapped_heads[BUD_ORDER_LIMIT];
+
+static size_t page_size(void) {
+    static size_t page = 0;
+
+    if(page == 0) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    return page;
+}
+
+/* Length of the mapping of a large object of the given requested size. */
+static size_t large_length(uint32_t rsize) {
+    return (sizeof(bud_large) + rsize + page_size() - 1) & ~(page_size() - 1);
+}
+
+/* Length of the slab map of a region, a bit for each block of SLAB_ORDER. */
+static size_t slab_map_length(bud_region *rp) {
+    size_t bits = (rp->limit - rp->start) >> SLAB_ORDER;
+
+    return (((bits + 63) / 64) * sizeof(uint64_t) + page_size() - 1) & ~(page_size() - 1);
+}
+
+/* Length of the order map of a region, a byte for each block of order_min. */
+static size_t oob_map_length(bud_heap *h, bud_region *rp) {
+    size_t bytes = (rp->limit - rp->start) >> h->order_min;
+
+    return (bytes + page_size() - 1) & ~(page_size() - 1);
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_init_ex(int order_min, int order_max) {
+    bud_heap *h = &bud_default_heap;
+
+    // A free block must hold its header and links, and the largest block is
+    // committed with mprotect(), so it must be made of whole pages.
+    if(order_min < ORDER_MIN || order_max > BUD_ORDER_LIMIT || order_min >= order_max ||
+       BLOCK_SIZE(order_max - 1) < page_size()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    heap_reset(h, mapped_heads, order_min, order_max);
+    h->mapped = 1;
+    h->nregions = 0;
+    h->large = NULL;
+    return 0;
+}
+
+/* Check budext.h for documentation. */
+void bud_mem_fini_ex(void) {
+    bud_heap *h = &bud_default_heap;
+
+    for(int i = 0; i < h->nregions; i++) {
+        munmap(h->regions[i].start, h->regions[i].limit - h->regions[i].start);
+        munmap(h->regions[i].slab_map, slab_map_length(&h->regions[i]));
+        munmap(h->regions[i].oob_map, oob_map_length(h, &h->regions[i]));
+    }
+
+    while(h->large != NULL) {
+        bud_large *lp = h->large;
+
+        h->large = lp->next;
+        munmap(lp, LARGE_LENGTH(lp));
+    }
+
+    // Back to the heap bud_mem_init() sets up.
+    heap_reset(h, free_list_heads, ORDER_MIN, ORDER_MAX);
+    h->mapped = 0;
+    h->nregions = 0;
+}
+
+/*
+ * Reserves a new region of address space for the heap.
+ *
+ * @return the region, or NULL if the heap has all it may have or the
+ * address space is exhausted.
+ */
+static bud_region *reserve_region(bud_heap *h) {
+    size_t chunk = BLOCK_SIZE(h->order_max - 1);
+    size_t size = (chunk > BUD_REGION_SIZE) ? chunk : BUD_REGION_SIZE;
+    char *base = NULL, *start = NULL;
+    bud_region *rp = NULL;
+
+    if(h->nregions == BUD_MAX_REGIONS) {
+        return NULL;
+    }
+
+    // Map a largest block more than needed, then trim both ends so the
+    // region starts on a multiple of the largest block.
+    base = mmap(NULL, size + chunk, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) {
+        return NULL;
+    }
+
+    start = (char *) (((uintptr_t) base + chunk - 1) & ~(chunk - 1));
+    if(start > base) {
+        munmap(base, start - base);
+    }
+    if(base + chunk > start) {
+        munmap(start + size, (base + chunk) - start);
+    }
+
+    rp = &h->regions[h->nregions];
+    rp->start = rp->end = start;
+    rp->limit = start + size;
+
+    // Its slab map, whose pages are only touched once slabs are made there.
+    rp->slab_map = mmap(NULL, slab_map_length(rp), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(rp->slab_map == MAP_FAILED) {
+        munmap(start, size);
+        return NULL;
+    }
+
+    // And its order map, likewise.
+    rp->oob_map = mmap(NULL, oob_map_length(h, rp), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(rp->oob_map == MAP_FAILED) {
+        munmap(rp->slab_map, slab_map_length(rp));
+        munmap(start, size);
+        return NULL;
+    }
+
+    h->nregions++;
+    debug("reserve_region: %p - %p", rp->start, rp->limit);
+    return rp;
+}
+
+/*
+ * Commits the next largest block of the heap, reserving a new region if
+ * the last one is full.
+ *
+ * @param h the heap being grown
+ * @return the block, or (void *) -1 with errno set to ENOMEM.
+ */
+void *map_grow(bud_heap *h) {
+    size_t chunk = BLOCK_SIZE(h->order_max - 1);
+    bud_region *rp = (h->nregions > 0) ? &h->regions[h->nregions - 1] : NULL;
+    char *block = NULL;
+
+    if(h->file != NULL) {
+        return file_grow(h);
+    }
+
+    if(rp == NULL || rp->end + chunk > rp->limit) {
+        if((rp = reserve_region(h)) == NULL) {
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+    }
+
+    if(mprotect(rp->end, chunk, PROT_READ | PROT_WRITE) == -1) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+
+    block = rp->end;
+    rp->end += chunk;
+    debug("map_grow: %p -> %p", block, rp->end);
+    return block;
+}
+
+/*
+ * @param h the heap
+ * @param ptr the pointer
+ * @return 1 if ptr lies in the committed part of one of the regions of the heap.
+ */
+int map_contains(bud_heap *h, void *ptr) {
+    for(int i = 0; i < h->nregions; i++) {
+        if((char *) ptr >= h->regions[i].start && (char *) ptr < h->regions[i].end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Check budheap.h for documentation. */
+void map_freed(bud_heap *h, bud_free_block *block) {
+    if(!(h->mode & BUD_TRIM) || !h->mapped || h->file != NULL) {
+        return;
+    }
+
+    FREE_SINCE(block) = now_ms();
+    map_trim(h, 0);
+}
+
+/*
+ * Gives back all but the first page of a free block of the largest order.
+ *
+ * @return 0 on success, or -1 if madvise() failed.
+ */
+static int decommit(bud_heap *h, bud_free_block *block) {
+    size_t length = BLOCK_SIZE(h->order_max - 1) - page_size();
+    char *pages = (char *) block + page_size();
+
+    // MADV_FREE is only there since Linux 4.5.
+    if(h->trim_lazy && madvise(pages, length, MADV_FREE) == 0) {
+        return 0;
+    }
+    return madvise(pages, length, MADV_DONTNEED);
+}
+
+/* Check budheap.h for documentation. */
+size_t map_trim(bud_heap *h, int force) {
+    size_t size = BLOCK_SIZE(h->order_max - 1), kept = 0, released = 0;
+    bud_free_block *sentinel = &h->heads[FREE_LIST_INDEX(h, h->order_max - 1)];
+    bud_free_block *block = NULL, *next = NULL;
+    uint64_t now = now_ms();
+
+    // The pages of a heap in a file or shared memory are not this
+    // process's to give back.
+    if(!h->mapped || h->file != NULL || size <= page_size()) {
+        return 0;
+    }
+
+    // The committed blocks come first, most recently freed first, so the
+    // ones kept are those likeliest to be still in the cache.
+    for(block = sentinel->next; block != sentinel && !BLOCK_DECOMMITTED(block); block = next) {
+        next = block->next;
+
+        if(kept < h->trim_keep || (!force && now - FREE_SINCE(block) < h->trim_delay)) {
+            kept += size;
+            continue;
+        }
+        if(decommit(h, block) == -1) {
+            break;
+        }
+        set_block_decommitted(block, 1);
+        released += size - page_size();
+
+        // To the end of the list, behind the blocks still committed.
+        block->prev->next = block->next;
+        block->next->prev = block->prev;
+        block->prev = sentinel->prev;
+        block->next = sentinel;
+        sentinel->prev->next = block;
+        sentinel->prev = block;
+    }
+
+    debug("map_trim: %zu bytes given back", released);
+    return released;
+}
+
+/* Check budext.h for documentation. */
+void bud_trim_policy(size_t keep, unsigned delay_ms, int lazy) {
+    bud_heap *h = &bud_default_heap;
+
+    h->trim_keep = keep;
+    h->trim_delay = delay_ms;
+    h->trim_lazy = lazy;
+}
+
+/* Check budext.h for documentation. */
+size_t bud_trim(void) {
+    bud_heap *h = &bud_default_heap;
+    size_t released = 0;
+
+    if(h->mode & BUD_THREADED) {
+        heap_lock(h);
+        released = map_trim(h, 1);
+        heap_unlock(h);
+    } else {
+        released = map_trim(h, 1);
+    }
+    return released;
+}
+
+/*
+ * Records the requested size of a large object. It is padded if the pages
+ * of its mapping hold more than it asked for.
+ */
+static void large_set_size(bud_large *lp, uint32_t rsize) {
+    lp->header.allocated = 1;
+    lp->header.order = LARGE_ORDER;
+    lp->header.rsize = rsize & 0xffff;
+    lp->header.unused2 = rsize >> 16;
+    lp->header.padded = (large_length(rsize) - sizeof(bud_large) != rsize) ? 1 : 0;
+}
+
+static void large_link(bud_heap *h, bud_large *lp) {
+    lp->heap = h;
+    lp->check = LARGE_MAGIC ^ (uintptr_t) lp;
+
+    heap_lock(h);
+    lp->prev = NULL;
+    lp->next = h->large;
+    if(h->large != NULL) {
+        h->large->prev = lp;
+    }
+    h->large = lp;
+    heap_unlock(h);
+}
+
+static void large_unlink(bud_heap *h, bud_large *lp) {
+    lp->check = 0;
+
+    heap_lock(h);
+    if(lp->prev != NULL) {
+        lp->prev->next = lp->next;
+    } else {
+        h->large = lp->next;
+    }
+    if(lp->next != NULL) {
+        lp->next->prev = lp->prev;
+    }
+    heap_unlock(h);
+}
+
+/*
+ * Maps a large object.
+ *
+ * @param h the heap
+ * @param rsize the requested payload (in bytes)
+ */
+void *large_malloc(bud_heap *h, uint32_t rsize) {
+    size_t length = large_length(rsize);
+    bud_large *lp = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(lp == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    large_set_size(lp, rsize);
+    large_link(h, lp);
+    return LARGE_TO_PAYLOAD(lp);
+}
+
+/*
+ * Resizes a large object, or moves an object between a block and a mapping
+ * of its own.
+ *
+ * @param h the heap
+ * @param ptr the payload of the object, already checked
+ * @param rsize the new requested payload (in bytes)
+ */
+void *large_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
+    uint32_t old_rsize = BLOCK_RSIZE(PAYLOAD_TO_BLOCK(ptr));
+    void *new_ptr = NULL;
+
+    // A large object that stays large is remapped, which moves its pages
+    // rather than copying them.
+    if(BLOCK_ORDER(PAYLOAD_TO_BLOCK(ptr)) == LARGE_ORDER && rsize > MAX_RSIZE(h)) {
+        bud_large *lp = PAYLOAD_TO_LARGE(ptr);
+        size_t length = large_length(rsize);
+        bud_large *new_lp = NULL;
+
+        large_unlink(h, lp);
+        if((new_lp = mremap(lp, LARGE_LENGTH(lp), length, MREMAP_MAYMOVE)) == MAP_FAILED) {
+            large_link(h, lp);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        large_set_size(new_lp, rsize);
+        large_link(h, new_lp);
+        return LARGE_TO_PAYLOAD(new_lp);
+    }
+
+    // Otherwise the object changes between a block and a mapping of its own.
+    if((new_ptr = bud_malloc(rsize)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, (old_rsize < rsize) ? old_rsize : rsize);
+    bud_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * Unmaps a large object.
+ *
+ * @param h the heap
+ * @param ptr the payload of the object, already checked
+ */
+void large_free(bud_heap *h, void *ptr) {
+    bud_large *lp = PAYLOAD_TO_LARGE(ptr);
+
+    large_unlink(h, lp);
+    munmap(lp, LARGE_LENGTH(lp));
+}
+
+/*
+ * @param h the heap
+ * @param ptr the payload of a large object, already checked
+ * @return the bytes of its mapping after its header.
+ */
+size_t large_usable_size(bud_heap *h, void *ptr) {
+    return LARGE_LENGTH(PAYLOAD_TO_LARGE(ptr)) - sizeof(bud_large);
+}
+
+/*
+ * @param h the heap
+ * @param ptr the pointer
+ * @return 1 if ptr is the payload of a live large object of the heap.
+ */
+int large_validate(bud_heap *h, void *ptr) {
+    bud_large *lp = PAYLOAD_TO_LARGE(ptr);
+    unsigned char resident = 0;
+
+    // The payload of a large object is always the same distance into a page.
+    if(((uintptr_t) ptr & (page_size() - 1)) != sizeof(bud_large)) {
+        return 0;
+    }
+
+    // A large object is never inside a region. The part of a region not yet
+    // committed is mapped but cannot be read, so it is turned away here.
+    for(int i = 0; i < h->nregions; i++) {
+        if((char *) ptr >= h->regions[i].start && (char *) ptr < h->regions[i].limit) {
+            return 0;
+        }
+    }
+
+    // The page must still be mapped before its start can be read. Freeing
+    // an object unmaps it, so a second free stops here.
+    if(mincore(lp, page_size(), &resident) < 0) {
+        return 0;
+    }
+
+    return lp->heap == h && lp->check == (LARGE_MAGIC ^ (uintptr_t) lp);
+}
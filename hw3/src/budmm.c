@@ -9,9 +9,8 @@
 #include "debug.h"
 #include "budmm.h"
 #include "budprint.h"
-
-// Macro to get the correct index for a specific order in the free list.
-#define FREE_LIST_INDEX(ord) (ord - ORDER_MIN)
+#include "budheap.h"
+#include "budext.h"
 
 /*
  * You should store the heads of your free lists in these variables.
@@ -20,58 +19,78 @@
  */
 extern bud_free_block free_list_heads[NUM_FREE_LIST];
 
+/*
+ * The heap used by the functions in budmm.h.
+ */
+bud_heap bud_default_heap = {
+    .heads = free_list_heads,
+    .nonempty = 0,
+    .order_min = ORDER_MIN,
+    .order_max = ORDER_MAX,
+    .mapped = 0,
+    .lock = &bud_default_heap.own_lock,
+    .own_lock = PTHREAD_MUTEX_INITIALIZER,
+    .slab_locks = { [0 ... SLAB_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER },
+    .mode = 0
+};
+
 /* Helper Functions */
 uint32_t get_required_padding(uint8_t order, uint32_t rsize);
-uint8_t get_required_order(uint32_t rsize);
-void insert_into_freelist(bud_free_block *block);
-void coalesce_blocks(bud_free_block *block);
-int validate_pointer(void *ptr);
-int increase_heap();
-int delete_from_freelist_b(bud_free_block *block);
-bud_free_block *delete_from_freelist(uint8_t order);
-bud_free_block *split_block(uint32_t rsize, bud_free_block *block);
-bud_free_block *process_new_block(uint32_t rsize);
+void insert_into_freelist(bud_heap *h, bud_free_block *block);
+void coalesce_blocks(bud_heap *h, bud_free_block *block);
+int increase_heap(bud_heap *h);
+int delete_from_freelist_b(bud_heap *h, bud_free_block *block);
+bud_free_block *delete_from_freelist(bud_heap *h, uint8_t order);
+bud_free_block *split_block(bud_heap *h, uint8_t order, bud_free_block *block);
+bud_free_block *process_new_block(bud_heap *h, uint8_t order);
+bud_free_block *take_larger(bud_heap *h, uint8_t order, int largest);
 bud_free_block *get_buddy(bud_free_block *block);
+int is_free_buddy(bud_heap *h, bud_free_block *buddy, uint8_t order);
+void set_aligned_header(bud_free_block *block, int shift);
+void *aligned_realloc(bud_heap *h, void *ptr, uint32_t rsize);
+void *realloc_checked(bud_heap *h, void *ptr, uint32_t rsize);
+void free_checked(bud_heap *h, void *ptr);
 
 /* Check header file for documentation. */
 void *bud_malloc(uint32_t rsize) {
+    bud_heap *h = &bud_default_heap;
+
     // Check if the requested size is invalid.
-    if( rsize == 0 || rsize > (MAX_BLOCK_SIZE - sizeof(bud_header)) ) {
+    if( rsize == 0 || (rsize > MAX_RSIZE(h) && !MAPS_LARGE(h)) ) {
         errno = EINVAL;
         return NULL;
     }
 
-    // Try to get available free block.
-    bud_free_block *block = delete_from_freelist(get_required_order(rsize));
-
-    // If there's no free block available for that specific size,
-    // process a new block which may require splitting.
-    if(block == NULL) {
-        block = process_new_block(rsize);
+    void *ptr = NULL;
 
-        // If we still can't get a free block, then set the error and return NULL.
-        if(block == NULL) {
-            errno = ENOMEM;
-            return NULL;
+    if(rsize > MAX_RSIZE(h)) {
+        // A mapped heap gives requests too big for any block a mapping of their own.
+        ptr = stats_alloc(h, large_malloc(h, rsize));
+    } else if((h->mode & BUD_SLAB) && rsize <= BUD_SLAB_MAX && h->order_min <= SLAB_ORDER) {
+        // A heap whose smallest block is bigger than a slab has no slabs.
+        ptr = stats_alloc(h, slab_malloc(h, rsize));
+    } else if(h->mode & BUD_OOB) {
+        ptr = stats_alloc(h, oob_malloc(h, rsize));
+    } else {
+        ptr = (h->mode & BUD_THREADED) ? mt_malloc(h, rsize) : heap_malloc(h, rsize);
+        if(ptr != NULL) {
+            stats_block(BLOCK_ORDER(PAYLOAD_TO_BLOCK(ptr)), rsize, 1);
         }
     }
 
-    // Set the block properties to mark the block as allocated.
-    block->header.allocated = 1;
-    block->header.rsize = rsize;
-
-    // If we need padding, set padded to 1, otherwise set it to 0.
-    block->header.padded = get_required_padding(block->header.order, rsize) != 0 ? 1 : 0;
-
-    // Advance the pointer to the payload area.
-    block = (bud_free_block *) (((char *) block) + sizeof(bud_header));
-
-    // Return the allocated block.
-    return (void *) block;
+    if(ptr != NULL) {
+        TRACE(BUD_TRACE_MALLOC, 0, rsize, ptr, NULL);
+    }
+    return ptr;
 }
 
 /* Check header file for documentation. */
 void *bud_realloc(void *ptr, uint32_t rsize) {
+    bud_heap *h = &bud_default_heap;
+    bud_object old;
+    void *new_ptr = NULL;
+    uint64_t since = 0;
+
     // If the pointer is NULL, then this function should behave like a call to
     // bud_malloc with the same rsize.
     if(ptr == NULL) {
@@ -86,60 +105,404 @@ void *bud_realloc(void *ptr, uint32_t rsize) {
     }
 
     // Check if the requested size is invalid.
-    if( rsize > (MAX_BLOCK_SIZE - sizeof(bud_header)) ) {
+    if( rsize > MAX_RSIZE(h) && !MAPS_LARGE(h) ) {
         errno = EINVAL;
         return NULL;
     }
 
     // Check if the pointer is invalid. If so, abort.
-    if(!validate_pointer(ptr)) {
+    if(!validate_pointer(h, ptr)) {
         abort();
     }
 
+    since = TRACE_CLOCK();
+
+    // Counted as a whole, rather than as the mallocs and frees it makes.
+    stats_realloc_begin(h, ptr, &old);
+    new_ptr = realloc_checked(h, ptr, rsize);
+    stats_realloc_end(h, &old, new_ptr);
+
+    if(new_ptr != NULL) {
+        TRACE(BUD_TRACE_REALLOC, since, rsize, ptr, new_ptr);
+    }
+    return new_ptr;
+}
+
+/*
+ * Resizes an object whose pointer and new size have already been checked.
+ *
+ * @param h the heap the object belongs to
+ * @param ptr the object
+ * @param rsize the new requested payload (in bytes)
+ */
+void *realloc_checked(bud_heap *h, void *ptr, uint32_t rsize) {
+    // Objects of slabs have no header, so they are told apart by where they lie.
+    if(slab_owns(h, ptr)) {
+        return slab_realloc(h, ptr, rsize);
+    }
+
+    // Nor do blocks whose order is kept out of band.
+    if(oob_order(h, ptr)) {
+        return oob_realloc(h, ptr, rsize);
+    }
+
+    // Blocks from bud_memalign() stay aligned, so never become large objects.
+    if(BLOCK_ALIGN(PAYLOAD_TO_BLOCK(ptr)) != 0) {
+        return aligned_realloc(h, ptr, rsize);
+    }
+
+    // Large objects, and blocks growing into one, are handled apart.
+    if(rsize > MAX_RSIZE(h) || BLOCK_ORDER(PAYLOAD_TO_BLOCK(ptr)) == LARGE_ORDER) {
+        return large_realloc(h, ptr, rsize);
+    }
+
+    if(h->mode & BUD_THREADED) {
+        return mt_realloc(h, ptr, rsize);
+    }
+
+    return heap_realloc(h, ptr, rsize);
+}
+
+/* Check header file for documentation. */
+void bud_free(void *ptr) {
+    bud_heap *h = &bud_default_heap;
+    uint64_t since = 0;
+
+    // If the pointer is NULL or invalid, abort.
+    if(ptr == NULL || !validate_pointer(h, ptr)) {
+        abort();
+    }
+
+    // Recorded once freed, as a realloc is, but with the time before
+    // another thread can be handed the block.
+    since = TRACE_CLOCK();
+    free_checked(h, ptr);
+    TRACE(BUD_TRACE_FREE, since, 0, ptr, NULL);
+}
+
+/*
+ * Frees an object whose pointer has already been checked.
+ *
+ * @param h the heap the object belongs to
+ * @param ptr the object
+ */
+void free_checked(bud_heap *h, void *ptr) {
+    bud_free_block *block = NULL;
+
+    if(slab_owns(h, ptr)) {
+        stats_free(h, ptr);
+        slab_free(h, ptr);
+        return;
+    }
+
+    if(oob_order(h, ptr)) {
+        stats_free(h, ptr);
+        oob_free(h, ptr);
+        return;
+    }
+
+    if(BLOCK_ORDER(PAYLOAD_TO_BLOCK(ptr)) == LARGE_ORDER) {
+        stats_free(h, ptr);
+        large_free(h, ptr);
+        return;
+    }
+
+    // From here on the block is freed through its usual payload. The
+    // requested size of an aligned block includes the room in front of it.
+    oob_mark_aligned(h, ptr, 0);
+    block = payload_block(ptr);
+    stats_block(BLOCK_ORDER(block), BLOCK_RSIZE(block) + sizeof(bud_header) - ((char *) ptr - (char *) block), -1);
+    ptr = BLOCK_TO_PAYLOAD(block);
+
+    if(h->mode & BUD_THREADED) {
+        mt_free(h, ptr);
+    } else {
+        heap_free(h, ptr);
+    }
+}
+
+/* Check budext.h for documentation. */
+size_t bud_usable_size(void *ptr) {
+    bud_heap *h = &bud_default_heap;
+
+    if(ptr == NULL) {
+        return 0;
+    }
+
+    if(!validate_pointer(h, ptr)) {
+        abort();
+    }
+
+    if(slab_owns(h, ptr)) {
+        return slab_usable_size(h, ptr);
+    }
+
+    if(oob_order(h, ptr)) {
+        return BLOCK_SIZE(oob_order(h, ptr));
+    }
+
+    if(BLOCK_ORDER(PAYLOAD_TO_BLOCK(ptr)) == LARGE_ORDER) {
+        return large_usable_size(h, ptr);
+    }
+
+    bud_free_block *block = payload_block(ptr);
+    return BLOCK_SIZE(BLOCK_ORDER(block)) - ((char *) ptr - (char *) block);
+}
+
+/* Check budext.h for documentation. */
+void *bud_memalign(size_t alignment, uint32_t size) {
+    bud_heap *h = &bud_default_heap;
+    bud_free_block *block = NULL;
+    void *payload = NULL;
+    uint64_t rsize = 0;
+
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Every payload is aligned to 8 already.
+    if(alignment <= sizeof(bud_header)) {
+        return bud_malloc(size);
+    }
+
+    // And a block with no header to its own size, so a block as large as
+    // the alignment will do.
+    if(h->mode & BUD_OOB) {
+        rsize = (size > alignment) ? size : alignment;
+        if(size == 0 || rsize > MAX_RSIZE(h)) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        payload = stats_alloc(h, oob_malloc(h, rsize));
+        if(payload != NULL) {
+            TRACE(BUD_TRACE_MALLOC, 0, size, payload, NULL);
+        }
+        return payload;
+    }
+
+    // The block holds the alignment bytes in front of the payload, so it is
+    // at least as large as the alignment and aligned to it.
+    rsize = (uint64_t) size + alignment - sizeof(bud_header);
+    if(size == 0 || rsize > MAX_RSIZE(h)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Not bud_malloc(), which may put a small request in a slab.
+    payload = (h->mode & BUD_THREADED) ? mt_malloc(h, rsize) : heap_malloc(h, rsize);
+    if(payload == NULL) {
+        return NULL;
+    }
+
+    block = PAYLOAD_TO_BLOCK(payload);
+    set_aligned_header(block, __builtin_ctzll(alignment));
+    stats_block(BLOCK_ORDER(block), size, 1);
+
+    payload = (char *) block + alignment;
+    oob_mark_aligned(h, payload, 1);
+    TRACE(BUD_TRACE_MALLOC, 0, size, payload, NULL);
+    return payload;
+}
+
+/* Check budext.h for documentation. */
+void *bud_aligned_alloc(size_t alignment, uint32_t size) {
+    if(alignment == 0 || size % alignment != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return bud_memalign(alignment, size);
+}
+
+/* Check budext.h for documentation. */
+int bud_mem_mode(int mode) {
+    bud_heap *h = &bud_default_heap;
+    int old = h->mode;
+
+    // A shared heap is always locked, and its quick lists and slab lists
+    // would be those of this process alone.
+    if(h->shared) {
+        mode = (mode | BUD_THREADED) & ~(BUD_QUICK | BUD_SLAB);
+    }
+
+    // Only a heap of its own address space is trimmed.
+    if(h->file != NULL) {
+        mode &= ~BUD_TRIM;
+    }
+
+    // Leaving threaded mode, so the magazines of this thread go back to the heap.
+    if((old & BUD_THREADED) && !(mode & BUD_THREADED)) {
+        mt_flush(h);
+    }
+
+    // Leaving quick mode, so the quick lists go back to the free lists.
+    if((old & BUD_QUICK) && !(mode & BUD_QUICK)) {
+        heap_flush_quick(h);
+    }
+
+    // Leaving slab mode, so the empty slabs kept for reuse go back too.
+    if((old & BUD_SLAB) && !(mode & BUD_SLAB)) {
+        slab_flush(h);
+    }
+
+    h->mode = mode;
+    return old;
+}
+
+/*
+ * Allocates a block for a request that has already been checked.
+ *
+ * @param h the heap to allocate from
+ * @param rsize the requested payload (in bytes)
+ */
+void *heap_malloc(bud_heap *h, uint32_t rsize) {
+    bud_free_block *block = heap_take(h, get_required_order(h, rsize));
+
+    // If we can't get a free block, then set the error and return NULL.
+    if(block == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Set the block properties to mark the block as allocated.
+    set_requested_size(block, rsize);
+
+    // Return the payload area.
+    return BLOCK_TO_PAYLOAD(block);
+}
+
+/*
+ * Gets a free block of the given order, marked allocated.
+ *
+ * @param h the heap to take the block from
+ * @param order the order of the block
+ */
+bud_free_block *heap_take(bud_heap *h, uint8_t order) {
+    bud_free_block *block = h->quick[FREE_LIST_INDEX(h, order)];
+
+    // In quick mode, the block freed last of this order is reused as it is.
+    if(block != NULL) {
+        h->quick[FREE_LIST_INDEX(h, order)] = block->next;
+        h->quick_count[FREE_LIST_INDEX(h, order)]--;
+        set_block_quick(block, 0);
+        block->next = NULL;
+        return block;
+    }
+
+    // Try to get available free block.
+    block = delete_from_freelist(h, order);
+
+    // If there's no free block available for that specific size,
+    // process a new block which may require splitting.
+    if(block == NULL) {
+        block = process_new_block(h, order);
+
+        if(block == NULL) {
+            return NULL;
+        }
+    }
+
+    block->header.allocated = 1;
+    return block;
+}
+
+/*
+ * Gets a free block of the given order, marked allocated, split off the
+ * front of the largest free block if that is larger. Its higher buddies
+ * are then free, and it can grow in place for several orders.
+ *
+ * @param h the heap to take the block from
+ * @param order the order of the block
+ */
+bud_free_block *heap_take_lower(bud_heap *h, uint8_t order) {
+    bud_free_block *block = NULL;
+
+    if(order + 1 >= h->order_max || (block = take_larger(h, order + 1, 1)) == NULL) {
+        return heap_take(h, order);
+    }
+
+    block = split_block(h, order, block);
+    block->header.allocated = 1;
+    return block;
+}
+
+/*
+ * Sets the requested size of an allocated block, and whether it is padded.
+ *
+ * @param block the allocated block
+ * @param rsize the requested payload (in bytes)
+ */
+void set_requested_size(bud_free_block *block, uint32_t rsize) {
+    block->header.allocated = 1;
+    set_block_align(block, 0);
+    block->header.rsize = rsize & 0xffff;
+    block->header.unused2 = rsize >> 16;
+
+    // If we need padding, set padded to 1, otherwise set it to 0.
+    block->header.padded = get_required_padding(BLOCK_ORDER(block), rsize) != 0 ? 1 : 0;
+}
+
+/*
+ * Resizes an allocated block for a request that has already been checked.
+ *
+ * @param h the heap the block belongs to
+ * @param ptr the payload of the block
+ * @param rsize the new requested payload (in bytes)
+ */
+void *heap_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
     // Convert from payload to header pointer.
-    bud_free_block *block = (bud_free_block *) (((char *) ptr) - sizeof(bud_header));
-    bud_header header = block->header;
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+    uint8_t block_order = BLOCK_ORDER(block);
 
     // Get the appropriate order for the given block size.
-    uint8_t order = get_required_order(rsize);
+    uint8_t order = get_required_order(h, rsize);
 
     // If the pointer already has a block size that can accomodate the requested size,
     // then we just have to return the ptr because no other work is required.
     // Note: This includes the case where the requested size is less than the
     //       requested size of the original block but the difference is not
     //       by a factor of 2.
-    if(header.order == order) {
+    if(block_order == order) {
         // Update the rsize.
-        block->header.rsize = rsize;
+        set_requested_size(block, rsize);
 
-        // If we need padding, set padded to 1, otherwise set it to 0.
-        block->header.padded = get_required_padding(block->header.order, rsize) != 0 ? 1 : 0;
+        return ptr;
+    }
+
+    // If the requested size is larger than what we already have, and the
+    // buddies above the block are free, the block may grow into them.
+    else if(block_order < order && (h->mode & BUD_GROW_IN_PLACE) && heap_grow(h, block, order)) {
+        set_requested_size(block, rsize);
 
         return ptr;
     }
 
-    // If the requested size is larger than what we already have,
-    // then we have to bud_malloc the larger size, move the information from
+    // Otherwise we have to bud_malloc the larger size, move the information from
     // the old block to the new block, and free the old block.
-    else if(header.order < order) {
-        void *new_block = bud_malloc(rsize);
+    else if(block_order < order) {
+        // When growing in place, prefer the lower half of a larger free block,
+        // so that the new block can grow in place the next time.
+        bud_free_block *new_block = (h->mode & BUD_GROW_IN_PLACE) ?
+                                    heap_take_lower(h, order) : heap_take(h, order);
 
         // If we can't allocate more space, return NULL.
         if(new_block == NULL) {
+            errno = ENOMEM;
             return NULL;
         }
 
-        // Save the rsize before we move block pointer to payload area.
-        uint32_t rsize = block->header.rsize;
+        set_requested_size(new_block, rsize);
 
         // Copy the information from the old block to the new block.
-        memcpy(new_block, ptr, rsize);
+        memcpy(BLOCK_TO_PAYLOAD(new_block), ptr, BLOCK_RSIZE(block));
 
         // Free the old block.
-        bud_free(ptr);
+        heap_free(h, ptr);
 
         // Return the new bigger block with the data copied over.
-        return new_block;
+        return BLOCK_TO_PAYLOAD(new_block);
     }
 
     // If the requested size if smaller whan what we already have
@@ -149,52 +512,193 @@ void *bud_realloc(void *ptr, uint32_t rsize) {
     else {
         // Split the block.
         // We can ignore the return value because we already have a reference.
-        split_block(rsize, block);
+        split_block(h, order, block);
 
         // Set the block properties.
-        block->header.allocated = 1;
-        block->header.rsize = rsize;
-
-        // If we need padding, set padded to 1, otherwise set it to 0.
-        block->header.padded = get_required_padding(block->header.order, rsize) != 0 ? 1 : 0;
+        set_requested_size(block, rsize);
 
         // Return the reallocated block.
         return ptr;
     }
 }
 
-/* Check header file for documentation. */
-void bud_free(void *ptr) {
-    // If the pointer is NULL or invalid, abort.
-    if(ptr == NULL || !validate_pointer(ptr)) {
-        abort();
+/*
+ * Grows an allocated block in place to the given order, by absorbing its
+ * buddies. This works only if the block is the lower buddy at every order
+ * it passes through, and each higher buddy is free and whole.
+ *
+ * @param h the heap the block belongs to
+ * @param block the block being grown
+ * @param order the order wanted
+ * @return 1 if the block was grown, 0 if it was left alone.
+ */
+int heap_grow(bud_heap *h, bud_free_block *block, uint8_t order) {
+    // Check every buddy before touching any of them.
+    for(uint8_t k = BLOCK_ORDER(block); k < order; k++) {
+        size_t block_size = BLOCK_SIZE(k);
+
+        // A block that is the higher buddy at order k would have to grow downwards.
+        if(((uintptr_t) block) & block_size) {
+            return 0;
+        }
+
+        if(!is_free_buddy(h, (bud_free_block *) (((char *) block) + block_size), k)) {
+            return 0;
+        }
     }
 
-    // Convert from payload to header pointer.
-    bud_free_block *block = (bud_free_block *) (((char *) ptr) - sizeof(bud_header));
+    for(uint8_t k = BLOCK_ORDER(block); k < order; k++) {
+        delete_from_freelist_b(h, (bud_free_block *) (((char *) block) + BLOCK_SIZE(k)));
+        STAT_ADD(stats_mine(), coalesces[k], 1);
+    }
+
+    set_block_order(block, order);
+    return 1;
+}
+
+/*
+ * Marks an allocated block as coming from bud_memalign(), and copies its
+ * header to right in front of its aligned payload.
+ *
+ * @param block the allocated block
+ * @param shift log2 of the alignment
+ */
+void set_aligned_header(bud_free_block *block, int shift) {
+    set_block_align(block, shift);
+    PAYLOAD_TO_BLOCK(((char *) block) + BLOCK_SIZE(shift))->header = block->header;
+}
+
+/*
+ * The block a checked payload belongs to.
+ *
+ * @param ptr the payload
+ */
+bud_free_block *payload_block(void *ptr) {
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+    int shift = BLOCK_ALIGN(block);
+
+    return shift ? (bud_free_block *) (((char *) ptr) - BLOCK_SIZE(shift)) : block;
+}
+
+/*
+ * Resizes a block from bud_memalign(), keeping its alignment. It stays
+ * where it is if it needs a block of the same order, and otherwise moves.
+ * Only the payload after the aligned pointer is copied. A size too big
+ * for the largest block fails as it does for bud_memalign(), since a
+ * large object cannot be aligned.
+ *
+ * @param h the heap the block belongs to
+ * @param ptr the aligned payload of the block, already checked
+ * @param rsize the new requested payload (in bytes)
+ */
+void *aligned_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
+    bud_free_block *block = payload_block(ptr);
+    int shift = BLOCK_ALIGN(block);
+    size_t alignment = BLOCK_SIZE(shift);
+    uint32_t old_rsize = BLOCK_RSIZE(block) - (alignment - sizeof(bud_header));
+    uint64_t block_rsize = (uint64_t) rsize + alignment - sizeof(bud_header);
+    void *new_ptr = NULL;
+
+    if(block_rsize <= MAX_RSIZE(h) && get_required_order(h, block_rsize) == BLOCK_ORDER(block)) {
+        set_requested_size(block, block_rsize);
+        set_aligned_header(block, shift);
+        return ptr;
+    }
+
+    if((new_ptr = bud_memalign(alignment, rsize)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, (old_rsize < rsize) ? old_rsize : rsize);
+    bud_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * Frees an allocated block whose pointer has already been checked.
+ *
+ * @param h the heap the block belongs to
+ * @param ptr the payload of the block
+ */
+void heap_free(bud_heap *h, void *ptr) {
+    heap_give(h, PAYLOAD_TO_BLOCK(ptr));
+}
+
+/*
+ * Returns a block to the free lists.
+ *
+ * @param h the heap the block belongs to
+ * @param block the block being freed
+ */
+void heap_give(bud_heap *h, bud_free_block *block) {
+    int index = FREE_LIST_INDEX(h, BLOCK_ORDER(block));
+
+    // In quick mode, the block is held back without coalescing, unless
+    // its quick list is full. It stays marked allocated meanwhile.
+    if((h->mode & BUD_QUICK) && h->quick_count[index] < QUICK_CAPACITY) {
+        set_block_quick(block, 1);
+        block->next = h->quick[index];
+        h->quick[index] = block;
+        h->quick_count[index]++;
+        return;
+    }
 
     // Change block allocation status to 0 to mark it as free.
     block->header.allocated = 0;
 
-    // We do not coalesce if the order of the block is ORDER_MAX - 1
-    // because we do not want it to coalesce into a block of ORDER MAX.
-    if(block->header.order == (ORDER_MAX - 1)) {
-        insert_into_freelist(block);
+    // We do not coalesce if the block is of the largest order
+    // because we do not want it to coalesce into a block of order_max.
+    if(BLOCK_ORDER(block) == (h->order_max - 1)) {
+        insert_into_freelist(h, block);
+        map_freed(h, block);
     } else {
         // Attempt immediate coalescing.
         // This will try to coalesce the blocks. If we cannot coalesce,
         // we will just add the block to the free list as intended.
-        coalesce_blocks(block);
+        coalesce_blocks(h, block);
+    }
+}
+
+/*
+ * Returns the blocks in the quick lists to the free lists, coalescing them.
+ *
+ * @param h the heap
+ * @return the number of blocks returned.
+ */
+int heap_flush_quick(bud_heap *h) {
+    int flushed = 0;
+
+    for(int i = 0; i < BUD_MAX_ORDERS; i++) {
+        while(h->quick[i] != NULL) {
+            bud_free_block *block = h->quick[i];
+
+            h->quick[i] = block->next;
+            set_block_quick(block, 0);
+            block->header.allocated = 0;
+
+            // Straight to coalescing, so the block does not go back on the quick list.
+            if(BLOCK_ORDER(block) == h->order_max - 1) {
+                insert_into_freelist(h, block);
+                map_freed(h, block);
+            } else {
+                coalesce_blocks(h, block);
+            }
+            flushed++;
+        }
+        h->quick_count[i] = 0;
     }
+
+    return flushed;
 }
 
 /*
  * Repeatedly attempts to combine (coalesce) adjacent free blocks to
  * the given block.
  *
+ * @param h the heap the block belongs to
  * @param block the block whose "buddies" are being coalesced if they are valid.
  */
-void coalesce_blocks(bud_free_block *block) {
+void coalesce_blocks(bud_heap *h, bud_free_block *block) {
     bud_free_block *buddy = NULL;
     bud_free_block *lower = block;
 
@@ -202,28 +706,27 @@ void coalesce_blocks(bud_free_block *block) {
         // Get the buddy of the block that will be coalesced.
         buddy = get_buddy(lower);
 
-        // Check if lower has an order size of ORDER_MAX - 1.
-        // Check if the buddy has a different order.
-        // Check if the buddy is not free.
-        // Check if the buddy is not a block that's already being coalesced.
-        //      Note: Not sure if this check is necessary.
+        // Check if lower is of the largest order.
+        // Check if the buddy is not a whole free block in its free list.
         if(
             buddy == NULL ||
-            lower->header.order == ORDER_MAX - 1 ||
-            buddy->header.order != lower->header.order ||
-            buddy->header.allocated == 1 ||
-            (buddy->next == NULL && buddy->prev == NULL)) {
-                insert_into_freelist(lower);
+            BLOCK_ORDER(lower) == h->order_max - 1 ||
+            !is_free_buddy(h, buddy, BLOCK_ORDER(lower))) {
+                insert_into_freelist(h, lower);
+                if(BLOCK_ORDER(lower) == h->order_max - 1) {
+                    map_freed(h, lower);
+                }
                 return;
         }
 
         // Remove the buddy from the free list so it can be coalesced.
-        if(delete_from_freelist_b(buddy)) {
+        if(delete_from_freelist_b(h, buddy)) {
             // Keeps track of the lower addressed block.
             lower = (lower < buddy) ? lower : buddy;
 
             // Increment the order of the block that is lower addressed.
-            (lower->header.order)++;
+            STAT_ADD(stats_mine(), coalesces[BLOCK_ORDER(lower)], 1);
+            set_block_order(lower, BLOCK_ORDER(lower) + 1);
         }
     }
 }
@@ -234,35 +737,55 @@ void coalesce_blocks(bud_free_block *block) {
  * @param block the block whose buddy is being looked for.
  */
 bud_free_block *get_buddy(bud_free_block *block) {
-    return (bud_free_block *) ( ((uintptr_t) block) ^ (ORDER_TO_BLOCK_SIZE(block->header.order)) );
+    return (bud_free_block *) ( ((uintptr_t) block) ^ (BLOCK_SIZE(BLOCK_ORDER(block))) );
 }
 
 /*
- * Splits a block until the lower buddy of a block fits the given rsize appropriately.
+ * Checks whether a buddy is a whole free block of the given order, sitting
+ * in its free list. A live block of BUD_OOB has no header, only whatever
+ * was written there, so it is looked up first.
  *
- * @param rsize the requested payload (in bytes)
+ * @param h the heap the buddy belongs to
+ * @param buddy the buddy
+ * @param order the order of the block it is the buddy of
+ */
+int is_free_buddy(bud_heap *h, bud_free_block *buddy, uint8_t order) {
+    return !(h->oob_used && oob_order(h, buddy)) &&
+           BLOCK_ORDER(buddy) == order &&
+           buddy->header.allocated == 0 &&
+           !(buddy->next == NULL && buddy->prev == NULL);
+}
+
+/*
+ * Splits a block until the lower buddy of a block is of the given order.
+ *
+ * @param h the heap the block belongs to
+ * @param order the order wanted
  * @param block the block being split
  */
-bud_free_block *split_block(uint32_t rsize, bud_free_block *block) {
+bud_free_block *split_block(bud_heap *h, uint8_t order, bud_free_block *block) {
     bud_free_block *higher = NULL;
 
     // If we don't have the appropriate fit yet, keep on splitting the block.
-    while(get_required_order(rsize) != block->header.order) {
+    while(order != BLOCK_ORDER(block)) {
         // Get the block size (in bytes) of the block.
-        uint32_t block_size = ORDER_TO_BLOCK_SIZE(block->header.order);
+        size_t block_size = BLOCK_SIZE(BLOCK_ORDER(block));
+        STAT_ADD(stats_mine(), splits[BLOCK_ORDER(block)], 1);
 
         // Split the block into half.
         higher = (bud_free_block *) ( ((char *) block) + (block_size >> 1) );
 
-        // Edit the header for the higher addressed block.
+        // Edit the header for the higher addressed block. It starts out as
+        // whatever was last written there, so clear it all first.
+        higher->header = (bud_header) { 0 };
         higher->header.allocated = 0; // Set its allocation status to free.
-        higher->header.order = block->header.order - 1; // Decrease the order by 1.
+        set_block_order(higher, BLOCK_ORDER(block) - 1); // Decrease the order by 1.
 
         // Decrease original block order by 1.
-        (block->header.order)--;
+        set_block_order(block, BLOCK_ORDER(block) - 1);
 
         // Add the higher addressed block to the appropriate free list.
-        insert_into_freelist(higher);
+        insert_into_freelist(h, higher);
     }
 
     // Return a pointer to the block with its appropriate size.
@@ -270,83 +793,122 @@ bud_free_block *split_block(uint32_t rsize, bud_free_block *block) {
 }
 
 /*
- * Returns a new block for the given rsize if one is not available in the free list.
- * If the required size is not of ORDER_MAX, then splitting must occur.
+ * Returns a new block of the given order if one is not available in the free list.
+ * If the required order is not the largest, then splitting must occur.
  *
- * @param rsize the requested payload (in bytes)
+ * @param h the heap to take the block from
+ * @param order the order of the block wanted
  */
-bud_free_block *process_new_block(uint32_t rsize) {
+bud_free_block *process_new_block(bud_heap *h, uint8_t order) {
     bud_free_block *new_block = NULL;
 
-    for(uint8_t order = get_required_order(rsize); order < ORDER_MAX; order++) {
-        // Get the sentinel node for the given order in the free list.
-        bud_free_block *sentinel = &free_list_heads[FREE_LIST_INDEX(order)];
-
-         // If the list is non-empty for that block size,
-         // set the new block equal to available block for that size.
-        if(sentinel->next != sentinel && sentinel->prev != sentinel) {
-            new_block = sentinel->next;
-            break;
-        }
-    }
-
     // If there are no more free blocks bigger than the requested size,
-    // increase heap size and try again.
-    if(new_block == NULL) {
-        if(!increase_heap()) {
+    // try again with the blocks held in quick lists, if any, and
+    // otherwise increase heap size and try again.
+    while((new_block = take_larger(h, order, 0)) == NULL) {
+        if(heap_flush_quick(h) == 0 && !increase_heap(h)) {
             return NULL;
         }
+    }
 
-        return process_new_block(rsize);
-    } else {
-        if(new_block->header.order == 0) {
-            return NULL;
-        }
-        // Delete the block from the freelist.
-        // We can ignore the return value because we have a reference to new_block.
-        delete_from_freelist(new_block->header.order);
+    // Split the block until we get a block with the correct size.
+    return split_block(h, order, new_block);
+}
 
-        // If the block is of order max, then we just return it because no splitting is required.
-        if(new_block->header.order == (ORDER_MAX - 1) && get_required_order(rsize) == (ORDER_MAX - 1)) {
-            return new_block;
+/*
+ * Deletes and returns the first free block of the smallest (or largest)
+ * order at least as large as the given one, or NULL if there is none.
+ *
+ * @param h the heap to take the block from
+ * @param order the smallest order wanted
+ * @param largest whether to take a block of the largest order instead
+ */
+bud_free_block *take_larger(bud_heap *h, uint8_t order, int largest) {
+    bud_free_block *block = NULL;
+    uint32_t candidates = 0;
+
+    // Orders at least as large as the one requested that have free blocks.
+    while(block == NULL && (candidates = h->nonempty & ~(ORDER_BIT(h, order) - 1)) != 0) {
+        // Take the first block of the smallest such order. Its list may
+        // have been emptied by bud_mem_init(), so drop the bit if so.
+        uint8_t larger = h->order_min + (largest ? 31 - __builtin_clz(candidates) : __builtin_ctz(candidates));
+        if((block = delete_from_freelist(h, larger)) == NULL) {
+            h->nonempty &= ~ORDER_BIT(h, larger);
         }
-
-        // Otherwise, split the block until we get a block with the correct size.
-        return split_block(rsize, new_block);
     }
+
+    return block;
 }
 
 /*
  * Validates a pointer according to the commented criteria below.
  *
+ * @param h the heap the pointer should belong to
  * @param ptr the pointer being validated
  */
-int validate_pointer(void *ptr) {
+int validate_pointer(bud_heap *h, void *ptr) {
     // Check if address if is not between heap_start and heap_end.
-    if(ptr < bud_heap_start() || ptr >= bud_heap_end()) {
+    // In a mapped heap, it may still be a large object.
+    if(h->mapped) {
+        if(!map_contains(h, ptr)) {
+            return large_validate(h, ptr);
+        }
+    } else if(ptr < bud_heap_start() || ptr >= bud_heap_end()) {
+        return 0;
+    }
+
+    // An object of a slab has no header to check.
+    if(slab_owns(h, ptr)) {
+        return slab_validate(h, ptr);
+    }
+
+    // Nor does a block whose order is kept out of band. One freed already
+    // is turned away here, rather than checked against the end of the
+    // block before it, and a pointer just inside one would be checked
+    // against what was written there.
+    if(oob_order(h, ptr)) {
+        return 1;
+    }
+    if(oob_stray(h, ptr) || (h->oob_used && oob_order(h, PAYLOAD_TO_BLOCK(ptr)))) {
         return 0;
     }
 
     // Convert from payload area to header area.
-    bud_free_block *block = (bud_free_block *) (((char *) ptr) - sizeof(bud_header));
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+
+    // A payload from bud_memalign() has a copy of the header of its block in
+    // front of it. The block must be in the heap and agree with the copy.
+    if(BLOCK_ALIGN(block) != 0) {
+        bud_free_block *start = payload_block(ptr);
+
+        if(BLOCK_ALIGN(block) >= h->order_max ||
+           (h->mapped ? !map_contains(h, start) : (void *) start < bud_heap_start()) ||
+           memcmp(&start->header, &block->header, sizeof(bud_header)) != 0) {
+            return 0;
+        }
+        block = start;
+    }
+
     bud_header header = block->header;
+    uint8_t order = BLOCK_ORDER(block);
+    uint32_t rsize = BLOCK_RSIZE(block);
 
     // Check if address is not aligned to a multiple of 8.
     if( ((uintptr_t) block) % 8 != 0) {
         return 0;
     }
 
-    // Check if the value in the order field is not between [ORDER_MIN, ORDER_MAX).
-    if(header.order < ORDER_MIN || header.order >= ORDER_MAX) {
+    // Check if the value in the order field is not between [order_min, order_max).
+    if(order < h->order_min || order >= h->order_max) {
         return 0;
     }
 
-    // Check if the allocated bit is 0.
-    if(header.allocated == 0) {
+    // Check if the allocated bit is 0, or the block is in a quick list.
+    if(header.allocated == 0 || BLOCK_QUICK(block)) {
         return 0;
     }
 
-    uint32_t required_padding = get_required_padding(header.order, header.rsize);
+    uint32_t required_padding = get_required_padding(order, rsize);
 
     // Check if padded bit is 0 when it's not supposed to.
     if(header.padded == 0 && required_padding != 0) {
@@ -360,7 +922,7 @@ int validate_pointer(void *ptr) {
 
     // Check if requested size and order don't make sense.
     // Example: rsize = 100 but order = 6 (supposed to be 7)
-    if(header.order != get_required_order(header.rsize)) {
+    if(order != get_required_order(h, rsize)) {
         return 0;
     }
 
@@ -375,63 +937,113 @@ int validate_pointer(void *ptr) {
  * @param rsize the requested payload (in bytes)
  */
 uint32_t get_required_padding(uint8_t order, uint32_t rsize) {
-    return (uint32_t) ((ORDER_TO_BLOCK_SIZE(order) - sizeof(bud_header)) - rsize);
+    return (uint32_t) ((BLOCK_SIZE(order) - sizeof(bud_header)) - rsize);
 }
 
 /*
  * Calculates the appropriate order for a given rsize.
  *
+ * @param h the heap the block would come from
  * @param rsize the requested payload (in bytes)
  */
-uint8_t get_required_order(uint32_t rsize) {
-    uint8_t order = 0;
-    for(order = ORDER_MIN; ORDER_TO_BLOCK_SIZE(order) < (rsize + sizeof(bud_header)); order++);
+uint8_t get_required_order(bud_heap *h, uint32_t rsize) {
+    uint64_t size = (uint64_t) rsize + sizeof(bud_header);
+
+    if(size <= BLOCK_SIZE(h->order_min)) {
+        return h->order_min;
+    }
+
+    // The smallest order whose block holds size bytes is the number of
+    // bits needed to write size - 1.
+    return 64 - __builtin_clzll(size - 1);
+}
+
+/*
+ * Resets the free lists, quick lists and slab lists of a heap to empty.
+ *
+ * @param h the heap
+ * @param heads the sentinels of its free lists, one per order
+ * @param order_min the order of its smallest block
+ * @param order_max the order of its largest block + 1
+ */
+void heap_reset(bud_heap *h, bud_free_block *heads, uint8_t order_min, uint8_t order_max) {
+    for(int i = 0; i < order_max - order_min; i++) {
+        heads[i].next = heads[i].prev = &heads[i];
+    }
 
-    return order;
+    heap_attach(h, heads, order_min, order_max);
+    h->nonempty = 0;
+}
+
+/*
+ * Takes over free lists that may already hold blocks, emptying the quick
+ * lists and slab lists of a heap.
+ *
+ * @param h the heap
+ * @param heads the sentinels of its free lists, one per order
+ * @param order_min the order of its smallest block
+ * @param order_max the order of its largest block + 1
+ */
+void heap_attach(bud_heap *h, bud_free_block *heads, uint8_t order_min, uint8_t order_max) {
+    h->heads = heads;
+    h->order_min = order_min;
+    h->order_max = order_max;
+
+    // Any of the lists may hold blocks, and is looked at to find out.
+    h->nonempty = BLOCK_SIZE(order_max - order_min) - 1;
+
+    for(int i = 0; i < BUD_MAX_ORDERS; i++) {
+        h->quick[i] = NULL;
+        h->quick_count[i] = 0;
+    }
+
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        h->slabs[i] = NULL;
+    }
+
+    h->oob_used = 0;
+    h->generation++;
 }
 
 /*
  * Deletes the given block and returns 1 if the block was actually in
  * the free list and was removed, 0 otherwise.
  *
+ * @param h the heap the block belongs to
  * @param block the block that is being deleted from the free list.
  */
-int delete_from_freelist_b(bud_free_block *block) {
-    // Get the sentinel node from the free list for the given block's order.
-    bud_free_block *sentinel = &free_list_heads[FREE_LIST_INDEX(block->header.order)];
-
-    // If the list is empty, return 0.
-    if(sentinel->next == sentinel && sentinel->prev == sentinel) {
+int delete_from_freelist_b(bud_heap *h, bud_free_block *block) {
+    // A block that is not in a free list has no neighbours.
+    if(block->next == NULL || block->prev == NULL) {
         return 0;
     }
 
-    // Loop through the list until the block we find matches the given block.
-    // If we find it, delete it and return 1, otherwise return 0.
-    for(bud_free_block *current = sentinel; current->next != sentinel; current = current->next) {
-        if(current->next != block) {
-            continue;
-        }
+    // Unlink it from its neighbours.
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
 
-        current->next = block->next;
-        block->next->prev = current;
+    block->next = NULL;
+    block->prev = NULL;
+    set_block_decommitted(block, 0);
 
-        block->next = NULL;
-        block->prev = NULL;
-
-        return 1;
+    // If that emptied the list, clear its bit.
+    bud_free_block *sentinel = &h->heads[FREE_LIST_INDEX(h, BLOCK_ORDER(block))];
+    if(sentinel->next == sentinel) {
+        h->nonempty &= ~ORDER_BIT(h, BLOCK_ORDER(block));
     }
 
-    return 0;
+    return 1;
 }
 
 /*
  * Delete and retrieve the first free block in the free list for the given order.
  *
+ * @param h the heap to take the block from
  * @param order the order of the block being retrieved (and deleted) from the free list.
  */
-bud_free_block *delete_from_freelist(uint8_t order) {
+bud_free_block *delete_from_freelist(bud_heap *h, uint8_t order) {
     // Get the sentinel node from the free list for the given order.
-    bud_free_block *sentinel = &free_list_heads[FREE_LIST_INDEX(order)];
+    bud_free_block *sentinel = &h->heads[FREE_LIST_INDEX(h, order)];
 
     // Get the first non-sentinel node in that free list.
     bud_free_block *deleted = sentinel->next;
@@ -447,6 +1059,12 @@ bud_free_block *delete_from_freelist(uint8_t order) {
 
     deleted->next = NULL;
     deleted->prev = NULL;
+    set_block_decommitted(deleted, 0);
+
+    // If that emptied the list, clear its bit.
+    if(sentinel->next == sentinel) {
+        h->nonempty &= ~ORDER_BIT(h, order);
+    }
 
     return deleted;
 }
@@ -454,11 +1072,12 @@ bud_free_block *delete_from_freelist(uint8_t order) {
 /*
  * Inserts the given block into its appropriate free list according to its order.
  *
+ * @param h the heap the block belongs to
  * @param the block being inserted into the free list.
  */
-void insert_into_freelist(bud_free_block *block) {
+void insert_into_freelist(bud_heap *h, bud_free_block *block) {
     // Get the sentinel node from the free list for the given block's order.
-    bud_free_block *sentinel = &free_list_heads[FREE_LIST_INDEX(block->header.order)];
+    bud_free_block *sentinel = &h->heads[FREE_LIST_INDEX(h, BLOCK_ORDER(block))];
 
     // If the list is empty.
     if(sentinel->next == sentinel && sentinel->prev == sentinel) {
@@ -474,32 +1093,47 @@ void insert_into_freelist(bud_free_block *block) {
         sentinel->next = block;
         block->prev = sentinel;
     }
+
+    h->nonempty |= ORDER_BIT(h, BLOCK_ORDER(block));
 }
 
 /*
- * Increases the size of the heap by MAX_BLOCK_SIZE.
- * Note: This function is a combination of bud_sbrk() + actually adding the
- *       the block of size ORDER_MAX into its free list.
+ * Increases the size of the heap by a block of the largest order.
+ * Note: This function is a combination of bud_sbrk() (or map_grow()) + actually
+ *       adding the the block of the largest order into its free list.
  *
+ * @param h the heap being increased
  * @return 1 if the heap could successfully be increased, 0 otherwise.
  */
-int increase_heap() {
-    void *current = bud_sbrk();
+int increase_heap(bud_heap *h) {
+    void *current = h->mapped ? map_grow(h) : bud_sbrk();
 
     // If the heap cannot be increased, return 0.
     if(current == (void *) -1) {
         return 0;
     }
 
+    // bud_mem_init() starts the heap over without a word, so its first
+    // block is where a new generation begins.
+    if(!h->mapped && current == bud_heap_start()) {
+        h->generation++;
+    }
+
+    // The memory may have held slabs before bud_mem_init() reset the heap.
+    slab_forget(h, current);
+    oob_forget(h, current);
+
     // Cast the given memory to a bud_free_block.
     bud_free_block *block = (bud_free_block *) current;
 
     // Edit the allocation status and order of the new block.
+    block->header = (bud_header) { 0 };
     block->header.allocated = 0;
-    block->header.order = ORDER_MAX - 1;
+    set_block_order(block, h->order_max - 1);
 
     // Insert the new block into the free list.
-    insert_into_freelist(block);
+    insert_into_freelist(h, block);
+    stats_grow(h);
 
     // Return 1 because the heap could be successfully expanded.
     return 1;
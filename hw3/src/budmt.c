@@ -0,0 +1,294 @@
+/*
+ * Threaded mode of the allocator.
+ *
+ * Each thread keeps a magazine of free blocks for each of the smallest
+ * orders. Blocks in a magazine stay marked allocated as far as the heap is
+ * concerned, so they are never coalesced, and a thread can hand them out
+ * and take them back without locking. Like blocks in quick lists, they are
+ * marked quick, so freeing one again is caught. Only when a magazine is
+ * empty (on allocation) or full (on free) does the thread lock the heap,
+ * and then it moves MAG_BATCH blocks at once. Larger blocks go straight to
+ * the locked heap.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+#define MAG_ORDERS 5    /* The five smallest orders (32 to 512 bytes by default) are cached */
+#define MAG_SIZE 16     /* Most blocks a magazine holds */
+#define MAG_BATCH 8     /* Blocks moved between a magazine and the heap at once */
+
+/* A stack of free blocks, linked through their next pointers. */
+typedef struct magazine {
+    bud_free_block *top;
+    int count;
+} magazine;
+
+/* The magazines of a thread. */
+typedef struct thread_cache {
+    bud_heap *heap;     /* Heap the blocks came from */
+    unsigned generation;    /* ... and its generation when they did */
+    magazine mags[MAG_ORDERS];
+} thread_cache;
+
+static __thread thread_cache cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Whether the magazines of a thread hold blocks of the heap as it is now.
+ * bud_mem_init() does not change the generation of the heap, but it leaves
+ * the heap empty, and a block of an empty heap cannot be in a magazine.
+ *
+ * @param tc the magazines
+ * @param h the heap
+ */
+static int cache_current(thread_cache *tc, bud_heap *h) {
+    return tc->generation == h->generation && (h->mapped || bud_heap_end() != bud_heap_start());
+}
+
+/*
+ * Moves up to n blocks from a magazine back to the heap.
+ *
+ * @param h the heap the blocks came from
+ * @param mag the magazine
+ * @param n how many blocks to move
+ */
+static void mag_drain(bud_heap *h, magazine *mag, int n) {
+    heap_lock(h);
+    while(n-- > 0 && mag->top != NULL) {
+        bud_free_block *block = mag->top;
+
+        mag->top = block->next;
+        mag->count--;
+        set_block_quick(block, 0);
+        heap_give(h, block);
+    }
+    heap_unlock(h);
+}
+
+/*
+ * Fills a magazine with up to MAG_BATCH blocks of its order from the heap.
+ *
+ * @param h the heap to take the blocks from
+ * @param mag the magazine
+ * @param order the order of the blocks
+ */
+static void mag_fill(bud_heap *h, magazine *mag, uint8_t order) {
+    heap_lock(h);
+    for(int i = 0; i < MAG_BATCH; i++) {
+        bud_free_block *block = heap_take(h, order);
+
+        if(block == NULL) {
+            break;
+        }
+
+        set_block_quick(block, 1);
+        block->next = mag->top;
+        mag->top = block;
+        mag->count++;
+    }
+
+    // Taking the blocks may have grown an empty heap into a new generation.
+    cache.generation = h->generation;
+    heap_unlock(h);
+}
+
+/*
+ * Empties the magazines of an exiting thread, unless the heap they came
+ * from is gone.
+ */
+static void cache_destroy(void *arg) {
+    thread_cache *tc = arg;
+
+    if(!cache_current(tc, tc->heap)) {
+        return;
+    }
+
+    for(int i = 0; i < MAG_ORDERS; i++) {
+        mag_drain(tc->heap, &tc->mags[i], tc->mags[i].count);
+    }
+}
+
+static void cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_destroy);
+}
+
+/*
+ * Returns the magazine of the calling thread for an order, or NULL if the
+ * order is not cached. A shared heap has no magazines, since blocks in them
+ * would be lost with a process that died.
+ *
+ * @param h the heap
+ * @param order the order of the block
+ */
+static magazine *get_magazine(bud_heap *h, uint8_t order) {
+    if(FREE_LIST_INDEX(h, order) >= MAG_ORDERS || h->shared) {
+        return NULL;
+    }
+
+    // The first time a thread caches a block, arrange for its magazines
+    // to be emptied when it exits. cache.heap is set first because
+    // pthread_setspecific() may itself allocate.
+    if(cache.heap == NULL) {
+        cache.heap = h;
+        pthread_once(&cache_once, cache_key_create);
+        pthread_setspecific(cache_key, &cache);
+    }
+
+    // Blocks from before the heap started over are forgotten, not freed.
+    if(!cache_current(&cache, h)) {
+        memset(cache.mags, 0, sizeof(cache.mags));
+        cache.generation = h->generation;
+    }
+
+    return &cache.mags[FREE_LIST_INDEX(h, order)];
+}
+
+/*
+ * bud_malloc() in threaded mode.
+ *
+ * @param h the heap
+ * @param rsize the requested payload (in bytes), already checked
+ */
+void *mt_malloc(bud_heap *h, uint32_t rsize) {
+    uint8_t order = get_required_order(h, rsize);
+    magazine *mag = get_magazine(h, order);
+    bud_free_block *block = NULL;
+    void *ptr = NULL;
+
+    if(mag == NULL) {
+        heap_lock(h);
+        ptr = heap_malloc(h, rsize);
+        heap_unlock(h);
+        return ptr;
+    }
+
+    if(mag->count == 0) {
+        mag_fill(h, mag, order);
+
+        if(mag->count == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    block = mag->top;
+    mag->top = block->next;
+    mag->count--;
+
+    set_block_quick(block, 0);
+    set_requested_size(block, rsize);
+    return BLOCK_TO_PAYLOAD(block);
+}
+
+/*
+ * bud_free() in threaded mode.
+ *
+ * @param h the heap
+ * @param ptr the payload of the block, already checked
+ */
+void mt_free(bud_heap *h, void *ptr) {
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+    magazine *mag = get_magazine(h, BLOCK_ORDER(block));
+
+    if(mag == NULL) {
+        heap_lock(h);
+        heap_free(h, ptr);
+        heap_unlock(h);
+        return;
+    }
+
+    if(mag->count == MAG_SIZE) {
+        mag_drain(h, mag, MAG_BATCH);
+    }
+
+    set_block_quick(block, 1);
+    block->next = mag->top;
+    mag->top = block;
+    mag->count++;
+}
+
+/*
+ * bud_realloc() in threaded mode. A block that keeps its order is resized
+ * in place. One that grows absorbs its buddies under the lock if it can,
+ * and is otherwise copied to a new block, outside the lock. With
+ * BUD_GROW_IN_PLACE the new block bypasses the magazines. One that
+ * shrinks is split under the lock.
+ *
+ * @param h the heap
+ * @param ptr the payload of the block, already checked
+ * @param rsize the new requested payload (in bytes), already checked
+ */
+void *mt_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+    uint8_t order = get_required_order(h, rsize);
+    void *new_ptr = NULL;
+
+    if(BLOCK_ORDER(block) == order) {
+        set_requested_size(block, rsize);
+        return ptr;
+    }
+
+    if(BLOCK_ORDER(block) < order) {
+        // Blocks in magazines are marked allocated, so cannot be absorbed.
+        heap_lock(h);
+        if((h->mode & BUD_GROW_IN_PLACE) && heap_grow(h, block, order)) {
+            set_requested_size(block, rsize);
+            new_ptr = ptr;
+        }
+        heap_unlock(h);
+
+        if(new_ptr != NULL) {
+            return new_ptr;
+        }
+
+        // Otherwise the copy goes to a block that has room to grow in place.
+        if(h->mode & BUD_GROW_IN_PLACE) {
+            bud_free_block *new_block = NULL;
+
+            heap_lock(h);
+            new_block = heap_take_lower(h, order);
+            heap_unlock(h);
+
+            if(new_block == NULL) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            set_requested_size(new_block, rsize);
+            new_ptr = BLOCK_TO_PAYLOAD(new_block);
+        } else if((new_ptr = mt_malloc(h, rsize)) == NULL) {
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, BLOCK_RSIZE(block));
+        mt_free(h, ptr);
+        return new_ptr;
+    }
+
+    heap_lock(h);
+    new_ptr = heap_realloc(h, ptr, rsize);
+    heap_unlock(h);
+    return new_ptr;
+}
+
+/*
+ * Empties the magazines of the calling thread.
+ *
+ * @param h the heap
+ */
+void mt_flush(bud_heap *h) {
+    if(!cache_current(&cache, h)) {
+        return;
+    }
+
+    for(int i = 0; i < MAG_ORDERS; i++) {
+        mag_drain(h, &cache.mags[i], cache.mags[i].count);
+    }
+}
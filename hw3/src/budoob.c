@@ -0,0 +1,186 @@
+/*
+ * Blocks with no header in front of their payload, for BUD_OOB mode.
+ *
+ * The payload of such a block is the block itself, so a request of 2^k
+ * bytes fits a block of order k, aligned to 2^k, where with its header it
+ * would take one of order k + 1. The order of the block is kept out of
+ * band, in the heap's order map: a byte for each block of order_min the
+ * heap could hold, holding the order of the block that starts there if
+ * that block is live and has no header, and 0 otherwise.
+ *
+ * Only live blocks are out of band. A block is taken from the heap, and
+ * given back to it, as a block with a header, so the buddy system goes on
+ * keeping its free lists in the blocks themselves. The header of a live
+ * block is the caller's to overwrite, which is why is_free_buddy() asks
+ * the order map before it trusts one.
+ *
+ * No payload with a header starts on a block of order_min but those of
+ * bud_memalign(), which the map marks with OOB_ALIGNED. So a pointer there
+ * that the map knows nothing of is one that was never handed out, or was
+ * freed already, and validate_pointer() turns it away without reading the
+ * word in front of it, which is the end of the block before.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+#define OOB_ALIGNED 0xff    /* A payload of bud_memalign() starts here */
+
+/* The order map of a heap set up by bud_mem_init(). */
+static uint8_t legacy_map[MAX_HEAP_SIZE >> ORDER_MIN];
+
+/*
+ * Finds the byte of the order map for a block of order_min.
+ *
+ * @param h the heap
+ * @param ptr the start of the block
+ * @return the byte, or NULL if ptr is not in the heap.
+ */
+static uint8_t *oob_entry(bud_heap *h, void *ptr) {
+    if(h->mapped) {
+        for(int i = 0; i < h->nregions; i++) {
+            if((char *) ptr >= h->regions[i].start && (char *) ptr < h->regions[i].end) {
+                return &h->regions[i].oob_map[((char *) ptr - h->regions[i].start) >> h->order_min];
+            }
+        }
+        return NULL;
+    }
+
+    if(ptr < bud_heap_start() || ptr >= bud_heap_end()) {
+        return NULL;
+    }
+    return &legacy_map[((char *) ptr - (char *) bud_heap_start()) >> ORDER_MIN];
+}
+
+/*
+ * Finds the byte of the order map for a pointer on a block of order_min.
+ *
+ * @return the byte, or NULL if ptr is not on one in the heap.
+ */
+static uint8_t *oob_boundary(bud_heap *h, void *ptr) {
+    // Blocks start on a multiple of the smallest block, unlike any payload
+    // after a header.
+    if(((uintptr_t) ptr & (BLOCK_SIZE(h->order_min) - 1)) != 0) {
+        return NULL;
+    }
+    return oob_entry(h, ptr);
+}
+
+/* Check budheap.h for documentation. */
+uint8_t oob_order(bud_heap *h, void *ptr) {
+    uint8_t *entry = oob_boundary(h, ptr);
+
+    if(entry == NULL || *entry == OOB_ALIGNED) {
+        return 0;
+    }
+    return *entry;
+}
+
+/* Check budheap.h for documentation. */
+int oob_stray(bud_heap *h, void *ptr) {
+    uint8_t *entry = oob_boundary(h, ptr);
+
+    return entry != NULL && *entry == 0;
+}
+
+/* Check budheap.h for documentation. */
+void oob_mark_aligned(bud_heap *h, void *ptr, int live) {
+    uint8_t *entry = oob_boundary(h, ptr);
+
+    if(entry != NULL) {
+        *entry = live ? OOB_ALIGNED : 0;
+    }
+}
+
+/* Check budheap.h for documentation. */
+void oob_forget(bud_heap *h, void *block) {
+    uint8_t *entry = oob_entry(h, block);
+
+    if(entry != NULL) {
+        memset(entry, 0, BLOCK_SIZE(h->order_max - 1 - h->order_min));
+    }
+}
+
+/*
+ * The order of the block that holds a request with no header.
+ */
+static uint8_t oob_required_order(bud_heap *h, uint32_t rsize) {
+    uint8_t order = (rsize <= 1) ? 0 : 64 - __builtin_clzll(rsize - 1);
+
+    return (order < h->order_min) ? h->order_min : order;
+}
+
+/*
+ * Allocates a block whose payload is the whole block.
+ *
+ * @param h the heap
+ * @param rsize the requested payload (in bytes), at most MAX_RSIZE(h)
+ */
+void *oob_malloc(bud_heap *h, uint32_t rsize) {
+    uint8_t order = oob_required_order(h, rsize);
+    uint32_t inband = BLOCK_SIZE(order) - sizeof(bud_header);
+    void *payload = (h->mode & BUD_THREADED) ? mt_malloc(h, inband) : heap_malloc(h, inband);
+    bud_free_block *block = NULL;
+
+    if(payload == NULL) {
+        return NULL;
+    }
+
+    block = PAYLOAD_TO_BLOCK(payload);
+    *oob_entry(h, block) = order;
+    __atomic_store_n(&h->oob_used, 1, __ATOMIC_RELAXED);
+    return block;
+}
+
+/*
+ * Frees a block with no header, giving it one again for the heap.
+ *
+ * @param h the heap
+ * @param ptr the block, already checked
+ */
+void oob_free(bud_heap *h, void *ptr) {
+    bud_free_block *block = ptr;
+    uint8_t *entry = oob_entry(h, ptr);
+
+    // Written before the block leaves the map, so that it never looks free.
+    block->header = (bud_header) { 0 };
+    set_block_order(block, *entry);
+    set_requested_size(block, BLOCK_SIZE(*entry) - sizeof(bud_header));
+    *entry = 0;
+
+    if(h->mode & BUD_THREADED) {
+        mt_free(h, BLOCK_TO_PAYLOAD(block));
+    } else {
+        heap_free(h, BLOCK_TO_PAYLOAD(block));
+    }
+}
+
+/*
+ * Resizes a block with no header. It stays where it is if the new size
+ * needs a block of the same order, and otherwise moves to wherever
+ * bud_malloc() puts it.
+ *
+ * @param h the heap
+ * @param ptr the block, already checked
+ * @param rsize the new requested payload (in bytes)
+ */
+void *oob_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
+    size_t size = BLOCK_SIZE(oob_order(h, ptr));
+    void *new_ptr = NULL;
+
+    if(oob_required_order(h, rsize) == oob_order(h, ptr)) {
+        return ptr;
+    }
+
+    if((new_ptr = bud_malloc(rsize)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, (size < rsize) ? size : rsize);
+    oob_free(h, ptr);
+    return new_ptr;
+}
@@ -0,0 +1,411 @@
+/*
+ * Slabs of small objects, for BUD_SLAB mode.
+ *
+ * The smallest block is 32 bytes, 8 of them header, so an 8-byte object
+ * would waste most of its block. A slab is instead a block of SLAB_ORDER,
+ * taken from the heap like any other, whose header is followed by a
+ * bitmap of free slots and then by the slots, all of one size. The slabs
+ * of each size that have a free slot are kept on a list. A slab that
+ * becomes empty is kept on it while it is the only slab there, so that a
+ * size freed and allocated in turn does not take and give back a block
+ * each time, and is given back to the heap otherwise. In threaded mode
+ * each size has its own lock, and the lock of the heap is only taken to
+ * take or give back a block.
+ *
+ * Since an object in a slab has no header, bud_free() tells it from a
+ * payload by the heap's slab map: a bit for each block of SLAB_ORDER the
+ * heap could hold, set while that block is a slab. A pointer's slab is its
+ * address rounded down to SLAB_ORDER, as blocks are aligned to their size.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+#define SLAB_SIZE BLOCK_SIZE(SLAB_ORDER)
+#define SLAB_WORDS (SLAB_SIZE / 8 / 64)     /* Enough bits for slots of 8 bytes */
+
+/* The start of a slab. Its slots follow from SLAB_FIRST on. */
+typedef struct bud_slab {
+    bud_header header;      /* Header of the block, which stays allocated */
+    struct bud_slab *next;  /* Slabs of the same size with a free slot */
+    struct bud_slab *prev;
+    uint16_t size;          /* Bytes in a slot */
+    uint16_t nslots;
+    uint16_t nfree;
+    uint16_t unused;
+    uint64_t free[SLAB_WORDS];  /* A bit for each slot, set if it is free */
+} bud_slab;
+
+/* Offset of the first slot, 8 past a multiple of 16 like a payload. */
+#define SLAB_FIRST (((sizeof(bud_slab) + 15) & ~((size_t) 15)) + 8)
+
+/* The slab a pointer into it lies in. */
+#define SLAB_OF(ptr) ((bud_slab *) ((uintptr_t) (ptr) & ~(SLAB_SIZE - 1)))
+
+/* Index of the size class of a request, and the slot size of a class. */
+#define SLAB_CLASS(rsize) (((rsize) + 7) / 8 - 1)
+#define CLASS_SIZE(class) (((class) + 1) * 8)
+
+/* The slab map of a heap set up by bud_mem_init(). */
+static uint64_t legacy_map[((MAX_HEAP_SIZE >> SLAB_ORDER) + 63) / 64];
+
+/*
+ * Finds the bit of the slab map that covers a pointer.
+ *
+ * @param h the heap
+ * @param ptr the pointer
+ * @param mask set to the bit in the word returned
+ * @return the word of the map holding the bit, or NULL if ptr is not in the heap.
+ */
+static uint64_t *slab_map_word(bud_heap *h, void *ptr, uint64_t *mask) {
+    char *start = NULL;
+    uint64_t *map = NULL;
+    size_t index = 0;
+
+    if(h->mapped) {
+        for(int i = 0; i < h->nregions; i++) {
+            if((char *) ptr >= h->regions[i].start && (char *) ptr < h->regions[i].end) {
+                start = h->regions[i].start;
+                map = h->regions[i].slab_map;
+                break;
+            }
+        }
+        if(map == NULL) {
+            return NULL;
+        }
+    } else {
+        if(ptr < bud_heap_start() || ptr >= bud_heap_end()) {
+            return NULL;
+        }
+        start = bud_heap_start();
+        map = legacy_map;
+    }
+
+    index = ((char *) ptr - start) >> SLAB_ORDER;
+    *mask = 1ULL << (index % 64);
+    return &map[index / 64];
+}
+
+/* Check budheap.h for documentation. */
+int slab_owns(bud_heap *h, void *ptr) {
+    uint64_t mask = 0;
+    uint64_t *word = slab_map_word(h, ptr, &mask);
+
+    return word != NULL && (*word & mask) != 0;
+}
+
+static void slab_mark(bud_heap *h, void *block, int is_slab) {
+    uint64_t mask = 0;
+    uint64_t *word = slab_map_word(h, block, &mask);
+
+    if(word != NULL) {
+        *word = is_slab ? (*word | mask) : (*word & ~mask);
+    }
+}
+
+/* Check budheap.h for documentation. */
+void slab_forget(bud_heap *h, void *block) {
+    for(size_t offset = 0; offset < BLOCK_SIZE(h->order_max - 1); offset += SLAB_SIZE) {
+        slab_mark(h, (char *) block + offset, 0);
+    }
+}
+
+/* Check budheap.h for documentation. */
+void slab_relocate(bud_heap *h, ptrdiff_t delta) {
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        if(h->slabs[i] == NULL) {
+            continue;
+        }
+
+        h->slabs[i] = (bud_slab *) ((char *) h->slabs[i] + delta);
+        for(bud_slab *slab = h->slabs[i]; slab != NULL; slab = slab->next) {
+            if(slab->prev != NULL) {
+                slab->prev = (bud_slab *) ((char *) slab->prev + delta);
+            }
+            if(slab->next != NULL) {
+                slab->next = (bud_slab *) ((char *) slab->next + delta);
+            }
+        }
+    }
+}
+
+static void slab_lock(bud_heap *h, int class) {
+    if(h->mode & BUD_THREADED) {
+        pthread_mutex_lock(&h->slab_locks[class]);
+    }
+}
+
+static void slab_unlock(bud_heap *h, int class) {
+    if(h->mode & BUD_THREADED) {
+        pthread_mutex_unlock(&h->slab_locks[class]);
+    }
+}
+
+/* The heap and its slab map are shared by all the size classes. */
+static void slab_heap_lock(bud_heap *h) {
+    if(h->mode & BUD_THREADED) {
+        heap_lock(h);
+    }
+}
+
+static void slab_heap_unlock(bud_heap *h) {
+    if(h->mode & BUD_THREADED) {
+        heap_unlock(h);
+    }
+}
+
+/* Check budheap.h for documentation. */
+void slab_lock_all(bud_heap *h) {
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&h->slab_locks[i]);
+    }
+}
+
+/* Check budheap.h for documentation. */
+void slab_unlock_all(bud_heap *h) {
+    for(int i = SLAB_CLASSES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&h->slab_locks[i]);
+    }
+}
+
+/*
+ * The first slab with a free slot of a size class. bud_mem_init() resets
+ * the heap without knowing about slabs, so a list whose head is no longer
+ * a slab of the heap is dropped.
+ */
+static bud_slab *partial_head(bud_heap *h, int class) {
+    bud_slab *slab = h->slabs[class];
+
+    if(slab != NULL && !slab_owns(h, slab)) {
+        slab = h->slabs[class] = NULL;
+    }
+    return slab;
+}
+
+static void partial_link(bud_heap *h, bud_slab *slab) {
+    int class = SLAB_CLASS(slab->size);
+
+    slab->prev = NULL;
+    slab->next = partial_head(h, class);
+    if(slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    h->slabs[class] = slab;
+}
+
+static void partial_unlink(bud_heap *h, bud_slab *slab) {
+    if(slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        h->slabs[SLAB_CLASS(slab->size)] = slab->next;
+    }
+    if(slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Check budheap.h for documentation. */
+void slab_rebuild(bud_heap *h) {
+    for(int i = 0; i < h->nregions; i++) {
+        for(char *block = h->regions[i].start; block < h->regions[i].end; block += SLAB_SIZE) {
+            bud_slab *slab = (bud_slab *) block;
+
+            // A slab whose counts make no sense is left off, and its slots with it.
+            if(!slab_owns(h, slab) || slab->size == 0 || slab->size > BUD_SLAB_MAX || slab->size % 8 != 0 ||
+               slab->nslots != (SLAB_SIZE - SLAB_FIRST) / slab->size || slab->nfree == 0 || slab->nfree > slab->nslots) {
+                continue;
+            }
+            partial_link(h, slab);
+        }
+    }
+
+    // As bud_mem_fini_file() would have given back the empty ones.
+    slab_flush(h);
+}
+
+/*
+ * Takes a block from the heap and makes a slab of it, on the list of its
+ * size class.
+ *
+ * @param h the heap
+ * @param class the size class
+ * @return the slab, or NULL if the heap cannot grow.
+ */
+static bud_slab *slab_new(bud_heap *h, int class) {
+    bud_free_block *block = NULL;
+    bud_slab *slab = NULL;
+
+    slab_heap_lock(h);
+    if((block = heap_take(h, SLAB_ORDER)) != NULL) {
+        set_requested_size(block, SLAB_SIZE - sizeof(bud_header));
+        slab_mark(h, block, 1);
+    }
+    slab_heap_unlock(h);
+
+    if(block == NULL) {
+        return NULL;
+    }
+    slab = (bud_slab *) block;
+
+    slab->size = CLASS_SIZE(class);
+    slab->nslots = (SLAB_SIZE - SLAB_FIRST) / slab->size;
+    slab->nfree = slab->nslots;
+    memset(slab->free, 0, sizeof(slab->free));
+    for(int i = 0; i < slab->nslots; i++) {
+        slab->free[i / 64] |= 1ULL << (i % 64);
+    }
+
+    partial_link(h, slab);
+    debug("slab_new: %p of %d-byte slots", (void *) slab, slab->size);
+    return slab;
+}
+
+/*
+ * Allocates an object of up to BUD_SLAB_MAX bytes from a slab.
+ *
+ * @param h the heap
+ * @param rsize the requested payload (in bytes)
+ */
+void *slab_malloc(bud_heap *h, uint32_t rsize) {
+    int class = SLAB_CLASS(rsize), slot = 0;
+    bud_slab *slab = NULL;
+
+    slab_lock(h, class);
+    if((slab = partial_head(h, class)) == NULL && (slab = slab_new(h, class)) == NULL) {
+        slab_unlock(h, class);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // A slab on the list has a free slot, so some word has a bit set.
+    for(int i = 0; i < SLAB_WORDS; i++) {
+        if(slab->free[i] != 0) {
+            slot = i * 64 + __builtin_ctzll(slab->free[i]);
+            slab->free[i] &= slab->free[i] - 1;
+            break;
+        }
+    }
+
+    // A full slab leaves the list until one of its objects is freed.
+    if(--slab->nfree == 0) {
+        partial_unlink(h, slab);
+    }
+    slab_unlock(h, class);
+
+    return (char *) slab + SLAB_FIRST + (size_t) slot * slab->size;
+}
+
+/* Check budheap.h for documentation. */
+int slab_validate(bud_heap *h, void *ptr) {
+    bud_slab *slab = SLAB_OF(ptr);
+    size_t offset = (char *) ptr - (char *) slab;
+    size_t slot = 0;
+
+    // It must be the start of one of the slots, and not a free one.
+    if(offset < SLAB_FIRST || (offset - SLAB_FIRST) % slab->size != 0) {
+        return 0;
+    }
+
+    slot = (offset - SLAB_FIRST) / slab->size;
+    return slot < slab->nslots && (slab->free[slot / 64] & (1ULL << (slot % 64))) == 0;
+}
+
+/*
+ * Takes an empty slab off the list of its size class and gives it back to
+ * the heap. The lock of its class is held.
+ *
+ * @param h the heap
+ * @param slab the slab
+ */
+static void slab_release(bud_heap *h, bud_slab *slab) {
+    debug("slab_release: %p", (void *) slab);
+    partial_unlink(h, slab);
+
+    slab_heap_lock(h);
+    slab_mark(h, slab, 0);
+    heap_give(h, (bud_free_block *) slab);
+    slab_heap_unlock(h);
+}
+
+/*
+ * Frees an object of a slab. If the slab is then empty, it is kept for
+ * the next object of its size if it is the only slab of the size with a
+ * free slot, and given back to the heap otherwise.
+ *
+ * @param h the heap
+ * @param ptr the object, already checked
+ */
+void slab_free(bud_heap *h, void *ptr) {
+    bud_slab *slab = SLAB_OF(ptr);
+    size_t slot = ((char *) ptr - (char *) slab - SLAB_FIRST) / slab->size;
+    int class = SLAB_CLASS(slab->size);
+
+    slab_lock(h, class);
+    slab->free[slot / 64] |= 1ULL << (slot % 64);
+
+    if(++slab->nfree == 1) {
+        partial_link(h, slab);
+    }
+
+    // Out of slab mode, nothing more is allocated from it.
+    if(slab->nfree == slab->nslots &&
+       (!(h->mode & BUD_SLAB) || slab->prev != NULL || slab->next != NULL)) {
+        slab_release(h, slab);
+    }
+    slab_unlock(h, class);
+}
+
+/* Check budheap.h for documentation. */
+void slab_flush(bud_heap *h) {
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        bud_slab *slab = NULL, *next = NULL;
+
+        slab_lock(h, i);
+        for(slab = partial_head(h, i); slab != NULL; slab = next) {
+            next = slab->next;
+            if(slab->nfree == slab->nslots) {
+                slab_release(h, slab);
+            }
+        }
+        slab_unlock(h, i);
+    }
+}
+
+/*
+ * Resizes an object of a slab. It stays where it is if the new size is of
+ * the same class, and otherwise moves to wherever bud_malloc() puts it.
+ *
+ * @param h the heap
+ * @param ptr the object, already checked
+ * @param rsize the new requested payload (in bytes)
+ */
+void *slab_realloc(bud_heap *h, void *ptr, uint32_t rsize) {
+    uint32_t size = SLAB_OF(ptr)->size;
+    void *new_ptr = NULL;
+
+    if(SLAB_CLASS(rsize) == SLAB_CLASS(size)) {
+        return ptr;
+    }
+
+    if((new_ptr = bud_malloc(rsize)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, (size < rsize) ? size : rsize);
+    slab_free(h, ptr);
+    return new_ptr;
+}
+
+/*
+ * @param h the heap
+ * @param ptr an object of a slab, already checked
+ * @return the size of its slot.
+ */
+size_t slab_usable_size(bud_heap *h, void *ptr) {
+    return SLAB_OF(ptr)->size;
+}
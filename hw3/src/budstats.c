@@ -0,0 +1,400 @@
+/*
+ * Counters of the allocator, for bud_stats().
+ *
+ * Each thread counts into its own bud_counters, found through a __thread
+ * variable, and only ever writes its own. Counting is then a plain add
+ * with no lock and no shared cache line. A thread's counters are put on a
+ * list the first time it counts, so that bud_stats() can sum them, and
+ * folded into the counters of exited threads when it exits.
+ *
+ * The free lists are not counted but walked by bud_stats(), since it is
+ * called far less often than they change.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+__thread bud_counters bud_thread_counters;
+
+static bud_counters *threads = NULL;        /* Counters of live threads */
+static bud_counters exited;                 /* Sum of the counters of exited threads */
+static uint64_t peak_reserved = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* The thread of bud_stats_every(), if one is running. */
+static pthread_t dumper;
+static int dumping = 0;
+static FILE *dump_out = NULL;
+static unsigned dump_seconds = 0;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_stop = PTHREAD_COND_INITIALIZER;
+
+/* Reads a counter another thread may be writing. */
+#define STAT_READ(c, field) __atomic_load_n(&(c)->field, __ATOMIC_RELAXED)
+
+/*
+ * Adds the counters of one thread to a sum. stats_lock is held.
+ */
+static void counters_add(bud_counters *sum, bud_counters *c) {
+    for(int i = 0; i < BUD_MAX_ORDERS; i++) {
+        sum->allocs[i] += STAT_READ(c, allocs[i]);
+        sum->frees[i] += STAT_READ(c, frees[i]);
+        sum->splits[i] += STAT_READ(c, splits[i]);
+        sum->coalesces[i] += STAT_READ(c, coalesces[i]);
+    }
+    sum->slab_allocs += STAT_READ(c, slab_allocs);
+    sum->slab_frees += STAT_READ(c, slab_frees);
+    sum->growths += STAT_READ(c, growths);
+    sum->requested += STAT_READ(c, requested);
+    sum->reserved += STAT_READ(c, reserved);
+}
+
+/*
+ * Sums the counters of all threads, live and exited, and updates the peak
+ * of the reserved bytes. stats_lock is held.
+ */
+static void counters_sum(bud_counters *sum) {
+    memset(sum, 0, sizeof(*sum));
+    counters_add(sum, &exited);
+    for(bud_counters *c = threads; c != NULL; c = c->next) {
+        counters_add(sum, c);
+    }
+
+    if(sum->reserved > 0 && (uint64_t) sum->reserved > peak_reserved) {
+        peak_reserved = sum->reserved;
+    }
+}
+
+/*
+ * Folds the counters of an exiting thread into those of exited threads.
+ * They start again from zero, since other destructors of the thread may
+ * still count, and register them again to be folded in once more.
+ */
+static void counters_destroy(void *arg) {
+    bud_counters *c = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    counters_add(&exited, c);
+    if(c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        threads = c->next;
+    }
+    if(c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    *c = (bud_counters) { 0 };
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_create(void) {
+    pthread_key_create(&stats_key, counters_destroy);
+}
+
+/*
+ * Puts the counters of the calling thread on the list, the first time it
+ * counts anything.
+ *
+ * @return the counters.
+ */
+bud_counters *stats_register(void) {
+    bud_counters *c = &bud_thread_counters;
+
+    // Marked first, as pthread_setspecific() may itself allocate.
+    c->registered = 1;
+    pthread_once(&stats_once, stats_key_create);
+    pthread_setspecific(stats_key, c);
+
+    pthread_mutex_lock(&stats_lock);
+    c->prev = NULL;
+    c->next = threads;
+    if(threads != NULL) {
+        threads->prev = c;
+    }
+    threads = c;
+    pthread_mutex_unlock(&stats_lock);
+    return c;
+}
+
+/*
+ * Finds what an object counts as.
+ *
+ * @param h the heap
+ * @param ptr the object, already checked
+ * @param object filled in
+ */
+static void object_info(bud_heap *h, void *ptr, bud_object *object) {
+    bud_free_block *block = PAYLOAD_TO_BLOCK(ptr);
+
+    if(slab_owns(h, ptr)) {
+        object->order = -1;
+        object->requested = object->reserved = slab_usable_size(h, ptr);
+    } else if(oob_order(h, ptr)) {
+        object->order = oob_order(h, ptr);
+        object->requested = object->reserved = BLOCK_SIZE(object->order);
+    } else if(BLOCK_ORDER(block) == LARGE_ORDER) {
+        object->order = LARGE_ORDER;
+        object->requested = BLOCK_RSIZE(block);
+        object->reserved = large_usable_size(h, ptr) + sizeof(bud_large);
+    } else {
+        // The requested size of an aligned block includes the room in front
+        // of its payload.
+        block = payload_block(ptr);
+        object->order = BLOCK_ORDER(block);
+        object->requested = BLOCK_RSIZE(block) + sizeof(bud_header) - ((char *) ptr - (char *) block);
+        object->reserved = BLOCK_SIZE(object->order);
+    }
+}
+
+/*
+ * Counts an object in or out.
+ *
+ * @param c the counters of the calling thread
+ * @param object what it counts as
+ * @param sign 1 if it was allocated, -1 if freed
+ */
+static void object_count(bud_counters *c, bud_object *object, int sign) {
+    if(object->order < 0) {
+        if(sign > 0) {
+            STAT_ADD(c, slab_allocs, 1);
+        } else {
+            STAT_ADD(c, slab_frees, 1);
+        }
+    } else if(sign > 0) {
+        STAT_ADD(c, allocs[object->order], 1);
+    } else {
+        STAT_ADD(c, frees[object->order], 1);
+    }
+
+    STAT_ADD(c, requested, sign * (int64_t) object->requested);
+    STAT_ADD(c, reserved, sign * (int64_t) object->reserved);
+}
+
+/* Check budheap.h for documentation. */
+void *stats_alloc(bud_heap *h, void *ptr) {
+    bud_counters *c = stats_mine();
+    bud_object object;
+
+    if(ptr == NULL || c->busy) {
+        return ptr;
+    }
+
+    object_info(h, ptr, &object);
+    object_count(c, &object, 1);
+    return ptr;
+}
+
+/* Check budheap.h for documentation. */
+void stats_free(bud_heap *h, void *ptr) {
+    bud_counters *c = stats_mine();
+    bud_object object;
+
+    if(c->busy) {
+        return;
+    }
+
+    object_info(h, ptr, &object);
+    object_count(c, &object, -1);
+}
+
+/* Check budheap.h for documentation. */
+void stats_realloc_begin(bud_heap *h, void *ptr, bud_object *old) {
+    object_info(h, ptr, old);
+    stats_mine()->busy++;
+}
+
+/* Check budheap.h for documentation. */
+void stats_realloc_end(bud_heap *h, bud_object *old, void *new_ptr) {
+    bud_counters *c = stats_mine();
+    bud_object object;
+
+    if(--c->busy > 0 || new_ptr == NULL) {
+        return;
+    }
+
+    // Out with the old size and in with the new, as a free and an alloc
+    // only if the object changed order.
+    object_info(h, new_ptr, &object);
+    if(object.order == old->order) {
+        STAT_ADD(c, requested, (int64_t) object.requested - (int64_t) old->requested);
+        STAT_ADD(c, reserved, (int64_t) object.reserved - (int64_t) old->reserved);
+    } else {
+        object_count(c, old, -1);
+        object_count(c, &object, 1);
+    }
+}
+
+/* Check budheap.h for documentation. */
+void stats_grow(bud_heap *h) {
+    bud_counters *c = stats_mine();
+    bud_counters sum;
+
+    STAT_ADD(c, growths, 1);
+
+    // The heap grows when it is fullest, so that is where the peak is sampled.
+    pthread_mutex_lock(&stats_lock);
+    counters_sum(&sum);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Walks the free lists of the heap for the free bytes and the largest free block.
+ */
+static void free_list_stats(bud_heap *h, struct bud_stats *stats) {
+    for(int i = 0; i < h->order_max - h->order_min; i++) {
+        bud_free_block *sentinel = &h->heads[i];
+
+        for(bud_free_block *block = sentinel->next; block != sentinel; block = block->next) {
+            size_t size = BLOCK_SIZE(h->order_min + i);
+
+            stats->free_bytes += size;
+            if(size > stats->largest_free) {
+                stats->largest_free = size;
+            }
+            if(BLOCK_DECOMMITTED(block)) {
+                stats->decommitted += size - sysconf(_SC_PAGESIZE);
+            }
+        }
+    }
+
+    if(h->file != NULL) {
+        stats->heap_size = file_brk(h);
+    } else if(h->mapped) {
+        for(int i = 0; i < h->nregions; i++) {
+            stats->heap_size += h->regions[i].end - h->regions[i].start;
+        }
+    } else {
+        stats->heap_size = (char *) bud_heap_end() - (char *) bud_heap_start();
+    }
+}
+
+/* Check budext.h for documentation. */
+void bud_stats(struct bud_stats *stats) {
+    bud_heap *h = &bud_default_heap;
+    bud_counters sum;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&stats_lock);
+    counters_sum(&sum);
+    stats->peak_reserved = peak_reserved;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats->order_min = h->order_min;
+    stats->order_max = h->order_max;
+    for(int i = 0; i < BUD_ORDER_LIMIT; i++) {
+        stats->allocs[i] = sum.allocs[i];
+        stats->frees[i] = sum.frees[i];
+        stats->live[i] = sum.allocs[i] - sum.frees[i];
+        stats->splits[i] = sum.splits[i];
+        stats->coalesces[i] = sum.coalesces[i];
+    }
+    stats->slab_allocs = sum.slab_allocs;
+    stats->slab_frees = sum.slab_frees;
+    stats->slab_live = sum.slab_allocs - sum.slab_frees;
+    stats->growths = sum.growths;
+    stats->requested = (sum.requested > 0) ? sum.requested : 0;
+    stats->reserved = (sum.reserved > 0) ? sum.reserved : 0;
+
+    if(h->mode & BUD_THREADED) {
+        heap_lock(h);
+        free_list_stats(h, stats);
+        heap_unlock(h);
+    } else {
+        free_list_stats(h, stats);
+    }
+
+    stats->fragmentation = (stats->free_bytes == 0) ? 0 :
+                           1 - (double) stats->largest_free / stats->free_bytes;
+}
+
+/* Check budext.h for documentation. */
+int bud_stats_json(FILE *out) {
+    struct bud_stats s;
+
+    bud_stats(&s);
+
+    fprintf(out, "{\"heap_size\":%" PRIu64 ",\"free_bytes\":%" PRIu64 ",\"largest_free\":%" PRIu64
+                 ",\"fragmentation\":%.4f,\"decommitted\":%" PRIu64 ",\"requested\":%" PRIu64
+                 ",\"reserved\":%" PRIu64 ",\"peak_reserved\":%" PRIu64 ",\"growths\":%" PRIu64 ",",
+            s.heap_size, s.free_bytes, s.largest_free, s.fragmentation, s.decommitted,
+            s.requested, s.reserved, s.peak_reserved, s.growths);
+    fprintf(out, "\"large\":{\"allocs\":%" PRIu64 ",\"frees\":%" PRIu64 ",\"live\":%" PRIu64 "},",
+            s.allocs[LARGE_ORDER], s.frees[LARGE_ORDER], s.live[LARGE_ORDER]);
+    fprintf(out, "\"slab\":{\"allocs\":%" PRIu64 ",\"frees\":%" PRIu64 ",\"live\":%" PRIu64 "},",
+            s.slab_allocs, s.slab_frees, s.slab_live);
+
+    fputs("\"orders\":[", out);
+    for(int order = s.order_min; order < s.order_max; order++) {
+        fprintf(out, "%s{\"order\":%d,\"allocs\":%" PRIu64 ",\"frees\":%" PRIu64 ",\"live\":%" PRIu64
+                     ",\"splits\":%" PRIu64 ",\"coalesces\":%" PRIu64 "}",
+                (order == s.order_min) ? "" : ",", order, s.allocs[order], s.frees[order],
+                s.live[order], s.splits[order], s.coalesces[order]);
+    }
+    fputs("]}\n", out);
+
+    return (fflush(out) == EOF || ferror(out)) ? -1 : 0;
+}
+
+/*
+ * The thread of bud_stats_every(). It writes the counters, then waits the
+ * period out unless told to stop.
+ */
+static void *dump_loop(void *arg) {
+    struct timespec until;
+
+    pthread_mutex_lock(&dump_lock);
+    while(dumping) {
+        bud_stats_json(dump_out);
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += dump_seconds;
+        while(dumping && pthread_cond_timedwait(&dump_stop, &dump_lock, &until) != ETIMEDOUT) {
+            continue;
+        }
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+/* Check budext.h for documentation. */
+int bud_stats_every(FILE *out, unsigned seconds) {
+    int error = 0;
+
+    // Stop the thread already running, if any.
+    pthread_mutex_lock(&dump_lock);
+    if(dumping) {
+        dumping = 0;
+        pthread_cond_signal(&dump_stop);
+        pthread_mutex_unlock(&dump_lock);
+        pthread_join(dumper, NULL);
+        pthread_mutex_lock(&dump_lock);
+    }
+
+    if(seconds > 0) {
+        dump_out = out;
+        dump_seconds = seconds;
+        dumping = 1;
+        if((error = pthread_create(&dumper, NULL, dump_loop, NULL)) != 0) {
+            dumping = 0;
+        }
+    }
+    pthread_mutex_unlock(&dump_lock);
+
+    if(error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
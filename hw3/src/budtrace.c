@@ -0,0 +1,328 @@
+/*
+ * Traces of the calls made to the allocator, for bud_trace_start().
+ *
+ * Each thread records into a buffer of its own, found through a __thread
+ * pointer, so recording a call takes no lock. Only when the buffer is full
+ * does the thread take the lock of the trace and write the buffer out in
+ * one write(). The buffers are mapped rather than allocated, since they
+ * are made from inside bud_malloc(), and put on a list so that
+ * bud_trace_stop() can write out what is left in them. A thread's buffer
+ * is written out and unmapped when it exits.
+ *
+ * The lock of the trace is held across fork(), and the child drops the
+ * buffers it inherited, whose records the parent writes, before going on
+ * in a file of its own or not at all.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "budmm.h"
+#include "budheap.h"
+#include "budext.h"
+
+#define TRACE_RECORDS 2048  /* Records a thread buffers before writing them */
+
+typedef struct trace_buffer {
+    int thread;
+    int count;
+    struct trace_buffer *next;
+    struct trace_buffer *prev;
+    struct bud_trace_record records[TRACE_RECORDS];
+} trace_buffer;
+
+int bud_tracing = 0;
+
+static __thread trace_buffer *mine = NULL;
+static __thread int registering = 0;
+
+static trace_buffer *buffers = NULL;        /* Buffers of live threads */
+static int threads = 0;                     /* Threads that have had a buffer */
+static int trace_fd = -1;
+static int trace_errno = 0;                 /* Of the first write that failed */
+static uint64_t trace_epoch = 0;
+static char trace_path[PATH_MAX];           /* As given, with any "%p" in it */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/* Check budheap.h for documentation. */
+uint64_t trace_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Writes out the records of a buffer, or drops them if no trace is open.
+ * trace_lock is held.
+ */
+static void buffer_write(trace_buffer *b) {
+    char *data = (char *) b->records;
+    size_t left = b->count * sizeof(struct bud_trace_record);
+    ssize_t n = 0;
+
+    while(trace_fd != -1 && left > 0) {
+        if((n = write(trace_fd, data, left)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            // The trace is cut short rather than left with a hole in it.
+            if(trace_errno == 0) {
+                trace_errno = errno;
+            }
+            bud_tracing = 0;
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+    b->count = 0;
+}
+
+/*
+ * Writes out the buffer of an exiting thread and unmaps it.
+ */
+static void buffer_destroy(void *arg) {
+    trace_buffer *b = arg;
+
+    pthread_mutex_lock(&trace_lock);
+    buffer_write(b);
+    if(b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        buffers = b->next;
+    }
+    if(b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    mine = NULL;
+    munmap(b, sizeof(trace_buffer));
+}
+
+static void trace_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static int trace_open(const char *path);
+
+/*
+ * Drops the buffers a child inherited, and moves the trace to a file of
+ * the child's own if its path has a "%p", or stops it if not.
+ */
+static void trace_child(void) {
+    trace_buffer *next = NULL;
+
+    // Only the thread that forked is left, and its records are the parent's.
+    for(trace_buffer *b = buffers; b != NULL; b = next) {
+        next = b->next;
+        if(b != mine) {
+            munmap(b, sizeof(trace_buffer));
+        }
+    }
+    buffers = mine;
+    threads = 0;
+    if(mine != NULL) {
+        mine->thread = threads++;
+        mine->count = 0;
+        mine->next = mine->prev = NULL;
+    }
+
+    if(trace_fd != -1) {
+        close(trace_fd);
+        trace_fd = -1;
+        bud_tracing = 0;
+        if(strstr(trace_path, "%p") != NULL && (trace_fd = trace_open(trace_path)) != -1) {
+            trace_errno = 0;
+            trace_epoch = trace_clock();
+            bud_tracing = 1;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_init(void) {
+    pthread_key_create(&trace_key, buffer_destroy);
+    pthread_atfork(trace_prepare, trace_parent, trace_child);
+}
+
+/*
+ * Maps a buffer for the calling thread and puts it on the list.
+ *
+ * @return the buffer, or NULL if it cannot be mapped.
+ */
+static trace_buffer *buffer_register(void) {
+    trace_buffer *b = NULL;
+
+    // Marked first, as pthread_setspecific() may itself allocate.
+    registering = 1;
+    b = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(b == MAP_FAILED) {
+        registering = 0;
+        return NULL;
+    }
+
+    pthread_once(&trace_once, trace_init);
+    pthread_setspecific(trace_key, b);
+
+    pthread_mutex_lock(&trace_lock);
+    b->thread = threads++;
+    b->prev = NULL;
+    b->next = buffers;
+    if(buffers != NULL) {
+        buffers->prev = b;
+    }
+    buffers = b;
+    pthread_mutex_unlock(&trace_lock);
+
+    registering = 0;
+    return mine = b;
+}
+
+/* Check budheap.h for documentation. */
+void trace_record(int op, uint64_t since, uint32_t size, void *handle, void *result) {
+    trace_buffer *b = mine;
+    struct bud_trace_record *r = NULL;
+
+    if(stats_mine()->busy || registering) {
+        return;
+    }
+    if(b == NULL && (b = buffer_register()) == NULL) {
+        return;
+    }
+
+    // A call made before the trace started is counted from its start.
+    if(since == 0) {
+        since = trace_clock();
+    }
+
+    r = &b->records[b->count++];
+    r->time = (since > trace_epoch) ? since - trace_epoch : 0;
+    r->op = op;
+    r->size = size;
+    r->thread = b->thread;
+    r->handle = (uintptr_t) handle;
+    r->result = (uintptr_t) result;
+
+    if(b->count == TRACE_RECORDS) {
+        pthread_mutex_lock(&trace_lock);
+        buffer_write(b);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+/*
+ * Opens the file of a trace, with any "%p" in its path turned into the id
+ * of the process, and writes its header.
+ *
+ * @return the file, or -1 with errno set.
+ */
+static int trace_open(const char *path) {
+    struct bud_trace_header header = {
+        .version = BUD_TRACE_VERSION,
+        .record_size = sizeof(struct bud_trace_record)
+    };
+    char name[PATH_MAX];
+    const char *mark = strstr(path, "%p");
+    int fd = -1, length = 0;
+
+    if(mark != NULL) {
+        length = snprintf(name, sizeof(name), "%.*s%d%s", (int) (mark - path), path, (int) getpid(), mark + 2);
+    } else {
+        length = snprintf(name, sizeof(name), "%s", path);
+    }
+    if(length >= (int) sizeof(name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(header.magic, BUD_TRACE_MAGIC, sizeof(header.magic));
+    if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        return -1;
+    }
+    if(write(fd, &header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Check budext.h for documentation. */
+int bud_trace_start(const char *path) {
+    int fd = -1;
+
+    if(strlen(path) >= sizeof(trace_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    pthread_once(&trace_once, trace_init);
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd != -1) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    if((fd = trace_open(path)) == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    strcpy(trace_path, path);
+
+    // Records left from a trace cut short belong to no file.
+    for(trace_buffer *b = buffers; b != NULL; b = b->next) {
+        b->count = 0;
+    }
+
+    trace_fd = fd;
+    trace_errno = 0;
+    trace_epoch = trace_clock();
+    bud_tracing = 1;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/* Check budext.h for documentation. */
+int bud_trace_stop(void) {
+    int error = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    bud_tracing = 0;
+    if(trace_fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(trace_buffer *b = buffers; b != NULL; b = b->next) {
+        buffer_write(b);
+    }
+
+    if(close(trace_fd) == -1 && trace_errno == 0) {
+        trace_errno = errno;
+    }
+    trace_fd = -1;
+    error = trace_errno;
+    pthread_mutex_unlock(&trace_lock);
+
+    if(error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
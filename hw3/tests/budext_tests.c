@@ -0,0 +1,1408 @@
+#include <criterion/criterion.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include "budmm.h"
+#include "budext.h"
+#include "budheap.h"
+#include "debug.h"
+
+/*
+ * Tests of the extensions in budext.h.
+ */
+
+static int count_free_blocks(int order) {
+    int n = 0;
+    bud_free_block *head = &free_list_heads[order - ORDER_MIN];
+
+    for(bud_free_block *bp = head->next; bp != head; bp = bp->next) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Once everything has been freed, every block should have coalesced back
+ * into a block of the largest order.
+ */
+static void assert_all_coalesced(void) {
+    for(int order = ORDER_MIN; order < ORDER_MAX - 1; order++) {
+        cr_assert_eq(count_free_blocks(order), 0, "List [%d] still holds blocks", order - ORDER_MIN);
+    }
+    cr_assert_eq(count_free_blocks(ORDER_MAX - 1) * MAX_BLOCK_SIZE,
+                 (char *) bud_heap_end() - (char *) bud_heap_start(),
+                 "Some of the heap was not returned");
+}
+
+static void *churn(void *arg) {
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    char *slots[16] = { NULL };
+
+    for(int i = 0; i < 20000; i++) {
+        int slot = rand_r(&seed) % 16;
+        uint32_t size = rand_r(&seed) % 300 + 1;
+
+        if(slots[slot] != NULL) {
+            // The block must still hold what this thread wrote into it.
+            cr_assert_eq(slots[slot][0], (char) slot);
+            bud_free(slots[slot]);
+        }
+
+        cr_assert_not_null(slots[slot] = bud_malloc(size));
+        memset(slots[slot], slot, size);
+    }
+
+    for(int i = 0; i < 16; i++) {
+        bud_free(slots[i]);
+    }
+    return NULL;
+}
+
+Test(bud_threaded_suite, threads_share_heap, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 10) {
+    pthread_t tids[4];
+
+    bud_mem_mode(BUD_THREADED);
+    for(int i = 0; i < 4; i++) {
+        cr_assert_eq(pthread_create(&tids[i], NULL, churn, (void *) (uintptr_t) (i + 1)), 0);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    bud_mem_mode(0);
+
+    assert_all_coalesced();
+}
+
+Test(bud_threaded_suite, magazine_reuses_block, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_THREADED);
+
+    void *x = bud_malloc(sizeof(int));
+    bud_free(x);
+    void *y = bud_malloc(sizeof(int));
+
+    cr_assert_eq(x, y, "A block freed by this thread should be reused first");
+    bud_free(y);
+
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+static void *free_arg(void *arg) {
+    bud_free(arg);
+    return NULL;
+}
+
+Test(bud_threaded_suite, double_free_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    pthread_t tid;
+
+    bud_mem_mode(BUD_THREADED);
+
+    // The block sits in this thread's magazine when another thread frees it.
+    char *x = bud_malloc(20);
+    bud_free(x);
+    cr_assert_eq(pthread_create(&tid, NULL, free_arg, x), 0);
+    pthread_join(tid, NULL);
+}
+
+Test(bud_threaded_suite, reinit_forgets_magazines, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_THREADED);
+
+    void *x = bud_malloc(sizeof(int));
+    bud_free(x);
+    bud_mem_fini();
+    bud_mem_init();
+
+    // The block in the magazine belonged to the old heap.
+    void *y = bud_malloc(sizeof(int));
+    cr_assert(y >= bud_heap_start() && y < bud_heap_end(), "Block from before bud_mem_init()");
+    bud_free(y);
+
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+Test(bud_fast_suite, order_boundaries, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    for(int order = ORDER_MIN; order < ORDER_MAX; order++) {
+        uint32_t fit = ORDER_TO_BLOCK_SIZE(order) - sizeof(bud_header);
+        bud_header *hp = NULL;
+        void *x = bud_malloc(fit);
+
+        cr_assert_not_null(x);
+        hp = (bud_header *) ((char *) x - sizeof(bud_header));
+        cr_assert_eq(hp->order, order, "%u bytes got order %d, not %d", fit, hp->order, order);
+        bud_free(x);
+
+        if(order < ORDER_MAX - 1) {
+            x = bud_malloc(fit + 1);
+            hp = (bud_header *) ((char *) x - sizeof(bud_header));
+            cr_assert_eq(hp->order, order + 1, "%u bytes got order %d, not %d", fit + 1, hp->order, order + 1);
+            bud_free(x);
+        }
+    }
+    assert_all_coalesced();
+}
+
+Test(bud_fast_suite, reinit_forgets_free_blocks, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    // Leave free blocks of several orders behind, then start over.
+    void *x = bud_malloc(sizeof(int));
+    cr_assert_not_null(x);
+    bud_mem_fini();
+    bud_mem_init();
+
+    // The old blocks are gone, so these must come from the new heap.
+    void *y = bud_malloc(sizeof(int));
+    void *z = bud_malloc(1000);
+    cr_assert_not_null(y);
+    cr_assert_not_null(z);
+    cr_assert(y >= bud_heap_start() && y < bud_heap_end(), "Block from before bud_mem_init()");
+    cr_assert(z >= bud_heap_start() && z < bud_heap_end(), "Block from before bud_mem_init()");
+    bud_free(y);
+    bud_free(z);
+    assert_all_coalesced();
+}
+
+#define MAPPED_ORDER_MAX 21     /* Largest block of 1 MiB */
+
+static void mapped_init(void) {
+    cr_assert_eq(bud_mem_init_ex(ORDER_MIN, MAPPED_ORDER_MAX), 0);
+}
+
+Test(bud_mapped_suite, bad_orders, .timeout = 5) {
+    errno = 0;
+    cr_assert_eq(bud_mem_init_ex(ORDER_MIN - 1, MAPPED_ORDER_MAX), -1);
+    cr_assert_eq(errno, EINVAL);
+    cr_assert_eq(bud_mem_init_ex(ORDER_MIN, BUD_ORDER_LIMIT + 1), -1);
+    cr_assert_eq(bud_mem_init_ex(10, 10), -1);
+    cr_assert_eq(bud_mem_init_ex(ORDER_MIN, 8), -1, "Largest block smaller than a page");
+}
+
+Test(bud_mapped_suite, grows_past_max_heap, .init = mapped_init, .fini = bud_mem_fini_ex, .timeout = 5) {
+    char *blocks[64];
+
+    // 64 blocks of order 20 is far more than MAX_HEAP_SIZE.
+    for(int i = 0; i < 64; i++) {
+        blocks[i] = bud_malloc(600000);
+        cr_assert_not_null(blocks[i], "Allocation %d failed", i);
+        bud_header *hp = (bud_header *) (blocks[i] - sizeof(bud_header));
+        cr_assert_eq(hp->order | ((hp->unused1 & 1) << 4), 20);
+        memset(blocks[i], i, 600000);
+    }
+
+    for(int i = 0; i < 64; i++) {
+        cr_assert_eq(blocks[i][599999], (char) i);
+        bud_free(blocks[i]);
+    }
+
+    // Everything coalesces back, and is handed out again.
+    char *x = bud_malloc((1 << (MAPPED_ORDER_MAX - 1)) - sizeof(bud_header));
+    char *y = bud_malloc(sizeof(int));
+    cr_assert_not_null(x);
+    cr_assert_not_null(y);
+    bud_free(x);
+    bud_free(y);
+}
+
+Test(bud_mapped_suite, large_objects, .init = mapped_init, .fini = bud_mem_fini_ex, .timeout = 5) {
+    uint32_t big = 3 << 20;
+    char *x = bud_malloc(big);
+
+    cr_assert_not_null(x, "Request past the largest block was not mapped");
+    memset(x, 'x', big);
+
+    // Stays large, and keeps its contents.
+    x = bud_realloc(x, 2 * big);
+    cr_assert_not_null(x);
+    cr_assert_eq(x[big - 1], 'x');
+    x[2 * big - 1] = 'y';
+
+    // Back into a block.
+    x = bud_realloc(x, 1000);
+    cr_assert_not_null(x);
+    cr_assert_eq(x[999], 'x');
+
+    // And out again.
+    x = bud_realloc(x, big);
+    cr_assert_not_null(x);
+    cr_assert_eq(x[0], 'x');
+    bud_free(x);
+}
+
+Test(bud_mapped_suite, free_unknown_large, .init = mapped_init, .fini = bud_mem_fini_ex, .timeout = 5,
+     .signal = SIGABRT) {
+    char *x = bud_malloc(3 << 20);
+
+    bud_free(x);
+    bud_free(x);
+}
+
+Test(bud_mapped_suite, free_copy_of_large, .init = mapped_init, .fini = bud_mem_fini_ex, .timeout = 5,
+     .signal = SIGABRT) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *x = bud_malloc(3 << 20);
+    char *copy = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t offset = (uintptr_t) x & (page - 1);
+
+    // The page looks just like the start of x, but is not a large object.
+    cr_assert_neq(copy, MAP_FAILED);
+    memcpy(copy, x - offset, page);
+    bud_free(copy + offset);
+}
+
+Test(bud_mapped_suite, free_in_uncommitted_region, .init = mapped_init, .fini = bud_mem_fini_ex,
+     .timeout = 5, .signal = SIGABRT) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *x = bud_malloc(16);
+    // Well past what the heap has committed, but still inside its region.
+    char *tail = (char *) (((uintptr_t) x + (64 << 20)) & ~(uintptr_t) (page - 1));
+
+    bud_free(tail + sizeof(bud_large));
+}
+
+Test(bud_shim_suite, preloaded_programs_run, .timeout = 20) {
+    char *library = realpath("bin/libbudmm.so", NULL);
+    char line[64] = { 0 };
+    FILE *fp = NULL;
+
+    cr_assert_not_null(library, "bin/libbudmm.so has not been built (make shim)");
+    setenv("LD_PRELOAD", library, 1);
+
+    // A pipeline, so the shell forks with the shim loaded.
+    cr_assert_not_null(fp = popen("seq 1 50000 | sort -rn | head -1", "r"));
+    cr_assert_not_null(fgets(line, sizeof(line), fp));
+    cr_assert_eq(pclose(fp), 0);
+    cr_assert_str_eq(line, "50000\n");
+    free(library);
+}
+
+Test(bud_shim_suite, huge_alignment_fails, .timeout = 5) {
+    void *library = dlopen("bin/libbudmm.so", RTLD_NOW | RTLD_LOCAL), *ptr = NULL;
+    int (*shim_posix_memalign)(void **, size_t, size_t) = NULL;
+    void *(*shim_aligned_alloc)(size_t, size_t) = NULL;
+
+    // Loaded on the side, so that this process keeps the C library's malloc().
+    cr_assert_not_null(library, "bin/libbudmm.so has not been built (make shim)");
+    cr_assert_not_null(shim_posix_memalign = (int (*)(void **, size_t, size_t)) dlsym(library, "posix_memalign"));
+    cr_assert_not_null(shim_aligned_alloc = (void *(*)(size_t, size_t)) dlsym(library, "aligned_alloc"));
+
+    cr_assert_eq(shim_posix_memalign(&ptr, 1UL << 33, 16), ENOMEM);
+    cr_assert_null(ptr);
+    cr_assert_null(shim_aligned_alloc(1UL << 33, 1UL << 33));
+    cr_assert_eq(errno, ENOMEM);
+}
+
+Test(bud_realloc_suite, grows_in_place, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_GROW_IN_PLACE);
+
+    // The first block of a fresh heap has nothing but free buddies above it.
+    char *x = bud_malloc(20);
+    cr_assert_not_null(x);
+    strcpy(x, "grows in place");
+
+    for(uint32_t size = 50; size < MAX_BLOCK_SIZE - sizeof(bud_header); size *= 2) {
+        cr_assert_eq(bud_realloc(x, size), x, "Block moved when growing to %u bytes", size);
+        cr_assert_str_eq(x, "grows in place");
+    }
+    bud_free(x);
+    assert_all_coalesced();
+}
+
+Test(bud_realloc_suite, grows_by_copy_when_buddy_taken, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char *x = NULL, *y = NULL, *z = NULL;
+
+    bud_mem_mode(BUD_GROW_IN_PLACE);
+    x = bud_malloc(20);
+    y = bud_malloc(20);
+
+    // y is the buddy of x, so x cannot grow where it is.
+    cr_assert_eq(y, x + MIN_BLOCK_SIZE);
+    strcpy(x, "copied");
+    z = bud_realloc(x, 100);
+    cr_assert_not_null(z);
+    cr_assert_neq(z, x);
+    cr_assert_str_eq(z, "copied");
+
+    // The copy was given room to grow, so the next doubling stays put.
+    cr_assert_eq(bud_realloc(z, 200), z);
+    cr_assert_str_eq(z, "copied");
+
+    // y is the higher buddy, so it cannot grow downwards into the freed x.
+    char *w = bud_realloc(y, 50);
+    cr_assert_not_null(w);
+    cr_assert_neq(w, y);
+
+    bud_free(z);
+    bud_free(w);
+    assert_all_coalesced();
+}
+
+Test(bud_quick_suite, reuses_without_coalescing, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_QUICK);
+
+    char *x = bud_malloc(20);
+    char *y = bud_malloc(20);
+    bud_free(x);
+    bud_free(y);
+
+    // Neither went back to the free lists, so the split halves are still there.
+    cr_assert_eq(count_free_blocks(ORDER_MIN), 0);
+    cr_assert_eq(count_free_blocks(ORDER_MIN + 1), 1);
+
+    // Last in, first out.
+    cr_assert_eq(bud_malloc(20), y);
+    cr_assert_eq(bud_malloc(20), x);
+    bud_free(x);
+    bud_free(y);
+
+    // Leaving the mode coalesces everything.
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+Test(bud_quick_suite, double_free_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    bud_mem_mode(BUD_QUICK);
+
+    char *x = bud_malloc(20);
+    bud_free(x);
+    bud_free(x);
+}
+
+Test(bud_quick_suite, flushed_before_growing, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char *blocks[MAX_HEAP_SIZE / 512];
+    int n = MAX_HEAP_SIZE / 512;
+
+    bud_mem_mode(BUD_QUICK);
+
+    // Fill the whole heap with small blocks, and free them into the quick lists.
+    for(int i = 0; i < n; i++) {
+        cr_assert_not_null(blocks[i] = bud_malloc(500));
+    }
+    for(int i = 0; i < n; i++) {
+        bud_free(blocks[i]);
+    }
+
+    // The heap cannot grow, but the quick lists coalesce into largest blocks.
+    for(int i = 0; i < MAX_HEAP_SIZE / MAX_BLOCK_SIZE; i++) {
+        cr_assert_not_null(blocks[i] = bud_malloc(MAX_BLOCK_SIZE - sizeof(bud_header)),
+                           "Quick lists were not flushed");
+    }
+    for(int i = 0; i < MAX_HEAP_SIZE / MAX_BLOCK_SIZE; i++) {
+        bud_free(blocks[i]);
+    }
+
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+Test(bud_quick_suite, split_headers_start_clean, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    uint32_t size = MAX_BLOCK_SIZE - sizeof(bud_header);
+    char *x = bud_malloc(size), *y = NULL, *z = NULL;
+
+    // Leave set bits wherever the headers of split blocks will go.
+    cr_assert_not_null(x);
+    memset(x, 0xff, size);
+    bud_free(x);
+
+    cr_assert_not_null(y = bud_malloc(20));
+    cr_assert_not_null(z = bud_malloc(20));
+    bud_free(z);
+    bud_free(y);
+    assert_all_coalesced();
+}
+
+Test(bud_slab_suite, packs_small_objects, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char *objects[400];
+
+    bud_mem_mode(BUD_SLAB);
+
+    // 400 objects of 8 bytes fit in a single slab of 4 KiB.
+    for(int i = 0; i < 400; i++) {
+        cr_assert_not_null(objects[i] = bud_malloc(8));
+        cr_assert_eq((uintptr_t) objects[i] % 8, 0, "Object %d is not 8-byte aligned", i);
+        cr_assert_eq(bud_usable_size(objects[i]), 8);
+        memset(objects[i], i, 8);
+    }
+    for(int i = 1; i < 400; i++) {
+        cr_assert_eq(objects[i] - objects[i - 1], 8, "Objects are not packed");
+    }
+    for(int i = 0; i < 400; i++) {
+        cr_assert_eq(objects[i][7], (char) i, "Object %d was overwritten", i);
+    }
+
+    // Freeing the last object keeps the slab for the next one, until
+    // slab mode is left.
+    for(int i = 0; i < 400; i++) {
+        bud_free(objects[i]);
+    }
+    cr_assert_eq(bud_malloc(8), objects[0], "The empty slab should have been kept");
+    bud_free(objects[0]);
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+Test(bud_slab_suite, threads_share_slabs, .init = mapped_init, .fini = bud_mem_fini_ex, .timeout = 10) {
+    pthread_t tids[4];
+    struct bud_stats stats;
+
+    // Most of what churn() asks for is small enough for a slab. Slabs of
+    // every size, and magazines in every thread, need more than
+    // MAX_HEAP_SIZE.
+    bud_mem_mode(BUD_THREADED | BUD_SLAB);
+    for(int i = 0; i < 4; i++) {
+        cr_assert_eq(pthread_create(&tids[i], NULL, churn, (void *) (uintptr_t) (i + 1)), 0);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    bud_mem_mode(0);
+
+    bud_stats(&stats);
+    cr_assert_eq(stats.free_bytes, stats.heap_size, "Some of the heap was not returned");
+}
+
+Test(bud_slab_suite, realloc_leaves_slab, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_SLAB);
+
+    char *x = bud_malloc(20), *y = NULL;
+    cr_assert_not_null(x);
+    strcpy(x, "slab object");
+
+    // Same size class, same slot.
+    cr_assert_eq(bud_realloc(x, 24), x);
+
+    // Too big for any slab, so it moves to a block of its own.
+    cr_assert_not_null(y = bud_realloc(x, 1000));
+    cr_assert_str_eq(y, "slab object");
+    cr_assert_eq(bud_usable_size(y), 1024 - sizeof(bud_header));
+
+    // Slab objects are still freed once the mode is off.
+    x = bud_malloc(100);
+    bud_mem_mode(0);
+    bud_free(x);
+    bud_free(y);
+    assert_all_coalesced();
+}
+
+Test(bud_slab_suite, double_free_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    bud_mem_mode(BUD_SLAB);
+
+    char *x = bud_malloc(16), *y = bud_malloc(16);
+    bud_free(x);
+    bud_free(x);
+    bud_free(y);
+}
+
+Test(bud_slab_suite, inside_object_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    bud_mem_mode(BUD_SLAB);
+
+    char *x = bud_malloc(48);
+    bud_free(x + 8);
+}
+
+Test(bud_align_suite, payloads_are_aligned, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    size_t alignments[] = { 16, 64, 256, 4096 };
+    uint32_t sizes[] = { 1, 100, 4096 };
+
+    for(int i = 0; i < 4; i++) {
+        for(int j = 0; j < 3; j++) {
+            char *x = bud_memalign(alignments[i], sizes[j]);
+
+            cr_assert_not_null(x, "No block for %u bytes on %zu", sizes[j], alignments[i]);
+            cr_assert_eq((uintptr_t) x % alignments[i], 0, "%p is not aligned to %zu", x, alignments[i]);
+            cr_assert_geq(bud_usable_size(x), sizes[j]);
+            memset(x, 0xaa, sizes[j]);
+            bud_free(x);
+        }
+    }
+    assert_all_coalesced();
+}
+
+Test(bud_align_suite, multiple_of_alignment_costs_nothing, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char *x = bud_aligned_alloc(64, 64);
+    char *y = bud_aligned_alloc(4096, 4096);
+
+    // The same blocks bud_malloc() would use, of 128 bytes and 8 KiB.
+    cr_assert_not_null(x);
+    cr_assert_not_null(y);
+    cr_assert_eq(bud_usable_size(x), 128 - 64);
+    cr_assert_eq(bud_usable_size(y), 8192 - 4096);
+
+    cr_assert_null(bud_aligned_alloc(64, 100), "Size is not a multiple of the alignment");
+    cr_assert_eq(errno, EINVAL);
+    cr_assert_null(bud_memalign(48, 16), "Alignment is not a power of two");
+    cr_assert_eq(errno, EINVAL);
+
+    bud_free(x);
+    bud_free(y);
+    assert_all_coalesced();
+}
+
+Test(bud_align_suite, realloc_keeps_alignment, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char *x = bud_memalign(256, 10), *y = NULL;
+
+    cr_assert_not_null(x);
+    strcpy(x, "aligned");
+
+    cr_assert_eq(bud_realloc(x, 200), x, "Block of the same order moved");
+    cr_assert_not_null(y = bud_realloc(x, 2000));
+    cr_assert_eq((uintptr_t) y % 256, 0, "%p lost its alignment", y);
+    cr_assert_str_eq(y, "aligned");
+
+    bud_free(y);
+    assert_all_coalesced();
+
+    // In a mapped heap, a size past the largest block would make a large
+    // object, which cannot be aligned, so the block is left as it was.
+    bud_mem_fini();
+    cr_assert_eq(bud_mem_init_ex(ORDER_MIN, 14), 0);
+    cr_assert_not_null(x = bud_memalign(4096, 4000));
+    memset(x, 'a', 4000);
+    errno = 0;
+    cr_assert_null(bud_realloc(x, 20000));
+    cr_assert_eq(errno, EINVAL);
+    cr_assert_eq((uintptr_t) x % 4096, 0);
+    cr_assert_eq(x[3999], 'a');
+    bud_free(x);
+    bud_mem_fini_ex();
+    bud_mem_init();
+}
+
+Test(bud_align_suite, block_start_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    char *x = bud_memalign(64, 32);
+
+    // The usual payload of the block is not the one handed out.
+    bud_free(x - 64 + sizeof(bud_header));
+}
+
+Test(bud_stats_suite, counts_blocks, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    struct bud_stats before, during, after;
+
+    bud_stats(&before);
+    char *x = bud_malloc(20), *y = bud_malloc(1000);
+    bud_stats(&during);
+
+    cr_assert_eq(during.allocs[5] - before.allocs[5], 1);
+    cr_assert_eq(during.allocs[10] - before.allocs[10], 1);
+    cr_assert_eq(during.live[10], 1);
+    cr_assert_eq(during.requested - before.requested, 1020);
+    cr_assert_eq(during.reserved - before.reserved, 32 + 1024);
+    cr_assert_eq(during.growths - before.growths, 1);
+    cr_assert_eq(during.splits[14] - before.splits[14], 1, "The first block was not split");
+    cr_assert_geq(during.peak_reserved, during.reserved);
+
+    // x split the heap down to 32 bytes, and y took one of the halves.
+    cr_assert_eq(during.heap_size, MAX_BLOCK_SIZE);
+    cr_assert_eq(during.free_bytes, MAX_BLOCK_SIZE - 32 - 1024);
+    cr_assert_eq(during.largest_free, MAX_BLOCK_SIZE / 2);
+    cr_assert_float_eq(during.fragmentation, 1 - 8192.0 / 15328, 1e-9);
+
+    bud_free(x);
+    bud_free(y);
+    bud_stats(&after);
+
+    cr_assert_eq(after.frees[5] - before.frees[5], 1);
+    cr_assert_eq(after.live[10], 0);
+    cr_assert_eq(after.requested, before.requested);
+    cr_assert_eq(after.coalesces[5] - before.coalesces[5], 1);
+    cr_assert_float_eq(after.fragmentation, 0, 1e-9, "One free block is not fragmented");
+}
+
+Test(bud_stats_suite, threads_count_for_themselves, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 10) {
+    struct bud_stats before, after;
+    uint64_t allocs = 0, frees = 0;
+    pthread_t tids[4];
+
+    bud_stats(&before);
+    bud_mem_mode(BUD_THREADED);
+    for(int i = 0; i < 4; i++) {
+        cr_assert_eq(pthread_create(&tids[i], NULL, churn, (void *) (uintptr_t) (i + 1)), 0);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    bud_mem_mode(0);
+    bud_stats(&after);
+
+    // The threads have exited, so their counters were folded in.
+    for(int order = ORDER_MIN; order < ORDER_MAX; order++) {
+        allocs += after.allocs[order] - before.allocs[order];
+        frees += after.frees[order] - before.frees[order];
+    }
+    cr_assert_eq(allocs, 4 * 20000);
+    cr_assert_eq(frees, 4 * 20000);
+    cr_assert_eq(after.reserved, before.reserved);
+}
+
+static void *alloc_twenty(void *arg) {
+    void *blocks[20];
+
+    for(int i = 0; i < 20; i++) {
+        cr_assert_not_null(blocks[i] = bud_malloc(20));
+    }
+    for(int i = 0; i < 20; i++) {
+        bud_free(blocks[i]);
+    }
+    return NULL;
+}
+
+Test(bud_stats_suite, exiting_thread_counts_once, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    struct bud_stats before, after;
+    pthread_t tid;
+
+    // Counting before any magazine exists means the counters of a thread
+    // are folded in before its magazines are emptied, which counts again.
+    bud_free(bud_malloc(20));
+    bud_stats(&before);
+
+    bud_mem_mode(BUD_THREADED);
+    cr_assert_eq(pthread_create(&tid, NULL, alloc_twenty, NULL), 0);
+    pthread_join(tid, NULL);
+    bud_mem_mode(0);
+    bud_stats(&after);
+
+    cr_assert_eq(after.allocs[5] - before.allocs[5], 20);
+    cr_assert_eq(after.frees[5] - before.frees[5], 20);
+    cr_assert_eq(after.requested, before.requested);
+}
+
+Test(bud_stats_suite, dumps_json, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    FILE *out = tmpfile();
+    char line[4096];
+    int lines = 0;
+
+    cr_assert_not_null(out);
+    cr_assert_eq(bud_stats_json(out), 0);
+
+    // Once straight away, and again a second later.
+    cr_assert_eq(bud_stats_every(out, 1), 0);
+    usleep(1500000);
+    cr_assert_eq(bud_stats_every(out, 0), 0);
+
+    rewind(out);
+    while(fgets(line, sizeof(line), out) != NULL) {
+        cr_assert(strncmp(line, "{\"heap_size\":", 13) == 0, "Not the counters: %s", line);
+        cr_assert(strstr(line, "\"fragmentation\":") != NULL);
+        cr_assert(strcmp(line + strlen(line) - 3, "]}\n") == 0, "Line was cut short: %s", line);
+        lines++;
+    }
+    cr_assert_eq(lines, 3);
+    fclose(out);
+}
+
+/* Waits for a child and checks that it exited with 0. */
+static void assert_child_ok(pid_t pid) {
+    int status = 0;
+
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "The child failed, status %#x", status);
+}
+
+/*
+ * Reads back a trace written to path.
+ *
+ * @return the number of records read into records.
+ */
+static int read_trace(char *path, struct bud_trace_record *records, int max) {
+    struct bud_trace_header header;
+    FILE *in = fopen(path, "rb");
+    int count = 0;
+
+    cr_assert_not_null(in);
+    cr_assert_eq(fread(&header, sizeof(header), 1, in), 1);
+    cr_assert(memcmp(header.magic, BUD_TRACE_MAGIC, 8) == 0);
+    cr_assert_eq(header.record_size, sizeof(struct bud_trace_record));
+
+    while(count < max && fread(&records[count], sizeof(*records), 1, in) == 1) {
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+Test(bud_trace_suite, records_calls, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char path[] = "/tmp/budtraceXXXXXX";
+    struct bud_trace_record r[8];
+    int fd = mkstemp(path);
+
+    cr_assert_neq(fd, -1);
+    close(fd);
+    cr_assert_eq(bud_trace_start(path), 0);
+    cr_assert_eq(bud_trace_start(path), -1, "A second trace was started");
+    cr_assert_eq(errno, EBUSY);
+
+    char *x = bud_malloc(20);
+    char *moved = bud_realloc(x, 2000);
+    char *y = bud_realloc(NULL, 50);
+    cr_assert_null(bud_malloc(0));
+    bud_realloc(y, 0);
+    bud_free(moved);
+
+    cr_assert_eq(bud_trace_stop(), 0);
+    bud_free(bud_malloc(10));
+
+    // The malloc and free the realloc made on the way are not there, and
+    // neither is the call that failed or the calls after the trace stopped.
+    cr_assert_eq(read_trace(path, r, 8), 5);
+    unlink(path);
+
+    cr_assert(r[0].op == BUD_TRACE_MALLOC && r[0].size == 20 && r[0].handle == (uintptr_t) x);
+    cr_assert(r[1].op == BUD_TRACE_REALLOC && r[1].size == 2000);
+    cr_assert(r[1].handle == (uintptr_t) x && r[1].result == (uintptr_t) moved);
+    cr_assert(r[2].op == BUD_TRACE_MALLOC && r[2].size == 50 && r[2].handle == (uintptr_t) y);
+    cr_assert(r[3].op == BUD_TRACE_FREE && r[3].handle == (uintptr_t) y);
+    cr_assert(r[4].op == BUD_TRACE_FREE && r[4].handle == (uintptr_t) moved);
+    for(int i = 1; i < 5; i++) {
+        cr_assert_geq(r[i].time, r[i - 1].time);
+        cr_assert_eq(r[i].thread, r[0].thread);
+    }
+}
+
+Test(bud_trace_suite, threads_write_their_buffers, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 10) {
+    static struct bud_trace_record r[2 * 2 * 20000 + 1];
+    char path[] = "/tmp/budtraceXXXXXX";
+    int fd = mkstemp(path), count = 0, mallocs[2] = {0}, frees[2] = {0};
+    pthread_t tids[2];
+
+    cr_assert_neq(fd, -1);
+    close(fd);
+    cr_assert_eq(bud_trace_start(path), 0);
+    bud_mem_mode(BUD_THREADED);
+    for(int i = 0; i < 2; i++) {
+        cr_assert_eq(pthread_create(&tids[i], NULL, churn, (void *) (uintptr_t) (i + 1)), 0);
+    }
+    for(int i = 0; i < 2; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    bud_mem_mode(0);
+    cr_assert_eq(bud_trace_stop(), 0);
+
+    // Every call of both threads was written out when the thread exited.
+    count = read_trace(path, r, sizeof(r) / sizeof(r[0]));
+    unlink(path);
+    for(int i = 0; i < count; i++) {
+        int *ops = (r[i].op == BUD_TRACE_MALLOC) ? mallocs : frees;
+
+        ops[r[i].thread == r[0].thread ? 0 : 1]++;
+    }
+    cr_assert_eq(count, 2 * 20000 * 2);
+    for(int i = 0; i < 2; i++) {
+        cr_assert_eq(mallocs[i], 20000);
+        cr_assert_eq(frees[i], 20000);
+    }
+}
+
+Test(bud_trace_suite, forked_child_traces_apart, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char path[64], child_path[64];
+    struct bud_trace_record r[8];
+    pid_t pid = 0;
+
+    cr_assert_eq(bud_trace_start("/tmp/budtrace.%p"), 0);
+    char *x = bud_malloc(20);
+    if((pid = fork()) == 0) {
+        // The malloc of the parent is not written again from here.
+        bud_free(bud_malloc(30));
+        _exit(bud_trace_stop() == 0 ? 0 : 1);
+    }
+    cr_assert_neq(pid, -1);
+    assert_child_ok(pid);
+    bud_free(x);
+    cr_assert_eq(bud_trace_stop(), 0);
+
+    snprintf(path, sizeof(path), "/tmp/budtrace.%d", (int) getpid());
+    cr_assert_eq(read_trace(path, r, 8), 2);
+    unlink(path);
+    cr_assert(r[0].op == BUD_TRACE_MALLOC && r[0].handle == (uintptr_t) x);
+    cr_assert(r[1].op == BUD_TRACE_FREE && r[1].handle == (uintptr_t) x);
+
+    snprintf(child_path, sizeof(child_path), "/tmp/budtrace.%d", (int) pid);
+    cr_assert_eq(read_trace(child_path, r, 8), 2);
+    unlink(child_path);
+    cr_assert(r[0].op == BUD_TRACE_MALLOC && r[0].size == 30 && r[0].thread == 0);
+    cr_assert(r[1].op == BUD_TRACE_FREE && r[1].handle == r[0].handle);
+}
+
+Test(bud_trace_suite, forked_child_stops_tracing, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    char path[] = "/tmp/budtraceXXXXXX";
+    struct bud_trace_record r[8];
+    int fd = mkstemp(path);
+    pid_t pid = 0;
+
+    cr_assert_neq(fd, -1);
+    close(fd);
+    cr_assert_eq(bud_trace_start(path), 0);
+    char *x = bud_malloc(20);
+    if((pid = fork()) == 0) {
+        // With no "%p" the child has no file of its own to write to.
+        bud_free(bud_malloc(30));
+        _exit(bud_trace_stop() == -1 && errno == EINVAL ? 0 : 1);
+    }
+    cr_assert_neq(pid, -1);
+    assert_child_ok(pid);
+    bud_free(x);
+    cr_assert_eq(bud_trace_stop(), 0);
+
+    cr_assert_eq(read_trace(path, r, 8), 2);
+    unlink(path);
+    cr_assert(r[0].op == BUD_TRACE_MALLOC && r[0].handle == (uintptr_t) x);
+    cr_assert(r[1].op == BUD_TRACE_FREE && r[1].handle == (uintptr_t) x);
+}
+
+/*
+ * Whether the pages of a block past its first are resident.
+ */
+static int rest_resident(void *block, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char vec[size / page];
+    int resident = 0;
+
+    cr_assert_eq(mincore(block, size, vec), 0);
+    for(size_t i = 1; i < size / page; i++) {
+        resident += vec[i] & 1;
+    }
+    return resident;
+}
+
+static void trim_fini(void) {
+    bud_mem_mode(0);
+    bud_trim_policy(0, 0, 0);
+    bud_mem_fini_ex();
+}
+
+Test(bud_trim_suite, gives_back_free_largest_blocks, .init = mapped_init, .fini = trim_fini, .timeout = 5) {
+    size_t size = 1 << (MAPPED_ORDER_MAX - 1);
+    struct bud_stats stats;
+    char *x[3];
+
+    bud_mem_mode(BUD_TRIM);
+    for(int i = 0; i < 3; i++) {
+        cr_assert_not_null(x[i] = bud_malloc(size - 8));
+        memset(x[i], 1, size - 8);
+    }
+    cr_assert_eq(rest_resident(x[0] - 8, size), size / sysconf(_SC_PAGESIZE) - 1);
+
+    // Each block is whole as soon as it is freed.
+    for(int i = 0; i < 3; i++) {
+        bud_free(x[i]);
+        cr_assert_eq(rest_resident(x[i] - 8, size), 0, "Block %d was not given back", i);
+    }
+    bud_stats(&stats);
+    cr_assert_eq(stats.decommitted, 3 * (size - sysconf(_SC_PAGESIZE)));
+    cr_assert_eq(stats.free_bytes, 3 * size);
+
+    // The header kept its mark, and loses it when the block is used again.
+    char *y = bud_malloc(100);
+    bud_stats(&stats);
+    cr_assert_eq(stats.decommitted, 2 * (size - sysconf(_SC_PAGESIZE)));
+    bud_free(y);
+}
+
+Test(bud_trim_suite, keeps_blocks_freed_last, .init = mapped_init, .fini = trim_fini, .timeout = 5) {
+    size_t size = 1 << (MAPPED_ORDER_MAX - 1);
+    struct bud_stats stats;
+    char *x[3];
+
+    bud_mem_mode(BUD_TRIM);
+    bud_trim_policy(size, 0, 0);
+    for(int i = 0; i < 3; i++) {
+        cr_assert_not_null(x[i] = bud_malloc(size - 8));
+        memset(x[i], 1, size - 8);
+    }
+    for(int i = 0; i < 3; i++) {
+        bud_free(x[i]);
+    }
+
+    // Only the block freed last is left, and it is the one taken next.
+    bud_stats(&stats);
+    cr_assert_eq(stats.decommitted, 2 * (size - sysconf(_SC_PAGESIZE)));
+    cr_assert_neq(rest_resident(x[2] - 8, size), 0);
+    cr_assert_eq(bud_malloc(size - 8), x[2]);
+
+    // Past the delay, or with bud_trim(), the rest go too.
+    bud_trim_policy(0, 60000, 0);
+    bud_free(x[2]);
+    cr_assert_neq(rest_resident(x[2] - 8, size), 0, "Trimmed before the delay");
+    cr_assert_eq(bud_trim(), size - sysconf(_SC_PAGESIZE));
+    cr_assert_eq(rest_resident(x[2] - 8, size), 0);
+}
+
+Test(bud_trim_suite, leaves_legacy_heap, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    struct bud_stats stats;
+
+    bud_mem_mode(BUD_TRIM);
+    bud_free(bud_malloc(MAX_BLOCK_SIZE - 8));
+    bud_mem_mode(0);
+
+    cr_assert_eq(bud_trim(), 0);
+    bud_stats(&stats);
+    cr_assert_eq(stats.decommitted, 0);
+    assert_all_coalesced();
+}
+
+Test(bud_oob_suite, power_of_two_fits_its_block, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    struct bud_stats before, after;
+    char *objects[16];
+
+    bud_mem_mode(BUD_OOB);
+    bud_stats(&before);
+
+    // Each object is a whole block of 64 bytes, header and all.
+    for(int i = 0; i < 16; i++) {
+        cr_assert_not_null(objects[i] = bud_malloc(64));
+        cr_assert_eq((uintptr_t) objects[i] % 64, 0, "Object %d is not 64-byte aligned", i);
+        cr_assert_eq(bud_usable_size(objects[i]), 64);
+        memset(objects[i], i, 64);
+    }
+    bud_stats(&after);
+    cr_assert_eq(after.reserved - before.reserved, 16 * 64);
+    cr_assert_eq(after.live[6] - before.live[6], 16);
+
+    for(int i = 0; i < 16; i++) {
+        for(int j = 0; j < 64; j++) {
+            cr_assert_eq(objects[i][j], (char) i, "Object %d was overwritten", i);
+        }
+    }
+
+    // Freed with the mode off, and coalesced whatever was written in them.
+    bud_mem_mode(0);
+    for(int i = 0; i < 16; i++) {
+        bud_free(objects[i]);
+    }
+    assert_all_coalesced();
+}
+
+Test(bud_oob_suite, realloc_moves_across_orders, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5) {
+    bud_mem_mode(BUD_OOB);
+
+    char *x = bud_malloc(64), *y = NULL;
+    cr_assert_not_null(x);
+    strcpy(x, "out of band");
+
+    // Same order, same block.
+    cr_assert_eq(bud_realloc(x, 40), x);
+
+    cr_assert_not_null(y = bud_realloc(x, 100));
+    cr_assert_str_eq(y, "out of band");
+    cr_assert_eq((uintptr_t) y % 128, 0);
+    cr_assert_eq(bud_usable_size(y), 128);
+
+    // Ordinary blocks are still resized as before, and can be shrunk into one.
+    bud_mem_mode(0);
+    x = bud_malloc(100);
+    bud_mem_mode(BUD_OOB);
+    cr_assert_eq(bud_usable_size(x), 128 - sizeof(bud_header));
+    bud_free(bud_realloc(x, 200));
+    bud_free(y);
+    bud_mem_mode(0);
+    assert_all_coalesced();
+}
+
+Test(bud_oob_suite, inside_block_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    bud_mem_mode(BUD_OOB);
+
+    char *x = bud_malloc(64);
+    memset(x, 0, 64);
+    bud_free(x + 8);
+}
+
+Test(bud_oob_suite, double_free_aborts, .init = bud_mem_init, .fini = bud_mem_fini, .timeout = 5,
+     .signal = SIGABRT) {
+    bud_mem_mode(BUD_OOB);
+
+    char *x = bud_malloc(64), *y = bud_malloc(64), *z = NULL;
+    cr_assert_eq(y, x + 64);
+
+    // The end of x holds the header of a live block, as a caller may copy one.
+    bud_mem_mode(0);
+    z = bud_malloc(56);
+    memcpy(x + 56, z - sizeof(bud_header), sizeof(bud_header));
+
+    bud_free(y);
+    bud_free(y);
+}
+
+#define FILE_HEAP "/tmp/budext_file_heap"
+#define FILE_HEAP_SIZE (64 << 20)                       /* Four largest blocks */
+#define FILE_BLOCK_SIZE (1 << (BUD_FILE_ORDER_MAX - 1))
+
+struct node {
+    struct bud_off next;
+    int value;
+};
+
+static void file_init(void) {
+    unlink(FILE_HEAP);
+}
+
+static void file_fini(void) {
+    unlink(FILE_HEAP);
+}
+
+/*
+ * Makes a list of nodes of many sizes, some of them in slabs, with some
+ * blocks freed in between, and makes it the root of the heap.
+ */
+static void make_list(int count) {
+    struct node *head = NULL, *n = NULL;
+
+    bud_mem_mode(BUD_SLAB | BUD_QUICK);
+    for(int i = 0; i < count; i++) {
+        cr_assert_not_null(n = bud_malloc(sizeof(struct node) + i % 200));
+        n->value = i;
+        n->next = bud_to_off(head);
+        head = n;
+        if(i % 2 == 1) {
+            bud_free(bud_malloc(sizeof(struct node) + i % 200));
+        }
+    }
+    bud_set_root(head);
+}
+
+/* Checks and frees the list, then checks that the whole heap is free. */
+static void free_list(int count) {
+    struct node *n = bud_root(), *next = NULL;
+    struct bud_stats stats;
+
+    for(int i = count - 1; i >= 0; i--, n = next) {
+        cr_assert_not_null(n, "The list ends before node %d", i);
+        cr_assert_eq(n->value, i, "Node %d holds %d", i, n->value);
+        next = bud_from_off(n->next);
+        bud_free(n);
+    }
+    cr_assert_null(n);
+
+    bud_stats(&stats);
+    cr_assert_eq(stats.free_bytes, stats.heap_size);
+    cr_assert_eq(stats.largest_free, FILE_BLOCK_SIZE);
+}
+
+Test(bud_file_suite, keeps_objects, .init = file_init, .fini = file_fini, .timeout = 5) {
+    struct bud_stats before, after;
+    struct bud_off big;
+    void *root = NULL;
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), 0);
+    make_list(2000);
+
+    // Big enough that the heap grows into a second largest block, and no bigger.
+    big = bud_to_off(bud_malloc(FILE_BLOCK_SIZE - sizeof(bud_header)));
+    cr_assert_neq(big.off, 0);
+    cr_assert_null(bud_malloc(FILE_BLOCK_SIZE));
+    cr_assert_eq(errno, EINVAL);
+    root = bud_root();
+    bud_stats(&before);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+
+    // Opened again, the heap is as it was, where it was.
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, 0), 0);
+    cr_assert_eq(bud_root(), root);
+    bud_stats(&after);
+    cr_assert_eq(after.heap_size, 2 * FILE_BLOCK_SIZE);
+    cr_assert_eq(after.heap_size, before.heap_size);
+    cr_assert_eq(after.free_bytes, before.free_bytes);
+
+    bud_free(bud_from_off(big));
+    free_list(2000);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+}
+
+Test(bud_file_suite, moves_with_its_file, .init = file_init, .fini = file_fini, .timeout = 5) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *root = NULL, *taken = NULL;
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), 0);
+    make_list(2000);
+    root = bud_root();
+    cr_assert_eq(bud_mem_fini_file(), 0);
+
+    // Something else now lies where the heap was.
+    taken = (char *) ((uintptr_t) root & ~(page - 1));
+    cr_assert_eq(mmap(taken, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0), taken);
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, 0), 0);
+    cr_assert_neq(bud_root(), root);
+    cr_assert_eq((uintptr_t) bud_root() & (page - 1), (uintptr_t) root & (page - 1));
+
+    // The free lists and slabs moved with it, and are used as before.
+    bud_mem_mode(BUD_SLAB);
+    for(int i = 0; i < 1000; i++) {
+        bud_free(bud_malloc(i % 300 + 1));
+    }
+    bud_mem_mode(0);
+    free_list(2000);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+    munmap(taken, page);
+}
+
+Test(bud_file_suite, refuses_other_files, .init = file_init, .fini = file_fini, .timeout = 5) {
+    FILE *out = fopen(FILE_HEAP, "w");
+
+    cr_assert_not_null(out);
+    fputs("not a heap", out);
+    fclose(out);
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), -1);
+    cr_assert_eq(errno, EINVAL);
+
+    // Nor is a heap made smaller than a page, or opened while it is open.
+    unlink(FILE_HEAP);
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, 100), -1);
+    cr_assert_eq(errno, EINVAL);
+    unlink(FILE_HEAP);
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), 0);
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), -1);
+    cr_assert_eq(errno, EBUSY);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+}
+
+Test(bud_file_suite, reopens_after_crash, .init = file_init, .fini = file_fini, .timeout = 5) {
+    pid_t pid = 0;
+
+    // The child dies with the heap open, its slab lists never written out.
+    if((pid = fork()) == 0) {
+        if(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE) == -1) {
+            _exit(1);
+        }
+        make_list(2000);
+        bud_mem_mode(BUD_SLAB);
+        _exit(0);
+    }
+    cr_assert_neq(pid, -1);
+    assert_child_ok(pid);
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, 0), 0);
+    bud_mem_mode(BUD_SLAB);
+    for(int i = 0; i < 1000; i++) {
+        bud_free(bud_malloc(i % 300 + 1));
+    }
+    bud_mem_mode(0);
+    free_list(2000);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+}
+
+Test(bud_file_suite, broken_after_crash, .init = file_init, .fini = file_fini, .timeout = 5) {
+    pid_t pid = 0;
+
+    if((pid = fork()) == 0) {
+        if(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE) == -1) {
+            _exit(1);
+        }
+
+        // A block whose buddy is live stays on its list, which is then cut.
+        char *x = bud_malloc(100);
+        bud_malloc(100);
+        bud_free(x);
+        ((bud_free_block *) (x - sizeof(bud_header)))->next = NULL;
+        _exit(0);
+    }
+    cr_assert_neq(pid, -1);
+    assert_child_ok(pid);
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, 0), -1);
+    cr_assert_eq(errno, ENOTRECOVERABLE);
+}
+
+Test(bud_file_suite, offsets_need_the_heap, .init = file_init, .fini = file_fini, .timeout = 5) {
+    struct bud_off off = { 4096 };
+    char x[100];
+
+    // With no heap in a file there is nothing to be an offset into.
+    errno = 0;
+    cr_assert_eq(bud_to_off(x).off, 0);
+    cr_assert_eq(errno, EINVAL);
+    cr_assert_null(bud_from_off(off));
+    cr_assert_eq(bud_set_root(x), -1);
+    cr_assert_null(bud_root());
+    cr_assert_eq(errno, EINVAL);
+
+    // Nor is a pointer outside the heap of a file.
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), 0);
+    errno = 0;
+    cr_assert_eq(bud_to_off(x).off, 0);
+    cr_assert_eq(errno, EINVAL);
+    cr_assert_eq(bud_set_root(NULL), 0);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+}
+
+Test(bud_file_suite, is_not_trimmed, .init = file_init, .fini = file_fini, .timeout = 5) {
+    struct bud_stats stats;
+    char *x = NULL;
+
+    cr_assert_eq(bud_mem_init_file(FILE_HEAP, FILE_HEAP_SIZE), 0);
+    bud_mem_mode(BUD_TRIM);
+    cr_assert_eq(bud_mem_mode(0) & BUD_TRIM, 0);
+
+    // Whole largest blocks stay as they are in the file, freed or trimmed.
+    bud_mem_mode(BUD_TRIM);
+    cr_assert_not_null(x = bud_malloc(FILE_BLOCK_SIZE - sizeof(bud_header)));
+    bud_free(x);
+    cr_assert_eq(bud_trim(), 0);
+    bud_stats(&stats);
+    cr_assert_eq(stats.decommitted, 0);
+    cr_assert_eq(bud_mem_fini_file(), 0);
+}
+
+#define SHARED_HEAP_SIZE (16 << 20)
+#define SHARED_NAME "/budext_shared_heap"
+
+static void shared_fini(void) {
+    bud_mem_fini_shared();
+    shm_unlink(SHARED_NAME);
+}
+
+Test(bud_shared_suite, processes_pass_objects, .fini = shared_fini, .timeout = 10) {
+    struct bud_stats stats;
+    struct bud_off off;
+    int fds[2];
+    pid_t pid = 0;
+    char *msg = NULL;
+
+    cr_assert_eq(bud_mem_init_shared(NULL, SHARED_HEAP_SIZE), 0);
+    cr_assert_eq(pipe(fds), 0);
+
+    // The parent's message is freed by the child, and the child's read
+    // and freed by the parent.
+    cr_assert_not_null(msg = bud_malloc(1 << 20));
+    memset(msg, 'p', 1 << 20);
+    if((pid = fork()) == 0) {
+        char *mine = bud_malloc(1 << 20);
+
+        if(mine == NULL || msg[(1 << 20) - 1] != 'p') {
+            _exit(1);
+        }
+        bud_free(msg);
+        memset(mine, 'c', 1 << 20);
+        off = bud_to_off(mine);
+        _exit(write(fds[1], &off, sizeof(off)) != sizeof(off));
+    }
+    cr_assert_eq(read(fds[0], &off, sizeof(off)), sizeof(off));
+    assert_child_ok(pid);
+
+    msg = bud_from_off(off);
+    cr_assert_eq(msg[0], 'c');
+    cr_assert_eq(msg[(1 << 20) - 1], 'c');
+    bud_free(msg);
+
+    bud_stats(&stats);
+    cr_assert_eq(stats.free_bytes, stats.heap_size);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test(bud_shared_suite, named_heap_is_opened_again, .init = shared_fini, .fini = shared_fini, .timeout = 10) {
+    char *root = NULL;
+    pid_t pid = 0;
+
+    cr_assert_eq(bud_mem_init_shared(SHARED_NAME, SHARED_HEAP_SIZE), 0);
+    cr_assert_not_null(root = bud_malloc(100));
+    strcpy(root, "shared root");
+    bud_set_root(root);
+
+    // Only ever the one lock, whatever the mode asks for.
+    cr_assert_eq(bud_mem_mode(BUD_SLAB | BUD_QUICK | BUD_OOB), BUD_THREADED);
+    bud_free(bud_malloc(16));
+    cr_assert_eq(bud_mem_mode(0), BUD_THREADED | BUD_OOB);
+    cr_assert_eq(bud_mem_fini_shared(), 0);
+
+    // Another process opens it where it was and frees the root.
+    if((pid = fork()) == 0) {
+        if(bud_mem_init_shared(SHARED_NAME, 0) != 0 || bud_root() != root || strcmp(root, "shared root") != 0) {
+            _exit(1);
+        }
+        bud_free(root);
+        bud_set_root(NULL);
+        _exit(bud_mem_fini_shared());
+    }
+    assert_child_ok(pid);
+
+    cr_assert_eq(bud_mem_init_shared(SHARED_NAME, 0), 0);
+    cr_assert_null(bud_root());
+    cr_assert_eq(bud_malloc(100), root);
+}
+
+Test(bud_shared_suite, lock_of_dead_process_is_taken, .fini = shared_fini, .timeout = 10) {
+    pid_t pid = 0;
+
+    cr_assert_eq(bud_mem_init_shared(NULL, SHARED_HEAP_SIZE), 0);
+    if((pid = fork()) == 0) {
+        heap_lock(&bud_default_heap);
+        _exit(0);
+    }
+    assert_child_ok(pid);
+
+    bud_free(bud_malloc(100));
+}
+
+Test(bud_shared_suite, lists_broken_by_dead_process_abort, .fini = shared_fini, .timeout = 10,
+     .signal = SIGABRT) {
+    pid_t pid = 0;
+
+    cr_assert_eq(bud_mem_init_shared(NULL, SHARED_HEAP_SIZE), 0);
+    char *x = bud_malloc(100);
+    cr_assert_not_null(bud_malloc(100));
+    bud_free(x);
+
+    // Dies holding the lock, half way through taking x off its list.
+    if((pid = fork()) == 0) {
+        heap_lock(&bud_default_heap);
+        ((bud_free_block *) (x - sizeof(bud_header)))->next = NULL;
+        _exit(0);
+    }
+    assert_child_ok(pid);
+
+    bud_malloc(100);
+}
+
+Test(bud_shared_suite, racing_processes_make_one_heap, .init = shared_fini, .fini = shared_fini, .timeout = 10) {
+    struct bud_stats stats;
+    pid_t pids[8];
+    int go[2];
+
+    cr_assert_eq(pipe(go), 0);
+    for(int i = 0; i < 8; i++) {
+        if((pids[i] = fork()) == 0) {
+            char *objects[64], c = 0;
+
+            // All start at once, when the pipe is closed.
+            close(go[1]);
+            if(read(go[0], &c, 1) != 0 || bud_mem_init_shared(SHARED_NAME, SHARED_HEAP_SIZE) != 0) {
+                _exit(1);
+            }
+            for(int j = 0; j < 64; j++) {
+                if((objects[j] = bud_malloc(1000)) == NULL) {
+                    _exit(2);
+                }
+                memset(objects[j], 'a' + i, 1000);
+            }
+            usleep(50000);
+
+            // No heap made over this one took the objects back.
+            for(int j = 0; j < 64; j++) {
+                if(objects[j][0] != 'a' + i || objects[j][999] != 'a' + i) {
+                    _exit(3);
+                }
+                bud_free(objects[j]);
+            }
+            _exit(bud_mem_fini_shared());
+        }
+        cr_assert_neq(pids[i], -1);
+    }
+    close(go[0]);
+    close(go[1]);
+    for(int i = 0; i < 8; i++) {
+        assert_child_ok(pids[i]);
+    }
+
+    cr_assert_eq(bud_mem_init_shared(SHARED_NAME, 0), 0);
+    bud_stats(&stats);
+    cr_assert_eq(stats.free_bytes, stats.heap_size);
+}